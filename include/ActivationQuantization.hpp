@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <map>
+#include <string>
+#include <vector>
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    /// Observed output range of one layer over the calibration positions.
+    struct ActivationRange
+    {
+        float min = 0.0f;
+        float max = 0.0f;
+        /// Low and high percentiles, such as the 0.01th and 99.99th, if the calibration recorded them.
+        bool hasPercentiles = false;
+        float percentileLow = 0.0f;
+        float percentileHigh = 0.0f;
+        /// Per-output-channel (min, max), empty if only the whole tensor was measured.
+        std::vector<std::pair<float, float>> channels;
+    };
+
+    /// Activation ranges by ConvLayerDesc name.
+    class CalibrationTable
+    {
+    public:
+        std::map<std::string, ActivationRange> layers;
+
+        const ActivationRange *find(const std::string &name) const
+        {
+            auto it = layers.find(name);
+            return it == layers.end() ? nullptr : &it->second;
+        }
+    };
+
+    /// Parses a calibration file: one record per line, '#' starts a comment.
+    ///   layer NAME MIN MAX [PERCENTILE_LOW PERCENTILE_HIGH]
+    ///   channel NAME INDEX MIN MAX
+    /// Channel records follow the layer record of their layer and list every channel in order.
+    /// Throws std::runtime_error on malformed input.
+    CalibrationTable parseCalibration(std::istream &in);
+
+    /// Reads a calibration file, see parseCalibration. Throws std::runtime_error on failure.
+    CalibrationTable loadCalibrationFile(const std::string &path);
+
+    enum class ActivationQuantization
+    {
+        INT8_PER_TENSOR,
+        INT8_PER_CHANNEL,
+        FLOAT16 // The range is too risky for int8; the output stays in floating point
+    };
+
+    const char *activationQuantizationName(ActivationQuantization quantization);
+
+    /// Affine int8 quantization of one layer's output: q = round(x / scale) + zeroPoint.
+    struct LayerActivationQuantization
+    {
+        ActivationQuantization quantization = ActivationQuantization::FLOAT16;
+        /// One value for per-tensor quantization, one per output channel for per-channel.
+        std::vector<float> scales;
+        std::vector<int8_t> zeroPoints;
+        /// Fraction of the observed range outside the quantized range.
+        double clippedFraction = 0.0;
+    };
+
+    struct ActivationQuantizationOptions
+    {
+        /// Layers whose full range is more than this many times their percentile range have
+        /// outliers that int8 cannot represent, and fall back to float16.
+        double maxOutlierRatio = 4.0;
+        /// Per-channel scales are used when the widest channel range is more than this many
+        /// times the narrowest, so narrow channels keep their resolution.
+        double maxChannelRangeSpread = 8.0;
+    };
+
+    /// Quantization of each calibrated layer output, see ModelBuilder::setActivationQuantizationPlan
+    /// for how it is lowered and what it does not save.
+    class ActivationQuantizationPlan
+    {
+    public:
+        std::map<std::string, LayerActivationQuantization> layers;
+
+        const LayerActivationQuantization *find(const std::string &name) const
+        {
+            auto it = layers.find(name);
+            return it == layers.end() ? nullptr : &it->second;
+        }
+    };
+
+    /// Chooses int8 per-tensor, int8 per-channel or float16 for the output of every convolution
+    /// of the model that has a calibration record. Ranges are clipped to the percentiles when
+    /// the calibration has them. Convolutions without a record are left out of the plan.
+    ActivationQuantizationPlan planActivationQuantization(const ModelDesc &modelDesc,
+                                                          const CalibrationTable &calibration,
+                                                          const ActivationQuantizationOptions &options = {});
+
+} // namespace KataGoCoreML
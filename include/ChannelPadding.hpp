@@ -0,0 +1,21 @@
+#pragma once
+
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    /// Rounds a channel count up to a multiple of the alignment.
+    int alignChannels(int channels, int alignment);
+
+    /// Zero-pads every internal channel dimension of a model to a multiple of `alignment`,
+    /// such as 8, 16 or 32, to avoid slow remainder paths on the Neural Engine and GPU.
+    ///
+    /// Extra conv and matmul weights are zero, and extra batch norm channels have zero scale
+    /// and bias, so padded channels stay exactly zero through every activation and never
+    /// reach the outputs. The initial convolution reads the spatial input padded with zero
+    /// channels to a multiple of `alignment`, as ModelBuilder::setChannelAlignment pads it in
+    /// the graph; other dimensions facing the model inputs and outputs keep their size.
+    /// Throws std::invalid_argument if alignment is not positive.
+    void padModelChannels(ModelDesc &modelDesc, int alignment);
+
+} // namespace KataGoCoreML
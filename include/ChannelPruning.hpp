@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    struct PrunedChannels
+    {
+        /// Name of the layer whose output channels were removed.
+        std::string layerName;
+        int numChannelsBefore;
+        int numChannelsAfter;
+    };
+
+    /// Removes dead channels from the mid channels of residual and global pooling blocks and
+    /// from the global pooling channels, including blocks nested in bottleneck blocks.
+    ///
+    /// A channel is dead if all of its outgoing weights are zero, or if its activation is
+    /// exactly zero everywhere: its batch norm has zero scale, or all its incoming weights are
+    /// zero, and the activation of the resulting constant is zero. Removing such channels
+    /// leaves the model outputs unchanged. Every block keeps at least one channel.
+    /// Call it before padModelChannels, whose padding channels are dead by construction.
+    std::vector<PrunedChannels> pruneDeadChannels(ModelDesc &modelDesc);
+
+} // namespace KataGoCoreML
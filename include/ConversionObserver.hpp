@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+#include "CostModel.hpp"
+#include "OpFusion.hpp"
+#include "OpScheduling.hpp"
+
+namespace KataGoCoreML
+{
+    // Stages of a createMLPackage call, in the order they run
+    enum class ConversionStage
+    {
+        GRAPH_BUILD,
+        WEIGHT_WRITE,
+        VERIFY,
+        SERIALIZE,
+        PACKAGE_ASSEMBLY
+    };
+
+    const char *conversionStageName(ConversionStage stage);
+
+    // Escapes a string for use inside a JSON string literal
+    std::string escapeJSON(const std::string &s);
+
+    struct StageTiming
+    {
+        ConversionStage stage;
+        double seconds;
+    };
+
+    struct LayerWeightRecord
+    {
+        std::string name;
+        std::size_t bytes;
+    };
+
+    // A weight tensor emitted in sparse form
+    struct SparseLayerRecord
+    {
+        std::string name;
+        double sparsity;
+        std::size_t denseBytes;
+        std::size_t encodedBytes;
+    };
+
+    struct LowRankLayerRecord
+    {
+        std::string name;
+        int rank;
+        double macReduction;
+        double relativeError;
+    };
+
+    // A layer output with an activation quantization plan, including float16 fallbacks
+    struct ActivationQuantizationRecord
+    {
+        std::string name;
+        std::string quantization;
+        int numScales;
+        double clippedFraction;
+    };
+
+    // A plan entry for a ModelDesc layer that the graph does not lower yet, so it had no effect
+    struct UnloweredPlanLayer
+    {
+        std::string plan;
+        std::string name;
+    };
+
+    /// Summary of one conversion, filled in by ModelBuilder::createMLPackage.
+    class ConversionReport
+    {
+    public:
+        std::string packagePath;
+        std::vector<StageTiming> stageTimings;
+        std::map<std::string, int> opCounts;
+        std::vector<LayerWeightRecord> layerWeights;
+        std::vector<SparseLayerRecord> sparseLayers;
+        std::vector<LowRankLayerRecord> lowRankLayers;
+        std::vector<ActivationQuantizationRecord> quantizedActivations;
+        std::vector<UnloweredPlanLayer> unloweredPlanLayers;
+        /// Peak resident memory of the whole process so far, as peakResidentMemoryBytes returns
+        /// it when the conversion ends. It includes earlier conversions and anything else the
+        /// process did, so it is an upper bound on the memory of this conversion.
+        std::size_t peakMemoryBytes = 0;
+        /// ModelDesc::sha256 of the converted model, empty if it was not loaded from a file.
+        std::string modelSha256;
+        /// packageContentHash of the built package.
+        std::string packageSha256;
+        /// Static cost of the emitted program.
+        CostReport cost;
+        /// Convolution epilogues rewritten into fusable forms.
+        EpilogueFusion epilogueFusion;
+        /// Peak activation memory before and after the operations were reordered.
+        MemorySchedule memorySchedule;
+
+        /// Total wall time spent in the given stage, in seconds.
+        double stageSeconds(ConversionStage stage) const;
+
+        /// Total number of weight bytes written to weight.bin.
+        std::size_t totalWeightBytes() const;
+
+        /// Total number of operations in the emitted program.
+        int totalOpCount() const;
+
+        std::string toJSON() const;
+
+        /// Writes toJSON() to the given path.
+        /// Throws std::runtime_error on failure.
+        void writeJSON(const std::string &path) const;
+    };
+
+    /// Receives progress events from ModelBuilder::createMLPackage.
+    /// All callbacks are invoked on the thread running the conversion.
+    class ConversionObserver
+    {
+    public:
+        virtual ~ConversionObserver() = default;
+
+        virtual void onStageBegin(ConversionStage /*stage*/) {}
+        virtual void onStageEnd(ConversionStage /*stage*/, double /*seconds*/) {}
+        virtual void onLayerWeightsWritten(const std::string & /*name*/, std::size_t /*bytes*/) {}
+        virtual void onMessage(const std::string & /*message*/) {}
+        virtual void onConversionFinished(const ConversionReport & /*report*/) {}
+    };
+
+    /// Returns the peak resident memory of the current process in bytes, or 0 if unknown.
+    std::size_t peakResidentMemoryBytes();
+
+} // namespace KataGoCoreML
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "ConversionObserver.hpp"
+
+namespace KataGoCoreML
+{
+    /// Thrown by a cancelled conversion, from ConversionTask::get.
+    class ConversionCancelled : public std::runtime_error
+    {
+    public:
+        ConversionCancelled() : std::runtime_error("Conversion cancelled") {}
+    };
+
+    /// Handle to a conversion running on a background thread, see ModelBuilder::createMLPackageAsync.
+    /// Destroying the handle waits for the conversion; call cancel() first to stop it early.
+    class ConversionTask
+    {
+    public:
+        ConversionTask(const ConversionTask &) = delete;
+        ConversionTask &operator=(const ConversionTask &) = delete;
+        ~ConversionTask();
+
+        /// Requests cancellation. The conversion stops at its next stage or layer boundary,
+        /// removes its temporary files and any partially assembled package.
+        void cancel();
+
+        bool cancelRequested() const;
+
+        /// Fraction of the conversion completed, from 0 to 1.
+        double progress() const;
+
+        /// Stage currently running.
+        ConversionStage stage() const;
+
+        /// Returns true if the conversion has finished, successfully or not.
+        bool ready() const;
+
+        /// Waits up to the given duration. Returns true if the conversion has finished.
+        bool waitFor(std::chrono::milliseconds timeout) const;
+
+        /// Waits for the conversion and rethrows its error, or ConversionCancelled if it was cancelled.
+        void get();
+
+    private:
+        friend class ModelBuilder;
+        friend class ProgressObserver;
+
+        struct State
+        {
+            std::atomic<bool> cancelled{false};
+            std::atomic<double> progress{0.0};
+            std::atomic<int> stage{static_cast<int>(ConversionStage::GRAPH_BUILD)};
+        };
+
+        ConversionTask() : state(std::make_shared<State>()) {}
+
+        std::shared_ptr<State> state;
+        std::shared_future<void> result;
+        std::thread thread;
+    };
+
+} // namespace KataGoCoreML
@@ -42,8 +42,9 @@
 #define LOWEST_ALLOWED_SPECIFICATION_VERSION_FOR_NEURALNETWORK SPECIFICATION_VERSION_IOS_13
 #define LOWEST_ALLOWED_SPECIFICATION_VERSION_FOR_MILPROGRAM SPECIFICATION_VERSION_IOS_15
 
-// Compute unit configuration options
-enum ComputeUnit {
+// Compute unit configuration options. The underlying type is fixed so that public headers
+// can declare the enum without including this file.
+enum ComputeUnit : int {
     COMPUTE_UNIT_ALL = 1,          // Use CPU, GPU, and Neural Engine
     COMPUTE_UNIT_CPU_AND_GPU = 2,  // Use CPU and GPU only
     COMPUTE_UNIT_CPU_ONLY = 3,     // Use CPU only
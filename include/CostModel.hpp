@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Defined in CoremltoolsDefines.hpp, which is not included so that its macros stay private
+enum ComputeUnit : int;
+
+namespace CoreML
+{
+    namespace Specification
+    {
+        namespace MILSpec
+        {
+            class Operation;
+            class Program;
+            class ValueType;
+        }
+    }
+}
+
+namespace KataGoCoreML
+{
+    /// Static cost of one operation of the emitted program.
+    struct OpCost
+    {
+        std::string name;
+        std::string type;
+        /// Multiply-accumulates of conv, linear and matmul ops; 0 for other ops.
+        std::uint64_t macs = 0;
+        /// Bytes of weights stored by const and constexpr ops.
+        std::uint64_t weightBytes = 0;
+        /// Bytes of the op's output tensors, 0 for weights.
+        std::uint64_t activationBytes = 0;
+        /// Bytes read and written by the op, including the weights it reads; 0 for const and
+        /// constexpr ops, whose weights are counted by the ops that read them.
+        std::uint64_t memoryTrafficBytes = 0;
+    };
+
+    /// Rough sustained throughput of a compute unit configuration, used for roofline estimates.
+    struct HardwareProfile
+    {
+        double macsPerSecond;
+        double bytesPerSecond;
+    };
+
+    /// Apple M1-class figures, a starting point to be replaced with measured values.
+    HardwareProfile defaultHardwareProfile(ComputeUnit computeUnit);
+
+    const char *computeUnitName(ComputeUnit computeUnit);
+
+    /// Roofline estimate: every op takes the longer of its compute time and its memory time.
+    struct ComputeUnitEstimate
+    {
+        ComputeUnit computeUnit;
+        HardwareProfile profile;
+        double seconds = 0.0;
+        /// Fraction of the MACs in ops that are compute bound.
+        double computeBoundFraction = 0.0;
+    };
+
+    /// Static cost of a program for the batch and board size it was built for.
+    struct CostReport
+    {
+        int batchSize = 0;
+        int nnXLen = 0;
+        int nnYLen = 0;
+        std::vector<OpCost> ops;
+        std::uint64_t totalMacs = 0;
+        std::uint64_t totalWeightBytes = 0;
+        std::uint64_t totalActivationBytes = 0;
+        /// Largest total size of activations alive at the same time, inputs included,
+        /// when the ops run in program order.
+        std::uint64_t peakLiveActivationBytes = 0;
+        std::vector<ComputeUnitEstimate> estimates;
+
+        std::string toJSON(int indent = 0) const;
+    };
+
+    /// Analyzes the main function of a program, with the default profile of every ComputeUnit.
+    /// Tensor shapes must be static.
+    CostReport analyzeProgramCost(const CoreML::Specification::MILSpec::Program &program);
+
+    /// Bytes of a tensor value with a static shape; 0 for other values.
+    std::uint64_t valueBytes(const CoreML::Specification::MILSpec::ValueType &type);
+
+    /// Whether the op only produces weights (const and constexpr_* ops), which are not
+    /// counted as activations.
+    bool isConstantOperation(const CoreML::Specification::MILSpec::Operation &op);
+
+    /// Adds a roofline estimate for the given profile.
+    void addComputeUnitEstimate(CostReport &report, ComputeUnit computeUnit, const HardwareProfile &profile);
+
+} // namespace KataGoCoreML
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    /// A KxK convolution split into a Kx1 convolution to `rank` channels followed by
+    /// a 1xK convolution, the spatially separable decomposition of its kernel.
+    struct FactorizedConv
+    {
+        ConvLayerDesc vertical;
+        ConvLayerDesc horizontal;
+        int rank = 0;
+        /// Multiply-accumulates per output position.
+        std::uint64_t originalMacs = 0;
+        std::uint64_t factorizedMacs = 0;
+        /// Frobenius norm of the kernel error relative to the kernel.
+        double relativeError = 0.0;
+
+        double macReduction() const
+        {
+            return originalMacs > 0 ? 1.0 - static_cast<double>(factorizedMacs) / originalMacs : 0.0;
+        }
+    };
+
+    /// Factorizes a convolution with the smallest rank whose relative error is at most
+    /// `maxRelativeError`, through an SVD of the kernel. Returns false, leaving `result`
+    /// unspecified, if the kernel is not at least 2x2 with unit dilation, or if no such
+    /// rank needs fewer MACs than the original convolution.
+    bool factorizeConv(const ConvLayerDesc &conv, double maxRelativeError, FactorizedConv &result);
+
+    struct LowRankOptions
+    {
+        /// Per-layer budget for FactorizedConv::relativeError.
+        double maxRelativeError = 0.02;
+        /// Names of the convolutions to factorize; empty for every convolution factorizeConv accepts.
+        std::vector<std::string> layers;
+    };
+
+    /// Factorized convolutions by layer name, see ModelBuilder::setLowRankPlan.
+    class LowRankPlan
+    {
+    public:
+        std::map<std::string, FactorizedConv> layers;
+
+        const FactorizedConv *find(const std::string &name) const
+        {
+            auto it = layers.find(name);
+            return it == layers.end() ? nullptr : &it->second;
+        }
+    };
+
+    /// Factorizes the selected convolutions of a model. Layers that cannot meet the error
+    /// budget with fewer MACs are left out of the plan. The SVD is O(K^3 C^3) per layer.
+    LowRankPlan planLowRankFactorization(const ModelDesc &modelDesc, const LowRankOptions &options);
+
+} // namespace KataGoCoreML
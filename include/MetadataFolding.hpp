@@ -0,0 +1,22 @@
+#pragma once
+
+#include <vector>
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    /// Runs the SGF metadata encoder MLP (mul1, bias1, act1, mul2, bias2, act2, mul3) on one
+    /// metadata vector and returns the resulting per-channel trunk bias.
+    /// Throws std::invalid_argument if the vector does not match the encoder's input size.
+    std::vector<float> evaluateMetadataEncoder(const SGFMetadataEncoderDesc &encoder,
+                                               const std::vector<float> &inputMeta);
+
+    /// Bakes a fixed metadata vector into the model, removing the metadata encoder and its input.
+    ///
+    /// The encoder output is a constant bias added to the trunk after the initial convolution.
+    /// Since every block and the trunk tip read the residual stream through a batch norm, the
+    /// bias is folded exactly into the means of those batch norms. Does nothing for models
+    /// without a metadata encoder.
+    void foldFixedMetadata(ModelDesc &modelDesc, const std::vector<float> &inputMeta);
+
+} // namespace KataGoCoreML
@@ -4,6 +4,11 @@
 #include <vector>
 #include "UtilTempDir.hpp"
 #include "ModelDescription.hpp"
+#include "ActivationQuantization.hpp"
+#include "ConversionObserver.hpp"
+#include "ConversionTask.hpp"
+#include "LowRankConv.hpp"
+#include "QuantizationAnalysis.hpp"
 
 namespace KataGoCoreML
 {
@@ -15,6 +20,7 @@ namespace KataGoCoreML
     const std::string OUTPUT_VALUE_NAME = "output_value";
     const std::string OUTPUT_SCORE_VALUE_NAME = "output_score_value";
     const std::string OUTPUT_OWNERSHIP_NAME = "output_ownership";
+    const std::string OUTPUT_PACKED_NAME = "output_packed";
 
     class InputFeature
     {
@@ -26,6 +32,42 @@ namespace KataGoCoreML
             : name(name), shape(shape) {}
     };
 
+    class OutputFeature
+    {
+    public:
+        std::string name;
+        std::vector<int> shape;
+
+        OutputFeature(const std::string &name, const std::vector<int> &shape)
+            : name(name), shape(shape) {}
+    };
+
+    /// Layout of the model outputs, produced in the graph so that the returned buffers can be
+    /// consumed without reshuffling. The default is one NCHW tensor per network output.
+    struct OutputLayout
+    {
+        /// output_policy is [batch, numPolicy, nnYLen * nnXLen + 1], each policy row followed by
+        /// its pass logit, and output_policy_pass is not emitted.
+        bool policyWithPass = false;
+        /// Spatial outputs are channels-last: ownership is [batch, nnYLen, nnXLen, C] and the
+        /// policy is [batch, nnYLen, nnXLen, numPolicy], or [batch, nnYLen * nnXLen + 1, numPolicy]
+        /// with policyWithPass.
+        bool channelsLast = false;
+        /// A single output_packed [batch, n] holds every output of a batch entry contiguously,
+        /// in the order and layout of ModelBuilder::getOutputFeatures.
+        bool packed = false;
+    };
+
+    /// SHA-256 over the relative path, size and contents of every file in a package, in path order.
+    /// Packages built from the same ModelDesc and options have the same hash.
+    std::string packageContentHash(const std::string &packagePath);
+
+    /// Converts a ModelDesc into a CoreML package.
+    /// Of the network, only the initial convolution of the trunk is lowered from the ModelDesc
+    /// so far; the outputs come from zero-weight placeholder heads that read it. Plans name
+    /// layers as the ModelDesc does, with the output prefix prepended for the secondary model.
+    /// A builder is not thread-safe, but separate builders may run createMLPackage
+    /// concurrently, including on the same ModelDesc, which is only read by createMLPackage.
     class ModelBuilder
     {
     public:
@@ -33,11 +75,199 @@ namespace KataGoCoreML
             : modelDesc(modelDesc),
               nnXLen(nnXLen),
               nnYLen(nnYLen),
+              paddedXLen(nnXLen),
+              paddedYLen(nnYLen),
               batchSize(batchSize) {}
 
         void addInputFeature(InputFeature &inputFeature);
         void createMLPackage(const std::string &packagePath);
 
+        /// Runs createMLPackage on a background thread. The builder and its ModelDesc must
+        /// outlive the task and must not be used by the caller until the task has finished.
+        std::unique_ptr<ConversionTask> createMLPackageAsync(const std::string &packagePath);
+
+        /// Registers an observer notified of conversion progress. Not owned; may be nullptr.
+        void setObserver(ConversionObserver *observer)
+        {
+            this->observer = observer;
+        }
+
+        /// If non-empty, createMLPackage writes the conversion report as JSON to this path.
+        void setReportPath(const std::string &reportPath)
+        {
+            this->reportPath = reportPath;
+        }
+
+        /// Sets the storage precision of each layer's weights, see selectMixedPrecision. Weights
+        /// that are not those of a ModelDesc layer have the default precision. Entries for layers
+        /// the graph does not lower yet are skipped and listed in
+        /// ConversionReport::unloweredPlanLayers; createMLPackage throws std::invalid_argument if
+        /// the plan names something that is not a layer of the model.
+        void setPrecisionPlan(const PrecisionPlan &precisionPlan)
+        {
+            this->precisionPlan = precisionPlan;
+        }
+
+        const PrecisionPlan &getPrecisionPlan() const
+        {
+            return precisionPlan;
+        }
+
+        /// Emits the convolutions of the plan as separable pairs, see planLowRankFactorization.
+        /// Unlowered and unknown layers are handled as by setPrecisionPlan.
+        void setLowRankPlan(const LowRankPlan &lowRankPlan)
+        {
+            this->lowRankPlan = lowRankPlan;
+        }
+
+        const LowRankPlan &getLowRankPlan() const
+        {
+            return lowRankPlan;
+        }
+
+        /// Quantizes the outputs of the plan's int8 layers with quantize/dequantize pairs,
+        /// which need iOS 17. Float16 entries are left in floating point. Unlowered and unknown
+        /// layers are handled as by setPrecisionPlan. The dequantize still materializes the
+        /// floating point tensor, so the pair reproduces int8 rounding without by itself halving
+        /// activation memory traffic; that is up to the runtime fusing it into its neighbours.
+        void setActivationQuantizationPlan(const ActivationQuantizationPlan &activationQuantizationPlan)
+        {
+            this->activationQuantizationPlan = activationQuantizationPlan;
+        }
+
+        const ActivationQuantizationPlan &getActivationQuantizationPlan() const
+        {
+            return activationQuantizationPlan;
+        }
+
+        void setOutputLayout(const OutputLayout &outputLayout)
+        {
+            this->outputLayout = outputLayout;
+        }
+
+        const OutputLayout &getOutputLayout() const
+        {
+            return outputLayout;
+        }
+
+        /// The network outputs in the configured layout, followed by those of the secondary model
+        /// if there is one. With OutputLayout::packed, these are the consecutive segments of the
+        /// output_packed row of each network rather than separate outputs.
+        std::vector<OutputFeature> getOutputFeatures() const;
+
+        /// The outputs of one network of the package in the configured layout, named with
+        /// `outputPrefix` prepended.
+        std::vector<OutputFeature> getNetworkOutputFeatures(const ModelDesc &networkDesc,
+                                                            const std::string &outputPrefix) const;
+
+        /// Emits a second network in the same program, such as the human SL net next to the
+        /// main net, so one prediction evaluates both. It reads the same inputs, and its
+        /// outputs are named with `outputPrefix` prepended, such as "human_output_policy" and,
+        /// with OutputLayout::packed, "human_output_packed". The ModelDesc is not owned and
+        /// must outlive the builder. Throws std::invalid_argument if the prefix is empty, if the
+        /// networks take inputs with other channel counts, or if called after setFixedMetadata
+        /// or setChannelAlignment, which then also apply to the secondary model.
+        void setSecondaryModel(ModelDesc &secondaryModelDesc, const std::string &outputPrefix);
+
+        /// The secondary model, or nullptr if there is none.
+        ModelDesc *getSecondaryModelDesc() const
+        {
+            return secondaryModelDesc;
+        }
+
+        const std::string &getSecondaryOutputPrefix() const
+        {
+            return secondaryOutputPrefix;
+        }
+
+        /// Emits weights with at least this fraction of exact zeros as sparse constants
+        /// (constexpr_sparse_to_dense, iOS 16). Values above 1 disable sparse encoding.
+        void setSparsityThreshold(float sparsityThreshold)
+        {
+            this->sparsityThreshold = sparsityThreshold;
+        }
+
+        float getSparsityThreshold() const
+        {
+            return sparsityThreshold;
+        }
+
+        /// Runs the network at a larger board size, such as 20x20 or 24x24, which accelerators
+        /// may process faster than odd sizes. Inputs and outputs keep the nnXLen x nnYLen size:
+        /// the graph zero-pads the spatial input, so the extra positions are off the board
+        /// mask, and crops the spatial outputs. Throws std::invalid_argument if smaller than the
+        /// board, or if the board size is flexible.
+        void setPaddedBoardSize(int paddedXLen, int paddedYLen);
+
+        int getPaddedXLen() const
+        {
+            return paddedXLen;
+        }
+
+        int getPaddedYLen() const
+        {
+            return paddedYLen;
+        }
+
+        /// Builds one package for every board from minLen x minLen to maxLen x maxLen. The Y and
+        /// X dimensions of input_spatial are ranges in the model description, with nnYLen x
+        /// nnXLen as the default shape, and unknown in the program and in the spatial outputs,
+        /// which are -1 in getOutputFeatures. Quantities that depend on the board size, such as
+        /// means over the board, are computed in the graph from the on-board mask, channel 0
+        /// of input_spatial. The conversion report is for the nnXLen x nnYLen board.
+        /// Throws std::invalid_argument if nnXLen or nnYLen is out of the range, or if a padded
+        /// board size is set.
+        void setFlexibleBoardSize(int minLen, int maxLen);
+
+        bool hasFlexibleBoardSize() const
+        {
+            return maxBoardLen > 0;
+        }
+
+        int getMinBoardLen() const
+        {
+            return minBoardLen;
+        }
+
+        int getMaxBoardLen() const
+        {
+            return maxBoardLen;
+        }
+
+        /// Zero-pads internal channel counts to a multiple of `alignment`, see padModelChannels,
+        /// and zero-pads the channels of the spatial input in the graph to match. Inputs and
+        /// outputs keep their size. This modifies the ModelDesc, and that of the secondary
+        /// model, so call it before any conversion that shares them. Calling it again with the
+        /// same alignment has no effect; throws std::invalid_argument for another alignment.
+        void setChannelAlignment(int alignment);
+
+        int getChannelAlignment() const
+        {
+            return channelAlignment;
+        }
+
+        /// Folds a fixed SGF metadata vector into the ModelDesc, see foldFixedMetadata. The
+        /// metadata encoder is evaluated once here, and input_meta is dropped from the inputs.
+        /// This modifies the ModelDesc, and that of the secondary model, so call it before any
+        /// conversion that shares them.
+        void setFixedMetadata(const std::vector<float> &inputMeta);
+
+        bool hasFixedMetadata() const
+        {
+            return fixedMetadata;
+        }
+
+        ConversionObserver *getObserver() const
+        {
+            return observer;
+        }
+
+        /// Report of the most recent createMLPackage call.
+        const ConversionReport &getReport() const
+        {
+            return report;
+        }
+
         const std::vector<InputFeature> &getInputFeatures() const
         {
             return inputFeatures;
@@ -67,11 +297,27 @@ namespace KataGoCoreML
         std::vector<InputFeature> inputFeatures;
         std::string packagePath;
         ModelDesc &modelDesc;
+        ModelDesc *secondaryModelDesc = nullptr;
+        std::string secondaryOutputPrefix;
         int nnXLen;
         int nnYLen;
+        int paddedXLen;
+        int paddedYLen;
+        int minBoardLen = 0;
+        int maxBoardLen = 0;
         int batchSize;
+        ConversionObserver *observer = nullptr;
+        std::string reportPath;
+        ConversionReport report;
+        PrecisionPlan precisionPlan;
+        LowRankPlan lowRankPlan;
+        ActivationQuantizationPlan activationQuantizationPlan;
+        OutputLayout outputLayout;
+        float sparsityThreshold = 2.0f;
+        bool fixedMetadata = false;
+        int channelAlignment = 1;
 
-        std::string setupAndSerializeModel(const std::string &weightFile);
+        void setupAndSerializeModel(const std::string &weightFile, const std::string &modelFile);
     };
 
 } // namespace KataGoCoreML
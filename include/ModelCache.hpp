@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    /// Writes a ModelDesc as a flat cache file that mapModelCache can map without parsing:
+    /// a fixed header with the offset and size of each section, a table of contents holding
+    /// every layer description, and the weight arrays as little-endian float32 at 64-byte
+    /// aligned offsets. `sourceKey`, up to 64 bytes, identifies the model the cache was built
+    /// from. The file is written in place; write to a temporary path and rename it if readers
+    /// may run concurrently. Throws std::runtime_error on failure.
+    void writeModelCache(const ModelDesc &modelDesc, const std::string &path, const std::string &sourceKey = "");
+
+    /// Maps a cache file written by writeModelCache. The weight arrays of the returned ModelDesc
+    /// are views into the mapping, which stays mapped as long as any of them, so only the layer
+    /// descriptions themselves are allocated. If `sourceKey` is not empty, the cache must have
+    /// been written with the same key. Throws std::runtime_error if the file cannot be mapped,
+    /// is not a cache of this format version, or does not match the key.
+    ModelDesc mapModelCache(const std::string &path, const std::string &sourceKey = "");
+
+    /// Loads a KataGo model through a cache in `cacheDir`, keyed by the model's absolute path,
+    /// size and modification time. The cache is built by loadModelFile the first time and
+    /// whenever the model changes, and mapped otherwise. Failing to write the cache is not an
+    /// error; the model is still returned. The key does not notice a model rewritten in place
+    /// with the same size and modification time. With a non-empty `expectedSha256` the model
+    /// file is hashed again (read, not parsed) on every cache hit, and a mismatch rebuilds the
+    /// cache through loadModelFile, which throws.
+    ModelDesc loadModelFileCached(const std::string &modelPath, const std::string &cacheDir,
+                                  const std::string &expectedSha256 = "");
+
+} // namespace KataGoCoreML
@@ -2,9 +2,12 @@
 
 #pragma once
 
+#include <functional>
 #include <istream>
+#include <memory>
 #include <string>
 #include <vector>
+#include "WeightArray.hpp"
 
 using unique_ptr_void = std::unique_ptr<void, void (*)(const void *)>;
 
@@ -20,7 +23,7 @@ namespace KataGoCoreML
         int dilationY;
         int dilationX;
         // outC x inC x H x W (col-major order - W has least stride, outC greatest)
-        std::vector<float> weights;
+        WeightArray weights;
 
         ConvLayerDesc();
     };
@@ -32,10 +35,10 @@ namespace KataGoCoreML
         float epsilon;
         bool hasScale;
         bool hasBias;
-        std::vector<float> mean;
-        std::vector<float> variance;
-        std::vector<float> scale;
-        std::vector<float> bias;
+        WeightArray mean;
+        WeightArray variance;
+        WeightArray scale;
+        WeightArray bias;
 
         BatchNormLayerDesc();
     };
@@ -57,7 +60,7 @@ namespace KataGoCoreML
         std::string name;
         int inChannels;
         int outChannels;
-        std::vector<float> weights;
+        WeightArray weights;
 
         MatMulLayerDesc();
     };
@@ -66,7 +69,7 @@ namespace KataGoCoreML
     {
         std::string name;
         int numChannels;
-        std::vector<float> weights;
+        WeightArray weights;
 
         MatBiasLayerDesc();
     };
@@ -238,4 +241,11 @@ namespace KataGoCoreML
 
         ModelDesc();
     };
+
+    // Visit every convolution / matrix multiplication layer of a model in network order,
+    // descending into residual, global pooling and nested bottleneck blocks
+    void forEachConvLayer(const ModelDesc &modelDesc,
+                          const std::function<void(const ConvLayerDesc &)> &visit);
+    void forEachMatMulLayer(const ModelDesc &modelDesc,
+                            const std::function<void(const MatMulLayerDesc &)> &visit);
 } // namespace KataGoCoreML
@@ -0,0 +1,25 @@
+// The file format read here shall be consistent with katago/cpp/neuralnet/desc.cpp
+
+#pragma once
+
+#include <istream>
+#include <string>
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    /// Reads a KataGo model (.bin, .bin.gz, .txt or .txt.gz) into a ModelDesc.
+    /// Floats are read in binary for .bin files and as text for .txt files, as KataGo does.
+    /// ModelDesc::sha256 is set to the SHA-256 of the file as stored, computed while it is read.
+    /// Throws std::runtime_error if the file cannot be read or parsed, or if `expectedSha256`
+    /// is not empty and differs from the file's SHA-256.
+    ModelDesc loadModelFile(const std::string &path, const std::string &expectedSha256 = "");
+
+    /// Whether `expectedSha256` is empty or equal to the hex digest `sha256`, ignoring case.
+    bool sha256Matches(const std::string &sha256, const std::string &expectedSha256);
+
+    /// Parses a decompressed KataGo model from a stream.
+    /// Throws std::runtime_error on malformed input.
+    ModelDesc parseModel(std::istream &in, const std::string &sha256, bool binaryFloats);
+
+} // namespace KataGoCoreML
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace CoreML
+{
+    namespace Specification
+    {
+        namespace MILSpec
+        {
+            class Block;
+            class NamedValueType;
+            class Operation;
+            class ValueType;
+        }
+    }
+}
+
+namespace KataGoCoreML
+{
+    /// Appends MIL operations to a block. The type of each (data type, shape) pair is built
+    /// once per builder, on the block's arena, and copied into the outputs and const values
+    /// that have it. Names derived from an op name, such as the "_pad" const of a conv, are
+    /// formed once into storage owned by the builder and bound by reference. Each op is named
+    /// after its output, as coremltools does.
+    ///
+    /// Element types T are float, MILBlob::Fp16, std::int8_t, std::uint8_t, std::uint32_t,
+    /// std::int32_t, bool and std::string; immediate const values cannot be Fp16 or unsigned.
+    class OpBuilder
+    {
+    public:
+        explicit OpBuilder(CoreML::Specification::MILSpec::Block &block);
+        ~OpBuilder();
+
+        OpBuilder(const OpBuilder &) = delete;
+        OpBuilder &operator=(const OpBuilder &) = delete;
+
+        CoreML::Specification::MILSpec::Block &getBlock() const
+        {
+            return block;
+        }
+
+        /// The name `base` + `suffix`, stored by the builder and valid as long as it. Each call
+        /// stores a new string; names in a program are unique, so there is nothing to share.
+        const std::string &name(const std::string &base, const char *suffix = "");
+
+        /// Type of a tensor of T with `shape`, a scalar if `shape` is empty.
+        template <typename T>
+        const CoreML::Specification::MILSpec::ValueType &tensorType(const std::vector<int> &shape);
+
+        /// Type of a tensor with the data type of `value` and the given shape.
+        const CoreML::Specification::MILSpec::ValueType &tensorTypeLike(
+            const CoreML::Specification::MILSpec::NamedValueType &value, const std::vector<int> &shape);
+
+        /// Appends an op of `type` whose "name" attribute is `name`.
+        CoreML::Specification::MILSpec::Operation &addOperation(const char *type, const std::string &name);
+
+        /// Binds the input `input` of `op` to the value named `value`.
+        void bind(CoreML::Specification::MILSpec::Operation &op, const char *input, const std::string &value);
+
+        CoreML::Specification::MILSpec::NamedValueType *addOutput(
+            CoreML::Specification::MILSpec::Operation &op,
+            const std::string &name,
+            const CoreML::Specification::MILSpec::ValueType &type);
+
+        /// const op with immediate values; `values` has as many elements as `shape`.
+        template <typename T>
+        CoreML::Specification::MILSpec::NamedValueType *addConst(const std::string &name,
+                                                                 const std::vector<int> &shape,
+                                                                 const std::vector<T> &values);
+
+        template <typename T>
+        CoreML::Specification::MILSpec::NamedValueType *addScalarConst(const std::string &name, const T &value);
+
+        /// Elementwise op of one input, such as relu, with the type of its input.
+        CoreML::Specification::MILSpec::NamedValueType *addUnary(
+            const char *type, const CoreML::Specification::MILSpec::NamedValueType &x, const std::string &name);
+
+        /// Elementwise op of two inputs, such as add, broadcast as in numpy.
+        CoreML::Specification::MILSpec::NamedValueType *addBinary(
+            const char *type,
+            const CoreML::Specification::MILSpec::NamedValueType &x,
+            const CoreML::Specification::MILSpec::NamedValueType &y,
+            const std::string &name);
+
+        /// Stride 1 convolution of an NCHW tensor with "same" padding and one group, the only
+        /// kind KataGo models have. `weight` names a [outChannels, C, kY, kX] value.
+        CoreML::Specification::MILSpec::NamedValueType *addConv(
+            const CoreML::Specification::MILSpec::NamedValueType &x,
+            const std::string &weight,
+            int outChannels,
+            int dilationY,
+            int dilationX,
+            const std::string &name);
+
+        /// Product of the last two dimensions, broadcast over the leading ones.
+        CoreML::Specification::MILSpec::NamedValueType *addMatmul(
+            const CoreML::Specification::MILSpec::NamedValueType &x,
+            const CoreML::Specification::MILSpec::NamedValueType &y,
+            const std::string &name);
+
+        /// reduce_* op, such as reduce_mean, over `axes`.
+        CoreML::Specification::MILSpec::NamedValueType *addReduce(
+            const char *type,
+            const CoreML::Specification::MILSpec::NamedValueType &x,
+            const std::vector<int> &axes,
+            bool keepDims,
+            const std::string &name);
+
+    private:
+        struct Cache;
+
+        CoreML::Specification::MILSpec::Block &block;
+        std::unique_ptr<Cache> cache;
+    };
+
+} // namespace KataGoCoreML
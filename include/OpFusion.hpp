@@ -0,0 +1,32 @@
+#pragma once
+
+namespace CoreML
+{
+    namespace Specification
+    {
+        namespace MILSpec
+        {
+            class Block;
+        }
+    }
+}
+
+namespace KataGoCoreML
+{
+    /// Rewrites applied by fuseEpilogues.
+    struct EpilogueFusion
+    {
+        /// conv followed by an add of a per-channel constant, folded into the conv's bias.
+        int biasesFused = 0;
+        /// Activations moved to directly follow the conv or add they read, so the two can be fused.
+        int activationsAdjoined = 0;
+    };
+
+    /// Rewrites convolution epilogues of a block into the forms the runtime fuses:
+    /// - conv, then add of a constant with one value per output channel, becomes one conv with
+    ///   that constant as its bias, if the conv has no bias yet and the add is its only reader;
+    /// - an activation that is the only reader of a conv or add is moved to directly follow it.
+    /// Values keep their names, so readers of the rewritten ops are unchanged.
+    EpilogueFusion fuseEpilogues(CoreML::Specification::MILSpec::Block &block);
+
+} // namespace KataGoCoreML
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace CoreML
+{
+    namespace Specification
+    {
+        namespace MILSpec
+        {
+            class Block;
+            class Function;
+        }
+    }
+}
+
+namespace KataGoCoreML
+{
+    /// Largest total size of activations alive at the same time, before and after scheduling.
+    /// Activations are counted as in CostReport::peakLiveActivationBytes.
+    struct MemorySchedule
+    {
+        std::uint64_t peakLiveActivationBytesBefore = 0;
+        std::uint64_t peakLiveActivationBytesAfter = 0;
+    };
+
+    /// Rearranges the operations of a block so that the i-th operation is the one at index
+    /// order[i]. Operations not in `order` are deleted. Operations are moved, not copied.
+    void reorderOperations(CoreML::Specification::MILSpec::Block &block, const std::vector<int> &order);
+
+    /// Reorders the operations of a block of `function` to reduce the peak live activation
+    /// bytes, keeping every operation after the operations it reads. Each operation is emitted
+    /// just before its first consumer needs it, and the inputs of an operation are computed
+    /// most demanding first, so that their intermediate tensors are freed early. The block is
+    /// left in its original order unless the new order has a lower peak. Tensor shapes must
+    /// be static.
+    MemorySchedule scheduleForMemory(CoreML::Specification::MILSpec::Block &block,
+                                     const CoreML::Specification::MILSpec::Function &function);
+
+} // namespace KataGoCoreML
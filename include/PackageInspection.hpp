@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace KataGoCoreML
+{
+    /// A model input or output as declared in the model description. Dimensions with a range
+    /// of sizes are -1, and outputs of flexible shape have no shape.
+    struct PackageFeature
+    {
+        std::string name;
+        std::string dataType;
+        std::vector<std::int64_t> shape;
+    };
+
+    /// The weight blobs of one op in weight.bin.
+    struct PackageLayerWeights
+    {
+        std::string name;
+        std::string opType;
+        /// Data type of the op's largest blob, such as the quantized data of a dequantize op.
+        std::string dataType;
+        std::uint64_t bytes = 0;
+        int numBlobs = 0;
+    };
+
+    /// Contents of a built .mlpackage, read back from model.mlmodel and weight.bin.
+    class PackageSummary
+    {
+    public:
+        std::string packagePath;
+        /// Size of every file in the package.
+        std::uint64_t packageBytes = 0;
+        std::uint64_t modelBytes = 0;
+        std::uint64_t weightFileBytes = 0;
+        int specificationVersion = 0;
+        std::string opset;
+        std::vector<PackageFeature> inputs;
+        std::vector<PackageFeature> outputs;
+        std::map<std::string, int> opCounts;
+        /// Ops with weights in weight.bin, in program order.
+        std::vector<PackageLayerWeights> layerWeights;
+        /// Number of const and constexpr_* ops, and their serialized size in model.mlmodel.
+        int numConstOps = 0;
+        std::uint64_t constOpBytes = 0;
+        /// Bytes of weight.bin that are headers, blob metadata and alignment padding.
+        std::uint64_t weightFileOverheadBytes = 0;
+
+        int totalOpCount() const;
+
+        /// Total size of the weight blobs, excluding weightFileOverheadBytes.
+        std::uint64_t totalWeightBytes() const;
+
+        std::string toText() const;
+        std::string toJSON() const;
+    };
+
+    /// Reads a package built by ModelBuilder::createMLPackage. Only the package files are read,
+    /// so this works on any platform. Throws std::runtime_error if the package cannot be read.
+    PackageSummary inspectPackage(const std::string &packagePath);
+
+    /// Differences from `before` to `after` in size, I/O, op counts and per-layer weights,
+    /// one per line. Empty if the packages do not differ in any of them.
+    std::string diffPackages(const PackageSummary &before, const PackageSummary &after);
+
+} // namespace KataGoCoreML
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace CoreML
+{
+    namespace Specification
+    {
+        class Model;
+    }
+}
+
+namespace KataGoCoreML
+{
+    /// Type- and shape-checks the ML program of a model without compiling it, so that a broken
+    /// graph fails at conversion time instead of when Core ML loads the package:
+    /// - every argument refers to a function input or to an earlier op output, and no name
+    ///   is defined twice;
+    /// - every op has the inputs and attributes its type requires, and its declared output
+    ///   types match the types inferred from its inputs;
+    /// - the function inputs, and the block outputs, match the inputs and outputs declared
+    ///   in the model description, where a dimension with a range of sizes is unknown and a
+    ///   feature without a shape matches any shape;
+    /// - the opset matches the specification version.
+    /// Returns one message per problem found, empty if the program is valid.
+    std::vector<std::string> findProgramErrors(const CoreML::Specification::Model &model);
+
+    /// Sets the output type of every op of the main function to the type inferred from its
+    /// inputs, so that a change to the function inputs, such as a dimension made unknown,
+    /// carries through the program. Ops whose type cannot be inferred keep their declared
+    /// type, and findProgramErrors reports them.
+    void inferOutputTypes(CoreML::Specification::Model &model);
+
+    /// Throws std::runtime_error listing the problems found by findProgramErrors, if any.
+    void verifyProgram(const CoreML::Specification::Model &model);
+
+} // namespace KataGoCoreML
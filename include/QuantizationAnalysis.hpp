@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    // Storage precision of a layer's weights in the emitted package, from most to least accurate
+    enum class WeightPrecision
+    {
+        FLOAT32,
+        FLOAT16,
+        INT8 // Symmetric per-output-channel linear quantization, requires iOS 16
+    };
+
+    const char *weightPrecisionName(WeightPrecision precision);
+
+    /// Bytes used to store one weight at the given precision (excluding per-channel scales).
+    std::size_t weightPrecisionBytes(WeightPrecision precision);
+
+    struct PrecisionErrorStats
+    {
+        WeightPrecision precision;
+        double snrDb;       // Signal-to-noise ratio of the rounded weights, +inf if lossless
+        double maxAbsError; // Largest absolute difference from the float32 weights
+    };
+
+    struct LayerQuantizationAnalysis
+    {
+        std::string name;
+        std::size_t numWeights;
+        std::vector<PrecisionErrorStats> stats;
+
+        /// Returns the statistics for the given precision, or nullptr if it was not analyzed.
+        const PrecisionErrorStats *find(WeightPrecision precision) const;
+    };
+
+    /// Per-layer weight precision chosen for a conversion. Layers not listed use the default.
+    class PrecisionPlan
+    {
+    public:
+        WeightPrecision defaultPrecision = WeightPrecision::FLOAT32;
+        std::map<std::string, WeightPrecision> layers;
+
+        WeightPrecision precisionFor(const std::string &layerName) const;
+
+        /// Returns true if any layer, or the default, uses the given precision.
+        bool uses(WeightPrecision precision) const;
+    };
+
+    struct QuantizationErrorBudget
+    {
+        double minSnrDb = 40.0;
+        double maxAbsError = 1e-2;
+    };
+
+    /// Computes weight-space error statistics for every convolution and matrix multiplication
+    /// layer of the model at each candidate precision. Layers without weights are skipped.
+    std::vector<LayerQuantizationAnalysis> analyzeQuantizationError(
+        const ModelDesc &modelDesc,
+        const std::vector<WeightPrecision> &candidates = {WeightPrecision::FLOAT16, WeightPrecision::INT8});
+
+    /// Picks for each layer the cheapest analyzed precision that meets the budget.
+    /// Layers where no candidate meets the budget stay at float32.
+    PrecisionPlan selectMixedPrecision(const std::vector<LayerQuantizationAnalysis> &analysis,
+                                       const QuantizationErrorBudget &budget);
+
+    /// Rounds the weights through float16 and back.
+    std::vector<float> roundTripFloat16(const WeightArray &weights);
+
+    /// Quantizes the weights to int8 with one symmetric scale per slice along the outermost axis.
+    /// The weights are viewed as numChannels contiguous slices of equal length.
+    void quantizeInt8PerChannel(const WeightArray &weights,
+                                int numChannels,
+                                std::vector<int8_t> &quantized,
+                                std::vector<float> &scales);
+
+} // namespace KataGoCoreML
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace KataGoCoreML
+{
+    /// Incremental SHA-256 (FIPS 180-4). Blocks are compressed with the CPU's SHA-256
+    /// instructions when it has them.
+    class Sha256
+    {
+    public:
+        Sha256();
+
+        void update(const void *data, std::size_t size);
+
+        void update(const std::string &data)
+        {
+            update(data.data(), data.size());
+        }
+
+        /// Returns the digest. The hash must not be updated afterwards.
+        std::array<std::uint8_t, 32> digest();
+
+        /// Returns the digest as 64 lowercase hex digits.
+        std::string hexDigest();
+
+        /// Whether this CPU runs the SHA-NI (x86) or ARMv8 cryptography extension code path.
+        static bool isHardwareAccelerated();
+
+        /// Lets hashes use the hardware code path when the CPU has one (the default), or forces
+        /// the portable one, for instance to check that both give the same digests. Applies to
+        /// every Sha256 from then on, including hashes in progress.
+        static void setHardwareAccelerationEnabled(bool enabled);
+
+    private:
+        void processBlocks(const std::uint8_t *blocks, std::size_t numBlocks);
+
+        std::array<std::uint32_t, 8> state;
+        std::array<std::uint8_t, 64> buffer;
+        std::size_t bufferSize = 0;
+        std::uint64_t totalBytes = 0;
+    };
+
+} // namespace KataGoCoreML
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "ModelDescription.hpp"
+
+namespace KataGoCoreML
+{
+    struct LayerSparsity
+    {
+        std::string name;
+        std::size_t numWeights;
+        std::size_t numZeros;
+
+        double sparsity() const
+        {
+            return numWeights == 0 ? 0.0 : static_cast<double>(numZeros) / numWeights;
+        }
+    };
+
+    /// Counts the exactly-zero weights of every convolution and matrix multiplication layer.
+    /// Layers without weights are skipped.
+    std::vector<LayerSparsity> analyzeWeightSparsity(const ModelDesc &modelDesc);
+
+    /// Fraction of exactly-zero values in the weights, 0 if empty.
+    double weightSparsity(const WeightArray &weights);
+
+    /// Splits the weights into their non-zero values and a bit mask packed
+    /// in little-endian bit order, one bit per weight, as consumed by constexpr_sparse_to_dense.
+    void encodeSparseWeights(const WeightArray &weights,
+                             std::vector<float> &nonzeroData,
+                             std::vector<uint8_t> &mask);
+
+} // namespace KataGoCoreML
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace KataGoCoreML
+{
+    /// Float weights of a layer, either owned or viewed in a buffer owned by someone else.
+    ///
+    /// Views let a ModelDesc reference the caller's weights, such as the vectors of KataGo's
+    /// own ModelDesc or an mmap'd file, without copying the network. A viewed buffer must stay
+    /// alive and unchanged as long as the view, unless `owner` is given to keep it alive.
+    /// Only mutableData() gives write access; it copies viewed data into an owned buffer first
+    /// (copy-on-write), so the caller's buffer is never modified.
+    class WeightArray
+    {
+    public:
+        WeightArray() = default;
+
+        WeightArray(std::vector<float> values)
+            : owned(std::move(values)) {}
+
+        WeightArray(std::initializer_list<float> values)
+            : owned(values) {}
+
+        static WeightArray view(const float *data, std::size_t size,
+                                std::shared_ptr<const void> owner = nullptr)
+        {
+            WeightArray array;
+            if (size > 0)
+            {
+                array.viewData = data;
+                array.viewSize = size;
+                array.owner = std::move(owner);
+            }
+            return array;
+        }
+
+        static WeightArray view(const std::vector<float> &values)
+        {
+            return view(values.data(), values.size());
+        }
+
+        // A view of a temporary would dangle as soon as the full expression ends
+        static WeightArray view(std::vector<float> &&) = delete;
+
+        bool isView() const
+        {
+            return viewData != nullptr;
+        }
+
+        std::size_t size() const
+        {
+            return isView() ? viewSize : owned.size();
+        }
+
+        bool empty() const
+        {
+            return size() == 0;
+        }
+
+        const float *data() const
+        {
+            return isView() ? viewData : owned.data();
+        }
+
+        const float *begin() const
+        {
+            return data();
+        }
+
+        const float *end() const
+        {
+            return data() + size();
+        }
+
+        const float &operator[](std::size_t i) const
+        {
+            return data()[i];
+        }
+
+        /// Copies a view into an owned buffer, then returns the owned data.
+        float *mutableData()
+        {
+            if (isView())
+            {
+                owned.assign(viewData, viewData + viewSize);
+                viewData = nullptr;
+                viewSize = 0;
+                owner.reset();
+            }
+            return owned.data();
+        }
+
+        std::vector<float> toVector() const
+        {
+            return std::vector<float>(begin(), end());
+        }
+
+    private:
+        std::vector<float> owned;
+        const float *viewData = nullptr;
+        std::size_t viewSize = 0;
+        std::shared_ptr<const void> owner;
+    };
+
+} // namespace KataGoCoreML
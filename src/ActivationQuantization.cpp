@@ -0,0 +1,231 @@
+#include "ActivationQuantization.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace KataGoCoreML
+{
+    // Parses a whole token as a number; throws std::runtime_error otherwise
+    template <typename T>
+    static T parseNumber(const std::string &token, const std::string &where)
+    {
+        std::istringstream in(token);
+        T value;
+        if (!(in >> value) || !in.eof())
+        {
+            throw std::runtime_error(where + "expected a number, got " + token);
+        }
+        return value;
+    }
+
+    CalibrationTable parseCalibration(std::istream &in)
+    {
+        CalibrationTable table;
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(in, line))
+        {
+            ++lineNumber;
+            const std::string where = "Calibration line " + std::to_string(lineNumber) + ": ";
+            const std::size_t comment = line.find('#');
+            if (comment != std::string::npos)
+            {
+                line.erase(comment);
+            }
+
+            std::istringstream fields(line);
+            std::vector<std::string> tokens;
+            for (std::string token; fields >> token;)
+            {
+                tokens.push_back(token);
+            }
+            if (tokens.empty())
+            {
+                continue;
+            }
+
+            const std::string &kind = tokens[0];
+            if (kind == "layer")
+            {
+                if (tokens.size() != 4 && tokens.size() != 6)
+                {
+                    throw std::runtime_error(where + "expected 'layer NAME MIN MAX [PERCENTILE_LOW PERCENTILE_HIGH]'");
+                }
+                const std::string &name = tokens[1];
+                ActivationRange range;
+                range.min = parseNumber<float>(tokens[2], where);
+                range.max = parseNumber<float>(tokens[3], where);
+                if (tokens.size() == 6)
+                {
+                    range.hasPercentiles = true;
+                    range.percentileLow = parseNumber<float>(tokens[4], where);
+                    range.percentileHigh = parseNumber<float>(tokens[5], where);
+                }
+                if (!(range.min <= range.max) ||
+                    (range.hasPercentiles && !(range.min <= range.percentileLow &&
+                                               range.percentileLow <= range.percentileHigh &&
+                                               range.percentileHigh <= range.max)))
+                {
+                    throw std::runtime_error(where + "range of " + name + " is not ordered");
+                }
+                if (!table.layers.emplace(name, range).second)
+                {
+                    throw std::runtime_error(where + "duplicate layer " + name);
+                }
+            }
+            else if (kind == "channel")
+            {
+                if (tokens.size() != 5)
+                {
+                    throw std::runtime_error(where + "expected 'channel NAME INDEX MIN MAX'");
+                }
+                const std::string &name = tokens[1];
+                const int index = parseNumber<int>(tokens[2], where);
+                const float min = parseNumber<float>(tokens[3], where);
+                const float max = parseNumber<float>(tokens[4], where);
+                auto layer = table.layers.find(name);
+                if (layer == table.layers.end())
+                {
+                    throw std::runtime_error(where + "channel of " + name + " before its layer record");
+                }
+                if (index != static_cast<int>(layer->second.channels.size()))
+                {
+                    throw std::runtime_error(where + "channel " + std::to_string(index) + " of " + name + " is out of order");
+                }
+                if (!(min <= max))
+                {
+                    throw std::runtime_error(where + "range of " + name + " channel " + std::to_string(index) + " is not ordered");
+                }
+                layer->second.channels.emplace_back(min, max);
+            }
+            else
+            {
+                throw std::runtime_error(where + "unknown record " + kind);
+            }
+        }
+        return table;
+    }
+
+    CalibrationTable loadCalibrationFile(const std::string &path)
+    {
+        std::ifstream in(path);
+        if (!in)
+        {
+            throw std::runtime_error("Failed to open calibration file: " + path);
+        }
+        try
+        {
+            return parseCalibration(in);
+        }
+        catch (const std::runtime_error &e)
+        {
+            throw std::runtime_error(path + ": " + e.what());
+        }
+    }
+
+    const char *activationQuantizationName(ActivationQuantization quantization)
+    {
+        switch (quantization)
+        {
+        case ActivationQuantization::INT8_PER_TENSOR:
+            return "int8_per_tensor";
+        case ActivationQuantization::INT8_PER_CHANNEL:
+            return "int8_per_channel";
+        case ActivationQuantization::FLOAT16:
+            return "float16";
+        }
+        return "unknown";
+    }
+
+    // Affine int8 parameters covering [lo, hi], widened to include 0 so that zero padding
+    // and ReLU outputs are exact. A range of only 0 gets scale 1.
+    static void int8Parameters(float lo, float hi, float &scale, int8_t &zeroPoint)
+    {
+        lo = std::min(lo, 0.0f);
+        hi = std::max(hi, 0.0f);
+        scale = hi > lo ? (hi - lo) / 255.0f : 1.0f;
+        const float zero = std::round(-128.0f - lo / scale);
+        zeroPoint = static_cast<int8_t>(std::clamp(zero, -128.0f, 127.0f));
+    }
+
+    static LayerActivationQuantization planLayer(const ConvLayerDesc &conv,
+                                                 const ActivationRange &range,
+                                                 const ActivationQuantizationOptions &options)
+    {
+        LayerActivationQuantization layer;
+        if (!std::isfinite(range.min) || !std::isfinite(range.max) || !(range.min < range.max))
+        {
+            return layer;
+        }
+
+        float lo = range.min;
+        float hi = range.max;
+        if (range.hasPercentiles)
+        {
+            const double fullRange = static_cast<double>(range.max) - range.min;
+            const double percentileRange = static_cast<double>(range.percentileHigh) - range.percentileLow;
+            if (!(percentileRange > 0.0) || fullRange > options.maxOutlierRatio * percentileRange)
+            {
+                return layer;
+            }
+            lo = range.percentileLow;
+            hi = range.percentileHigh;
+            layer.clippedFraction = (fullRange - percentileRange) / fullRange;
+        }
+
+        if (!range.channels.empty())
+        {
+            if (static_cast<int>(range.channels.size()) != conv.outChannels)
+            {
+                throw std::runtime_error("Calibration of " + conv.name + " has " + std::to_string(range.channels.size()) +
+                                         " channels, but the layer has " + std::to_string(conv.outChannels));
+            }
+            float narrowest = range.channels[0].second - range.channels[0].first;
+            float widest = narrowest;
+            for (const auto &channel : range.channels)
+            {
+                narrowest = std::min(narrowest, channel.second - channel.first);
+                widest = std::max(widest, channel.second - channel.first);
+            }
+            if (widest > options.maxChannelRangeSpread * narrowest)
+            {
+                // Channel ranges are the full observed ranges, not clipped to percentiles
+                layer.quantization = ActivationQuantization::INT8_PER_CHANNEL;
+                layer.clippedFraction = 0.0;
+                layer.scales.resize(range.channels.size());
+                layer.zeroPoints.resize(range.channels.size());
+                for (std::size_t c = 0; c < range.channels.size(); ++c)
+                {
+                    int8Parameters(range.channels[c].first, range.channels[c].second, layer.scales[c], layer.zeroPoints[c]);
+                }
+                return layer;
+            }
+        }
+
+        layer.quantization = ActivationQuantization::INT8_PER_TENSOR;
+        layer.scales.resize(1);
+        layer.zeroPoints.resize(1);
+        int8Parameters(lo, hi, layer.scales[0], layer.zeroPoints[0]);
+        return layer;
+    }
+
+    ActivationQuantizationPlan planActivationQuantization(const ModelDesc &modelDesc,
+                                                          const CalibrationTable &calibration,
+                                                          const ActivationQuantizationOptions &options)
+    {
+        ActivationQuantizationPlan plan;
+        forEachConvLayer(modelDesc,
+                         [&](const ConvLayerDesc &conv)
+                         {
+                             if (const ActivationRange *range = calibration.find(conv.name))
+                             {
+                                 plan.layers[conv.name] = planLayer(conv, *range, options);
+                             }
+                         });
+        return plan;
+    }
+
+} // namespace KataGoCoreML
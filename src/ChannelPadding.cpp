@@ -0,0 +1,214 @@
+#include "ChannelPadding.hpp"
+
+#include <stdexcept>
+#include <string>
+
+namespace KataGoCoreML
+{
+    int alignChannels(int channels, int alignment)
+    {
+        return (channels + alignment - 1) / alignment * alignment;
+    }
+
+    // Weights are outC x inC x H x W
+    static void padConv(ConvLayerDesc &conv, int inChannels, int outChannels)
+    {
+        if (conv.inChannels == inChannels && conv.outChannels == outChannels)
+            return;
+
+        const std::size_t kernelSize = static_cast<std::size_t>(conv.convYSize) * conv.convXSize;
+        std::vector<float> weights(static_cast<std::size_t>(outChannels) * inChannels * kernelSize, 0.0f);
+        for (int oc = 0; oc < conv.outChannels; ++oc)
+            for (int ic = 0; ic < conv.inChannels; ++ic)
+                for (std::size_t k = 0; k < kernelSize; ++k)
+                    weights[(static_cast<std::size_t>(oc) * inChannels + ic) * kernelSize + k] =
+                        conv.weights[(static_cast<std::size_t>(oc) * conv.inChannels + ic) * kernelSize + k];
+
+        conv.weights = std::move(weights);
+        conv.inChannels = inChannels;
+        conv.outChannels = outChannels;
+    }
+
+    // Padded channels normalize to (x - 0) * 0 / sqrt(1 + eps) + 0 = 0
+    static void padBatchNorm(BatchNormLayerDesc &bn, int numChannels)
+    {
+        if (bn.numChannels == numChannels)
+            return;
+
+        // The padded scale is used, so the real channels need theirs
+        if (!bn.hasScale)
+        {
+            bn.scale = std::vector<float>(bn.numChannels, 1.0f);
+        }
+        auto pad = [&](const WeightArray &values, float fill)
+        {
+            std::vector<float> padded = values.toVector();
+            padded.resize(numChannels, fill);
+            return padded;
+        };
+        bn.mean = pad(bn.mean, 0.0f);
+        bn.variance = pad(bn.variance, 1.0f);
+        bn.scale = pad(bn.scale, 0.0f);
+        bn.bias = pad(bn.bias, 0.0f);
+        bn.hasScale = true;
+        bn.numChannels = numChannels;
+    }
+
+    // Weights are inC x outC. The input is `numSegments` consecutive groups of `segmentChannels`,
+    // as produced by global pooling; each group is padded to `paddedSegmentChannels`.
+    static void padSegmentedMatMul(MatMulLayerDesc &matMul,
+                                   int numSegments,
+                                   int segmentChannels,
+                                   int paddedSegmentChannels,
+                                   int outChannels)
+    {
+        if (matMul.inChannels != numSegments * segmentChannels)
+        {
+            throw std::invalid_argument(matMul.name + ": expected " + std::to_string(numSegments * segmentChannels) +
+                                        " input channels, got " + std::to_string(matMul.inChannels));
+        }
+        if (segmentChannels == paddedSegmentChannels && matMul.outChannels == outChannels)
+            return;
+
+        std::vector<float> weights(static_cast<std::size_t>(numSegments) * paddedSegmentChannels * outChannels, 0.0f);
+        for (int s = 0; s < numSegments; ++s)
+            for (int i = 0; i < segmentChannels; ++i)
+                for (int o = 0; o < matMul.outChannels; ++o)
+                    weights[static_cast<std::size_t>(s * paddedSegmentChannels + i) * outChannels + o] =
+                        matMul.weights[static_cast<std::size_t>(s * segmentChannels + i) * matMul.outChannels + o];
+
+        matMul.weights = std::move(weights);
+        matMul.inChannels = numSegments * paddedSegmentChannels;
+        matMul.outChannels = outChannels;
+    }
+
+    static void padMatMul(MatMulLayerDesc &matMul, int inChannels, int outChannels)
+    {
+        padSegmentedMatMul(matMul, 1, matMul.inChannels, inChannels, outChannels);
+    }
+
+    static void padMatBias(MatBiasLayerDesc &bias, int numChannels)
+    {
+        if (bias.numChannels == numChannels)
+            return;
+
+        std::vector<float> weights = bias.weights.toVector();
+        weights.resize(numChannels, 0.0f);
+        bias.weights = std::move(weights);
+        bias.numChannels = numChannels;
+    }
+
+    // Global pooling yields mean, scaled mean and max (or a second scaled mean) per channel
+    static constexpr int NUM_POOLED_FEATURES = 3;
+
+    static void padBlocks(std::vector<std::pair<int, unique_ptr_void>> &blocks, int channels, int alignment)
+    {
+        for (auto &block : blocks)
+        {
+            if (block.first == ORDINARY_BLOCK_KIND)
+            {
+                auto *b = static_cast<ResidualBlockDesc *>(block.second.get());
+                const int mid = alignChannels(b->regularConv.outChannels, alignment);
+                padBatchNorm(b->preBN, channels);
+                padConv(b->regularConv, channels, mid);
+                padBatchNorm(b->midBN, mid);
+                padConv(b->finalConv, mid, channels);
+            }
+            else if (block.first == GLOBAL_POOLING_BLOCK_KIND)
+            {
+                auto *b = static_cast<GlobalPoolingResidualBlockDesc *>(block.second.get());
+                const int regular = alignChannels(b->regularConv.outChannels, alignment);
+                const int gpool = b->gpoolConv.outChannels;
+                const int paddedGpool = alignChannels(gpool, alignment);
+                padBatchNorm(b->preBN, channels);
+                padConv(b->regularConv, channels, regular);
+                padConv(b->gpoolConv, channels, paddedGpool);
+                padBatchNorm(b->gpoolBN, paddedGpool);
+                padSegmentedMatMul(b->gpoolToBiasMul, NUM_POOLED_FEATURES, gpool, paddedGpool, regular);
+                padBatchNorm(b->midBN, regular);
+                padConv(b->finalConv, regular, channels);
+            }
+            else if (block.first == NESTED_BOTTLENECK_BLOCK_KIND)
+            {
+                auto *b = static_cast<NestedBottleneckResidualBlockDesc *>(block.second.get());
+                const int mid = alignChannels(b->preConv.outChannels, alignment);
+                padBatchNorm(b->preBN, channels);
+                padConv(b->preConv, channels, mid);
+                padBlocks(b->blocks, mid, alignment);
+                padBatchNorm(b->postBN, mid);
+                padConv(b->postConv, mid, channels);
+            }
+        }
+    }
+
+    void padModelChannels(ModelDesc &modelDesc, int alignment)
+    {
+        if (alignment <= 0)
+        {
+            throw std::invalid_argument("Channel alignment must be positive, got " + std::to_string(alignment));
+        }
+
+        TrunkDesc &trunk = modelDesc.trunk;
+        const int trunkChannels = alignChannels(trunk.trunkNumChannels, alignment);
+
+        // The graph zero-pads the spatial input to the aligned channel count
+        padConv(trunk.initialConv, alignChannels(trunk.initialConv.inChannels, alignment), trunkChannels);
+        padMatMul(trunk.initialMatMul, trunk.initialMatMul.inChannels, trunkChannels);
+        if (trunk.metaEncoderVersion > 0)
+        {
+            SGFMetadataEncoderDesc &encoder = trunk.sgfMetadataEncoder;
+            const int hidden1 = alignChannels(encoder.mul1.outChannels, alignment);
+            const int hidden2 = alignChannels(encoder.mul2.outChannels, alignment);
+            padMatMul(encoder.mul1, encoder.mul1.inChannels, hidden1);
+            padMatBias(encoder.bias1, hidden1);
+            padMatMul(encoder.mul2, hidden1, hidden2);
+            padMatBias(encoder.bias2, hidden2);
+            padMatMul(encoder.mul3, hidden2, trunkChannels);
+        }
+        padBlocks(trunk.blocks, trunkChannels, alignment);
+        padBatchNorm(trunk.trunkTipBN, trunkChannels);
+
+        trunk.trunkNumChannels = trunkChannels;
+        trunk.midNumChannels = alignChannels(trunk.midNumChannels, alignment);
+        trunk.regularNumChannels = alignChannels(trunk.regularNumChannels, alignment);
+        trunk.gpoolNumChannels = alignChannels(trunk.gpoolNumChannels, alignment);
+
+        // Policy head; p2Conv and the pass outputs keep their size
+        PolicyHeadDesc &policy = modelDesc.policyHead;
+        const int p1 = alignChannels(policy.p1Conv.outChannels, alignment);
+        const int g1 = policy.g1Conv.outChannels;
+        const int paddedG1 = alignChannels(g1, alignment);
+        padConv(policy.p1Conv, trunkChannels, p1);
+        padConv(policy.g1Conv, trunkChannels, paddedG1);
+        padBatchNorm(policy.g1BN, paddedG1);
+        padSegmentedMatMul(policy.gpoolToBiasMul, NUM_POOLED_FEATURES, g1, paddedG1, p1);
+        padBatchNorm(policy.p1BN, p1);
+        padConv(policy.p2Conv, p1, policy.p2Conv.outChannels);
+        if (modelDesc.modelVersion >= 15)
+        {
+            const int pass = alignChannels(policy.gpoolToPassMul.outChannels, alignment);
+            padSegmentedMatMul(policy.gpoolToPassMul, NUM_POOLED_FEATURES, g1, paddedG1, pass);
+            padMatBias(policy.gpoolToPassBias, pass);
+            padMatMul(policy.gpoolToPassMul2, pass, policy.gpoolToPassMul2.outChannels);
+        }
+        else
+        {
+            padSegmentedMatMul(policy.gpoolToPassMul, NUM_POOLED_FEATURES, g1, paddedG1,
+                               policy.gpoolToPassMul.outChannels);
+        }
+
+        // Value head; the value, score value and ownership outputs keep their size
+        ValueHeadDesc &value = modelDesc.valueHead;
+        const int v1 = value.v1Conv.outChannels;
+        const int paddedV1 = alignChannels(v1, alignment);
+        const int v2 = alignChannels(value.v2Mul.outChannels, alignment);
+        padConv(value.v1Conv, trunkChannels, paddedV1);
+        padBatchNorm(value.v1BN, paddedV1);
+        padSegmentedMatMul(value.v2Mul, NUM_POOLED_FEATURES, v1, paddedV1, v2);
+        padMatBias(value.v2Bias, v2);
+        padMatMul(value.v3Mul, v2, value.v3Mul.outChannels);
+        padMatMul(value.sv3Mul, v2, value.sv3Mul.outChannels);
+        padConv(value.vOwnershipConv, paddedV1, value.vOwnershipConv.outChannels);
+    }
+
+} // namespace KataGoCoreML
@@ -0,0 +1,253 @@
+#include "ChannelPruning.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+namespace KataGoCoreML
+{
+    static float activate(const ActivationLayerDesc &activation, float x)
+    {
+        if (activation.activation == ACTIVATION_RELU)
+            return x > 0.0f ? x : 0.0f;
+        if (activation.activation == ACTIVATION_MISH)
+            return x * std::tanh(std::log1p(std::exp(x)));
+        return x;
+    }
+
+    // Weights are outC x inC x H x W
+    static bool convOutputIsZero(const ConvLayerDesc &conv, int oc)
+    {
+        const std::size_t slice = static_cast<std::size_t>(conv.inChannels) * conv.convYSize * conv.convXSize;
+        const float *w = conv.weights.data() + oc * slice;
+        return std::all_of(w, w + slice, [](float x)
+                           { return x == 0.0f; });
+    }
+
+    static bool convInputIsZero(const ConvLayerDesc &conv, int ic)
+    {
+        const std::size_t kernel = static_cast<std::size_t>(conv.convYSize) * conv.convXSize;
+        for (int oc = 0; oc < conv.outChannels; ++oc)
+        {
+            const float *w = conv.weights.data() + (static_cast<std::size_t>(oc) * conv.inChannels + ic) * kernel;
+            if (!std::all_of(w, w + kernel, [](float x)
+                             { return x == 0.0f; }))
+                return false;
+        }
+        return true;
+    }
+
+    // Weights are inC x outC
+    static bool matMulRowIsZero(const MatMulLayerDesc &matMul, int row)
+    {
+        const float *w = matMul.weights.data() + static_cast<std::size_t>(row) * matMul.outChannels;
+        return std::all_of(w, w + matMul.outChannels, [](float x)
+                           { return x == 0.0f; });
+    }
+
+    static bool matMulColumnIsZero(const MatMulLayerDesc &matMul, int col)
+    {
+        for (int row = 0; row < matMul.inChannels; ++row)
+        {
+            if (matMul.weights[static_cast<std::size_t>(row) * matMul.outChannels + col] != 0.0f)
+                return false;
+        }
+        return true;
+    }
+
+    // True if act(bn(x)) is exactly zero for channel c, given whether its input x is
+    // known to be zero everywhere
+    static bool activationIsZero(const BatchNormLayerDesc &bn, const ActivationLayerDesc &activation,
+                                 int c, bool inputIsZero)
+    {
+        // A batch norm without scale or bias normalizes with scale 1 and bias 0
+        const float scale = bn.hasScale ? bn.scale[c] : 1.0f;
+        const float bias = bn.hasBias ? bn.bias[c] : 0.0f;
+        if (scale != 0.0f && !inputIsZero)
+            return false;
+        // (0 - mean) * scale / sqrt(var + eps) + bias, or just bias if the scale is zero
+        const float normalized = scale == 0.0f
+                                     ? bias
+                                     : (0.0f - bn.mean[c]) * scale / std::sqrt(bn.variance[c] + bn.epsilon) + bias;
+        return activate(activation, normalized) == 0.0f;
+    }
+
+    static void keepConvOutputs(ConvLayerDesc &conv, const std::vector<int> &keep)
+    {
+        const std::size_t slice = static_cast<std::size_t>(conv.inChannels) * conv.convYSize * conv.convXSize;
+        std::vector<float> weights;
+        weights.reserve(keep.size() * slice);
+        for (int oc : keep)
+            weights.insert(weights.end(), conv.weights.data() + oc * slice, conv.weights.data() + (oc + 1) * slice);
+        conv.weights = std::move(weights);
+        conv.outChannels = static_cast<int>(keep.size());
+    }
+
+    static void keepConvInputs(ConvLayerDesc &conv, const std::vector<int> &keep)
+    {
+        const std::size_t kernel = static_cast<std::size_t>(conv.convYSize) * conv.convXSize;
+        std::vector<float> weights;
+        weights.reserve(static_cast<std::size_t>(conv.outChannels) * keep.size() * kernel);
+        for (int oc = 0; oc < conv.outChannels; ++oc)
+            for (int ic : keep)
+            {
+                const float *w = conv.weights.data() + (static_cast<std::size_t>(oc) * conv.inChannels + ic) * kernel;
+                weights.insert(weights.end(), w, w + kernel);
+            }
+        conv.weights = std::move(weights);
+        conv.inChannels = static_cast<int>(keep.size());
+    }
+
+    static void keepBatchNorm(BatchNormLayerDesc &bn, const std::vector<int> &keep)
+    {
+        // Unused scales and biases may be empty
+        auto select = [&](const WeightArray &values)
+        {
+            std::vector<float> selected;
+            if (values.empty())
+                return selected;
+            selected.reserve(keep.size());
+            for (int c : keep)
+                selected.push_back(values[c]);
+            return selected;
+        };
+        bn.mean = select(bn.mean);
+        bn.variance = select(bn.variance);
+        bn.scale = select(bn.scale);
+        bn.bias = select(bn.bias);
+        bn.numChannels = static_cast<int>(keep.size());
+    }
+
+    static void keepMatMulColumns(MatMulLayerDesc &matMul, const std::vector<int> &keep)
+    {
+        std::vector<float> weights;
+        weights.reserve(static_cast<std::size_t>(matMul.inChannels) * keep.size());
+        for (int row = 0; row < matMul.inChannels; ++row)
+            for (int col : keep)
+                weights.push_back(matMul.weights[static_cast<std::size_t>(row) * matMul.outChannels + col]);
+        matMul.weights = std::move(weights);
+        matMul.outChannels = static_cast<int>(keep.size());
+    }
+
+    // Global pooling yields three features per channel, in three consecutive segments
+    static constexpr int NUM_POOLED_FEATURES = 3;
+
+    static void keepPooledMatMulRows(MatMulLayerDesc &matMul, int numChannels, const std::vector<int> &keep)
+    {
+        std::vector<float> weights;
+        weights.reserve(NUM_POOLED_FEATURES * keep.size() * matMul.outChannels);
+        for (int s = 0; s < NUM_POOLED_FEATURES; ++s)
+            for (int c : keep)
+            {
+                const float *w = matMul.weights.data() + static_cast<std::size_t>(s * numChannels + c) * matMul.outChannels;
+                weights.insert(weights.end(), w, w + matMul.outChannels);
+            }
+        matMul.weights = std::move(weights);
+        matMul.inChannels = NUM_POOLED_FEATURES * static_cast<int>(keep.size());
+    }
+
+    static std::vector<int> liveChannels(int numChannels, const std::function<bool(int)> &isDead)
+    {
+        std::vector<int> keep;
+        for (int c = 0; c < numChannels; ++c)
+        {
+            if (!isDead(c))
+                keep.push_back(c);
+        }
+        // A convolution needs at least one channel; a dead one contributes nothing
+        if (keep.empty() && numChannels > 0)
+            keep.push_back(0);
+        return keep;
+    }
+
+    static void record(std::vector<PrunedChannels> &pruned, const std::string &name, int before, int after)
+    {
+        if (after < before)
+            pruned.push_back({name, before, after});
+    }
+
+    struct ChannelCounts
+    {
+        int mid = 0;
+        int regular = 0;
+        int gpool = 0;
+    };
+
+    static void pruneBlocks(std::vector<std::pair<int, unique_ptr_void>> &blocks,
+                            std::vector<PrunedChannels> &pruned,
+                            ChannelCounts &counts)
+    {
+        for (auto &block : blocks)
+        {
+            if (block.first == ORDINARY_BLOCK_KIND)
+            {
+                auto *b = static_cast<ResidualBlockDesc *>(block.second.get());
+                const int numMid = b->regularConv.outChannels;
+                const std::vector<int> keep = liveChannels(numMid, [&](int c)
+                                                           { return convInputIsZero(b->finalConv, c) ||
+                                                                    activationIsZero(b->midBN, b->midActivation, c,
+                                                                                     convOutputIsZero(b->regularConv, c)); });
+                keepConvOutputs(b->regularConv, keep);
+                keepBatchNorm(b->midBN, keep);
+                keepConvInputs(b->finalConv, keep);
+                record(pruned, b->regularConv.name, numMid, b->regularConv.outChannels);
+                counts.mid = std::max(counts.mid, b->regularConv.outChannels);
+            }
+            else if (block.first == GLOBAL_POOLING_BLOCK_KIND)
+            {
+                auto *b = static_cast<GlobalPoolingResidualBlockDesc *>(block.second.get());
+
+                const int numGpool = b->gpoolConv.outChannels;
+                const std::vector<int> keepGpool = liveChannels(numGpool, [&](int c)
+                                                                {
+                    bool outgoingZero = true;
+                    for (int s = 0; s < NUM_POOLED_FEATURES; ++s)
+                        outgoingZero = outgoingZero && matMulRowIsZero(b->gpoolToBiasMul, s * numGpool + c);
+                    return outgoingZero ||
+                           activationIsZero(b->gpoolBN, b->gpoolActivation, c, convOutputIsZero(b->gpoolConv, c)); });
+                keepConvOutputs(b->gpoolConv, keepGpool);
+                keepBatchNorm(b->gpoolBN, keepGpool);
+                keepPooledMatMulRows(b->gpoolToBiasMul, numGpool, keepGpool);
+                record(pruned, b->gpoolConv.name, numGpool, b->gpoolConv.outChannels);
+                counts.gpool = std::max(counts.gpool, b->gpoolConv.outChannels);
+
+                // Regular channels also receive the pooled bias before midBN
+                const int numRegular = b->regularConv.outChannels;
+                const std::vector<int> keepRegular = liveChannels(numRegular, [&](int c)
+                                                                  { return convInputIsZero(b->finalConv, c) ||
+                                                                           activationIsZero(b->midBN, b->midActivation, c,
+                                                                                            convOutputIsZero(b->regularConv, c) &&
+                                                                                                matMulColumnIsZero(b->gpoolToBiasMul, c)); });
+                keepConvOutputs(b->regularConv, keepRegular);
+                keepMatMulColumns(b->gpoolToBiasMul, keepRegular);
+                keepBatchNorm(b->midBN, keepRegular);
+                keepConvInputs(b->finalConv, keepRegular);
+                record(pruned, b->regularConv.name, numRegular, b->regularConv.outChannels);
+                counts.regular = std::max(counts.regular, b->regularConv.outChannels);
+            }
+            else if (block.first == NESTED_BOTTLENECK_BLOCK_KIND)
+            {
+                auto *b = static_cast<NestedBottleneckResidualBlockDesc *>(block.second.get());
+                pruneBlocks(b->blocks, pruned, counts);
+            }
+        }
+    }
+
+    std::vector<PrunedChannels> pruneDeadChannels(ModelDesc &modelDesc)
+    {
+        std::vector<PrunedChannels> pruned;
+        ChannelCounts counts;
+        pruneBlocks(modelDesc.trunk.blocks, pruned, counts);
+
+        // Blocks may now differ in width; the trunk keeps the largest of each kind
+        TrunkDesc &trunk = modelDesc.trunk;
+        if (counts.mid > 0)
+            trunk.midNumChannels = counts.mid;
+        if (counts.regular > 0)
+            trunk.regularNumChannels = counts.regular;
+        if (counts.gpool > 0)
+            trunk.gpoolNumChannels = counts.gpool;
+        return pruned;
+    }
+
+} // namespace KataGoCoreML
@@ -0,0 +1,222 @@
+#include "ConversionObserver.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/resource.h>
+
+namespace KataGoCoreML
+{
+    const char *conversionStageName(ConversionStage stage)
+    {
+        switch (stage)
+        {
+        case ConversionStage::GRAPH_BUILD:
+            return "graph_build";
+        case ConversionStage::WEIGHT_WRITE:
+            return "weight_write";
+        case ConversionStage::VERIFY:
+            return "verify";
+        case ConversionStage::SERIALIZE:
+            return "serialize";
+        case ConversionStage::PACKAGE_ASSEMBLY:
+            return "package_assembly";
+        }
+        return "unknown";
+    }
+
+    std::size_t peakResidentMemoryBytes()
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+        {
+            return 0;
+        }
+#ifdef __APPLE__
+        // ru_maxrss is reported in bytes on macOS
+        return static_cast<std::size_t>(usage.ru_maxrss);
+#else
+        // ru_maxrss is reported in kilobytes on Linux
+        return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+#endif
+    }
+
+    double ConversionReport::stageSeconds(ConversionStage stage) const
+    {
+        double seconds = 0.0;
+        for (const auto &timing : stageTimings)
+        {
+            if (timing.stage == stage)
+            {
+                seconds += timing.seconds;
+            }
+        }
+        return seconds;
+    }
+
+    std::size_t ConversionReport::totalWeightBytes() const
+    {
+        std::size_t bytes = 0;
+        for (const auto &layer : layerWeights)
+        {
+            bytes += layer.bytes;
+        }
+        return bytes;
+    }
+
+    int ConversionReport::totalOpCount() const
+    {
+        int count = 0;
+        for (const auto &entry : opCounts)
+        {
+            count += entry.second;
+        }
+        return count;
+    }
+
+    std::string escapeJSON(const std::string &s)
+    {
+        std::string out;
+        out.reserve(s.size());
+        for (char c : s)
+        {
+            switch (c)
+            {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                }
+                else
+                {
+                    out += c;
+                }
+            }
+        }
+        return out;
+    }
+
+    std::string ConversionReport::toJSON() const
+    {
+        std::ostringstream os;
+        os << "{\n";
+        os << "  \"package_path\": \"" << escapeJSON(packagePath) << "\",\n";
+        os << "  \"model_sha256\": \"" << escapeJSON(modelSha256) << "\",\n";
+        os << "  \"package_sha256\": \"" << packageSha256 << "\",\n";
+
+        os << "  \"stages\": {";
+        const ConversionStage stages[] = {ConversionStage::GRAPH_BUILD,
+                                          ConversionStage::WEIGHT_WRITE,
+                                          ConversionStage::VERIFY,
+                                          ConversionStage::SERIALIZE,
+                                          ConversionStage::PACKAGE_ASSEMBLY};
+        for (std::size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); ++i)
+        {
+            os << (i == 0 ? "\n" : ",\n");
+            os << "    \"" << conversionStageName(stages[i]) << "\": " << stageSeconds(stages[i]);
+        }
+        os << "\n  },\n";
+
+        os << "  \"op_counts\": {";
+        bool first = true;
+        for (const auto &entry : opCounts)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    \"" << escapeJSON(entry.first) << "\": " << entry.second;
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "},\n";
+        os << "  \"total_ops\": " << totalOpCount() << ",\n";
+
+        os << "  \"layer_weight_bytes\": [";
+        first = true;
+        for (const auto &layer : layerWeights)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    {\"name\": \"" << escapeJSON(layer.name) << "\", \"bytes\": " << layer.bytes << "}";
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "],\n";
+        os << "  \"total_weight_bytes\": " << totalWeightBytes() << ",\n";
+
+        os << "  \"sparse_layers\": [";
+        first = true;
+        for (const auto &layer : sparseLayers)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    {\"name\": \"" << escapeJSON(layer.name) << "\", \"sparsity\": " << layer.sparsity
+               << ", \"dense_bytes\": " << layer.denseBytes << ", \"encoded_bytes\": " << layer.encodedBytes << "}";
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "],\n";
+        os << "  \"low_rank_layers\": [";
+        first = true;
+        for (const auto &layer : lowRankLayers)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    {\"name\": \"" << escapeJSON(layer.name) << "\", \"rank\": " << layer.rank
+               << ", \"mac_reduction\": " << layer.macReduction << ", \"relative_error\": " << layer.relativeError << "}";
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "],\n";
+        os << "  \"quantized_activations\": [";
+        first = true;
+        for (const auto &layer : quantizedActivations)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    {\"name\": \"" << escapeJSON(layer.name) << "\", \"quantization\": \"" << layer.quantization
+               << "\", \"num_scales\": " << layer.numScales << ", \"clipped_fraction\": " << layer.clippedFraction << "}";
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "],\n";
+        os << "  \"unlowered_plan_layers\": [";
+        first = true;
+        for (const auto &layer : unloweredPlanLayers)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    {\"plan\": \"" << escapeJSON(layer.plan) << "\", \"name\": \"" << escapeJSON(layer.name) << "\"}";
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "],\n";
+        os << "  \"peak_memory_bytes\": " << peakMemoryBytes << ",\n";
+        os << "  \"epilogue_fusion\": {\"biases_fused\": " << epilogueFusion.biasesFused
+           << ", \"activations_adjoined\": " << epilogueFusion.activationsAdjoined << "},\n";
+        os << "  \"memory_schedule\": {\"peak_live_activation_bytes_before\": "
+           << memorySchedule.peakLiveActivationBytesBefore << ", \"peak_live_activation_bytes_after\": "
+           << memorySchedule.peakLiveActivationBytesAfter << "},\n";
+        os << "  \"cost\": " << cost.toJSON(2) << "\n";
+        os << "}\n";
+        return os.str();
+    }
+
+    void ConversionReport::writeJSON(const std::string &path) const
+    {
+        std::ofstream ofs(path);
+        if (!ofs)
+        {
+            throw std::runtime_error("Failed to open conversion report file: " + path);
+        }
+        ofs << toJSON();
+        ofs.close();
+        if (!ofs)
+        {
+            throw std::runtime_error("Failed to write conversion report file: " + path);
+        }
+    }
+
+} // namespace KataGoCoreML
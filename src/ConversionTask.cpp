@@ -0,0 +1,155 @@
+#include "ConversionTask.hpp"
+#include "ModelBuilder.hpp"
+
+namespace KataGoCoreML
+{
+    // Forwards events to the builder's own observer while updating the task's progress.
+    // Throws ConversionCancelled at stage and layer boundaries once the task is cancelled,
+    // but never from onStageEnd, which runs in destructors.
+    class ProgressObserver : public ConversionObserver
+    {
+    public:
+        ProgressObserver(ConversionTask::State &state, ConversionObserver *next)
+            : state(state), next(next) {}
+
+        void onStageBegin(ConversionStage stage) override
+        {
+            checkCancelled();
+            state.stage = static_cast<int>(stage);
+            state.progress = stageStartProgress(stage);
+            if (next != nullptr)
+                next->onStageBegin(stage);
+        }
+
+        void onStageEnd(ConversionStage stage, double seconds) override
+        {
+            if (next != nullptr)
+                next->onStageEnd(stage, seconds);
+        }
+
+        void onLayerWeightsWritten(const std::string &name, std::size_t bytes) override
+        {
+            if (next != nullptr)
+                next->onLayerWeightsWritten(name, bytes);
+            checkCancelled();
+        }
+
+        void onMessage(const std::string &message) override
+        {
+            if (next != nullptr)
+                next->onMessage(message);
+        }
+
+        void onConversionFinished(const ConversionReport &report) override
+        {
+            state.progress = 1.0;
+            if (next != nullptr)
+                next->onConversionFinished(report);
+        }
+
+    private:
+        ConversionTask::State &state;
+        ConversionObserver *next;
+
+        void checkCancelled() const
+        {
+            if (state.cancelled)
+            {
+                throw ConversionCancelled();
+            }
+        }
+
+        // Rough share of the conversion time spent before each stage starts
+        static double stageStartProgress(ConversionStage stage)
+        {
+            switch (stage)
+            {
+            case ConversionStage::GRAPH_BUILD:
+                return 0.0;
+            case ConversionStage::WEIGHT_WRITE:
+                return 0.6;
+            case ConversionStage::VERIFY:
+                return 0.7;
+            case ConversionStage::SERIALIZE:
+                return 0.72;
+            case ConversionStage::PACKAGE_ASSEMBLY:
+                return 0.85;
+            }
+            return 0.0;
+        }
+    };
+
+    ConversionTask::~ConversionTask()
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+
+    void ConversionTask::cancel()
+    {
+        state->cancelled = true;
+    }
+
+    bool ConversionTask::cancelRequested() const
+    {
+        return state->cancelled;
+    }
+
+    double ConversionTask::progress() const
+    {
+        return state->progress;
+    }
+
+    ConversionStage ConversionTask::stage() const
+    {
+        return static_cast<ConversionStage>(state->stage.load());
+    }
+
+    bool ConversionTask::ready() const
+    {
+        return waitFor(std::chrono::milliseconds(0));
+    }
+
+    bool ConversionTask::waitFor(std::chrono::milliseconds timeout) const
+    {
+        return result.wait_for(timeout) == std::future_status::ready;
+    }
+
+    void ConversionTask::get()
+    {
+        result.get();
+    }
+
+    std::unique_ptr<ConversionTask> ModelBuilder::createMLPackageAsync(const std::string &packagePath)
+    {
+        std::unique_ptr<ConversionTask> task(new ConversionTask());
+        std::promise<void> promise;
+        task->result = promise.get_future().share();
+
+        std::shared_ptr<ConversionTask::State> state = task->state;
+        task->thread = std::thread(
+            [this, state, packagePath](std::promise<void> promise)
+            {
+                ConversionObserver *userObserver = observer;
+                ProgressObserver progressObserver(*state, userObserver);
+                observer = &progressObserver;
+                try
+                {
+                    createMLPackage(packagePath);
+                    observer = userObserver;
+                    promise.set_value();
+                }
+                catch (...)
+                {
+                    observer = userObserver;
+                    promise.set_exception(std::current_exception());
+                }
+            },
+            std::move(promise));
+
+        return task;
+    }
+
+} // namespace KataGoCoreML
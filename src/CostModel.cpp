@@ -0,0 +1,378 @@
+#include "CostModel.hpp"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <MIL.pb.h>
+#include "ConversionObserver.hpp"
+#include "CoremltoolsDefines.hpp"
+
+using namespace CoreML::Specification::MILSpec;
+
+namespace KataGoCoreML
+{
+    HardwareProfile defaultHardwareProfile(ComputeUnit computeUnit)
+    {
+        // Apple M1: ~68 GB/s unified memory, 2.6 TFLOPS GPU (fp32), 11 TOPS Neural Engine
+        switch (computeUnit)
+        {
+        case COMPUTE_UNIT_CPU_ONLY:
+            return {2.0e11, 60.0e9};
+        case COMPUTE_UNIT_CPU_AND_GPU:
+            return {1.3e12, 60.0e9};
+        case COMPUTE_UNIT_CPU_AND_NE:
+        case COMPUTE_UNIT_ALL:
+            return {5.5e12, 60.0e9};
+        }
+        return {2.0e11, 60.0e9};
+    }
+
+    const char *computeUnitName(ComputeUnit computeUnit)
+    {
+        switch (computeUnit)
+        {
+        case COMPUTE_UNIT_ALL:
+            return "all";
+        case COMPUTE_UNIT_CPU_AND_GPU:
+            return "cpu_and_gpu";
+        case COMPUTE_UNIT_CPU_ONLY:
+            return "cpu_only";
+        case COMPUTE_UNIT_CPU_AND_NE:
+            return "cpu_and_ne";
+        }
+        return "unknown";
+    }
+
+    static std::uint64_t dataTypeBytes(DataType dataType)
+    {
+        switch (dataType)
+        {
+        case DataType::BOOL:
+        case DataType::INT8:
+        case DataType::UINT8:
+            return 1;
+        case DataType::FLOAT16:
+        case DataType::BFLOAT16:
+        case DataType::INT16:
+        case DataType::UINT16:
+            return 2;
+        case DataType::FLOAT32:
+        case DataType::INT32:
+        case DataType::UINT32:
+            return 4;
+        case DataType::FLOAT64:
+        case DataType::INT64:
+        case DataType::UINT64:
+            return 8;
+        default:
+            return 0;
+        }
+    }
+
+    struct TensorInfo
+    {
+        std::vector<std::uint64_t> shape;
+        std::uint64_t bytes = 0;
+    };
+
+    static TensorInfo tensorInfo(const ValueType &type)
+    {
+        TensorInfo info;
+        if (!type.has_tensortype())
+        {
+            return info;
+        }
+        const TensorType &tensorType = type.tensortype();
+        std::uint64_t elements = 1;
+        for (const auto &dim : tensorType.dimensions())
+        {
+            const std::uint64_t size = dim.has_constant() ? dim.constant().size() : 0;
+            info.shape.push_back(size);
+            elements *= size;
+        }
+        info.bytes = elements * dataTypeBytes(tensorType.datatype());
+        return info;
+    }
+
+    std::uint64_t valueBytes(const ValueType &type)
+    {
+        return tensorInfo(type).bytes;
+    }
+
+    bool isConstantOperation(const Operation &op)
+    {
+        return op.type() == "const" || op.type().compare(0, 10, "constexpr_") == 0;
+    }
+
+    static std::uint64_t elementCount(const std::vector<std::uint64_t> &shape)
+    {
+        std::uint64_t count = 1;
+        for (auto dim : shape)
+        {
+            count *= dim;
+        }
+        return count;
+    }
+
+    static const std::vector<std::uint64_t> *argumentShape(const Operation &op,
+                                                           const std::string &inputName,
+                                                           const std::map<std::string, TensorInfo> &tensors)
+    {
+        auto input = op.inputs().find(inputName);
+        if (input == op.inputs().end() || input->second.arguments_size() == 0)
+        {
+            return nullptr;
+        }
+        auto tensor = tensors.find(input->second.arguments(0).name());
+        return tensor == tensors.end() ? nullptr : &tensor->second.shape;
+    }
+
+    // Each output element of conv, linear and matmul accumulates over one reduction slice
+    static std::uint64_t operationMacs(const Operation &op,
+                                       std::uint64_t outputElements,
+                                       const std::map<std::string, TensorInfo> &tensors)
+    {
+        if (op.type() == "conv")
+        {
+            // weight is outC x inC/groups x kernel...
+            const auto *weight = argumentShape(op, "weight", tensors);
+            if (weight == nullptr || weight->size() < 2)
+                return 0;
+            return outputElements * elementCount(*weight) / std::max<std::uint64_t>(1, (*weight)[0]);
+        }
+        if (op.type() == "linear")
+        {
+            // weight is outC x inC
+            const auto *weight = argumentShape(op, "weight", tensors);
+            if (weight == nullptr || weight->size() != 2)
+                return 0;
+            return outputElements * (*weight)[1];
+        }
+        if (op.type() == "matmul")
+        {
+            const auto *x = argumentShape(op, "x", tensors);
+            if (x == nullptr || x->empty())
+                return 0;
+            return outputElements * x->back();
+        }
+        return 0;
+    }
+
+    static const Block *mainBlock(const Program &program)
+    {
+        auto function = program.functions().find("main");
+        if (function == program.functions().end())
+        {
+            return nullptr;
+        }
+        const auto &specializations = function->second.block_specializations();
+        auto block = specializations.find(function->second.opset());
+        if (block != specializations.end())
+        {
+            return &block->second;
+        }
+        return specializations.empty() ? nullptr : &specializations.begin()->second;
+    }
+
+    CostReport analyzeProgramCost(const Program &program)
+    {
+        CostReport report;
+        const Block *block = mainBlock(program);
+        if (block == nullptr)
+        {
+            return report;
+        }
+        const auto &function = program.functions().at("main");
+
+        std::map<std::string, TensorInfo> tensors;
+        std::map<std::string, std::uint64_t> activations;
+        for (const auto &input : function.inputs())
+        {
+            tensors[input.name()] = tensorInfo(input.type());
+            activations[input.name()] = tensors[input.name()].bytes;
+        }
+
+        // Index of the last op reading each activation; block outputs stay alive to the end
+        const int numOps = block->operations_size();
+        std::map<std::string, int> lastUse;
+        for (int i = 0; i < numOps; ++i)
+        {
+            for (const auto &input : block->operations(i).inputs())
+            {
+                for (const auto &binding : input.second.arguments())
+                {
+                    if (binding.has_name())
+                    {
+                        lastUse[binding.name()] = i;
+                    }
+                }
+            }
+        }
+        for (const auto &output : block->outputs())
+        {
+            lastUse[output] = numOps;
+        }
+
+        std::uint64_t liveBytes = 0;
+        for (const auto &activation : activations)
+        {
+            liveBytes += activation.second;
+        }
+        report.peakLiveActivationBytes = liveBytes;
+
+        for (int i = 0; i < numOps; ++i)
+        {
+            const Operation &op = block->operations(i);
+            OpCost cost;
+            cost.type = op.type();
+            auto nameAttribute = op.attributes().find("name");
+            if (nameAttribute != op.attributes().end() &&
+                nameAttribute->second.immediatevalue().tensor().strings().values_size() > 0)
+            {
+                cost.name = nameAttribute->second.immediatevalue().tensor().strings().values(0);
+            }
+            else if (op.outputs_size() > 0)
+            {
+                cost.name = op.outputs(0).name();
+            }
+
+            std::uint64_t outputBytes = 0;
+            std::uint64_t outputElements = 0;
+            for (const auto &output : op.outputs())
+            {
+                const TensorInfo info = tensorInfo(output.type());
+                tensors[output.name()] = info;
+                outputBytes += info.bytes;
+                outputElements += elementCount(info.shape);
+            }
+
+            if (isConstantOperation(op))
+            {
+                // Stored weights: every tensor attribute except the op name
+                for (const auto &attribute : op.attributes())
+                {
+                    if (attribute.first != "name")
+                    {
+                        cost.weightBytes += tensorInfo(attribute.second.type()).bytes;
+                    }
+                }
+            }
+            else
+            {
+                cost.activationBytes = outputBytes;
+                cost.macs = operationMacs(op, outputElements, tensors);
+
+                std::uint64_t inputBytes = 0;
+                for (const auto &input : op.inputs())
+                {
+                    for (const auto &binding : input.second.arguments())
+                    {
+                        auto tensor = tensors.find(binding.name());
+                        if (binding.has_name() && tensor != tensors.end())
+                        {
+                            inputBytes += tensor->second.bytes;
+                        }
+                    }
+                }
+                cost.memoryTrafficBytes = inputBytes + outputBytes;
+
+                for (const auto &output : op.outputs())
+                {
+                    activations[output.name()] = tensors[output.name()].bytes;
+                }
+                liveBytes += outputBytes;
+                report.peakLiveActivationBytes = std::max(report.peakLiveActivationBytes, liveBytes);
+            }
+
+            // Free the activations that are not read after this op
+            for (auto it = activations.begin(); it != activations.end();)
+            {
+                auto use = lastUse.find(it->first);
+                if (use == lastUse.end() || use->second <= i)
+                {
+                    liveBytes -= it->second;
+                    it = activations.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+
+            report.totalMacs += cost.macs;
+            report.totalWeightBytes += cost.weightBytes;
+            report.totalActivationBytes += cost.activationBytes;
+            report.ops.push_back(std::move(cost));
+        }
+
+        for (ComputeUnit unit : {COMPUTE_UNIT_CPU_ONLY, COMPUTE_UNIT_CPU_AND_GPU, COMPUTE_UNIT_CPU_AND_NE, COMPUTE_UNIT_ALL})
+        {
+            addComputeUnitEstimate(report, unit, defaultHardwareProfile(unit));
+        }
+        return report;
+    }
+
+    void addComputeUnitEstimate(CostReport &report, ComputeUnit computeUnit, const HardwareProfile &profile)
+    {
+        ComputeUnitEstimate estimate;
+        estimate.computeUnit = computeUnit;
+        estimate.profile = profile;
+
+        std::uint64_t computeBoundMacs = 0;
+        for (const auto &op : report.ops)
+        {
+            const double computeSeconds = op.macs / profile.macsPerSecond;
+            const double memorySeconds = op.memoryTrafficBytes / profile.bytesPerSecond;
+            estimate.seconds += std::max(computeSeconds, memorySeconds);
+            if (op.macs > 0 && computeSeconds >= memorySeconds)
+            {
+                computeBoundMacs += op.macs;
+            }
+        }
+        estimate.computeBoundFraction =
+            report.totalMacs > 0 ? static_cast<double>(computeBoundMacs) / report.totalMacs : 0.0;
+        report.estimates.push_back(estimate);
+    }
+
+    std::string CostReport::toJSON(int indent) const
+    {
+        const std::string pad(indent, ' ');
+        std::ostringstream os;
+        os << "{\n";
+        os << pad << "  \"batch_size\": " << batchSize << ",\n";
+        os << pad << "  \"nn_x_len\": " << nnXLen << ",\n";
+        os << pad << "  \"nn_y_len\": " << nnYLen << ",\n";
+        os << pad << "  \"total_macs\": " << totalMacs << ",\n";
+        os << pad << "  \"total_weight_bytes\": " << totalWeightBytes << ",\n";
+        os << pad << "  \"total_activation_bytes\": " << totalActivationBytes << ",\n";
+        os << pad << "  \"peak_live_activation_bytes\": " << peakLiveActivationBytes << ",\n";
+
+        os << pad << "  \"estimates\": [";
+        bool first = true;
+        for (const auto &estimate : estimates)
+        {
+            os << (first ? "\n" : ",\n");
+            os << pad << "    {\"compute_unit\": \"" << computeUnitName(estimate.computeUnit)
+               << "\", \"seconds\": " << estimate.seconds
+               << ", \"compute_bound_fraction\": " << estimate.computeBoundFraction << "}";
+            first = false;
+        }
+        os << (first ? "" : "\n" + pad + "  ") << "],\n";
+
+        // Op names include layer names and output prefixes chosen by the caller
+        os << pad << "  \"ops\": [";
+        first = true;
+        for (const auto &op : ops)
+        {
+            os << (first ? "\n" : ",\n");
+            os << pad << "    {\"name\": \"" << escapeJSON(op.name) << "\", \"type\": \"" << escapeJSON(op.type)
+               << "\", \"macs\": " << op.macs << ", \"weight_bytes\": " << op.weightBytes
+               << ", \"activation_bytes\": " << op.activationBytes << "}";
+            first = false;
+        }
+        os << (first ? "" : "\n" + pad + "  ") << "]\n";
+        os << pad << "}";
+        return os.str();
+    }
+
+} // namespace KataGoCoreML
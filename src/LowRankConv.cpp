@@ -0,0 +1,358 @@
+#include "LowRankConv.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace KataGoCoreML
+{
+    // Eigen-decomposition of a symmetric n x n matrix (row-major) by Householder
+    // tridiagonalization and the implicit QL algorithm, after JAMA's tred2/tql2.
+    // On return `v` holds the eigenvectors as columns, matching the eigenvalues in `d`.
+    static void symmetricEigen(std::vector<double> &v, int n, std::vector<double> &d)
+    {
+        auto V = [&](int i, int j) -> double &
+        { return v[static_cast<std::size_t>(i) * n + j]; };
+        d.assign(n, 0.0);
+        std::vector<double> e(n, 0.0);
+
+        // Householder reduction to tridiagonal form
+        for (int j = 0; j < n; j++)
+            d[j] = V(n - 1, j);
+
+        for (int i = n - 1; i > 0; i--)
+        {
+            double scale = 0.0;
+            double h = 0.0;
+            for (int k = 0; k < i; k++)
+                scale += std::fabs(d[k]);
+
+            if (scale == 0.0)
+            {
+                e[i] = d[i - 1];
+                for (int j = 0; j < i; j++)
+                {
+                    d[j] = V(i - 1, j);
+                    V(i, j) = 0.0;
+                    V(j, i) = 0.0;
+                }
+            }
+            else
+            {
+                for (int k = 0; k < i; k++)
+                {
+                    d[k] /= scale;
+                    h += d[k] * d[k];
+                }
+                double f = d[i - 1];
+                double g = std::sqrt(h);
+                if (f > 0)
+                    g = -g;
+                e[i] = scale * g;
+                h = h - f * g;
+                d[i - 1] = f - g;
+                for (int j = 0; j < i; j++)
+                    e[j] = 0.0;
+
+                for (int j = 0; j < i; j++)
+                {
+                    f = d[j];
+                    V(j, i) = f;
+                    g = e[j] + V(j, j) * f;
+                    for (int k = j + 1; k <= i - 1; k++)
+                    {
+                        g += V(k, j) * d[k];
+                        e[k] += V(k, j) * f;
+                    }
+                    e[j] = g;
+                }
+                f = 0.0;
+                for (int j = 0; j < i; j++)
+                {
+                    e[j] /= h;
+                    f += e[j] * d[j];
+                }
+                const double hh = f / (h + h);
+                for (int j = 0; j < i; j++)
+                    e[j] -= hh * d[j];
+                for (int j = 0; j < i; j++)
+                {
+                    f = d[j];
+                    g = e[j];
+                    for (int k = j; k <= i - 1; k++)
+                        V(k, j) -= (f * e[k] + g * d[k]);
+                    d[j] = V(i - 1, j);
+                    V(i, j) = 0.0;
+                }
+            }
+            d[i] = h;
+        }
+
+        // Accumulate transformations
+        for (int i = 0; i < n - 1; i++)
+        {
+            V(n - 1, i) = V(i, i);
+            V(i, i) = 1.0;
+            const double h = d[i + 1];
+            if (h != 0.0)
+            {
+                for (int k = 0; k <= i; k++)
+                    d[k] = V(k, i + 1) / h;
+                for (int j = 0; j <= i; j++)
+                {
+                    double g = 0.0;
+                    for (int k = 0; k <= i; k++)
+                        g += V(k, i + 1) * V(k, j);
+                    for (int k = 0; k <= i; k++)
+                        V(k, j) -= g * d[k];
+                }
+            }
+            for (int k = 0; k <= i; k++)
+                V(k, i + 1) = 0.0;
+        }
+        for (int j = 0; j < n; j++)
+        {
+            d[j] = V(n - 1, j);
+            V(n - 1, j) = 0.0;
+        }
+        V(n - 1, n - 1) = 1.0;
+        e[0] = 0.0;
+
+        // Implicit QL iterations on the tridiagonal matrix
+        for (int i = 1; i < n; i++)
+            e[i - 1] = e[i];
+        e[n - 1] = 0.0;
+
+        double f = 0.0;
+        double tst1 = 0.0;
+        const double eps = std::numeric_limits<double>::epsilon();
+        for (int l = 0; l < n; l++)
+        {
+            tst1 = std::max(tst1, std::fabs(d[l]) + std::fabs(e[l]));
+            int m = l;
+            while (m < n - 1 && std::fabs(e[m]) > eps * tst1)
+                m++;
+
+            if (m > l)
+            {
+                do
+                {
+                    double g = d[l];
+                    double p = (d[l + 1] - g) / (2.0 * e[l]);
+                    double r = std::hypot(p, 1.0);
+                    if (p < 0)
+                        r = -r;
+                    d[l] = e[l] / (p + r);
+                    d[l + 1] = e[l] * (p + r);
+                    const double dl1 = d[l + 1];
+                    double h = g - d[l];
+                    for (int i = l + 2; i < n; i++)
+                        d[i] -= h;
+                    f += h;
+
+                    p = d[m];
+                    double c = 1.0;
+                    double c2 = c;
+                    double c3 = c;
+                    const double el1 = e[l + 1];
+                    double s = 0.0;
+                    double s2 = 0.0;
+                    for (int i = m - 1; i >= l; i--)
+                    {
+                        c3 = c2;
+                        c2 = c;
+                        s2 = s;
+                        g = c * e[i];
+                        h = c * p;
+                        r = std::hypot(p, e[i]);
+                        e[i + 1] = s * r;
+                        s = e[i] / r;
+                        c = p / r;
+                        p = c * d[i] - s * g;
+                        d[i + 1] = h + s * (c * g + s * d[i]);
+                        for (int k = 0; k < n; k++)
+                        {
+                            h = V(k, i + 1);
+                            V(k, i + 1) = s * V(k, i) + c * h;
+                            V(k, i) = c * V(k, i) - s * h;
+                        }
+                    }
+                    p = -s * s2 * c3 * el1 * e[l] / dl1;
+                    e[l] = s * p;
+                    d[l] = c * p;
+                } while (std::fabs(e[l]) > eps * tst1);
+            }
+            d[l] = d[l] + f;
+            e[l] = 0.0;
+        }
+    }
+
+    bool factorizeConv(const ConvLayerDesc &conv, double maxRelativeError, FactorizedConv &result)
+    {
+        const int kY = conv.convYSize;
+        const int kX = conv.convXSize;
+        const int inC = conv.inChannels;
+        const int outC = conv.outChannels;
+        if (kY < 2 || kX < 2 || conv.dilationY != 1 || conv.dilationX != 1 || inC <= 0 || outC <= 0 ||
+            conv.weights.size() != static_cast<std::size_t>(outC) * inC * kY * kX)
+        {
+            return false;
+        }
+
+        // The kernel as a matrix M with rows (ic, y) and columns (oc, x): the vertical conv
+        // spans its column space and the horizontal conv its row space
+        const int rows = inC * kY;
+        const int cols = outC * kX;
+        auto M = [&](int row, int col)
+        {
+            const int ic = row / kY, y = row % kY, oc = col / kX, x = col % kX;
+            return static_cast<double>(conv.weights[((static_cast<std::size_t>(oc) * inC + ic) * kY + y) * kX + x]);
+        };
+        std::vector<double> m(static_cast<std::size_t>(rows) * cols);
+        for (int row = 0; row < rows; ++row)
+            for (int col = 0; col < cols; ++col)
+                m[static_cast<std::size_t>(row) * cols + col] = M(row, col);
+
+        // Eigen-decompose the smaller Gram matrix: its eigenvalues are the squared singular values
+        const bool byRows = rows <= cols;
+        const int n = byRows ? rows : cols;
+        std::vector<double> gram(static_cast<std::size_t>(n) * n, 0.0);
+        for (int a = 0; a < n; ++a)
+            for (int b = a; b < n; ++b)
+            {
+                double sum = 0.0;
+                if (byRows)
+                    for (int k = 0; k < cols; ++k)
+                        sum += m[static_cast<std::size_t>(a) * cols + k] * m[static_cast<std::size_t>(b) * cols + k];
+                else
+                    for (int k = 0; k < rows; ++k)
+                        sum += m[static_cast<std::size_t>(k) * cols + a] * m[static_cast<std::size_t>(k) * cols + b];
+                gram[static_cast<std::size_t>(a) * n + b] = sum;
+                gram[static_cast<std::size_t>(b) * n + a] = sum;
+            }
+
+        std::vector<double> eigenvalues;
+        symmetricEigen(gram, n, eigenvalues);
+        std::vector<int> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](int a, int b)
+                  { return eigenvalues[a] > eigenvalues[b]; });
+
+        double total = 0.0;
+        for (double lambda : eigenvalues)
+            total += std::max(lambda, 0.0);
+
+        // Smallest rank within the error budget
+        int rank = 0;
+        double residual = total;
+        while (rank < n && (total <= 0.0 || std::sqrt(residual / total) > maxRelativeError))
+        {
+            residual -= std::max(eigenvalues[order[rank]], 0.0);
+            rank++;
+        }
+        residual = std::max(residual, 0.0);
+
+        const std::uint64_t originalMacs = static_cast<std::uint64_t>(inC) * outC * kY * kX;
+        const std::uint64_t factorizedMacs = static_cast<std::uint64_t>(rank) * (inC * kY + outC * kX);
+        if (rank == 0 || factorizedMacs >= originalMacs)
+        {
+            return false;
+        }
+
+        result.rank = rank;
+        result.originalMacs = originalMacs;
+        result.factorizedMacs = factorizedMacs;
+        result.relativeError = total > 0.0 ? std::sqrt(residual / total) : 0.0;
+
+        result.vertical = ConvLayerDesc();
+        result.vertical.name = conv.name + "_vertical";
+        result.vertical.convYSize = kY;
+        result.vertical.convXSize = 1;
+        result.vertical.inChannels = inC;
+        result.vertical.outChannels = rank;
+        std::vector<float> verticalWeights(static_cast<std::size_t>(rank) * rows);
+
+        result.horizontal = ConvLayerDesc();
+        result.horizontal.name = conv.name + "_horizontal";
+        result.horizontal.convYSize = 1;
+        result.horizontal.convXSize = kX;
+        result.horizontal.inChannels = rank;
+        result.horizontal.outChannels = outC;
+        std::vector<float> horizontalWeights(static_cast<std::size_t>(outC) * rank * kX);
+
+        std::vector<double> left(rows);
+        std::vector<double> right(cols);
+        for (int r = 0; r < rank; ++r)
+        {
+            // Singular vector pair scaled so that left * right^T is the rank-1 term
+            const int k = order[r];
+            if (byRows)
+            {
+                for (int row = 0; row < rows; ++row)
+                    left[row] = gram[static_cast<std::size_t>(row) * n + k];
+                for (int col = 0; col < cols; ++col)
+                {
+                    double sum = 0.0;
+                    for (int row = 0; row < rows; ++row)
+                        sum += left[row] * m[static_cast<std::size_t>(row) * cols + col];
+                    right[col] = sum;
+                }
+            }
+            else
+            {
+                for (int col = 0; col < cols; ++col)
+                    right[col] = gram[static_cast<std::size_t>(col) * n + k];
+                for (int row = 0; row < rows; ++row)
+                {
+                    double sum = 0.0;
+                    for (int col = 0; col < cols; ++col)
+                        sum += m[static_cast<std::size_t>(row) * cols + col] * right[col];
+                    left[row] = sum;
+                }
+            }
+
+            // Balance the two factors, which keeps both in a similar range for float16
+            double leftNorm = 0.0, rightNorm = 0.0;
+            for (double x : left)
+                leftNorm += x * x;
+            for (double x : right)
+                rightNorm += x * x;
+            leftNorm = std::sqrt(leftNorm);
+            rightNorm = std::sqrt(rightNorm);
+            const double leftScale = leftNorm > 0.0 && rightNorm > 0.0 ? std::sqrt(rightNorm / leftNorm) : 1.0;
+            const double rightScale = leftNorm > 0.0 && rightNorm > 0.0 ? std::sqrt(leftNorm / rightNorm) : 1.0;
+
+            // vertical: rank x inC x kY x 1, horizontal: outC x rank x 1 x kX
+            for (int row = 0; row < rows; ++row)
+                verticalWeights[static_cast<std::size_t>(r) * rows + row] = static_cast<float>(left[row] * leftScale);
+            for (int oc = 0; oc < outC; ++oc)
+                for (int x = 0; x < kX; ++x)
+                    horizontalWeights[(static_cast<std::size_t>(oc) * rank + r) * kX + x] =
+                        static_cast<float>(right[oc * kX + x] * rightScale);
+        }
+
+        result.vertical.weights = std::move(verticalWeights);
+        result.horizontal.weights = std::move(horizontalWeights);
+        return true;
+    }
+
+    LowRankPlan planLowRankFactorization(const ModelDesc &modelDesc, const LowRankOptions &options)
+    {
+        LowRankPlan plan;
+        forEachConvLayer(modelDesc,
+                         [&](const ConvLayerDesc &conv)
+                         {
+                             const bool selected =
+                                 options.layers.empty() ||
+                                 std::find(options.layers.begin(), options.layers.end(), conv.name) != options.layers.end();
+                             FactorizedConv factorized;
+                             if (selected && factorizeConv(conv, options.maxRelativeError, factorized))
+                             {
+                                 plan.layers[conv.name] = std::move(factorized);
+                             }
+                         });
+        return plan;
+    }
+
+} // namespace KataGoCoreML
@@ -0,0 +1,117 @@
+#include "MetadataFolding.hpp"
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+namespace KataGoCoreML
+{
+    static std::vector<float> applyMatMul(const MatMulLayerDesc &matMul, const std::vector<float> &input)
+    {
+        if (static_cast<int>(input.size()) != matMul.inChannels ||
+            matMul.weights.size() != static_cast<std::size_t>(matMul.inChannels) * matMul.outChannels)
+        {
+            throw std::invalid_argument(matMul.name + ": expected " + std::to_string(matMul.inChannels) +
+                                        " inputs, got " + std::to_string(input.size()));
+        }
+
+        // Weights are inC x outC
+        std::vector<float> output(matMul.outChannels, 0.0f);
+        for (int i = 0; i < matMul.inChannels; ++i)
+        {
+            const float *row = matMul.weights.data() + static_cast<std::size_t>(i) * matMul.outChannels;
+            for (int o = 0; o < matMul.outChannels; ++o)
+            {
+                output[o] += input[i] * row[o];
+            }
+        }
+        return output;
+    }
+
+    static void applyBias(const MatBiasLayerDesc &bias, std::vector<float> &values)
+    {
+        if (bias.weights.size() != values.size())
+        {
+            throw std::invalid_argument(bias.name + ": bias size does not match its input");
+        }
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            values[i] += bias.weights[i];
+        }
+    }
+
+    static void applyActivation(const ActivationLayerDesc &activation, std::vector<float> &values)
+    {
+        for (float &v : values)
+        {
+            if (activation.activation == ACTIVATION_RELU)
+            {
+                v = v > 0.0f ? v : 0.0f;
+            }
+            else if (activation.activation == ACTIVATION_MISH)
+            {
+                v = v * std::tanh(std::log1p(std::exp(v)));
+            }
+        }
+    }
+
+    std::vector<float> evaluateMetadataEncoder(const SGFMetadataEncoderDesc &encoder,
+                                               const std::vector<float> &inputMeta)
+    {
+        std::vector<float> x = applyMatMul(encoder.mul1, inputMeta);
+        applyBias(encoder.bias1, x);
+        applyActivation(encoder.act1, x);
+        x = applyMatMul(encoder.mul2, x);
+        applyBias(encoder.bias2, x);
+        applyActivation(encoder.act2, x);
+        return applyMatMul(encoder.mul3, x);
+    }
+
+    static void shiftMean(BatchNormLayerDesc &bn, const std::vector<float> &bias)
+    {
+        if (bn.mean.size() != bias.size())
+        {
+            throw std::invalid_argument(bn.name + ": batch norm channels do not match the metadata bias");
+        }
+        float *mean = bn.mean.mutableData();
+        for (std::size_t c = 0; c < bias.size(); ++c)
+        {
+            mean[c] -= bias[c];
+        }
+    }
+
+    void foldFixedMetadata(ModelDesc &modelDesc, const std::vector<float> &inputMeta)
+    {
+        TrunkDesc &trunk = modelDesc.trunk;
+        if (trunk.metaEncoderVersion <= 0)
+        {
+            return;
+        }
+
+        const std::vector<float> bias = evaluateMetadataEncoder(trunk.sgfMetadataEncoder, inputMeta);
+
+        // (x + bias - mean) == (x - (mean - bias)) for every consumer of the residual stream
+        for (auto &block : trunk.blocks)
+        {
+            if (block.first == ORDINARY_BLOCK_KIND)
+            {
+                shiftMean(static_cast<ResidualBlockDesc *>(block.second.get())->preBN, bias);
+            }
+            else if (block.first == GLOBAL_POOLING_BLOCK_KIND)
+            {
+                shiftMean(static_cast<GlobalPoolingResidualBlockDesc *>(block.second.get())->preBN, bias);
+            }
+            else if (block.first == NESTED_BOTTLENECK_BLOCK_KIND)
+            {
+                shiftMean(static_cast<NestedBottleneckResidualBlockDesc *>(block.second.get())->preBN, bias);
+            }
+        }
+        shiftMean(trunk.trunkTipBN, bias);
+
+        trunk.metaEncoderVersion = 0;
+        trunk.sgfMetadataEncoder = SGFMetadataEncoderDesc();
+        modelDesc.metaEncoderVersion = 0;
+        modelDesc.numInputMetaChannels = 0;
+    }
+
+} // namespace KataGoCoreML
@@ -1,11 +1,29 @@
 #include "ModelBuilder.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <memory>
+#include <set>
+#include <stdexcept>
 #include <MILBlob/Blob/StorageWriter.hpp>
+#include <MILBlob/Fp16.hpp>
 #include <Model.pb.h>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <ModelPackage.hpp>
+#include "ChannelPadding.hpp"
+#include "CostModel.hpp"
+#include "LowRankConv.hpp"
+#include "MetadataFolding.hpp"
+#include "OpBuilder.hpp"
+#include "OpFusion.hpp"
 #include "ModelVersion.hpp"
+#include "OpScheduling.hpp"
+#include "ProgramVerifier.hpp"
+#include "Sha256.hpp"
+#include "SparseWeights.hpp"
 #include "UtilTempDir.hpp"
 #include "CoremltoolsDefines.hpp"
 
@@ -17,304 +35,701 @@ namespace fs = std::filesystem;
 
 namespace KataGoCoreML
 {
-    NamedValueType *addReLUOperation(Block &block, const NamedValueType &input, const char *name)
+    void notifyMessage(ConversionObserver *observer, const std::string &message)
     {
-        // Create a new ReLU operation.
-        Operation *relu_op = block.add_operations();
-        relu_op->set_type("relu");
+        if (observer != nullptr)
+        {
+            observer->onMessage(message);
+        }
+    }
+
+    // Measures the wall time of a conversion stage and records it in the report
+    class StageTimer
+    {
+    public:
+        StageTimer(ConversionStage stage, ConversionObserver *observer, ConversionReport &report)
+            : stage(stage),
+              observer(observer),
+              report(report),
+              excludedSeconds(0.0),
+              start(std::chrono::steady_clock::now())
+        {
+            if (observer != nullptr)
+            {
+                observer->onStageBegin(stage);
+            }
+        }
+
+        ~StageTimer()
+        {
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            const double seconds = elapsed.count() - excludedSeconds;
+            report.stageTimings.push_back({stage, seconds});
+            if (observer != nullptr)
+            {
+                observer->onStageEnd(stage, seconds);
+            }
+        }
+
+        // Exclude time that is accounted to a nested stage
+        void exclude(double seconds)
+        {
+            excludedSeconds += seconds;
+        }
+
+    private:
+        ConversionStage stage;
+        ConversionObserver *observer;
+        ConversionReport &report;
+        double excludedSeconds;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // Writes weight blobs and accounts the time and bytes spent per layer
+    class WeightWriter
+    {
+    public:
+        WeightWriter(const std::string &weightsPath, ConversionObserver *observer, ConversionReport &report)
+            : storageWriter(weightsPath),
+              observer(observer),
+              report(report),
+              seconds(0.0) {}
+
+        template <typename T>
+        uint64_t write(const std::string &layerName, const std::vector<T> &data)
+        {
+            return write(layerName, Util::MakeSpan(data));
+        }
+
+        // Writes straight from the ModelDesc's buffer, which may be a view of the caller's weights
+        uint64_t write(const std::string &layerName, const WeightArray &data)
+        {
+            return write(layerName, Util::Span<const float>(data.data(), data.size()));
+        }
+
+        template <typename T>
+        uint64_t write(const std::string &layerName, Util::Span<const T> data)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const uint64_t offset = storageWriter.WriteData(data);
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            seconds += elapsed.count();
+
+            const std::size_t bytes = data.Size() * sizeof(T);
+            report.layerWeights.push_back({layerName, bytes});
+            if (observer != nullptr)
+            {
+                observer->onLayerWeightsWritten(layerName, bytes);
+            }
+            return offset;
+        }
+
+        void recordSparseLayer(const SparseLayerRecord &record)
+        {
+            report.sparseLayers.push_back(record);
+        }
+
+        void recordLowRankLayer(const LowRankLayerRecord &record)
+        {
+            report.lowRankLayers.push_back(record);
+        }
+
+        void recordActivationQuantization(const ActivationQuantizationRecord &record)
+        {
+            report.quantizedActivations.push_back(record);
+        }
+
+        // Record the accumulated weight write time as its own stage
+        double finish()
+        {
+            report.stageTimings.push_back({ConversionStage::WEIGHT_WRITE, seconds});
+            if (observer != nullptr)
+            {
+                observer->onStageBegin(ConversionStage::WEIGHT_WRITE);
+                observer->onStageEnd(ConversionStage::WEIGHT_WRITE, seconds);
+            }
+            return seconds;
+        }
+
+    private:
+        Blob::StorageWriter storageWriter;
+        ConversionObserver *observer;
+        ConversionReport &report;
+        double seconds;
+    };
+
+    const char *const WEIGHT_FILE_NAME = "@model_path/weights/weight.bin";
+
+    // Set an attribute to a tensor of T stored in the weight file
+    template <typename T, typename Data>
+    void setBlobAttribute(OpBuilder &ops,
+                          Operation &op,
+                          const std::string &attributeName,
+                          const std::vector<int> &shape,
+                          const std::string &layerName,
+                          const Data &data,
+                          WeightWriter &weightWriter)
+    {
+        Value &value = (*op.mutable_attributes())[attributeName];
+        *value.mutable_type() = ops.tensorType<T>(shape);
+        auto *blobFile = value.mutable_blobfilevalue();
+        blobFile->set_filename(WEIGHT_FILE_NAME);
+        blobFile->set_offset(weightWriter.write(layerName, data));
+    }
+
+    template <typename Values>
+    std::vector<Fp16> toFloat16(const Values &values)
+    {
+        std::vector<Fp16> halfValues(values.size());
+        for (std::size_t i = 0; i < values.size(); ++i)
+        {
+            halfValues[i] = Fp16::FromFloat(values[i]);
+        }
+        return halfValues;
+    }
+
+    // Cast a float16 tensor named `input` to a float32 tensor named `name`
+    void addCastToFloat32Operations(OpBuilder &ops,
+                                    const std::string &input,
+                                    const std::string &name,
+                                    const std::vector<int> &shape)
+    {
+        const std::string &dtypeName = ops.name(name, "_dtype");
+        ops.addScalarConst<std::string>(dtypeName, "fp32");
+
+        Operation &castOp = ops.addOperation("cast", name);
+        ops.bind(castOp, "x", input);
+        ops.bind(castOp, "dtype", dtypeName);
+        ops.addOutput(castOp, name, ops.tensorType<float>(shape));
+    }
+
+    // Emit the weight as non-zero values plus a bit mask, expanded by constexpr_sparse_to_dense
+    void addSparseWeightOperations(OpBuilder &ops,
+                                   const std::string &name,
+                                   const std::vector<int> &shape,
+                                   const WeightArray &weights,
+                                   WeightPrecision precision,
+                                   double sparsity,
+                                   WeightWriter &weightWriter)
+    {
+        std::vector<float> nonzeroData;
+        std::vector<uint8_t> mask;
+        encodeSparseWeights(weights, nonzeroData, mask);
+
+        const bool half = precision == WeightPrecision::FLOAT16;
+        const std::string &denseName = half ? ops.name(name, "_fp16") : name;
+        const int numNonzero = static_cast<int>(nonzeroData.size());
+
+        Operation &sparseOp = ops.addOperation("constexpr_sparse_to_dense", denseName);
+        ops.addOutput(sparseOp, denseName, half ? ops.tensorType<Fp16>(shape) : ops.tensorType<float>(shape));
+
+        if (half)
+        {
+            setBlobAttribute<Fp16>(ops, sparseOp, "nonzero_data", {numNonzero}, name, toFloat16(nonzeroData), weightWriter);
+        }
+        else
+        {
+            setBlobAttribute<float>(ops, sparseOp, "nonzero_data", {numNonzero}, name, nonzeroData, weightWriter);
+        }
+        setBlobAttribute<uint8_t>(ops, sparseOp, "mask", {static_cast<int>(mask.size())}, name, mask, weightWriter);
+
+        // uint32 immediate values are stored as raw little-endian bytes
+        Value &shapeValue = (*sparseOp.mutable_attributes())["shape"];
+        *shapeValue.mutable_type() = ops.tensorType<uint32_t>({static_cast<int>(shape.size())});
+        std::string shapeBytes;
+        for (const auto &dim : shape)
+        {
+            const uint32_t value = static_cast<uint32_t>(dim);
+            for (int i = 0; i < 4; ++i)
+            {
+                shapeBytes.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+            }
+        }
+        shapeValue.mutable_immediatevalue()->mutable_tensor()->mutable_bytes()->set_values(shapeBytes);
+
+        if (half)
+        {
+            addCastToFloat32Operations(ops, denseName, name, shape);
+        }
+
+        const std::size_t elementBytes = weightPrecisionBytes(precision);
+        weightWriter.recordSparseLayer({name,
+                                        sparsity,
+                                        weights.size() * elementBytes,
+                                        nonzeroData.size() * elementBytes + mask.size()});
+    }
+
+    // Emit the operations that produce a float32 weight tensor named `name`,
+    // stored in the weight file at the requested precision, sparse-encoded
+    // if at least `sparsityThreshold` of the weights are zero
+    void addWeightOperations(OpBuilder &ops,
+                             const std::string &name,
+                             const std::vector<int> &shape,
+                             const WeightArray &weights,
+                             WeightPrecision precision,
+                             float sparsityThreshold,
+                             WeightWriter &weightWriter)
+    {
+        // int8 weights are already compressed and constexpr ops cannot be chained, so only
+        // float weights are considered for sparse encoding
+        const double sparsity = weightSparsity(weights);
+        if (precision != WeightPrecision::INT8 && sparsity >= sparsityThreshold && sparsity < 1.0)
+        {
+            addSparseWeightOperations(ops, name, shape, weights, precision, sparsity, weightWriter);
+        }
+        else if (precision == WeightPrecision::FLOAT32)
+        {
+            Operation &constOp = ops.addOperation("const", name);
+            ops.addOutput(constOp, name, ops.tensorType<float>(shape));
+            setBlobAttribute<float>(ops, constOp, "val", shape, name, weights, weightWriter);
+        }
+        else if (precision == WeightPrecision::FLOAT16)
+        {
+            // Store as float16 and cast back to float32 at load time
+            const std::string &halfName = ops.name(name, "_fp16");
+            const std::vector<Fp16> halfWeights = toFloat16(weights);
+
+            Operation &constOp = ops.addOperation("const", halfName);
+            ops.addOutput(constOp, halfName, ops.tensorType<Fp16>(shape));
+            setBlobAttribute<Fp16>(ops, constOp, "val", shape, name, halfWeights, weightWriter);
+
+            addCastToFloat32Operations(ops, halfName, name, shape);
+        }
+        else
+        {
+            // Per-output-channel symmetric int8, dequantized when the model is loaded
+            const int numChannels = shape[0];
+            std::vector<int8_t> quantized;
+            std::vector<float> scales;
+            quantizeInt8PerChannel(weights, numChannels, quantized, scales);
+            const std::vector<int8_t> zeroPoints(numChannels, 0);
+
+            Operation &dequantizeOp = ops.addOperation("constexpr_affine_dequantize", name);
+            ops.addOutput(dequantizeOp, name, ops.tensorType<float>(shape));
+            setBlobAttribute<int8_t>(ops, dequantizeOp, "quantized_data", shape, name, quantized, weightWriter);
+            setBlobAttribute<int8_t>(ops, dequantizeOp, "zero_point", {numChannels}, name, zeroPoints, weightWriter);
+            setBlobAttribute<float>(ops, dequantizeOp, "scale", {numChannels}, name, scales, weightWriter);
+
+            Value &axis = (*dequantizeOp.mutable_attributes())["axis"];
+            *axis.mutable_type() = ops.tensorType<int32_t>({});
+            axis.mutable_immediatevalue()->mutable_tensor()->mutable_ints()->add_values(0);
+        }
+    }
 
-        // Bind the input: set argument "x" to be the provided input's name.
-        auto *binding = (*relu_op->mutable_inputs())["x"].add_arguments();
-        binding->set_name(input.name());
+    std::vector<int> tensorShape(const NamedValueType &value)
+    {
+        std::vector<int> shape;
+        for (const auto &dim : value.type().tensortype().dimensions())
+        {
+            shape.push_back(static_cast<int>(dim.constant().size()));
+        }
+        return shape;
+    }
 
-        // Create the operation's output "relu_out" and copy the input type.
-        NamedValueType *relu_output = relu_op->add_outputs();
-        relu_output->set_name(name);
-        *relu_output->mutable_type() = input.type(); // Use same type as input
+    // Zero-pad the channels, bottom and right of an NCHW tensor. Padded positions are off the
+    // board: they are 0 in the on-board mask channel of the spatial input, as for small boards.
+    NamedValueType *addInputPadOperation(OpBuilder &ops,
+                                         const NamedValueType &input,
+                                         const std::string &name,
+                                         int padC,
+                                         int padY,
+                                         int padX)
+    {
+        const std::string &padName = ops.name(name, "_pad");
+        const std::string &modeName = ops.name(name, "_mode");
+        const std::string &constantName = ops.name(name, "_constant_val");
+        ops.addConst<int32_t>(padName, {6}, {0, padC, 0, padY, 0, padX});
+        ops.addScalarConst<std::string>(modeName, "constant");
+        ops.addScalarConst(constantName, 0.0f);
+
+        Operation &padOp = ops.addOperation("pad", name);
+        ops.bind(padOp, "x", input.name());
+        ops.bind(padOp, "pad", padName);
+        ops.bind(padOp, "mode", modeName);
+        ops.bind(padOp, "constant_val", constantName);
+
+        std::vector<int> shape = tensorShape(input);
+        shape[1] += padC;
+        shape[2] += padY;
+        shape[3] += padX;
+        return ops.addOutput(padOp, name, ops.tensorTypeLike(input, shape));
+    }
 
-        return relu_output;
+    // Crop an NCHW tensor to its top-left nnYLen x nnXLen corner
+    NamedValueType *addSpatialCropOperation(OpBuilder &ops,
+                                            const NamedValueType &input,
+                                            const std::string &name,
+                                            int nnYLen,
+                                            int nnXLen)
+    {
+        std::vector<int> shape = tensorShape(input);
+        shape[2] = nnYLen;
+        shape[3] = nnXLen;
+        const std::string &beginName = ops.name(name, "_begin");
+        const std::string &sizeName = ops.name(name, "_size");
+        ops.addConst<int32_t>(beginName, {4}, {0, 0, 0, 0});
+        ops.addConst<int32_t>(sizeName, {4}, shape);
+
+        Operation &sliceOp = ops.addOperation("slice_by_size", name);
+        ops.bind(sliceOp, "x", input.name());
+        ops.bind(sliceOp, "begin", beginName);
+        ops.bind(sliceOp, "size", sizeName);
+        return ops.addOutput(sliceOp, name, ops.tensorTypeLike(input, shape));
     }
 
-    NamedValueType *addConvOperation(Block &block,
+    // One dimension of `shape` may be -1, the size that keeps the element count of the input
+    NamedValueType *addReshapeOperation(OpBuilder &ops,
+                                        const NamedValueType &input,
+                                        const std::string &name,
+                                        const std::vector<int> &shape)
+    {
+        const std::string &shapeName = ops.name(name, "_shape");
+        ops.addConst<int32_t>(shapeName, {static_cast<int>(shape.size())}, shape);
+
+        Operation &reshapeOp = ops.addOperation("reshape", name);
+        ops.bind(reshapeOp, "x", input.name());
+        ops.bind(reshapeOp, "shape", shapeName);
+
+        std::vector<int> outputShape = shape;
+        auto inferred = std::find(outputShape.begin(), outputShape.end(), -1);
+        if (inferred != outputShape.end())
+        {
+            int count = 1;
+            for (int dim : tensorShape(input))
+            {
+                count *= dim;
+            }
+            for (int dim : shape)
+            {
+                count /= dim == -1 ? 1 : dim;
+            }
+            *inferred = count;
+        }
+        return ops.addOutput(reshapeOp, name, ops.tensorTypeLike(input, outputShape));
+    }
+
+    NamedValueType *addTransposeOperation(OpBuilder &ops,
+                                          const NamedValueType &input,
+                                          const std::string &name,
+                                          const std::vector<int> &perm)
+    {
+        const std::string &permName = ops.name(name, "_perm");
+        ops.addConst<int32_t>(permName, {static_cast<int>(perm.size())}, perm);
+
+        Operation &transposeOp = ops.addOperation("transpose", name);
+        ops.bind(transposeOp, "x", input.name());
+        ops.bind(transposeOp, "perm", permName);
+
+        const std::vector<int> inputShape = tensorShape(input);
+        std::vector<int> shape;
+        for (int axis : perm)
+        {
+            shape.push_back(inputShape[axis]);
+        }
+        return ops.addOutput(transposeOp, name, ops.tensorTypeLike(input, shape));
+    }
+
+    NamedValueType *addConcatOperation(OpBuilder &ops,
+                                       const std::vector<const NamedValueType *> &inputs,
+                                       const std::string &name,
+                                       int axis)
+    {
+        const std::string &axisName = ops.name(name, "_axis");
+        const std::string &interleaveName = ops.name(name, "_interleave");
+        ops.addConst<int32_t>(axisName, {1}, {axis});
+        ops.addScalarConst(interleaveName, false);
+
+        Operation &concatOp = ops.addOperation("concat", name);
+        std::vector<int> shape = tensorShape(*inputs[0]);
+        shape[axis] = 0;
+        for (const auto *input : inputs)
+        {
+            ops.bind(concatOp, "values", input->name());
+            shape[axis] += tensorShape(*input)[axis];
+        }
+        ops.bind(concatOp, "axis", axisName);
+        ops.bind(concatOp, "interleave", interleaveName);
+        return ops.addOutput(concatOp, name, ops.tensorTypeLike(*inputs[0], shape));
+    }
+
+    // Mean of an NCHW tensor over the board, as [batch, C]
+    NamedValueType *addSpatialMeanOperation(OpBuilder &ops, const NamedValueType &input, const std::string &name)
+    {
+        return ops.addReduce("reduce_mean", input, {2, 3}, false, name);
+    }
+
+    // The on-board mask, channel 0 of the spatial input, as [batch, 1, H, W]
+    NamedValueType *addBoardMaskOperation(OpBuilder &ops, const NamedValueType &inputSpatial, const std::string &name)
+    {
+        std::vector<int> shape = tensorShape(inputSpatial);
+        shape[1] = 1;
+        const std::string &beginName = ops.name(name, "_begin");
+        const std::string &sizeName = ops.name(name, "_size");
+        ops.addConst<int32_t>(beginName, {4}, {0, 0, 0, 0});
+        ops.addConst<int32_t>(sizeName, {4}, {-1, 1, -1, -1});
+
+        Operation &sliceOp = ops.addOperation("slice_by_size", name);
+        ops.bind(sliceOp, "x", inputSpatial.name());
+        ops.bind(sliceOp, "begin", beginName);
+        ops.bind(sliceOp, "size", sizeName);
+        return ops.addOutput(sliceOp, name, ops.tensorTypeLike(inputSpatial, shape));
+    }
+
+    // Mean of an NCHW tensor over the on-board positions of `mask`, as [batch, C]. `maskArea`
+    // is the [batch, 1] number of on-board positions, so the mean holds for any board size.
+    NamedValueType *addMaskedSpatialMeanOperation(OpBuilder &ops,
+                                                  const NamedValueType &input,
+                                                  const NamedValueType &mask,
+                                                  const NamedValueType &maskArea,
+                                                  const std::string &name)
+    {
+        NamedValueType *masked = ops.addBinary("mul", input, mask, ops.name(name, "_masked"));
+        NamedValueType *sum = ops.addReduce("reduce_sum", *masked, {2, 3}, false, ops.name(name, "_sum"));
+        return ops.addBinary("real_div", *sum, maskArea, name);
+    }
+
+    NamedValueType *addConvOperation(OpBuilder &ops,
+                                     const NamedValueType &input,
+                                     const ConvLayerDesc &conv,
+                                     const std::string &name,
+                                     WeightPrecision weightPrecision,
+                                     float sparsityThreshold,
+                                     WeightWriter &weightWriter)
+    {
+        const std::string &weightName = ops.name(name, "_weight");
+        addWeightOperations(ops,
+                            weightName,
+                            {conv.outChannels, conv.inChannels, conv.convYSize, conv.convXSize},
+                            conv.weights,
+                            weightPrecision,
+                            sparsityThreshold,
+                            weightWriter);
+        return ops.addConv(input, weightName, conv.outChannels, conv.dilationY, conv.dilationX, name);
+    }
+
+    // 3x3 convolution with zero weights
+    NamedValueType *addConvOperation(OpBuilder &ops,
                                      const NamedValueType &input,
                                      const int numOutputChannel,
                                      const int numInputChannel,
-                                     std::string name,
-                                     Blob::StorageWriter &weightWriter)
-    {
-        const int kernelSize = 3;
-        const std::string weightName = name + "_weight";
-
-        // === Constant operation for weight ===
-        Operation *constWeightOp = block.add_operations();
-        constWeightOp->set_type("const");
-        auto *output_weight = constWeightOp->add_outputs();
-        output_weight->set_name(weightName);
-        auto *weight_output_tensor_type = output_weight->mutable_type()->mutable_tensortype();
-        weight_output_tensor_type->set_datatype(DataType::FLOAT32);
-        weight_output_tensor_type->set_rank(4);
-        weight_output_tensor_type->add_dimensions()->mutable_constant()->set_size(numOutputChannel);
-        weight_output_tensor_type->add_dimensions()->mutable_constant()->set_size(numInputChannel);
-        weight_output_tensor_type->add_dimensions()->mutable_constant()->set_size(kernelSize);
-        weight_output_tensor_type->add_dimensions()->mutable_constant()->set_size(kernelSize);
-
-        Value &weight_attribute_val = (*constWeightOp->mutable_attributes())["val"];
-        auto *weight_attribute_tensor_type = weight_attribute_val.mutable_type()->mutable_tensortype();
-        weight_attribute_tensor_type->set_datatype(DataType::FLOAT32);
-        weight_attribute_tensor_type->set_rank(4);
-        weight_attribute_tensor_type->add_dimensions()->mutable_constant()->set_size(numOutputChannel);
-        weight_attribute_tensor_type->add_dimensions()->mutable_constant()->set_size(numInputChannel);
-        weight_attribute_tensor_type->add_dimensions()->mutable_constant()->set_size(kernelSize);
-        weight_attribute_tensor_type->add_dimensions()->mutable_constant()->set_size(kernelSize);
-
-        const std::vector<float> weightData(numOutputChannel * numInputChannel * kernelSize * kernelSize, 0.0f);
-        auto span = Util::MakeSpan(weightData);
-        auto offset = weightWriter.WriteData(span);
-
-        auto *weight_attribute_val_blobfile = weight_attribute_val.mutable_blobfilevalue();
-        weight_attribute_val_blobfile->set_filename("@model_path/weights/weight.bin");
-        weight_attribute_val_blobfile->set_offset(offset);
-
-        Value &weight_attribute_name = (*constWeightOp->mutable_attributes())["name"];
-        weight_attribute_name.mutable_type()
-            ->mutable_tensortype()
-            ->set_datatype(DataType::STRING);
-        weight_attribute_name.mutable_immediatevalue()
-            ->mutable_tensor()
-            ->mutable_strings()
-            ->add_values(weightName);
-
-        // === Constant operation for padding type ===
-        Operation *constPadTypeOp = block.add_operations();
-        constPadTypeOp->set_type("const");
-        auto *output_pad_type = constPadTypeOp->add_outputs();
-        const std::string padTypeName = name + "_pad_type";
-        output_pad_type->set_name(padTypeName);
-        auto *pad_type_output_tensor_type = output_pad_type->mutable_type()->mutable_tensortype();
-        pad_type_output_tensor_type->set_datatype(DataType::STRING);
-
-        auto &pad_type_attribute_val = (*constPadTypeOp->mutable_attributes())["val"];
-        auto *pad_type_attribute_tensor_type = pad_type_attribute_val.mutable_type()->mutable_tensortype();
-        pad_type_attribute_tensor_type->set_datatype(DataType::STRING);
-        pad_type_attribute_val.mutable_immediatevalue()
-            ->mutable_tensor()
-            ->mutable_strings()
-            ->add_values("same");
-
-        auto &pad_type_attribute_name = (*constPadTypeOp->mutable_attributes())["name"];
-        pad_type_attribute_name.mutable_type()
-            ->mutable_tensortype()
-            ->set_datatype(DataType::STRING);
-        pad_type_attribute_name.mutable_immediatevalue()
-            ->mutable_tensor()
-            ->mutable_strings()
-            ->add_values(padTypeName);
-
-        // === Constant operation for strides ===
-        Operation *constStridesOp = block.add_operations();
-        constStridesOp->set_type("const");
-        auto *output_strides = constStridesOp->add_outputs();
-        const std::string stridesName = name + "_strides";
-        output_strides->set_name(stridesName);
-        auto *strides_output_tensor_type = output_strides->mutable_type()->mutable_tensortype();
-        strides_output_tensor_type->set_datatype(DataType::INT32);
-        strides_output_tensor_type->set_rank(1);
-        strides_output_tensor_type->add_dimensions()->mutable_constant()->set_size(2);
-
-        auto &strides_attribute_val = (*constStridesOp->mutable_attributes())["val"];
-        auto *strides_attribute_tensor_type = strides_attribute_val.mutable_type()->mutable_tensortype();
-        strides_attribute_tensor_type->set_datatype(DataType::INT32);
-        strides_attribute_tensor_type->set_rank(1);
-        strides_attribute_tensor_type->add_dimensions()
-            ->mutable_constant()
-            ->set_size(2);
-        auto *strides_attributes_val_ints = strides_attribute_val.mutable_immediatevalue()
-                                                ->mutable_tensor()
-                                                ->mutable_ints();
-
-        strides_attributes_val_ints->add_values(1);
-        strides_attributes_val_ints->add_values(1);
-
-        auto &strides_attribute_name = (*constStridesOp->mutable_attributes())["name"];
-        strides_attribute_name.mutable_type()
-            ->mutable_tensortype()
-            ->set_datatype(DataType::STRING);
-
-        strides_attribute_name.mutable_immediatevalue()
-            ->mutable_tensor()
-            ->mutable_strings()
-            ->add_values(stridesName);
-
-        // === Constant operation for pad ===
-        Operation *constPadOp = block.add_operations();
-        constPadOp->set_type("const");
-        auto *output_pad = constPadOp->add_outputs();
-        const std::string padName = name + "_pad";
-        output_pad->set_name(padName);
-        auto *pad_output_tensor_type = output_pad->mutable_type()->mutable_tensortype();
-        pad_output_tensor_type->set_datatype(DataType::INT32);
-        pad_output_tensor_type->set_rank(1);
-        pad_output_tensor_type->add_dimensions()
-            ->mutable_constant()
-            ->set_size(4);
-
-        auto &pad_attribute_val = (*constPadOp->mutable_attributes())["val"];
-        auto *pad_attribute_tensor_type = pad_attribute_val.mutable_type()->mutable_tensortype();
-        pad_attribute_tensor_type->set_datatype(DataType::INT32);
-        pad_attribute_tensor_type->set_rank(1);
-        pad_attribute_tensor_type->add_dimensions()
-            ->mutable_constant()
-            ->set_size(4);
-
-        auto *pad_attributes_val_ints = pad_attribute_val.mutable_immediatevalue()
-                                            ->mutable_tensor()
-                                            ->mutable_ints();
-        pad_attributes_val_ints->add_values(0);
-        pad_attributes_val_ints->add_values(0);
-        pad_attributes_val_ints->add_values(0);
-        pad_attributes_val_ints->add_values(0);
-
-        auto &pad_attribute_name = (*constPadOp->mutable_attributes())["name"];
-        pad_attribute_name.mutable_type()
-            ->mutable_tensortype()
-            ->set_datatype(DataType::STRING);
-
-        pad_attribute_name.mutable_immediatevalue()
-            ->mutable_tensor()
-            ->mutable_strings()
-            ->add_values(padName);
-
-        // === Constant operation for dilations ===
-        Operation *constDilationsOp = block.add_operations();
-        constDilationsOp->set_type("const");
-        auto *output_dilations = constDilationsOp->add_outputs();
-        const std::string dilationsName = name + "_dilations";
-        output_dilations->set_name(dilationsName);
-        auto *dilations_output_tensor_type = output_dilations->mutable_type()->mutable_tensortype();
-        dilations_output_tensor_type->set_datatype(DataType::INT32);
-        dilations_output_tensor_type->set_rank(1);
-        dilations_output_tensor_type->add_dimensions()
-            ->mutable_constant()
-            ->set_size(2);
-
-        auto &dilations_attribute_val = (*constDilationsOp->mutable_attributes())["val"];
-        auto *dilations_attribute_tensor_type = dilations_attribute_val.mutable_type()->mutable_tensortype();
-        dilations_attribute_tensor_type->set_datatype(DataType::INT32);
-        dilations_attribute_tensor_type->set_rank(1);
-        dilations_attribute_tensor_type->add_dimensions()
-            ->mutable_constant()
-            ->set_size(2);
-
-        auto *dilations_attributes_val_ints = dilations_attribute_val.mutable_immediatevalue()
-                                                  ->mutable_tensor()
-                                                  ->mutable_ints();
-
-        dilations_attributes_val_ints->add_values(1);
-        dilations_attributes_val_ints->add_values(1);
-
-        auto &dilations_attribute_name = (*constDilationsOp->mutable_attributes())["name"];
-
-        dilations_attribute_name.mutable_type()
-            ->mutable_tensortype()
-            ->set_datatype(DataType::STRING);
-
-        dilations_attribute_name.mutable_immediatevalue()
-            ->mutable_tensor()
-            ->mutable_strings()
-            ->add_values(dilationsName);
-
-        // === Constant operation for groups ===
-        Operation *constGroupsOp = block.add_operations();
-        constGroupsOp->set_type("const");
-        auto *output_groups = constGroupsOp->add_outputs();
-        const std::string groupsName = name + "_groups";
-        output_groups->set_name(groupsName);
-        auto *groups_output_tensor_type = output_groups->mutable_type()->mutable_tensortype();
-        groups_output_tensor_type->set_datatype(DataType::INT32);
-
-        auto &groups_attribute_val = (*constGroupsOp->mutable_attributes())["val"];
-        auto *groups_attribute_tensor_type = groups_attribute_val.mutable_type()->mutable_tensortype();
-        groups_attribute_tensor_type->set_datatype(DataType::INT32);
-
-        auto *groups_attributes_val_ints = groups_attribute_val.mutable_immediatevalue()
-                                               ->mutable_tensor()
-                                               ->mutable_ints();
-
-        groups_attributes_val_ints->add_values(1);
-
-        auto &groups_attribute_name = (*constGroupsOp->mutable_attributes())["name"];
-        groups_attribute_name.mutable_type()
-            ->mutable_tensortype()
-            ->set_datatype(DataType::STRING);
-
-        groups_attribute_name.mutable_immediatevalue()
-            ->mutable_tensor()
-            ->mutable_strings()
-            ->add_values(groupsName);
-
-        // === Convolution operation ===
-        Operation *convOp = block.add_operations();
-        convOp->set_type("conv");
-
-        // === Inputs ===
-        // x (the input tensor)
-        auto *input_x = (*convOp->mutable_inputs())["x"].add_arguments();
-        input_x->set_name(input.name());
-
-        // weight
-        auto *input_weight = (*convOp->mutable_inputs())["weight"].add_arguments();
-        input_weight->set_name(weightName);
-
-        // strides
-        auto *input_strides = (*convOp->mutable_inputs())["strides"].add_arguments();
-        input_strides->set_name(stridesName);
-
-        // pad
-        auto *input_pad = (*convOp->mutable_inputs())["pad"].add_arguments();
-        input_pad->set_name(padName);
-
-        // pad_type
-        auto *input_pad_type = (*convOp->mutable_inputs())["pad_type"].add_arguments();
-        input_pad_type->set_name(padTypeName);
-
-        // dilations
-        auto *input_dilations = (*convOp->mutable_inputs())["dilations"].add_arguments();
-        input_dilations->set_name(dilationsName);
-
-        // groups
-        auto *input_groups = (*convOp->mutable_inputs())["groups"].add_arguments();
-        input_groups->set_name(groupsName);
-
-        // === Outputs ===
-        auto output = convOp->add_outputs();
-        output->set_name(name);
-        auto *outputTensor = output->mutable_type()->mutable_tensortype();
-        outputTensor->set_datatype(DataType::FLOAT32);
-        outputTensor->set_rank(4);
-        const int batchSize = input.type().tensortype().dimensions(0).constant().size();
-        const int nnYLen = input.type().tensortype().dimensions(2).constant().size();
-        const int nnXLen = input.type().tensortype().dimensions(3).constant().size();
-        outputTensor->add_dimensions()->mutable_constant()->set_size(batchSize);
-        outputTensor->add_dimensions()->mutable_constant()->set_size(numOutputChannel);
-        outputTensor->add_dimensions()->mutable_constant()->set_size(nnYLen);
-        outputTensor->add_dimensions()->mutable_constant()->set_size(nnXLen);
-
-        // === Attributes ===
-        Value &attribute_name = (*convOp->mutable_attributes())["name"];
-        attribute_name.mutable_type()
-            ->mutable_tensortype()
-            ->set_datatype(DataType::STRING);
-
-        attribute_name.mutable_immediatevalue()
-            ->mutable_tensor()
-            ->mutable_strings()
-            ->add_values(name);
+                                     const std::string &name,
+                                     WeightPrecision weightPrecision,
+                                     float sparsityThreshold,
+                                     WeightWriter &weightWriter)
+    {
+        ConvLayerDesc conv;
+        conv.convYSize = 3;
+        conv.convXSize = 3;
+        conv.inChannels = numInputChannel;
+        conv.outChannels = numOutputChannel;
+        conv.weights = std::vector<float>(static_cast<std::size_t>(numOutputChannel) * numInputChannel * 9, 0.0f);
+        return addConvOperation(ops, input, conv, name, weightPrecision, sparsityThreshold, weightWriter);
+    }
+
+    // Round an NCHW tensor through int8: quantize to `name`_int8, then dequantize to `name`
+    NamedValueType *addQuantizeDequantizeOperations(OpBuilder &ops,
+                                                    const NamedValueType &input,
+                                                    const LayerActivationQuantization &quantization,
+                                                    const std::string &name)
+    {
+        const bool perChannel = quantization.quantization == ActivationQuantization::INT8_PER_CHANNEL;
+        const std::string &scaleName = ops.name(name, "_scale");
+        const std::string &zeroPointName = ops.name(name, "_zero_point");
+        const std::string &axisName = ops.name(name, "_axis");
+        const std::string &dtypeName = ops.name(name, "_dtype");
+        const std::string &quantizedName = ops.name(name, "_int8");
+        // Scalars for one scale, else one value per channel
+        const int numScales = static_cast<int>(quantization.scales.size());
+        const std::vector<int> parameterShape = numScales == 1 ? std::vector<int>{} : std::vector<int>{numScales};
+        ops.addConst(scaleName, parameterShape, quantization.scales);
+        ops.addConst(zeroPointName, parameterShape, quantization.zeroPoints);
+        if (perChannel)
+        {
+            ops.addScalarConst<int32_t>(axisName, 1);
+        }
+        ops.addScalarConst<std::string>(dtypeName, "int8");
+
+        const std::vector<int> shape = tensorShape(input);
+        Operation &quantizeOp = ops.addOperation("quantize", quantizedName);
+        ops.bind(quantizeOp, "input", input.name());
+        ops.bind(quantizeOp, "scale", scaleName);
+        ops.bind(quantizeOp, "zero_point", zeroPointName);
+        ops.bind(quantizeOp, "output_dtype", dtypeName);
+        if (perChannel)
+        {
+            ops.bind(quantizeOp, "axis", axisName);
+        }
+        ops.addOutput(quantizeOp, quantizedName, ops.tensorType<int8_t>(shape));
+
+        Operation &dequantizeOp = ops.addOperation("dequantize", name);
+        ops.bind(dequantizeOp, "input", quantizedName);
+        ops.bind(dequantizeOp, "scale", scaleName);
+        ops.bind(dequantizeOp, "zero_point", zeroPointName);
+        if (perChannel)
+        {
+            ops.bind(dequantizeOp, "axis", axisName);
+        }
+        return ops.addOutput(dequantizeOp, name, ops.tensorType<float>(shape));
+    }
 
+    // Emit a convolution of the ModelDesc, as the pair of separable convolutions
+    // of the builder's low-rank plan if it has one for this layer, with its output
+    // rounded through int8 if the builder's activation quantization plan says so.
+    // `layerName` is the name of the layer in the plans, see loweredLayerNames.
+    NamedValueType *addModelConvOperation(OpBuilder &ops,
+                                          const NamedValueType &input,
+                                          const ConvLayerDesc &conv,
+                                          const std::string &name,
+                                          const std::string &layerName,
+                                          const ModelBuilder &mb,
+                                          WeightWriter &weightWriter)
+    {
+        const WeightPrecision precision = mb.getPrecisionPlan().precisionFor(layerName);
+        const FactorizedConv *factorized = mb.getLowRankPlan().find(layerName);
+        const LayerActivationQuantization *quantization = mb.getActivationQuantizationPlan().find(layerName);
+        const bool quantized = quantization != nullptr && quantization->quantization != ActivationQuantization::FLOAT16;
+        const std::string &convName = quantized ? ops.name(name, "_float") : name;
+
+        NamedValueType *output;
+        if (factorized == nullptr)
+        {
+            output = addConvOperation(ops, input, conv, convName, precision, mb.getSparsityThreshold(), weightWriter);
+        }
+        else
+        {
+            NamedValueType *vertical = addConvOperation(ops, input, factorized->vertical, ops.name(name, "_vertical"),
+                                                        precision, mb.getSparsityThreshold(), weightWriter);
+            weightWriter.recordLowRankLayer({layerName,
+                                             factorized->rank,
+                                             factorized->macReduction(),
+                                             factorized->relativeError});
+            output = addConvOperation(ops, *vertical, factorized->horizontal, convName,
+                                      precision, mb.getSparsityThreshold(), weightWriter);
+        }
+
+        if (quantization != nullptr)
+        {
+            weightWriter.recordActivationQuantization({layerName,
+                                                       activationQuantizationName(quantization->quantization),
+                                                       static_cast<int>(quantization->scales.size()),
+                                                       quantization->clippedFraction});
+        }
+        if (quantized)
+        {
+            output = addQuantizeDequantizeOperations(ops, *output, *quantization, name);
+        }
         return output;
     }
 
-    void setupProgram(ModelBuilder &mb, Program &program,
-                      const std::string &weightsPath)
+    // Models read from a file have an initial convolution; a ModelDesc built by hand may not
+    bool hasInitialConv(const ModelDesc &modelDesc)
+    {
+        return modelDesc.trunk.initialConv.outChannels > 0 && !modelDesc.trunk.initialConv.weights.empty();
+    }
+
+    // Names by which the plans of the builder refer to the ModelDesc layers the graph lowers:
+    // the layer names of the model, and those of the secondary model with its output prefix
+    std::set<std::string> loweredLayerNames(const ModelBuilder &mb)
+    {
+        std::set<std::string> names;
+        auto addNetwork = [&](const ModelDesc &modelDesc, const std::string &prefix)
+        {
+            if (hasInitialConv(modelDesc))
+            {
+                names.insert(prefix + modelDesc.trunk.initialConv.name);
+            }
+        };
+        addNetwork(mb.getModelDesc(), "");
+        if (mb.getSecondaryModelDesc() != nullptr)
+        {
+            addNetwork(*mb.getSecondaryModelDesc(), mb.getSecondaryOutputPrefix());
+        }
+        return names;
+    }
+
+    // Names by which plans may refer to any layer with weights of the models, lowered or not
+    std::set<std::string> modelLayerNames(const ModelBuilder &mb)
+    {
+        std::set<std::string> names;
+        auto addNetwork = [&](const ModelDesc &modelDesc, const std::string &prefix)
+        {
+            forEachConvLayer(modelDesc, [&](const ConvLayerDesc &conv)
+                             { names.insert(prefix + conv.name); });
+            forEachMatMulLayer(modelDesc, [&](const MatMulLayerDesc &matMul)
+                               { names.insert(prefix + matMul.name); });
+        };
+        addNetwork(mb.getModelDesc(), "");
+        if (mb.getSecondaryModelDesc() != nullptr)
+        {
+            addNetwork(*mb.getSecondaryModelDesc(), mb.getSecondaryOutputPrefix());
+        }
+        return names;
+    }
+
+    // Plans built from the whole model, such as selectMixedPrecision's, also name layers the
+    // graph does not lower yet; those entries are reported and skipped. A name that is no layer
+    // of the models at all is a mistake in the plan.
+    template <typename Layers>
+    void checkPlanLayers(const Layers &layers,
+                         const std::set<std::string> &loweredNames,
+                         const std::set<std::string> &modelNames,
+                         const char *planName,
+                         ConversionReport &report,
+                         ConversionObserver *observer)
+    {
+        for (const auto &layer : layers)
+        {
+            if (loweredNames.count(layer.first) > 0)
+            {
+                continue;
+            }
+            if (modelNames.count(layer.first) == 0)
+            {
+                throw std::invalid_argument(std::string("The ") + planName + " plan names " + layer.first +
+                                            ", which is not a layer of the model");
+            }
+            report.unloweredPlanLayers.push_back({planName, layer.first});
+            notifyMessage(observer, std::string("Skipping ") + planName + " plan entry " + layer.first +
+                                        ": the layer is not lowered yet");
+        }
+    }
+
+    // Lowest specification version whose opset provides every operation in the block.
+    // The constexpr_* weight decompression operations were introduced in iOS 16, and
+    // activation quantize/dequantize in iOS 17.
+    int minimumSpecificationVersion(const Block &block)
+    {
+        int specificationVersion = SPECIFICATION_VERSION_IOS_15;
+        for (const auto &op : block.operations())
+        {
+            if (op.type() == "quantize" || op.type() == "dequantize")
+            {
+                return SPECIFICATION_VERSION_IOS_17;
+            }
+            if (op.type().rfind("constexpr_", 0) == 0)
+            {
+                specificationVersion = SPECIFICATION_VERSION_IOS_16;
+            }
+        }
+        return specificationVersion;
+    }
+
+    const char *opsetForSpecificationVersion(int specificationVersion)
+    {
+        if (specificationVersion >= SPECIFICATION_VERSION_IOS_17)
+        {
+            return OPSET_SPECIFICATION_VERSION_IOS_17;
+        }
+        return specificationVersion >= SPECIFICATION_VERSION_IOS_16 ? OPSET_SPECIFICATION_VERSION_IOS_16
+                                                                     : OPSET_SPECIFICATION_VERSION_IOS_15;
+    }
+
+    // Returns the time spent writing weights and sets specificationVersion to the version the program needs
+    double setupProgram(ModelBuilder &mb, Program &program,
+                        const std::string &weightsPath,
+                        ConversionReport &report,
+                        int &specificationVersion,
+                        google::protobuf::Arena *arena)
     {
         // Data type will be configurable, but for now we use float32
         const auto dataType = DataType::FLOAT32;
@@ -322,8 +737,8 @@ namespace KataGoCoreML
         // Version is set to a value that is consistent with coremltools
         program.set_version(1);
 
-        // Create Function
-        Function func;
+        // Create the function in place in the program
+        Function &func = (*program.mutable_functions())["main"];
 
         // For each input feature, add a input spatial tensor to the function
         for (const auto &inputFeature : mb.getInputFeatures())
@@ -339,29 +754,189 @@ namespace KataGoCoreML
             }
         }
 
-        // Define a block for input, output, and operations
-        func.set_opset(OPSET_SPECIFICATION_VERSION_IOS_15);
-        Block &block = (*func.mutable_block_specializations())[OPSET_SPECIFICATION_VERSION_IOS_15];
+        // Define a block for input, output, and operations.
+        // The opset is chosen once all operations are known; the block is allocated
+        // on the program's arena so moving it into the function is a pointer swap.
+        Block &block = *google::protobuf::Arena::CreateMessage<Block>(arena);
+        OpBuilder ops(block);
 
         // The inputs(0) is the input spatial tensor
-        NamedValueType inputSpatialValue = func.inputs(0);
+        const NamedValueType &inputSpatialValue = func.inputs(0);
         const int numSpatial = func.inputs(0).type().tensortype().dimensions(1).constant().size();
 
         // Create a writer for the weights
-        Blob::StorageWriter weightWriter(weightsPath);
+        WeightWriter weightWriter(weightsPath, mb.getObserver(), report);
+
+        // The graph runs at the padded board size and channel count; only the I/O keeps the logical size
+        const std::vector<int> inputSpatialShape = tensorShape(inputSpatialValue);
+        const int padC = alignChannels(numSpatial, mb.getChannelAlignment()) - numSpatial;
+        const int padY = mb.getPaddedYLen() - inputSpatialShape[2];
+        const int padX = mb.getPaddedXLen() - inputSpatialShape[3];
+        const bool padded = padY > 0 || padX > 0;
+        const NamedValueType *spatial = &inputSpatialValue;
+        if (padC > 0 || padded)
+        {
+            spatial = addInputPadOperation(ops, inputSpatialValue, INPUT_SPATIAL_NAME + "_padded", padC, padY, padX);
+        }
+
+        // On a flexible board, means are over the on-board positions of the mask, whose number
+        // is computed once in the graph; on a fixed board every position is on the board
+        const bool flexible = mb.hasFlexibleBoardSize();
+        NamedValueType *mask = nullptr;
+        NamedValueType *maskArea = nullptr;
+        if (flexible)
+        {
+            mask = addBoardMaskOperation(ops, inputSpatialValue, INPUT_SPATIAL_NAME + "_mask");
+            maskArea = ops.addReduce("reduce_sum", *mask, {2, 3}, false, INPUT_SPATIAL_NAME + "_mask_area");
+        }
+        auto spatialMean = [&](const NamedValueType &input, const std::string &name)
+        {
+            return flexible ? addMaskedSpatialMeanOperation(ops, input, *mask, *maskArea, name)
+                            : addSpatialMeanOperation(ops, input, name);
+        };
+
+        // The outputs of one network, in the order of ModelBuilder::getNetworkOutputFeatures.
+        // Networks share the inputs and the ops derived from them only; every other op is
+        // named with the network's output prefix.
+        const OutputLayout &layout = mb.getOutputLayout();
+        auto addNetwork = [&](const ModelDesc &modelDesc, const std::string &prefix)
+        {
+            // The initial convolution of the trunk is lowered from the ModelDesc
+            const NamedValueType *trunk = spatial;
+            int numTrunkChannels = numSpatial + padC;
+            if (hasInitialConv(modelDesc))
+            {
+                const ConvLayerDesc &initialConv = modelDesc.trunk.initialConv;
+                trunk = addModelConvOperation(ops, *spatial, initialConv, prefix + "initial_conv",
+                                              prefix + initialConv.name, mb, weightWriter);
+                numTrunkChannels = initialConv.outChannels;
+            }
+
+            // Placeholder heads until the rest of the trunk and the heads are lowered: zero-weight
+            // convolutions of the trunk, averaged over the board for the non-spatial outputs.
+            // They are not ModelDesc layers, so their weights have the default precision.
+            auto addHead = [&](const std::string &name, int numChannels)
+            {
+                NamedValueType *head = addConvOperation(ops,
+                                                        *trunk,
+                                                        numChannels,
+                                                        numTrunkChannels,
+                                                        padded ? name + "_padded" : name,
+                                                        mb.getPrecisionPlan().defaultPrecision,
+                                                        mb.getSparsityThreshold(),
+                                                        weightWriter);
+                if (padded)
+                {
+                    head = addSpatialCropOperation(ops, *head, name, inputSpatialShape[2], inputSpatialShape[3]);
+                }
+                return head;
+            };
+
+            // Outputs are named after the model outputs once they have the configured layout
+            const std::string policyName = prefix + OUTPUT_POLICY_NAME;
+            const std::string policyPassName = prefix + OUTPUT_POLICY_PASS_NAME;
+            const std::string valueName = prefix + OUTPUT_VALUE_NAME;
+            const std::string scoreValueName = prefix + OUTPUT_SCORE_VALUE_NAME;
+            const std::string ownershipName = prefix + OUTPUT_OWNERSHIP_NAME;
+            auto outputName = [&](const std::string &name)
+            {
+                return layout.packed ? name + "_unpacked" : name;
+            };
+            const bool policyTransformed = layout.policyWithPass || layout.channelsLast;
+            NamedValueType *policy = addHead(policyTransformed ? policyName + "_nchw" : outputName(policyName),
+                                             modelDesc.numPolicyChannels);
+            NamedValueType *policyPass = spatialMean(
+                *policy, layout.policyWithPass ? policyPassName : outputName(policyPassName));
+            NamedValueType *value = spatialMean(
+                *addHead(valueName + "_spatial", modelDesc.numValueChannels),
+                outputName(valueName));
+            NamedValueType *scoreValue = spatialMean(
+                *addHead(scoreValueName + "_spatial", modelDesc.numScoreValueChannels),
+                outputName(scoreValueName));
+            NamedValueType *ownership = addHead(layout.channelsLast ? ownershipName + "_nchw" : outputName(ownershipName),
+                                                modelDesc.numOwnershipChannels);
+
+            const int batchSize = inputSpatialShape[0];
+            // Reshapes infer the sizes that depend on a flexible board
+            const int boardArea = flexible ? -1 : inputSpatialShape[2] * inputSpatialShape[3];
+            if (layout.policyWithPass)
+            {
+                // [N, C, H, W] and [N, C] to [N, C, H * W + 1]
+                const int numPolicy = modelDesc.numPolicyChannels;
+                NamedValueType *rows = addReshapeOperation(ops, *policy, policyName + "_rows",
+                                                           {batchSize, numPolicy, boardArea});
+                NamedValueType *passColumn = addReshapeOperation(ops, *policyPass, policyPassName + "_column",
+                                                                 {batchSize, numPolicy, 1});
+                policy = addConcatOperation(ops, {rows, passColumn},
+                                            layout.channelsLast ? policyName + "_with_pass" : outputName(policyName),
+                                            2);
+                if (layout.channelsLast)
+                {
+                    policy = addTransposeOperation(ops, *policy, outputName(policyName), {0, 2, 1});
+                }
+            }
+            else if (layout.channelsLast)
+            {
+                policy = addTransposeOperation(ops, *policy, outputName(policyName), {0, 2, 3, 1});
+            }
+            if (layout.channelsLast)
+            {
+                ownership = addTransposeOperation(ops, *ownership, outputName(ownershipName), {0, 2, 3, 1});
+            }
+
+            std::vector<const NamedValueType *> outputs = {policy};
+            if (!layout.policyWithPass)
+            {
+                outputs.push_back(policyPass);
+            }
+            outputs.insert(outputs.end(), {value, scoreValue, ownership});
+
+            if (layout.packed)
+            {
+                // Flatten every output of a batch entry and lay them out one after the other
+                std::vector<const NamedValueType *> rows;
+                for (const auto *output : outputs)
+                {
+                    const std::vector<int> shape = tensorShape(*output);
+                    int size = 1;
+                    for (std::size_t i = 1; i < shape.size(); ++i)
+                    {
+                        size *= shape[i];
+                    }
+                    rows.push_back(shape.size() == 2 ? output
+                                                     : addReshapeOperation(ops, *output, output->name() + "_flat",
+                                                                           {batchSize, flexible ? -1 : size}));
+                }
+                outputs = {addConcatOperation(ops, rows, prefix + OUTPUT_PACKED_NAME, 1)};
+            }
+            return outputs;
+        };
+
+        // In the order of ModelBuilder::getOutputFeatures
+        std::vector<const NamedValueType *> outputs = addNetwork(mb.getModelDesc(), "");
+        if (mb.getSecondaryModelDesc() != nullptr)
+        {
+            const std::vector<const NamedValueType *> secondaryOutputs =
+                addNetwork(*mb.getSecondaryModelDesc(), mb.getSecondaryOutputPrefix());
+            outputs.insert(outputs.end(), secondaryOutputs.begin(), secondaryOutputs.end());
+        }
+
+        for (const auto *output : outputs)
+        {
+            block.add_outputs(output->name());
+        }
 
-        NamedValueType *initial_conv = addConvOperation(
-            block,
-            inputSpatialValue,
-            mb.getModelDesc().numPolicyChannels,
-            numSpatial,
-            OUTPUT_POLICY_NAME,
-            weightWriter);
+        // Lowering emits ops in visiting order; fuse the epilogues it spreads over separate ops,
+        // then reorder the ops to lower the peak activation memory
+        report.epilogueFusion = fuseEpilogues(block);
+        report.memorySchedule = scheduleForMemory(block, func);
 
-        block.add_outputs(initial_conv->name());
+        specificationVersion = minimumSpecificationVersion(block);
+        const char *opset = opsetForSpecificationVersion(specificationVersion);
+        func.set_opset(opset);
+        (*func.mutable_block_specializations())[opset].Swap(&block);
 
-        // Add the function to the program
-        (*program.mutable_functions())["main"] = func;
+        return weightWriter.finish();
     }
 
     // Populate model I/O
@@ -381,118 +956,169 @@ namespace KataGoCoreML
                 array->add_shape(dim);
             }
             array->set_datatype(dataType);
-        }
-
-        const int batchSize = mb.getBatchSize();
-        const int nnXLen = mb.getNnXLen();
-        const int nnYLen = mb.getNnYLen();
-        const ModelDesc &modelDesc = mb.getModelDesc();
-        const int numPolicy = modelDesc.numPolicyChannels;
-        assert(numPolicy > 0);
-
-        // Output Policy
-        {
-            auto *feature = desc.add_output();
-            feature->set_name(OUTPUT_POLICY_NAME);
-            auto *array = feature->mutable_type()->mutable_multiarraytype();
-            array->add_shape(batchSize);
-            array->add_shape(numPolicy);
-            array->add_shape(nnYLen);
-            array->add_shape(nnXLen);
-            array->set_datatype(dataType);
-        }
 
-        // Output Policy Pass
-        {
-            auto *feature = desc.add_output();
-            feature->set_name(OUTPUT_POLICY_PASS_NAME);
-            auto *array = feature->mutable_type()->mutable_multiarraytype();
-            array->add_shape(batchSize);
-            array->add_shape(numPolicy);
-            array->set_datatype(dataType);
+            // On a flexible board, the Y and X dimensions of input_spatial, the first input, are
+            // ranges around the default shape
+            if (mb.hasFlexibleBoardSize() && desc.input_size() == 1)
+            {
+                for (std::size_t i = 0; i < inputFeature.shape.size(); ++i)
+                {
+                    auto *range = array->mutable_shaperange()->add_sizeranges();
+                    const bool spatial = i == 2 || i == 3;
+                    range->set_lowerbound(spatial ? mb.getMinBoardLen() : inputFeature.shape[i]);
+                    range->set_upperbound(spatial ? mb.getMaxBoardLen() : inputFeature.shape[i]);
+                }
+            }
         }
 
-        // Output Value
+        // Outputs with a dimension of flexible size are declared without a shape, as coremltools does
+        auto addOutput = [&](const std::string &name, const std::vector<int> &shape)
         {
             auto *feature = desc.add_output();
-            feature->set_name(OUTPUT_VALUE_NAME);
+            feature->set_name(name);
             auto *array = feature->mutable_type()->mutable_multiarraytype();
-            const int numValue = modelDesc.numValueChannels;
-            assert(numValue > 0);
-            array->add_shape(batchSize);
-            array->add_shape(numValue);
+            if (std::find(shape.begin(), shape.end(), -1) == shape.end())
+            {
+                for (const auto &dim : shape)
+                {
+                    array->add_shape(dim);
+                }
+            }
             array->set_datatype(dataType);
-        }
+        };
 
-        // Output Score Value
+        // With the packed layout, each network has one output_packed of its outputs
+        auto addNetworkOutputs = [&](const ModelDesc &networkDesc, const std::string &prefix)
         {
-            auto *feature = desc.add_output();
-            feature->set_name(OUTPUT_SCORE_VALUE_NAME);
-            auto *array = feature->mutable_type()->mutable_multiarraytype();
-            const int numScoreValue = modelDesc.numScoreValueChannels;
-            assert(numScoreValue > 0);
-            array->add_shape(batchSize);
-            array->add_shape(numScoreValue);
-            array->set_datatype(dataType);
-        }
-
-        // Output Ownership
+            const std::vector<OutputFeature> outputFeatures = mb.getNetworkOutputFeatures(networkDesc, prefix);
+            if (mb.getOutputLayout().packed)
+            {
+                int size = 0;
+                for (const auto &outputFeature : outputFeatures)
+                {
+                    int featureSize = 1;
+                    for (std::size_t i = 1; i < outputFeature.shape.size(); ++i)
+                    {
+                        const int dim = outputFeature.shape[i];
+                        featureSize = featureSize < 0 || dim < 0 ? -1 : featureSize * dim;
+                    }
+                    size = size < 0 || featureSize < 0 ? -1 : size + featureSize;
+                }
+                addOutput(prefix + OUTPUT_PACKED_NAME, {mb.getBatchSize(), size});
+            }
+            else
+            {
+                for (const auto &outputFeature : outputFeatures)
+                {
+                    addOutput(outputFeature.name, outputFeature.shape);
+                }
+            }
+        };
+        addNetworkOutputs(mb.getModelDesc(), "");
+        if (mb.getSecondaryModelDesc() != nullptr)
         {
-            auto *feature = desc.add_output();
-            feature->set_name(OUTPUT_OWNERSHIP_NAME);
-            auto *array = feature->mutable_type()->mutable_multiarraytype();
-            const int numOwnership = modelDesc.numOwnershipChannels;
-            assert(numOwnership > 0);
-            array->add_shape(batchSize);
-            array->add_shape(numOwnership);
-            array->add_shape(nnYLen);
-            array->add_shape(nnXLen);
-            array->set_datatype(dataType);
+            addNetworkOutputs(*mb.getSecondaryModelDesc(), mb.getSecondaryOutputPrefix());
         }
     }
 
-    void setupModel(ModelBuilder &mb, Model &model,
-                    const std::string &weightsPath)
+    // Returns the time spent writing weights
+    double setupModel(ModelBuilder &mb, Model &model,
+                      const std::string &weightsPath,
+                      ConversionReport &report,
+                      google::protobuf::Arena *arena)
     {
-        // Specification version is set to a value that is consistent with coremltools
-        model.set_specificationversion(SPECIFICATION_VERSION_IOS_15);
-
         ModelDescription *desc = model.mutable_description();
         addModelIOFeatures(mb, *desc);
 
-        Program *program = new Program();
-        setupProgram(mb, *program, weightsPath);
-        model.set_allocated_mlprogram(program);
+        // The program is allocated on the model's arena
+        Program *program = model.mutable_mlprogram();
+        int specificationVersion = SPECIFICATION_VERSION_IOS_15;
+        const double weightSeconds = setupProgram(mb, *program, weightsPath, report, specificationVersion, arena);
+
+        // Specification version is set to a value that is consistent with coremltools
+        model.set_specificationversion(specificationVersion);
+        return weightSeconds;
     }
 
-    std::string createTempFile(const std::string &templatePattern)
+    // Makes the Y and X dimensions of input_spatial, the first input, unknown, along with
+    // every dimension of the program that follows from them
+    void makeBoardSizeFlexible(Model &model)
     {
-        std::string path = templatePattern;
-        int fd = mkstemp(const_cast<char *>(path.data()));
-        if (fd < 0)
+        Function &func = (*model.mutable_mlprogram()->mutable_functions())["main"];
+        auto &dimensions = *func.mutable_inputs(0)->mutable_type()->mutable_tensortype()->mutable_dimensions();
+        for (int axis : {2, 3})
         {
-            throw std::runtime_error("Failed to create temporary file: " + templatePattern);
+            dimensions.Mutable(axis)->mutable_unknown()->set_variadic(false);
         }
+        inferOutputTypes(model);
+    }
 
-        std::cout << "Temporary file created: " << path << std::endl;
-        return path;
+    void countOperations(const Program &program, std::map<std::string, int> &opCounts)
+    {
+        for (const auto &function : program.functions())
+        {
+            for (const auto &specialization : function.second.block_specializations())
+            {
+                for (const auto &op : specialization.second.operations())
+                {
+                    opCounts[op.type()]++;
+                }
+            }
+        }
     }
 
-    std::string ModelBuilder::setupAndSerializeModel(const std::string &weightFile)
+    void ModelBuilder::setupAndSerializeModel(const std::string &weightFile, const std::string &modelFile)
     {
+        // Every message of the model is allocated on one arena and freed with it,
+        // instead of thousands of individual heap allocations
+        google::protobuf::ArenaOptions arenaOptions;
+        arenaOptions.start_block_size = 64 * 1024;
+        arenaOptions.max_block_size = 4 * 1024 * 1024;
+        google::protobuf::Arena arena(arenaOptions);
+
         // Initialize and setup the model
-        Model model;
-        setupModel(*this, model, weightFile);
-
-        // Serialize the model to a new temp file
-        auto tmpPattern = (fs::temp_directory_path() / "modelXXXXXX").string();
-        std::string modelPath = createTempFile(tmpPattern);
-        std::ofstream ofs(modelPath, std::ios::binary);
-        model.SerializeToOstream(&ofs);
+        Model &model = *google::protobuf::Arena::CreateMessage<Model>(&arena);
+        {
+            StageTimer timer(ConversionStage::GRAPH_BUILD, observer, report);
+            timer.exclude(setupModel(*this, model, weightFile, report, &arena));
+        }
+        countOperations(model.mlprogram(), report.opCounts);
+        report.cost = analyzeProgramCost(model.mlprogram());
+        report.cost.batchSize = batchSize;
+        report.cost.nnXLen = nnXLen;
+        report.cost.nnYLen = nnYLen;
+
+        // The program is built, scheduled and costed on the default board, then generalized
+        if (hasFlexibleBoardSize())
+        {
+            makeBoardSizeFlexible(model);
+        }
+
+        // Catch malformed graphs here rather than when the package is compiled on a device
+        {
+            StageTimer timer(ConversionStage::VERIFY, observer, report);
+            verifyProgram(model);
+        }
+
+        // Serialize the model to the given file
+        // Map entries (functions, block specializations, attributes) are written in key order,
+        // so the same ModelDesc always serializes to the same bytes
+        StageTimer timer(ConversionStage::SERIALIZE, observer, report);
+        std::ofstream ofs(modelFile, std::ios::binary);
+        bool serialized;
+        {
+            google::protobuf::io::OstreamOutputStream zeroCopyStream(&ofs);
+            google::protobuf::io::CodedOutputStream codedStream(&zeroCopyStream);
+            codedStream.SetSerializationDeterministic(true);
+            serialized = model.SerializeToCodedStream(&codedStream) && !codedStream.HadError();
+        }
         ofs.close();
+        if (!serialized || !ofs)
+        {
+            throw std::runtime_error("Failed to serialize model to: " + modelFile);
+        }
 
-        std::cout << "Model serialized to: " << modelPath << std::endl;
-        return modelPath;
+        notifyMessage(observer, "Model serialized to: " + modelFile);
     }
 
     void cleanExistingPackage(const std::string &packagePath)
@@ -503,40 +1129,332 @@ namespace KataGoCoreML
         }
     }
 
+    struct PackageItem
+    {
+        std::string name;
+        std::string author;
+        std::string description;
+    };
+
+    const std::string PACKAGE_AUTHOR = "github.com/ChinChangYang/KataGoCoreML";
+    const PackageItem ROOT_MODEL_ITEM = {"model.mlmodel", PACKAGE_AUTHOR, "KataGo CoreML Model Specification"};
+    const PackageItem WEIGHTS_ITEM = {"weights", PACKAGE_AUTHOR, "KataGo CoreML Model Weights"};
+
+    // Name-based UUID (version 5 layout, SHA-256 instead of SHA-1) of an item's package path
+    std::string packageItemIdentifier(const PackageItem &item)
+    {
+        Sha256 sha;
+        sha.update(item.author + "/" + item.name);
+        std::array<std::uint8_t, 32> digest = sha.digest();
+        digest[6] = (digest[6] & 0x0f) | 0x50;
+        digest[8] = (digest[8] & 0x3f) | 0x80;
+
+        static const char hex[] = "0123456789ABCDEF";
+        std::string uuid;
+        for (int i = 0; i < 16; ++i)
+        {
+            if (i == 4 || i == 6 || i == 8 || i == 10)
+            {
+                uuid += '-';
+            }
+            uuid += hex[digest[i] >> 4];
+            uuid += hex[digest[i] & 0xf];
+        }
+        return uuid;
+    }
+
+    // ModelPackage identifies items by random UUIDs. Rewrite the manifest with identifiers
+    // derived from the item paths, in a fixed order, so equal models give equal packages.
+    // The root model comes first.
+    void writeDeterministicManifest(const std::string &packagePath, const std::vector<PackageItem> &items)
+    {
+        std::ofstream ofs(fs::path(packagePath) / "Manifest.json", std::ios::binary | std::ios::trunc);
+        ofs << "{\n";
+        ofs << "    \"fileFormatVersion\": \"1.0.0\",\n";
+        ofs << "    \"itemInfoEntries\": {\n";
+        for (std::size_t i = 0; i < items.size(); ++i)
+        {
+            const PackageItem &item = items[i];
+            ofs << "        \"" << packageItemIdentifier(item) << "\": {\n";
+            ofs << "            \"author\": \"" << item.author << "\",\n";
+            ofs << "            \"description\": \"" << item.description << "\",\n";
+            ofs << "            \"name\": \"" << item.name << "\",\n";
+            ofs << "            \"path\": \"" << item.author << "/" << item.name << "\"\n";
+            ofs << "        }" << (i + 1 < items.size() ? "," : "") << "\n";
+        }
+        ofs << "    },\n";
+        ofs << "    \"rootModelIdentifier\": \"" << packageItemIdentifier(items.front()) << "\"\n";
+        ofs << "}\n";
+        ofs.close();
+        if (!ofs)
+        {
+            throw std::runtime_error("Failed to write the manifest of: " + packagePath);
+        }
+    }
+
     void buildModelPackage(const std::string &packagePath,
                            const std::string &modelPath,
-                           const TempDir &weightDir)
+                           const fs::path &weightDir)
+    {
+        {
+            ModelPackage pkg(packagePath);
+            pkg.setRootModel(modelPath,
+                             ROOT_MODEL_ITEM.name,
+                             ROOT_MODEL_ITEM.author,
+                             ROOT_MODEL_ITEM.description);
+            pkg.addItem(weightDir,
+                        WEIGHTS_ITEM.name,
+                        WEIGHTS_ITEM.author,
+                        WEIGHTS_ITEM.description);
+        }
+
+        // The manifest is final once the package is closed
+        writeDeterministicManifest(packagePath, {ROOT_MODEL_ITEM, WEIGHTS_ITEM});
+    }
+
+    std::string packageContentHash(const std::string &packagePath)
     {
-        ModelPackage pkg(packagePath);
-        pkg.setRootModel(modelPath,
-                         "model.mlmodel",
-                         "github.com/ChinChangYang/KataGoCoreML",
-                         "KataGo CoreML Model Specification");
-        pkg.addItem(weightDir.path(),
-                    "weights",
-                    "github.com/ChinChangYang/KataGoCoreML",
-                    "KataGo CoreML Model Weights");
+        std::vector<fs::path> files;
+        for (const auto &entry : fs::recursive_directory_iterator(packagePath))
+        {
+            if (entry.is_regular_file())
+            {
+                files.push_back(fs::relative(entry.path(), packagePath));
+            }
+        }
+        std::sort(files.begin(), files.end());
+
+        // Each file contributes its relative path, its size and its contents
+        Sha256 sha;
+        std::vector<char> buffer(1 << 20);
+        for (const auto &file : files)
+        {
+            const std::string name = file.generic_string();
+            sha.update(name.c_str(), name.size() + 1);
+
+            const fs::path fullPath = fs::path(packagePath) / file;
+            const std::uint64_t size = fs::file_size(fullPath);
+            std::uint8_t sizeBytes[8];
+            for (int i = 0; i < 8; ++i)
+            {
+                sizeBytes[i] = static_cast<std::uint8_t>(size >> (8 * i));
+            }
+            sha.update(sizeBytes, sizeof(sizeBytes));
+
+            std::ifstream ifs(fullPath, std::ios::binary);
+            while (ifs)
+            {
+                ifs.read(buffer.data(), buffer.size());
+                sha.update(buffer.data(), static_cast<std::size_t>(ifs.gcount()));
+            }
+            if (ifs.bad())
+            {
+                throw std::runtime_error("Failed to read: " + fullPath.string());
+            }
+        }
+        return sha.hexDigest();
     }
 
     void ModelBuilder::addInputFeature(InputFeature &inputFeature)
     {
+        if (fixedMetadata && inputFeature.name == INPUT_META_NAME)
+        {
+            return;
+        }
         inputFeatures.push_back(inputFeature);
     }
 
+    std::vector<OutputFeature> ModelBuilder::getOutputFeatures() const
+    {
+        std::vector<OutputFeature> outputs = getNetworkOutputFeatures(modelDesc, "");
+        if (secondaryModelDesc != nullptr)
+        {
+            const std::vector<OutputFeature> secondaryOutputs =
+                getNetworkOutputFeatures(*secondaryModelDesc, secondaryOutputPrefix);
+            outputs.insert(outputs.end(), secondaryOutputs.begin(), secondaryOutputs.end());
+        }
+        return outputs;
+    }
+
+    std::vector<OutputFeature> ModelBuilder::getNetworkOutputFeatures(const ModelDesc &networkDesc,
+                                                                      const std::string &outputPrefix) const
+    {
+        const int numPolicy = networkDesc.numPolicyChannels;
+        const int numValue = networkDesc.numValueChannels;
+        const int numScoreValue = networkDesc.numScoreValueChannels;
+        const int numOwnership = networkDesc.numOwnershipChannels;
+        assert(numPolicy > 0);
+        assert(numValue > 0);
+        assert(numScoreValue > 0);
+        assert(numOwnership > 0);
+
+        // Sizes that follow from a flexible board are unknown
+        const int yLen = hasFlexibleBoardSize() ? -1 : nnYLen;
+        const int xLen = hasFlexibleBoardSize() ? -1 : nnXLen;
+        auto spatialShape = [&](int numChannels)
+        {
+            return outputLayout.channelsLast ? std::vector<int>{batchSize, yLen, xLen, numChannels}
+                                             : std::vector<int>{batchSize, numChannels, yLen, xLen};
+        };
+
+        std::vector<OutputFeature> outputs;
+        if (outputLayout.policyWithPass)
+        {
+            const int policyLength = hasFlexibleBoardSize() ? -1 : nnYLen * nnXLen + 1;
+            outputs.emplace_back(outputPrefix + OUTPUT_POLICY_NAME,
+                                 outputLayout.channelsLast ? std::vector<int>{batchSize, policyLength, numPolicy}
+                                                           : std::vector<int>{batchSize, numPolicy, policyLength});
+        }
+        else
+        {
+            outputs.emplace_back(outputPrefix + OUTPUT_POLICY_NAME, spatialShape(numPolicy));
+            outputs.emplace_back(outputPrefix + OUTPUT_POLICY_PASS_NAME, std::vector<int>{batchSize, numPolicy});
+        }
+        outputs.emplace_back(outputPrefix + OUTPUT_VALUE_NAME, std::vector<int>{batchSize, numValue});
+        outputs.emplace_back(outputPrefix + OUTPUT_SCORE_VALUE_NAME, std::vector<int>{batchSize, numScoreValue});
+        outputs.emplace_back(outputPrefix + OUTPUT_OWNERSHIP_NAME, spatialShape(numOwnership));
+        return outputs;
+    }
+
+    void ModelBuilder::setPaddedBoardSize(int paddedXLen, int paddedYLen)
+    {
+        if (paddedXLen < nnXLen || paddedYLen < nnYLen)
+        {
+            throw std::invalid_argument("Padded board size " + std::to_string(paddedXLen) + "x" +
+                                        std::to_string(paddedYLen) + " is smaller than the board");
+        }
+        if (hasFlexibleBoardSize() && (paddedXLen != nnXLen || paddedYLen != nnYLen))
+        {
+            throw std::invalid_argument("A flexible board size cannot be padded");
+        }
+        this->paddedXLen = paddedXLen;
+        this->paddedYLen = paddedYLen;
+    }
+
+    void ModelBuilder::setFlexibleBoardSize(int minLen, int maxLen)
+    {
+        if (minLen < 1 || minLen > maxLen || nnXLen < minLen || nnXLen > maxLen || nnYLen < minLen || nnYLen > maxLen)
+        {
+            throw std::invalid_argument("Flexible board size " + std::to_string(minLen) + ".." +
+                                        std::to_string(maxLen) + " does not contain the " + std::to_string(nnXLen) +
+                                        "x" + std::to_string(nnYLen) + " board");
+        }
+        if (paddedXLen != nnXLen || paddedYLen != nnYLen)
+        {
+            throw std::invalid_argument("A flexible board size cannot be padded");
+        }
+        minBoardLen = minLen;
+        maxBoardLen = maxLen;
+    }
+
+    void ModelBuilder::setSecondaryModel(ModelDesc &secondaryModelDesc, const std::string &outputPrefix)
+    {
+        if (outputPrefix.empty())
+        {
+            throw std::invalid_argument("The outputs of a secondary model need a prefix");
+        }
+        const bool metaCompatible = modelDesc.numInputMetaChannels == 0 || secondaryModelDesc.numInputMetaChannels == 0 ||
+                                    modelDesc.numInputMetaChannels == secondaryModelDesc.numInputMetaChannels;
+        if (modelDesc.numInputChannels != secondaryModelDesc.numInputChannels ||
+            modelDesc.numInputGlobalChannels != secondaryModelDesc.numInputGlobalChannels || !metaCompatible)
+        {
+            throw std::invalid_argument("Secondary model '" + secondaryModelDesc.name +
+                                        "' takes inputs with other channel counts than '" + modelDesc.name + "'");
+        }
+        if (fixedMetadata || channelAlignment != 1)
+        {
+            throw std::invalid_argument("A secondary model must be set before fixed metadata and channel alignment");
+        }
+        this->secondaryModelDesc = &secondaryModelDesc;
+        secondaryOutputPrefix = outputPrefix;
+    }
+
+    void ModelBuilder::setChannelAlignment(int alignment)
+    {
+        // The ModelDesc keeps the channels of the first padding, which the graph input must match
+        if (channelAlignment != 1 && alignment != channelAlignment)
+        {
+            throw std::invalid_argument("Channel alignment is already " + std::to_string(channelAlignment) +
+                                        ", cannot change it to " + std::to_string(alignment));
+        }
+        padModelChannels(modelDesc, alignment);
+        if (secondaryModelDesc != nullptr)
+        {
+            padModelChannels(*secondaryModelDesc, alignment);
+        }
+        channelAlignment = alignment;
+    }
+
+    void ModelBuilder::setFixedMetadata(const std::vector<float> &inputMeta)
+    {
+        foldFixedMetadata(modelDesc, inputMeta);
+        if (secondaryModelDesc != nullptr)
+        {
+            foldFixedMetadata(*secondaryModelDesc, inputMeta);
+        }
+        fixedMetadata = true;
+        inputFeatures.erase(std::remove_if(inputFeatures.begin(), inputFeatures.end(),
+                                           [](const InputFeature &feature)
+                                           { return feature.name == INPUT_META_NAME; }),
+                            inputFeatures.end());
+    }
+
     void ModelBuilder::createMLPackage(const std::string &packagePath)
     {
-        // Prepare a temp directory and weight file
-        auto weightDir = TempDir("weights");
-        auto weightFile = weightDir.path().string() + "/weight.bin";
+        report = ConversionReport();
+        report.packagePath = packagePath;
+        report.modelSha256 = modelDesc.sha256;
+
+        const std::set<std::string> loweredNames = loweredLayerNames(*this);
+        const std::set<std::string> modelNames = modelLayerNames(*this);
+        checkPlanLayers(precisionPlan.layers, loweredNames, modelNames, "precision", report, observer);
+        checkPlanLayers(lowRankPlan.layers, loweredNames, modelNames, "low-rank", report, observer);
+        checkPlanLayers(activationQuantizationPlan.layers, loweredNames, modelNames, "activation quantization",
+                        report, observer);
+
+        // Every intermediate file lives in a temp directory private to this call,
+        // so concurrent conversions never share paths
+        auto workDir = TempDir("katagocoreml");
+        const fs::path weightDir = workDir.path() / "weights";
+        fs::create_directory(weightDir);
+        const std::string weightFile = (weightDir / "weight.bin").string();
+        const std::string modelFile = (workDir.path() / "model.mlmodel").string();
+        notifyMessage(observer, "Temporary directory created: " + workDir.path().string());
 
         // Build and serialize the model
-        auto modelFile = setupAndSerializeModel(weightFile);
+        setupAndSerializeModel(weightFile, modelFile);
+
+        {
+            StageTimer timer(ConversionStage::PACKAGE_ASSEMBLY, observer, report);
 
-        // Remove any existing package
-        cleanExistingPackage(packagePath);
+            // Remove any existing package
+            cleanExistingPackage(packagePath);
 
-        // Assemble the final package
-        buildModelPackage(packagePath, modelFile, weightDir);
+            // Assemble the final package, never leaving a partial one behind
+            try
+            {
+                buildModelPackage(packagePath, modelFile, weightDir);
+            }
+            catch (...)
+            {
+                cleanExistingPackage(packagePath);
+                throw;
+            }
+        }
+
+        report.packageSha256 = packageContentHash(packagePath);
+
+        report.peakMemoryBytes = peakResidentMemoryBytes();
+
+        if (!reportPath.empty())
+        {
+            report.writeJSON(reportPath);
+        }
+
+        if (observer != nullptr)
+        {
+            observer->onConversionFinished(report);
+        }
     }
 
 } // namespace KataGoCoreML
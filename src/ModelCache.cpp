@@ -0,0 +1,689 @@
+#include "ModelCache.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ModelFile.hpp"
+#include "Sha256.hpp"
+
+namespace fs = std::filesystem;
+
+namespace KataGoCoreML
+{
+    // File layout:
+    //   header      CACHE_HEADER_SIZE bytes, see CacheHeader
+    //   contents    every field of the ModelDesc in declaration order, weight arrays as
+    //               (offset, count) pairs into the file
+    //   weights     float32 arrays, each starting at a multiple of CACHE_ALIGNMENT
+    // Integers and floats are little-endian, the byte order of every platform CoreML runs on.
+    static const char CACHE_MAGIC[8] = {'K', 'G', 'C', 'M', 'L', 'D', 'S', 'C'};
+    static constexpr std::uint32_t CACHE_FORMAT_VERSION = 2;
+    static constexpr std::uint64_t CACHE_ALIGNMENT = 64;
+    static constexpr std::size_t CACHE_HEADER_SIZE = 128;
+    static constexpr std::size_t CACHE_KEY_SIZE = 64;
+
+    struct CacheHeader
+    {
+        std::uint32_t formatVersion = CACHE_FORMAT_VERSION;
+        std::uint64_t contentsOffset = 0;
+        std::uint64_t contentsSize = 0;
+        std::uint64_t weightsOffset = 0;
+        std::uint64_t weightsSize = 0;
+        std::string sourceKey;
+    };
+
+    static std::uint64_t alignUp(std::uint64_t offset)
+    {
+        return (offset + CACHE_ALIGNMENT - 1) / CACHE_ALIGNMENT * CACHE_ALIGNMENT;
+    }
+
+    static bool hostIsLittleEndian()
+    {
+        const std::uint32_t one = 1;
+        unsigned char first;
+        std::memcpy(&first, &one, 1);
+        return first == 1;
+    }
+
+    static void appendBytes(std::string &out, std::uint64_t value, int numBytes)
+    {
+        for (int i = 0; i < numBytes; ++i)
+        {
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+    }
+
+    static std::uint64_t readBytes(const unsigned char *in, int numBytes)
+    {
+        std::uint64_t value = 0;
+        for (int i = 0; i < numBytes; ++i)
+        {
+            value |= static_cast<std::uint64_t>(in[i]) << (8 * i);
+        }
+        return value;
+    }
+
+    // Serializes the contents section and lays out the weight arrays after it
+    class CacheWriter
+    {
+    public:
+        static constexpr bool reading = false;
+
+        std::string contents;
+        std::vector<const WeightArray *> arrays;
+        std::vector<std::uint64_t> arrayOffsets;
+        std::uint64_t weightsSize = 0;
+
+        void io(const int &value)
+        {
+            appendBytes(contents, static_cast<std::uint32_t>(value), 4);
+        }
+
+        void io(const std::uint32_t &value)
+        {
+            appendBytes(contents, value, 4);
+        }
+
+        void io(const bool &value)
+        {
+            contents.push_back(value ? 1 : 0);
+        }
+
+        void io(const float &value)
+        {
+            std::uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            appendBytes(contents, bits, 4);
+        }
+
+        void io(const double &value)
+        {
+            std::uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            appendBytes(contents, bits, 8);
+        }
+
+        void io(const std::string &value)
+        {
+            io(static_cast<std::uint32_t>(value.size()));
+            contents += value;
+        }
+
+        // Offsets are relative to the weights section until its position is known
+        void io(const WeightArray &value)
+        {
+            const std::uint64_t offset = value.empty() ? 0 : alignUp(weightsSize);
+            if (!value.empty())
+            {
+                arrays.push_back(&value);
+                arrayOffsets.push_back(offset);
+                weightsSize = offset + value.size() * sizeof(float);
+            }
+            arrayFields.push_back(contents.size());
+            appendBytes(contents, offset, 8);
+            appendBytes(contents, value.size(), 8);
+        }
+
+        // Makes every array offset absolute once the weights section is placed
+        void relocate(std::uint64_t weightsOffset)
+        {
+            for (std::size_t field : arrayFields)
+            {
+                const auto *bytes = reinterpret_cast<const unsigned char *>(contents.data() + field);
+                if (readBytes(bytes + 8, 8) == 0)
+                    continue;
+                std::string offset;
+                appendBytes(offset, readBytes(bytes, 8) + weightsOffset, 8);
+                contents.replace(field, 8, offset);
+            }
+        }
+
+    private:
+        std::vector<std::size_t> arrayFields;
+    };
+
+    // Reads the contents section of a mapped cache; weight arrays become views of the mapping
+    class CacheReader
+    {
+    public:
+        static constexpr bool reading = true;
+
+        CacheReader(const unsigned char *file, std::uint64_t fileSize, std::uint64_t begin, std::uint64_t end,
+                    std::shared_ptr<const void> mapping)
+            : file(file), fileSize(fileSize), position(begin), end(end), mapping(std::move(mapping)) {}
+
+        void io(int &value)
+        {
+            value = static_cast<int>(static_cast<std::uint32_t>(readBytes(take(4), 4)));
+        }
+
+        void io(std::uint32_t &value)
+        {
+            value = static_cast<std::uint32_t>(readBytes(take(4), 4));
+        }
+
+        void io(bool &value)
+        {
+            value = *take(1) != 0;
+        }
+
+        void io(float &value)
+        {
+            const std::uint32_t bits = static_cast<std::uint32_t>(readBytes(take(4), 4));
+            std::memcpy(&value, &bits, sizeof(value));
+        }
+
+        void io(double &value)
+        {
+            const std::uint64_t bits = readBytes(take(8), 8);
+            std::memcpy(&value, &bits, sizeof(value));
+        }
+
+        void io(std::string &value)
+        {
+            std::uint32_t size;
+            io(size);
+            const unsigned char *bytes = take(size);
+            value.assign(reinterpret_cast<const char *>(bytes), size);
+        }
+
+        void io(WeightArray &value)
+        {
+            const std::uint64_t offset = readBytes(take(8), 8);
+            const std::uint64_t count = readBytes(take(8), 8);
+            if (count == 0)
+            {
+                value = WeightArray();
+                return;
+            }
+            if (offset % CACHE_ALIGNMENT != 0 || offset > fileSize || count > (fileSize - offset) / sizeof(float))
+            {
+                throw std::runtime_error("Corrupt model cache: weight array out of bounds");
+            }
+            value = WeightArray::view(reinterpret_cast<const float *>(file + offset), count, mapping);
+        }
+
+    private:
+        const unsigned char *take(std::uint64_t size)
+        {
+            if (size > end - position)
+            {
+                throw std::runtime_error("Corrupt model cache: truncated contents");
+            }
+            const unsigned char *bytes = file + position;
+            position += size;
+            return bytes;
+        }
+
+        const unsigned char *file;
+        std::uint64_t fileSize;
+        std::uint64_t position;
+        std::uint64_t end;
+        std::shared_ptr<const void> mapping;
+    };
+
+    // The same functions write and read: Desc is const for CacheWriter and mutable for CacheReader
+
+    template <typename Archive, typename Desc>
+    static void visitConv(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.convYSize);
+        ar.io(desc.convXSize);
+        ar.io(desc.inChannels);
+        ar.io(desc.outChannels);
+        ar.io(desc.dilationY);
+        ar.io(desc.dilationX);
+        ar.io(desc.weights);
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitBatchNorm(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.numChannels);
+        ar.io(desc.epsilon);
+        ar.io(desc.hasScale);
+        ar.io(desc.hasBias);
+        ar.io(desc.mean);
+        ar.io(desc.variance);
+        ar.io(desc.scale);
+        ar.io(desc.bias);
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitActivation(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.activation);
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitMatMul(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.inChannels);
+        ar.io(desc.outChannels);
+        ar.io(desc.weights);
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitMatBias(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.numChannels);
+        ar.io(desc.weights);
+    }
+
+    template <typename Archive, typename Blocks>
+    static void visitBlocks(Archive &ar, Blocks &blocks);
+
+    template <typename Archive>
+    static void visitResidualBlock(Archive &ar, ResidualBlockDesc &desc)
+    {
+        ar.io(desc.name);
+        visitBatchNorm(ar, desc.preBN);
+        visitActivation(ar, desc.preActivation);
+        visitConv(ar, desc.regularConv);
+        visitBatchNorm(ar, desc.midBN);
+        visitActivation(ar, desc.midActivation);
+        visitConv(ar, desc.finalConv);
+    }
+
+    template <typename Archive>
+    static void visitGlobalPoolingBlock(Archive &ar, GlobalPoolingResidualBlockDesc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.modelVersion);
+        visitBatchNorm(ar, desc.preBN);
+        visitActivation(ar, desc.preActivation);
+        visitConv(ar, desc.regularConv);
+        visitConv(ar, desc.gpoolConv);
+        visitBatchNorm(ar, desc.gpoolBN);
+        visitActivation(ar, desc.gpoolActivation);
+        visitMatMul(ar, desc.gpoolToBiasMul);
+        visitBatchNorm(ar, desc.midBN);
+        visitActivation(ar, desc.midActivation);
+        visitConv(ar, desc.finalConv);
+    }
+
+    template <typename Archive>
+    static void visitNestedBottleneckBlock(Archive &ar, NestedBottleneckResidualBlockDesc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.numBlocks);
+        visitBatchNorm(ar, desc.preBN);
+        visitActivation(ar, desc.preActivation);
+        visitConv(ar, desc.preConv);
+        visitBlocks(ar, desc.blocks);
+        visitBatchNorm(ar, desc.postBN);
+        visitActivation(ar, desc.postActivation);
+        visitConv(ar, desc.postConv);
+    }
+
+    template <typename T>
+    static unique_ptr_void makeBlock(T *block)
+    {
+        return unique_ptr_void(block, [](const void *p)
+                               { delete static_cast<const T *>(p); });
+    }
+
+    // Block descs are only reached through void pointers, so they are visited as mutable
+    // objects; CacheWriter never modifies them
+    template <typename Archive>
+    static void visitBlock(Archive &ar, int kind, void *block)
+    {
+        if (kind == ORDINARY_BLOCK_KIND)
+            visitResidualBlock(ar, *static_cast<ResidualBlockDesc *>(block));
+        else if (kind == GLOBAL_POOLING_BLOCK_KIND)
+            visitGlobalPoolingBlock(ar, *static_cast<GlobalPoolingResidualBlockDesc *>(block));
+        else if (kind == NESTED_BOTTLENECK_BLOCK_KIND)
+            visitNestedBottleneckBlock(ar, *static_cast<NestedBottleneckResidualBlockDesc *>(block));
+        else
+            throw std::runtime_error("Unknown block kind in model cache: " + std::to_string(kind));
+    }
+
+    template <typename Archive, typename Blocks>
+    static void visitBlocks(Archive &ar, Blocks &blocks)
+    {
+        std::uint32_t numBlocks = static_cast<std::uint32_t>(blocks.size());
+        ar.io(numBlocks);
+        if constexpr (Archive::reading)
+        {
+            blocks.clear();
+            for (std::uint32_t i = 0; i < numBlocks; ++i)
+            {
+                int kind;
+                ar.io(kind);
+                unique_ptr_void block(nullptr, [](const void *) {});
+                if (kind == ORDINARY_BLOCK_KIND)
+                    block = makeBlock(new ResidualBlockDesc());
+                else if (kind == GLOBAL_POOLING_BLOCK_KIND)
+                    block = makeBlock(new GlobalPoolingResidualBlockDesc());
+                else if (kind == NESTED_BOTTLENECK_BLOCK_KIND)
+                    block = makeBlock(new NestedBottleneckResidualBlockDesc());
+                visitBlock(ar, kind, block.get());
+                blocks.emplace_back(kind, std::move(block));
+            }
+        }
+        else
+        {
+            for (const auto &block : blocks)
+            {
+                ar.io(block.first);
+                visitBlock(ar, block.first, block.second.get());
+            }
+        }
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitMetadataEncoder(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.metaEncoderVersion);
+        ar.io(desc.numInputMetaChannels);
+        visitMatMul(ar, desc.mul1);
+        visitMatBias(ar, desc.bias1);
+        visitActivation(ar, desc.act1);
+        visitMatMul(ar, desc.mul2);
+        visitMatBias(ar, desc.bias2);
+        visitActivation(ar, desc.act2);
+        visitMatMul(ar, desc.mul3);
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitTrunk(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.modelVersion);
+        ar.io(desc.numBlocks);
+        ar.io(desc.trunkNumChannels);
+        ar.io(desc.midNumChannels);
+        ar.io(desc.regularNumChannels);
+        ar.io(desc.gpoolNumChannels);
+        ar.io(desc.metaEncoderVersion);
+        visitConv(ar, desc.initialConv);
+        visitMatMul(ar, desc.initialMatMul);
+        visitMetadataEncoder(ar, desc.sgfMetadataEncoder);
+        visitBlocks(ar, desc.blocks);
+        visitBatchNorm(ar, desc.trunkTipBN);
+        visitActivation(ar, desc.trunkTipActivation);
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitPolicyHead(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.modelVersion);
+        ar.io(desc.policyOutChannels);
+        visitConv(ar, desc.p1Conv);
+        visitConv(ar, desc.g1Conv);
+        visitBatchNorm(ar, desc.g1BN);
+        visitActivation(ar, desc.g1Activation);
+        visitMatMul(ar, desc.gpoolToBiasMul);
+        visitBatchNorm(ar, desc.p1BN);
+        visitActivation(ar, desc.p1Activation);
+        visitConv(ar, desc.p2Conv);
+        visitMatMul(ar, desc.gpoolToPassMul);
+        visitMatBias(ar, desc.gpoolToPassBias);
+        visitActivation(ar, desc.passActivation);
+        visitMatMul(ar, desc.gpoolToPassMul2);
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitValueHead(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.modelVersion);
+        visitConv(ar, desc.v1Conv);
+        visitBatchNorm(ar, desc.v1BN);
+        visitActivation(ar, desc.v1Activation);
+        visitMatMul(ar, desc.v2Mul);
+        visitMatBias(ar, desc.v2Bias);
+        visitActivation(ar, desc.v2Activation);
+        visitMatMul(ar, desc.v3Mul);
+        visitMatBias(ar, desc.v3Bias);
+        visitMatMul(ar, desc.sv3Mul);
+        visitMatBias(ar, desc.sv3Bias);
+        visitConv(ar, desc.vOwnershipConv);
+    }
+
+    template <typename Archive, typename Desc>
+    static void visitModel(Archive &ar, Desc &desc)
+    {
+        ar.io(desc.name);
+        ar.io(desc.sha256);
+        ar.io(desc.modelVersion);
+        ar.io(desc.numInputChannels);
+        ar.io(desc.numInputGlobalChannels);
+        ar.io(desc.numInputMetaChannels);
+        ar.io(desc.numPolicyChannels);
+        ar.io(desc.numValueChannels);
+        ar.io(desc.numScoreValueChannels);
+        ar.io(desc.numOwnershipChannels);
+        ar.io(desc.metaEncoderVersion);
+        ar.io(desc.postProcessParams.tdScoreMultiplier);
+        ar.io(desc.postProcessParams.scoreMeanMultiplier);
+        ar.io(desc.postProcessParams.scoreStdevMultiplier);
+        ar.io(desc.postProcessParams.leadMultiplier);
+        ar.io(desc.postProcessParams.varianceTimeMultiplier);
+        ar.io(desc.postProcessParams.shorttermValueErrorMultiplier);
+        ar.io(desc.postProcessParams.shorttermScoreErrorMultiplier);
+        visitTrunk(ar, desc.trunk);
+        visitPolicyHead(ar, desc.policyHead);
+        visitValueHead(ar, desc.valueHead);
+    }
+
+    static std::string encodeHeader(const CacheHeader &header)
+    {
+        std::string bytes(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        appendBytes(bytes, header.formatVersion, 4);
+        appendBytes(bytes, CACHE_HEADER_SIZE, 4);
+        appendBytes(bytes, header.contentsOffset, 8);
+        appendBytes(bytes, header.contentsSize, 8);
+        appendBytes(bytes, header.weightsOffset, 8);
+        appendBytes(bytes, header.weightsSize, 8);
+        std::string key = header.sourceKey;
+        key.resize(CACHE_KEY_SIZE, '\0');
+        bytes += key;
+        bytes.resize(CACHE_HEADER_SIZE, '\0');
+        return bytes;
+    }
+
+    static CacheHeader decodeHeader(const unsigned char *bytes, std::uint64_t fileSize)
+    {
+        if (fileSize < CACHE_HEADER_SIZE || std::memcmp(bytes, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0)
+        {
+            throw std::runtime_error("Not a model cache");
+        }
+        CacheHeader header;
+        header.formatVersion = static_cast<std::uint32_t>(readBytes(bytes + 8, 4));
+        if (header.formatVersion != CACHE_FORMAT_VERSION || readBytes(bytes + 12, 4) != CACHE_HEADER_SIZE)
+        {
+            throw std::runtime_error("Unsupported model cache version " + std::to_string(header.formatVersion));
+        }
+        header.contentsOffset = readBytes(bytes + 16, 8);
+        header.contentsSize = readBytes(bytes + 24, 8);
+        header.weightsOffset = readBytes(bytes + 32, 8);
+        header.weightsSize = readBytes(bytes + 40, 8);
+        const char *key = reinterpret_cast<const char *>(bytes + 48);
+        header.sourceKey.assign(key, strnlen(key, CACHE_KEY_SIZE));
+        if (header.contentsOffset > fileSize || header.contentsSize > fileSize - header.contentsOffset ||
+            header.weightsOffset > fileSize || header.weightsSize > fileSize - header.weightsOffset)
+        {
+            throw std::runtime_error("Corrupt model cache: sections out of bounds");
+        }
+        return header;
+    }
+
+    void writeModelCache(const ModelDesc &modelDesc, const std::string &path, const std::string &sourceKey)
+    {
+        if (!hostIsLittleEndian())
+        {
+            throw std::runtime_error("Model caches require a little-endian host");
+        }
+        if (sourceKey.size() > CACHE_KEY_SIZE)
+        {
+            throw std::runtime_error("Model cache key is longer than " + std::to_string(CACHE_KEY_SIZE) + " bytes");
+        }
+
+        CacheWriter writer;
+        visitModel(writer, modelDesc);
+
+        CacheHeader header;
+        header.contentsOffset = CACHE_HEADER_SIZE;
+        header.contentsSize = writer.contents.size();
+        header.weightsOffset = alignUp(header.contentsOffset + header.contentsSize);
+        header.weightsSize = writer.weightsSize;
+        header.sourceKey = sourceKey;
+        writer.relocate(header.weightsOffset);
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        const std::string headerBytes = encodeHeader(header);
+        out.write(headerBytes.data(), headerBytes.size());
+        out.write(writer.contents.data(), writer.contents.size());
+
+        // Arrays are written in layout order, zero-padded to their aligned offsets
+        const std::string padding(CACHE_ALIGNMENT, '\0');
+        std::uint64_t position = header.weightsOffset;
+        out.write(padding.data(), position - (header.contentsOffset + header.contentsSize));
+        for (std::size_t i = 0; i < writer.arrays.size(); ++i)
+        {
+            const std::uint64_t offset = header.weightsOffset + writer.arrayOffsets[i];
+            out.write(padding.data(), offset - position);
+            const WeightArray &array = *writer.arrays[i];
+            out.write(reinterpret_cast<const char *>(array.data()), array.size() * sizeof(float));
+            position = offset + array.size() * sizeof(float);
+        }
+        out.close();
+        if (!out)
+        {
+            throw std::runtime_error("Failed to write model cache: " + path);
+        }
+    }
+
+    ModelDesc mapModelCache(const std::string &path, const std::string &sourceKey)
+    {
+        if (!hostIsLittleEndian())
+        {
+            throw std::runtime_error("Model caches require a little-endian host");
+        }
+
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Failed to open model cache: " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            close(fd);
+            throw std::runtime_error("Failed to read model cache: " + path);
+        }
+        const std::uint64_t fileSize = static_cast<std::uint64_t>(st.st_size);
+        void *address = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+        if (address == MAP_FAILED)
+        {
+            throw std::runtime_error("Failed to map model cache: " + path);
+        }
+        std::shared_ptr<const void> mapping(address, [fileSize](const void *p)
+                                            { munmap(const_cast<void *>(p), fileSize); });
+
+        const auto *file = static_cast<const unsigned char *>(address);
+        const CacheHeader header = decodeHeader(file, fileSize);
+        if (!sourceKey.empty() && header.sourceKey != sourceKey)
+        {
+            throw std::runtime_error("Model cache is stale: " + path);
+        }
+
+        ModelDesc desc;
+        CacheReader reader(file, fileSize, header.contentsOffset, header.contentsOffset + header.contentsSize, mapping);
+        visitModel(reader, desc);
+        return desc;
+    }
+
+    static std::string modelSourceKey(const fs::path &modelPath)
+    {
+        const fs::path absolutePath = fs::absolute(modelPath);
+        const std::string size = std::to_string(fs::file_size(absolutePath));
+        const std::string modified = std::to_string(fs::last_write_time(absolutePath).time_since_epoch().count());
+        Sha256 hash;
+        hash.update(absolutePath.string());
+        hash.update(std::string(1, '\0') + size + '\0' + modified + '\0' + std::to_string(CACHE_FORMAT_VERSION));
+        return hash.hexDigest();
+    }
+
+    // Hashes the model file as stored, without parsing it
+    static std::string fileSha256(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            throw std::runtime_error("Failed to open model file: " + path);
+        }
+        Sha256 hash;
+        std::vector<char> chunk(1 << 20);
+        while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0)
+        {
+            hash.update(chunk.data(), static_cast<std::size_t>(in.gcount()));
+        }
+        return hash.hexDigest();
+    }
+
+    ModelDesc loadModelFileCached(const std::string &modelPath, const std::string &cacheDir,
+                                  const std::string &expectedSha256)
+    {
+        const std::string key = modelSourceKey(modelPath);
+        const fs::path cachePath = fs::path(cacheDir) / (fs::path(modelPath).filename().string() + "." +
+                                                         key.substr(0, 16) + ".kgcache");
+        if (fs::exists(cachePath))
+        {
+            try
+            {
+                ModelDesc cached = mapModelCache(cachePath.string(), key);
+                // The key cannot see a rewrite that keeps the size and modification time,
+                // so an expected digest is checked against the file itself
+                if (expectedSha256.empty() ||
+                    (sha256Matches(cached.sha256, expectedSha256) &&
+                     sha256Matches(fileSha256(modelPath), expectedSha256)))
+                {
+                    return cached;
+                }
+            }
+            catch (const std::runtime_error &)
+            {
+                // Rebuild a stale or damaged cache
+            }
+        }
+
+        ModelDesc desc = loadModelFile(modelPath, expectedSha256);
+
+        // Concurrent loaders each write their own file; the rename publishes a complete cache.
+        // The cache only saves time, so failing to write it does not fail the load.
+        const std::string tempPath = cachePath.string() + ".tmp" + std::to_string(getpid()) + "-" +
+                                     std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        try
+        {
+            fs::create_directories(cacheDir);
+            writeModelCache(desc, tempPath, key);
+            fs::rename(tempPath, cachePath);
+        }
+        catch (const std::exception &)
+        {
+            std::error_code ignored;
+            fs::remove(tempPath, ignored);
+        }
+        return desc;
+    }
+
+} // namespace KataGoCoreML
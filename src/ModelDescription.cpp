@@ -65,4 +65,80 @@ namespace KataGoCoreML
           metaEncoderVersion(0),
           postProcessParams() {}
 
+    static void visitBlocks(const std::vector<std::pair<int, unique_ptr_void>> &blocks,
+                            const std::function<void(const ConvLayerDesc &)> &visitConv,
+                            const std::function<void(const MatMulLayerDesc &)> &visitMatMul)
+    {
+        for (const auto &block : blocks)
+        {
+            if (block.first == ORDINARY_BLOCK_KIND)
+            {
+                const auto *desc = static_cast<const ResidualBlockDesc *>(block.second.get());
+                visitConv(desc->regularConv);
+                visitConv(desc->finalConv);
+            }
+            else if (block.first == GLOBAL_POOLING_BLOCK_KIND)
+            {
+                const auto *desc = static_cast<const GlobalPoolingResidualBlockDesc *>(block.second.get());
+                visitConv(desc->regularConv);
+                visitConv(desc->gpoolConv);
+                visitMatMul(desc->gpoolToBiasMul);
+                visitConv(desc->finalConv);
+            }
+            else if (block.first == NESTED_BOTTLENECK_BLOCK_KIND)
+            {
+                const auto *desc = static_cast<const NestedBottleneckResidualBlockDesc *>(block.second.get());
+                visitConv(desc->preConv);
+                visitBlocks(desc->blocks, visitConv, visitMatMul);
+                visitConv(desc->postConv);
+            }
+        }
+    }
+
+    static void visitWeightLayers(const ModelDesc &modelDesc,
+                                  const std::function<void(const ConvLayerDesc &)> &visitConv,
+                                  const std::function<void(const MatMulLayerDesc &)> &visitMatMul)
+    {
+        const TrunkDesc &trunk = modelDesc.trunk;
+        visitConv(trunk.initialConv);
+        visitMatMul(trunk.initialMatMul);
+        if (trunk.metaEncoderVersion > 0)
+        {
+            visitMatMul(trunk.sgfMetadataEncoder.mul1);
+            visitMatMul(trunk.sgfMetadataEncoder.mul2);
+            visitMatMul(trunk.sgfMetadataEncoder.mul3);
+        }
+        visitBlocks(trunk.blocks, visitConv, visitMatMul);
+
+        const PolicyHeadDesc &policy = modelDesc.policyHead;
+        visitConv(policy.p1Conv);
+        visitConv(policy.g1Conv);
+        visitMatMul(policy.gpoolToBiasMul);
+        visitConv(policy.p2Conv);
+        visitMatMul(policy.gpoolToPassMul);
+        if (policy.modelVersion >= 15)
+        {
+            visitMatMul(policy.gpoolToPassMul2);
+        }
+
+        const ValueHeadDesc &value = modelDesc.valueHead;
+        visitConv(value.v1Conv);
+        visitMatMul(value.v2Mul);
+        visitMatMul(value.v3Mul);
+        visitMatMul(value.sv3Mul);
+        visitConv(value.vOwnershipConv);
+    }
+
+    void forEachConvLayer(const ModelDesc &modelDesc,
+                          const std::function<void(const ConvLayerDesc &)> &visit)
+    {
+        visitWeightLayers(modelDesc, visit, [](const MatMulLayerDesc &) {});
+    }
+
+    void forEachMatMulLayer(const ModelDesc &modelDesc,
+                            const std::function<void(const MatMulLayerDesc &)> &visit)
+    {
+        visitWeightLayers(modelDesc, [](const ConvLayerDesc &) {}, visit);
+    }
+
 } // namespace KataGoCoreML
@@ -0,0 +1,455 @@
+#include "ModelFile.hpp"
+
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <zlib.h>
+#include "Sha256.hpp"
+
+namespace KataGoCoreML
+{
+    static void checkStream(std::istream &in, const std::string &name, const std::string &what)
+    {
+        if (in.fail())
+        {
+            throw std::runtime_error(name + ": model failed to parse " + what);
+        }
+    }
+
+    static std::vector<float> readFloats(std::istream &in, std::size_t numFloats, bool binaryFloats,
+                                         const std::string &name)
+    {
+        std::vector<float> buf(numFloats);
+        if (!binaryFloats)
+        {
+            for (std::size_t i = 0; i < numFloats; ++i)
+            {
+                in >> buf[i];
+            }
+            checkStream(in, name, "float weights");
+            return buf;
+        }
+
+        // Binary floats are preceded by "@BIN@" and stored little-endian
+        char c = 0;
+        while (in.get(c) && c != '@')
+        {
+            if (!std::isspace(static_cast<unsigned char>(c)))
+            {
+                throw std::runtime_error(name + ": unexpected character before binary weights");
+            }
+        }
+        const std::string marker = "BIN@";
+        for (char expected : marker)
+        {
+            if (!in.get(c) || c != expected)
+            {
+                throw std::runtime_error(name + ": missing @BIN@ marker before binary weights");
+            }
+        }
+        in.read(reinterpret_cast<char *>(buf.data()), numFloats * sizeof(float));
+        checkStream(in, name, "binary weights");
+        return buf;
+    }
+
+    static void parseActivation(std::istream &in, int modelVersion, ActivationLayerDesc &desc)
+    {
+        in >> desc.name;
+        if (modelVersion >= 11)
+        {
+            std::string kind;
+            in >> kind;
+            checkStream(in, desc.name, "activation kind");
+            if (kind == "ACTIVATION_IDENTITY")
+                desc.activation = ACTIVATION_IDENTITY;
+            else if (kind == "ACTIVATION_RELU")
+                desc.activation = ACTIVATION_RELU;
+            else if (kind == "ACTIVATION_MISH")
+                desc.activation = ACTIVATION_MISH;
+            else
+                throw std::runtime_error(desc.name + ": unknown activation " + kind);
+        }
+        else
+        {
+            desc.activation = ACTIVATION_RELU;
+        }
+    }
+
+    static void parseConv(std::istream &in, bool binaryFloats, ConvLayerDesc &desc)
+    {
+        in >> desc.name;
+        in >> desc.convYSize >> desc.convXSize >> desc.inChannels >> desc.outChannels;
+        in >> desc.dilationY >> desc.dilationX;
+        checkStream(in, desc.name, "conv parameters");
+
+        const int ySize = desc.convYSize;
+        const int xSize = desc.convXSize;
+        const int inC = desc.inChannels;
+        const int outC = desc.outChannels;
+        const std::vector<float> floats =
+            readFloats(in, static_cast<std::size_t>(ySize) * xSize * inC * outC, binaryFloats, desc.name);
+
+        // Model file order is y, x, inC, outC; we store outC, inC, y, x
+        std::vector<float> weights(floats.size());
+        std::size_t idx = 0;
+        for (int y = 0; y < ySize; ++y)
+            for (int x = 0; x < xSize; ++x)
+                for (int ic = 0; ic < inC; ++ic)
+                    for (int oc = 0; oc < outC; ++oc)
+                        weights[((static_cast<std::size_t>(oc) * inC + ic) * ySize + y) * xSize + x] = floats[idx++];
+        desc.weights = std::move(weights);
+    }
+
+    static void parseBatchNorm(std::istream &in, bool binaryFloats, BatchNormLayerDesc &desc)
+    {
+        in >> desc.name >> desc.numChannels >> desc.epsilon >> desc.hasScale >> desc.hasBias;
+        checkStream(in, desc.name, "batch norm parameters");
+
+        const std::size_t n = desc.numChannels;
+        desc.mean = readFloats(in, n, binaryFloats, desc.name);
+        desc.variance = readFloats(in, n, binaryFloats, desc.name);
+        if (desc.hasScale)
+            desc.scale = readFloats(in, n, binaryFloats, desc.name);
+        else
+            desc.scale = std::vector<float>(n, 1.0f);
+        if (desc.hasBias)
+            desc.bias = readFloats(in, n, binaryFloats, desc.name);
+        else
+            desc.bias = std::vector<float>(n, 0.0f);
+    }
+
+    static void parseMatMul(std::istream &in, bool binaryFloats, MatMulLayerDesc &desc)
+    {
+        in >> desc.name >> desc.inChannels >> desc.outChannels;
+        checkStream(in, desc.name, "matmul parameters");
+        desc.weights = readFloats(in, static_cast<std::size_t>(desc.inChannels) * desc.outChannels, binaryFloats, desc.name);
+    }
+
+    static void parseMatBias(std::istream &in, bool binaryFloats, MatBiasLayerDesc &desc)
+    {
+        in >> desc.name >> desc.numChannels;
+        checkStream(in, desc.name, "matbias parameters");
+        desc.weights = readFloats(in, desc.numChannels, binaryFloats, desc.name);
+    }
+
+    template <typename T>
+    static unique_ptr_void makeBlock(T *block)
+    {
+        return unique_ptr_void(block, [](const void *p)
+                               { delete static_cast<const T *>(p); });
+    }
+
+    static void parseBlockStack(std::istream &in, int modelVersion, bool binaryFloats, int numBlocks,
+                                std::vector<std::pair<int, unique_ptr_void>> &blocks);
+
+    static void parseResidualBlock(std::istream &in, int modelVersion, bool binaryFloats, ResidualBlockDesc &desc)
+    {
+        in >> desc.name;
+        parseBatchNorm(in, binaryFloats, desc.preBN);
+        parseActivation(in, modelVersion, desc.preActivation);
+        parseConv(in, binaryFloats, desc.regularConv);
+        parseBatchNorm(in, binaryFloats, desc.midBN);
+        parseActivation(in, modelVersion, desc.midActivation);
+        parseConv(in, binaryFloats, desc.finalConv);
+    }
+
+    static void parseGlobalPoolingBlock(std::istream &in, int modelVersion, bool binaryFloats,
+                                        GlobalPoolingResidualBlockDesc &desc)
+    {
+        in >> desc.name;
+        desc.modelVersion = modelVersion;
+        parseBatchNorm(in, binaryFloats, desc.preBN);
+        parseActivation(in, modelVersion, desc.preActivation);
+        parseConv(in, binaryFloats, desc.regularConv);
+        parseConv(in, binaryFloats, desc.gpoolConv);
+        parseBatchNorm(in, binaryFloats, desc.gpoolBN);
+        parseActivation(in, modelVersion, desc.gpoolActivation);
+        parseMatMul(in, binaryFloats, desc.gpoolToBiasMul);
+        parseBatchNorm(in, binaryFloats, desc.midBN);
+        parseActivation(in, modelVersion, desc.midActivation);
+        parseConv(in, binaryFloats, desc.finalConv);
+    }
+
+    static void parseNestedBottleneckBlock(std::istream &in, int modelVersion, bool binaryFloats,
+                                           NestedBottleneckResidualBlockDesc &desc)
+    {
+        in >> desc.name >> desc.numBlocks;
+        checkStream(in, desc.name, "nested bottleneck block count");
+        parseBatchNorm(in, binaryFloats, desc.preBN);
+        parseActivation(in, modelVersion, desc.preActivation);
+        parseConv(in, binaryFloats, desc.preConv);
+        parseBlockStack(in, modelVersion, binaryFloats, desc.numBlocks, desc.blocks);
+        parseBatchNorm(in, binaryFloats, desc.postBN);
+        parseActivation(in, modelVersion, desc.postActivation);
+        parseConv(in, binaryFloats, desc.postConv);
+    }
+
+    static void parseBlockStack(std::istream &in, int modelVersion, bool binaryFloats, int numBlocks,
+                                std::vector<std::pair<int, unique_ptr_void>> &blocks)
+    {
+        for (int i = 0; i < numBlocks; ++i)
+        {
+            std::string kind;
+            in >> kind;
+            checkStream(in, "block " + std::to_string(i), "block kind");
+            if (kind == "ordinary_block")
+            {
+                auto *block = new ResidualBlockDesc();
+                blocks.emplace_back(ORDINARY_BLOCK_KIND, makeBlock(block));
+                parseResidualBlock(in, modelVersion, binaryFloats, *block);
+            }
+            else if (kind == "gpool_block")
+            {
+                auto *block = new GlobalPoolingResidualBlockDesc();
+                blocks.emplace_back(GLOBAL_POOLING_BLOCK_KIND, makeBlock(block));
+                parseGlobalPoolingBlock(in, modelVersion, binaryFloats, *block);
+            }
+            else if (kind == "nested_bottleneck_block")
+            {
+                auto *block = new NestedBottleneckResidualBlockDesc();
+                blocks.emplace_back(NESTED_BOTTLENECK_BLOCK_KIND, makeBlock(block));
+                parseNestedBottleneckBlock(in, modelVersion, binaryFloats, *block);
+            }
+            else
+            {
+                throw std::runtime_error("Unsupported residual block kind: " + kind);
+            }
+        }
+    }
+
+    static void parseMetadataEncoder(std::istream &in, int modelVersion, bool binaryFloats, SGFMetadataEncoderDesc &desc)
+    {
+        in >> desc.name >> desc.metaEncoderVersion >> desc.numInputMetaChannels;
+        checkStream(in, desc.name, "metadata encoder parameters");
+        parseMatMul(in, binaryFloats, desc.mul1);
+        parseMatBias(in, binaryFloats, desc.bias1);
+        parseActivation(in, modelVersion, desc.act1);
+        parseMatMul(in, binaryFloats, desc.mul2);
+        parseMatBias(in, binaryFloats, desc.bias2);
+        parseActivation(in, modelVersion, desc.act2);
+        parseMatMul(in, binaryFloats, desc.mul3);
+    }
+
+    static void parseTrunk(std::istream &in, int modelVersion, bool binaryFloats, int metaEncoderVersion, TrunkDesc &desc)
+    {
+        int dilatedNumChannels = 0; // Unused by current models
+        in >> desc.name >> desc.numBlocks >> desc.trunkNumChannels >> desc.midNumChannels;
+        in >> desc.regularNumChannels >> dilatedNumChannels >> desc.gpoolNumChannels;
+        checkStream(in, desc.name, "trunk parameters");
+        desc.modelVersion = modelVersion;
+        desc.metaEncoderVersion = metaEncoderVersion;
+
+        parseConv(in, binaryFloats, desc.initialConv);
+        parseMatMul(in, binaryFloats, desc.initialMatMul);
+        if (metaEncoderVersion > 0)
+        {
+            parseMetadataEncoder(in, modelVersion, binaryFloats, desc.sgfMetadataEncoder);
+        }
+        parseBlockStack(in, modelVersion, binaryFloats, desc.numBlocks, desc.blocks);
+        parseBatchNorm(in, binaryFloats, desc.trunkTipBN);
+        parseActivation(in, modelVersion, desc.trunkTipActivation);
+    }
+
+    static void parsePolicyHead(std::istream &in, int modelVersion, bool binaryFloats, PolicyHeadDesc &desc)
+    {
+        in >> desc.name;
+        desc.modelVersion = modelVersion;
+        parseConv(in, binaryFloats, desc.p1Conv);
+        parseConv(in, binaryFloats, desc.g1Conv);
+        parseBatchNorm(in, binaryFloats, desc.g1BN);
+        parseActivation(in, modelVersion, desc.g1Activation);
+        parseMatMul(in, binaryFloats, desc.gpoolToBiasMul);
+        parseBatchNorm(in, binaryFloats, desc.p1BN);
+        parseActivation(in, modelVersion, desc.p1Activation);
+        parseConv(in, binaryFloats, desc.p2Conv);
+        parseMatMul(in, binaryFloats, desc.gpoolToPassMul);
+        if (modelVersion >= 15)
+        {
+            parseMatBias(in, binaryFloats, desc.gpoolToPassBias);
+            parseActivation(in, modelVersion, desc.passActivation);
+            parseMatMul(in, binaryFloats, desc.gpoolToPassMul2);
+        }
+        desc.policyOutChannels = desc.p2Conv.outChannels;
+    }
+
+    static void parseValueHead(std::istream &in, int modelVersion, bool binaryFloats, ValueHeadDesc &desc)
+    {
+        in >> desc.name;
+        desc.modelVersion = modelVersion;
+        parseConv(in, binaryFloats, desc.v1Conv);
+        parseBatchNorm(in, binaryFloats, desc.v1BN);
+        parseActivation(in, modelVersion, desc.v1Activation);
+        parseMatMul(in, binaryFloats, desc.v2Mul);
+        parseMatBias(in, binaryFloats, desc.v2Bias);
+        parseActivation(in, modelVersion, desc.v2Activation);
+        parseMatMul(in, binaryFloats, desc.v3Mul);
+        parseMatBias(in, binaryFloats, desc.v3Bias);
+        parseMatMul(in, binaryFloats, desc.sv3Mul);
+        parseMatBias(in, binaryFloats, desc.sv3Bias);
+        parseConv(in, binaryFloats, desc.vOwnershipConv);
+    }
+
+    ModelDesc parseModel(std::istream &in, const std::string &sha256, bool binaryFloats)
+    {
+        ModelDesc desc;
+        desc.sha256 = sha256;
+
+        in >> desc.name >> desc.modelVersion;
+        checkStream(in, "model", "name or version");
+        in >> desc.numInputChannels >> desc.numInputGlobalChannels;
+        checkStream(in, desc.name, "input channels");
+
+        if (desc.modelVersion >= 15)
+        {
+            in >> desc.metaEncoderVersion;
+            checkStream(in, desc.name, "metadata encoder version");
+        }
+
+        if (desc.modelVersion >= 13)
+        {
+            ModelPostProcessParams &params = desc.postProcessParams;
+            in >> params.tdScoreMultiplier >> params.scoreMeanMultiplier >> params.scoreStdevMultiplier;
+            in >> params.leadMultiplier >> params.varianceTimeMultiplier;
+            in >> params.shorttermValueErrorMultiplier >> params.shorttermScoreErrorMultiplier;
+            checkStream(in, desc.name, "post process parameters");
+        }
+
+        parseTrunk(in, desc.modelVersion, binaryFloats, desc.metaEncoderVersion, desc.trunk);
+        parsePolicyHead(in, desc.modelVersion, binaryFloats, desc.policyHead);
+        parseValueHead(in, desc.modelVersion, binaryFloats, desc.valueHead);
+
+        desc.numInputMetaChannels = desc.metaEncoderVersion > 0 ? desc.trunk.sgfMetadataEncoder.numInputMetaChannels : 0;
+        desc.numPolicyChannels = desc.policyHead.p2Conv.outChannels;
+        desc.numValueChannels = desc.valueHead.v3Mul.outChannels;
+        desc.numScoreValueChannels = desc.valueHead.sv3Mul.outChannels;
+        desc.numOwnershipChannels = desc.valueHead.vOwnershipConv.outChannels;
+        return desc;
+    }
+
+    static bool endsWith(const std::string &s, const std::string &suffix)
+    {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // Reads a model file, inflating it if it is gzip compressed. The SHA-256 of the file as
+    // stored, which is the digest KataGo gives a model, is computed on each chunk as it is read.
+    static std::string readModelBytes(const std::string &path, std::string &sha256)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open model file: " + path);
+        }
+
+        struct Inflater
+        {
+            z_stream stream{};
+            bool initialized = false;
+            ~Inflater()
+            {
+                if (initialized)
+                {
+                    inflateEnd(&stream);
+                }
+            }
+        } inflater;
+
+        Sha256 hash;
+        std::string contents;
+        std::vector<char> in(1 << 16);
+        std::vector<char> out(1 << 16);
+        bool firstChunk = true;
+        bool compressed = false;
+        bool finished = false;
+        while (file.read(in.data(), in.size()) || file.gcount() > 0)
+        {
+            const std::size_t n = static_cast<std::size_t>(file.gcount());
+            hash.update(in.data(), n);
+            if (firstChunk)
+            {
+                firstChunk = false;
+                compressed = n >= 2 && static_cast<unsigned char>(in[0]) == 0x1f &&
+                             static_cast<unsigned char>(in[1]) == 0x8b;
+                // 16 + MAX_WBITS: a gzip wrapper
+                if (compressed && inflateInit2(&inflater.stream, 16 + MAX_WBITS) != Z_OK)
+                {
+                    throw std::runtime_error("Failed to decompress model file: " + path);
+                }
+                inflater.initialized = compressed;
+            }
+            if (!compressed)
+            {
+                contents.append(in.data(), n);
+                continue;
+            }
+
+            // Bytes after the end of the gzip stream are hashed but ignored, as KataGo does
+            inflater.stream.next_in = reinterpret_cast<Bytef *>(in.data());
+            inflater.stream.avail_in = static_cast<uInt>(n);
+            while (!finished && (inflater.stream.avail_in > 0 || inflater.stream.avail_out == 0))
+            {
+                inflater.stream.next_out = reinterpret_cast<Bytef *>(out.data());
+                inflater.stream.avail_out = static_cast<uInt>(out.size());
+                const int status = inflate(&inflater.stream, Z_NO_FLUSH);
+                if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+                {
+                    throw std::runtime_error("Failed to decompress model file: " + path);
+                }
+                contents.append(out.data(), out.size() - inflater.stream.avail_out);
+                finished = status == Z_STREAM_END;
+                if (status == Z_BUF_ERROR)
+                {
+                    break;
+                }
+            }
+        }
+        if (file.bad() || (compressed && !finished))
+        {
+            throw std::runtime_error("Failed to decompress model file: " + path);
+        }
+        sha256 = hash.hexDigest();
+        return contents;
+    }
+
+    bool sha256Matches(const std::string &sha256, const std::string &expectedSha256)
+    {
+        if (expectedSha256.empty())
+        {
+            return true;
+        }
+        if (expectedSha256.size() != sha256.size())
+        {
+            return false;
+        }
+        for (std::size_t i = 0; i < sha256.size(); ++i)
+        {
+            if (std::tolower(static_cast<unsigned char>(sha256[i])) !=
+                std::tolower(static_cast<unsigned char>(expectedSha256[i])))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    ModelDesc loadModelFile(const std::string &path, const std::string &expectedSha256)
+    {
+        const bool binaryFloats = endsWith(path, ".bin") || endsWith(path, ".bin.gz");
+        if (!binaryFloats && !endsWith(path, ".txt") && !endsWith(path, ".txt.gz"))
+        {
+            throw std::runtime_error("Model file must end in .bin, .bin.gz, .txt or .txt.gz: " + path);
+        }
+
+        // A model that fails the check is not parsed
+        std::string sha256;
+        std::istringstream in(readModelBytes(path, sha256));
+        if (!sha256Matches(sha256, expectedSha256))
+        {
+            throw std::runtime_error("Model file has SHA-256 " + sha256 + ", expected " + expectedSha256 + ": " + path);
+        }
+        return parseModel(in, sha256, binaryFloats);
+    }
+
+} // namespace KataGoCoreML
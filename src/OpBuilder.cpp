@@ -0,0 +1,449 @@
+#include "OpBuilder.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <MILBlob/Fp16.hpp>
+#include <Model.pb.h>
+
+using namespace CoreML::Specification::MILSpec;
+
+namespace KataGoCoreML
+{
+    template <typename T>
+    struct ElementType;
+
+    template <>
+    struct ElementType<float>
+    {
+        static constexpr DataType value = DataType::FLOAT32;
+    };
+
+    template <>
+    struct ElementType<MILBlob::Fp16>
+    {
+        static constexpr DataType value = DataType::FLOAT16;
+    };
+
+    template <>
+    struct ElementType<std::int8_t>
+    {
+        static constexpr DataType value = DataType::INT8;
+    };
+
+    template <>
+    struct ElementType<std::uint8_t>
+    {
+        static constexpr DataType value = DataType::UINT8;
+    };
+
+    template <>
+    struct ElementType<std::uint32_t>
+    {
+        static constexpr DataType value = DataType::UINT32;
+    };
+
+    template <>
+    struct ElementType<std::int32_t>
+    {
+        static constexpr DataType value = DataType::INT32;
+    };
+
+    template <>
+    struct ElementType<bool>
+    {
+        static constexpr DataType value = DataType::BOOL;
+    };
+
+    template <>
+    struct ElementType<std::string>
+    {
+        static constexpr DataType value = DataType::STRING;
+    };
+
+    static void addImmediateValue(TensorValue &tensor, float value)
+    {
+        tensor.mutable_floats()->add_values(value);
+    }
+
+    static void addImmediateValue(TensorValue &tensor, std::int32_t value)
+    {
+        tensor.mutable_ints()->add_values(value);
+    }
+
+    static void addImmediateValue(TensorValue &tensor, bool value)
+    {
+        tensor.mutable_bools()->add_values(value);
+    }
+
+    static void addImmediateValue(TensorValue &tensor, const std::string &value)
+    {
+        tensor.mutable_strings()->add_values(value);
+    }
+
+    // int8 immediate values are stored as raw bytes
+    static void addImmediateValue(TensorValue &tensor, std::int8_t value)
+    {
+        tensor.mutable_bytes()->mutable_values()->push_back(static_cast<char>(value));
+    }
+
+    // Ranks of the types that are cached; higher ranks, which KataGo models do not have, get a
+    // new type on each request
+    static constexpr std::size_t MAX_CACHED_RANK = 5;
+
+    // Holds the whole shape, so that looking a type up allocates nothing
+    struct TypeKey
+    {
+        DataType dataType;
+        std::size_t rank;
+        std::array<int, MAX_CACHED_RANK> dims;
+
+        bool operator<(const TypeKey &other) const
+        {
+            return std::tie(dataType, rank, dims) < std::tie(other.dataType, other.rank, other.dims);
+        }
+    };
+
+    struct OpBuilder::Cache
+    {
+        // Prototypes are allocated on the block's arena, or on one of their own if the block is
+        // on the heap. A separate arena next to the block's measured slower, as protobuf keeps a
+        // per-thread fast path for the arena it last allocated on.
+        std::unique_ptr<google::protobuf::Arena> ownArena;
+        google::protobuf::Arena *arena;
+        // Sorted by key; a model has a few dozen distinct types
+        std::vector<std::pair<TypeKey, ValueType *>> tensorTypes;
+        // Derived names, formed once; a deque does not move them as it grows
+        std::deque<std::string> names;
+
+        explicit Cache(google::protobuf::Arena *blockArena)
+            : ownArena(blockArena == nullptr ? new google::protobuf::Arena : nullptr),
+              arena(blockArena == nullptr ? ownArena.get() : blockArena)
+        {
+            tensorTypes.reserve(64);
+        }
+
+        ValueType &newTensorType(DataType dataType, const int *shape, std::size_t rank)
+        {
+            ValueType &type = *google::protobuf::Arena::CreateMessage<ValueType>(arena);
+            TensorType &tensorType = *type.mutable_tensortype();
+            tensorType.set_datatype(dataType);
+            tensorType.set_rank(rank);
+            for (std::size_t i = 0; i < rank; ++i)
+            {
+                tensorType.add_dimensions()->mutable_constant()->set_size(shape[i]);
+            }
+            return type;
+        }
+
+        const ValueType &tensorType(DataType dataType, const int *shape, std::size_t rank)
+        {
+            if (rank > MAX_CACHED_RANK)
+            {
+                return newTensorType(dataType, shape, rank);
+            }
+            TypeKey key{dataType, rank, {}};
+            std::copy(shape, shape + rank, key.dims.begin());
+            auto it = std::lower_bound(tensorTypes.begin(), tensorTypes.end(), key,
+                                       [](const std::pair<TypeKey, ValueType *> &entry, const TypeKey &key)
+                                       { return entry.first < key; });
+            if (it == tensorTypes.end() || key < it->first)
+            {
+                it = tensorTypes.emplace(it, key, &newTensorType(dataType, shape, rank));
+            }
+            return *it->second;
+        }
+
+        const ValueType &tensorType(DataType dataType, const std::vector<int> &shape)
+        {
+            return tensorType(dataType, shape.data(), shape.size());
+        }
+    };
+
+    static std::vector<int> shapeOf(const NamedValueType &value)
+    {
+        std::vector<int> shape;
+        shape.reserve(value.type().tensortype().dimensions_size());
+        for (const auto &dim : value.type().tensortype().dimensions())
+        {
+            shape.push_back(static_cast<int>(dim.constant().size()));
+        }
+        return shape;
+    }
+
+    struct ConstOperation
+    {
+        NamedValueType *output;
+        TensorValue &value;
+    };
+
+    // const op with an immediate value of `type`, left for the caller to fill
+    static ConstOperation addConstOperation(OpBuilder &ops, const std::string &name, const ValueType &type)
+    {
+        Operation &op = ops.addOperation("const", name);
+        Value &value = (*op.mutable_attributes())["val"];
+        *value.mutable_type() = type;
+        return {ops.addOutput(op, name, type), *value.mutable_immediatevalue()->mutable_tensor()};
+    }
+
+    OpBuilder::OpBuilder(Block &block)
+        : block(block), cache(new Cache(block.GetArena()))
+    {
+    }
+
+    OpBuilder::~OpBuilder() = default;
+
+    const std::string &OpBuilder::name(const std::string &base, const char *suffix)
+    {
+        // Sized up front: base + suffix would copy base, then grow it for the suffix
+        const std::size_t suffixLength = std::strlen(suffix);
+        std::string &name = cache->names.emplace_back();
+        name.reserve(base.size() + suffixLength);
+        name.append(base).append(suffix, suffixLength);
+        return name;
+    }
+
+    template <typename T>
+    const ValueType &OpBuilder::tensorType(const std::vector<int> &shape)
+    {
+        return cache->tensorType(ElementType<T>::value, shape);
+    }
+
+    const ValueType &OpBuilder::tensorTypeLike(const NamedValueType &value, const std::vector<int> &shape)
+    {
+        return cache->tensorType(value.type().tensortype().datatype(), shape);
+    }
+
+    Operation &OpBuilder::addOperation(const char *type, const std::string &name)
+    {
+        Operation &op = *block.add_operations();
+        op.set_type(type);
+        // Set in place: copying a prototype of this small attribute measured slower
+        Value &nameAttribute = (*op.mutable_attributes())["name"];
+        nameAttribute.mutable_type()->mutable_tensortype()->set_datatype(DataType::STRING);
+        nameAttribute.mutable_immediatevalue()->mutable_tensor()->mutable_strings()->add_values(name);
+        return op;
+    }
+
+    void OpBuilder::bind(Operation &op, const char *input, const std::string &value)
+    {
+        (*op.mutable_inputs())[input].add_arguments()->set_name(value);
+    }
+
+    NamedValueType *OpBuilder::addOutput(Operation &op, const std::string &name, const ValueType &type)
+    {
+        NamedValueType *output = op.add_outputs();
+        output->set_name(name);
+        *output->mutable_type() = type;
+        return output;
+    }
+
+    template <typename T>
+    NamedValueType *OpBuilder::addConst(const std::string &name,
+                                        const std::vector<int> &shape,
+                                        const std::vector<T> &values)
+    {
+        ConstOperation constant = addConstOperation(*this, name, tensorType<T>(shape));
+        for (const auto &value : values)
+        {
+            addImmediateValue(constant.value, static_cast<T>(value));
+        }
+        return constant.output;
+    }
+
+    template <typename T>
+    NamedValueType *OpBuilder::addScalarConst(const std::string &name, const T &value)
+    {
+        ConstOperation constant = addConstOperation(*this, name, cache->tensorType(ElementType<T>::value, nullptr, 0));
+        addImmediateValue(constant.value, value);
+        return constant.output;
+    }
+
+    NamedValueType *OpBuilder::addUnary(const char *type, const NamedValueType &x, const std::string &name)
+    {
+        Operation &op = addOperation(type, name);
+        bind(op, "x", x.name());
+        return addOutput(op, name, x.type());
+    }
+
+    NamedValueType *OpBuilder::addBinary(const char *type,
+                                         const NamedValueType &x,
+                                         const NamedValueType &y,
+                                         const std::string &name)
+    {
+        // Trailing dimensions are aligned; each pair must be equal, or one of them 1
+        const std::vector<int> xShape = shapeOf(x);
+        const std::vector<int> yShape = shapeOf(y);
+        std::vector<int> shape(std::max(xShape.size(), yShape.size()));
+        for (std::size_t i = 0; i < shape.size(); ++i)
+        {
+            const int a = i < shape.size() - xShape.size() ? 1 : xShape[i - (shape.size() - xShape.size())];
+            const int b = i < shape.size() - yShape.size() ? 1 : yShape[i - (shape.size() - yShape.size())];
+            if (a != b && a != 1 && b != 1)
+            {
+                throw std::invalid_argument(std::string(type) + " '" + name + "' cannot broadcast its inputs");
+            }
+            shape[i] = a == 1 ? b : a;
+        }
+
+        Operation &op = addOperation(type, name);
+        bind(op, "x", x.name());
+        bind(op, "y", y.name());
+        return addOutput(op, name, tensorTypeLike(x, shape));
+    }
+
+    NamedValueType *OpBuilder::addConv(const NamedValueType &x,
+                                       const std::string &weight,
+                                       int outChannels,
+                                       int dilationY,
+                                       int dilationX,
+                                       const std::string &name)
+    {
+        const std::string &padTypeName = this->name(name, "_pad_type");
+        const std::string &stridesName = this->name(name, "_strides");
+        const std::string &padName = this->name(name, "_pad");
+        const std::string &dilationsName = this->name(name, "_dilations");
+        const std::string &groupsName = this->name(name, "_groups");
+        // Conv is the most frequent op, so its consts are filled in place rather than from vectors
+        const int pairShape[] = {2};
+        const int padShape[] = {4};
+        const ValueType &pairType = cache->tensorType(DataType::INT32, pairShape, 1);
+        addScalarConst<std::string>(padTypeName, "same");
+        TensorValue &strides = addConstOperation(*this, stridesName, pairType).value;
+        strides.mutable_ints()->add_values(1);
+        strides.mutable_ints()->add_values(1);
+        TensorValue &pad = addConstOperation(*this, padName, cache->tensorType(DataType::INT32, padShape, 1)).value;
+        for (int i = 0; i < 4; ++i)
+        {
+            pad.mutable_ints()->add_values(0);
+        }
+        TensorValue &dilations = addConstOperation(*this, dilationsName, pairType).value;
+        dilations.mutable_ints()->add_values(dilationY);
+        dilations.mutable_ints()->add_values(dilationX);
+        addScalarConst<std::int32_t>(groupsName, 1);
+
+        Operation &op = addOperation("conv", name);
+        bind(op, "x", x.name());
+        bind(op, "weight", weight);
+        bind(op, "strides", stridesName);
+        bind(op, "pad", padName);
+        bind(op, "pad_type", padTypeName);
+        bind(op, "dilations", dilationsName);
+        bind(op, "groups", groupsName);
+
+        const TensorType &xType = x.type().tensortype();
+        if (xType.dimensions_size() != 4)
+        {
+            throw std::invalid_argument("conv '" + name + "' needs an NCHW input");
+        }
+        int shape[4];
+        for (int i = 0; i < 4; ++i)
+        {
+            shape[i] = static_cast<int>(xType.dimensions(i).constant().size());
+        }
+        shape[1] = outChannels;
+        return addOutput(op, name, cache->tensorType(xType.datatype(), shape, 4));
+    }
+
+    NamedValueType *OpBuilder::addMatmul(const NamedValueType &x, const NamedValueType &y, const std::string &name)
+    {
+        const std::vector<int> xShape = shapeOf(x);
+        const std::vector<int> yShape = shapeOf(y);
+        if (xShape.size() < 2 || yShape.size() < 2 || xShape.back() != yShape[yShape.size() - 2])
+        {
+            throw std::invalid_argument("matmul '" + name + "' has inputs of incompatible shapes");
+        }
+        // Leading dimensions broadcast as in numpy
+        std::vector<int> shape(std::max(xShape.size(), yShape.size()));
+        for (std::size_t i = 0; i + 2 < shape.size(); ++i)
+        {
+            const int a = i < shape.size() - xShape.size() ? 1 : xShape[i - (shape.size() - xShape.size())];
+            const int b = i < shape.size() - yShape.size() ? 1 : yShape[i - (shape.size() - yShape.size())];
+            if (a != b && a != 1 && b != 1)
+            {
+                throw std::invalid_argument("matmul '" + name + "' cannot broadcast its inputs");
+            }
+            shape[i] = a == 1 ? b : a;
+        }
+        shape[shape.size() - 2] = xShape[xShape.size() - 2];
+        shape[shape.size() - 1] = yShape.back();
+
+        const std::string &transposeXName = this->name(name, "_transpose_x");
+        const std::string &transposeYName = this->name(name, "_transpose_y");
+        addScalarConst(transposeXName, false);
+        addScalarConst(transposeYName, false);
+
+        Operation &op = addOperation("matmul", name);
+        bind(op, "x", x.name());
+        bind(op, "y", y.name());
+        bind(op, "transpose_x", transposeXName);
+        bind(op, "transpose_y", transposeYName);
+        return addOutput(op, name, tensorTypeLike(x, shape));
+    }
+
+    NamedValueType *OpBuilder::addReduce(const char *type,
+                                         const NamedValueType &x,
+                                         const std::vector<int> &axes,
+                                         bool keepDims,
+                                         const std::string &name)
+    {
+        const std::string &axesName = this->name(name, "_axes");
+        const std::string &keepDimsName = this->name(name, "_keep_dims");
+        addConst<std::int32_t>(axesName, {static_cast<int>(axes.size())}, axes);
+        addScalarConst(keepDimsName, keepDims);
+
+        Operation &op = addOperation(type, name);
+        bind(op, "x", x.name());
+        bind(op, "axes", axesName);
+        bind(op, "keep_dims", keepDimsName);
+
+        const std::vector<int> xShape = shapeOf(x);
+        std::vector<bool> reduced(xShape.size(), false);
+        for (int axis : axes)
+        {
+            reduced[axis < 0 ? axis + static_cast<int>(xShape.size()) : axis] = true;
+        }
+        std::vector<int> shape;
+        for (std::size_t i = 0; i < xShape.size(); ++i)
+        {
+            if (!reduced[i])
+                shape.push_back(xShape[i]);
+            else if (keepDims)
+                shape.push_back(1);
+        }
+        return addOutput(op, name, tensorTypeLike(x, shape));
+    }
+
+    template const ValueType &OpBuilder::tensorType<float>(const std::vector<int> &);
+    template const ValueType &OpBuilder::tensorType<MILBlob::Fp16>(const std::vector<int> &);
+    template const ValueType &OpBuilder::tensorType<std::int8_t>(const std::vector<int> &);
+    template const ValueType &OpBuilder::tensorType<std::uint8_t>(const std::vector<int> &);
+    template const ValueType &OpBuilder::tensorType<std::uint32_t>(const std::vector<int> &);
+    template const ValueType &OpBuilder::tensorType<std::int32_t>(const std::vector<int> &);
+    template const ValueType &OpBuilder::tensorType<bool>(const std::vector<int> &);
+    template const ValueType &OpBuilder::tensorType<std::string>(const std::vector<int> &);
+
+    template NamedValueType *OpBuilder::addConst<float>(const std::string &, const std::vector<int> &,
+                                                        const std::vector<float> &);
+    template NamedValueType *OpBuilder::addConst<std::int8_t>(const std::string &, const std::vector<int> &,
+                                                              const std::vector<std::int8_t> &);
+    template NamedValueType *OpBuilder::addConst<std::int32_t>(const std::string &, const std::vector<int> &,
+                                                               const std::vector<std::int32_t> &);
+    template NamedValueType *OpBuilder::addConst<bool>(const std::string &, const std::vector<int> &,
+                                                       const std::vector<bool> &);
+    template NamedValueType *OpBuilder::addConst<std::string>(const std::string &, const std::vector<int> &,
+                                                              const std::vector<std::string> &);
+
+
+    template NamedValueType *OpBuilder::addScalarConst<float>(const std::string &, const float &);
+    template NamedValueType *OpBuilder::addScalarConst<std::int8_t>(const std::string &, const std::int8_t &);
+    template NamedValueType *OpBuilder::addScalarConst<std::int32_t>(const std::string &, const std::int32_t &);
+    template NamedValueType *OpBuilder::addScalarConst<bool>(const std::string &, const bool &);
+    template NamedValueType *OpBuilder::addScalarConst<std::string>(const std::string &, const std::string &);
+
+} // namespace KataGoCoreML
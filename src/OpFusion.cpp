@@ -0,0 +1,232 @@
+#include "OpFusion.hpp"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <Model.pb.h>
+#include "OpScheduling.hpp"
+
+using namespace CoreML::Specification::MILSpec;
+
+namespace KataGoCoreML
+{
+    static const std::set<std::string> ACTIVATION_TYPES = {
+        "gelu", "leaky_relu", "relu", "relu6", "sigmoid", "silu", "softplus", "tanh"};
+
+    static std::string argumentName(const Operation &op, const std::string &input)
+    {
+        auto it = op.inputs().find(input);
+        if (it == op.inputs().end() || it->second.arguments_size() != 1 || !it->second.arguments(0).has_name())
+        {
+            return "";
+        }
+        return it->second.arguments(0).name();
+    }
+
+    // Whether `constant` broadcasts to one value per channel (axis 1) of `output`
+    static bool isPerChannel(const TensorType &constant, const TensorType &output)
+    {
+        if (constant.datatype() != output.datatype())
+        {
+            return false;
+        }
+        const int rank = output.dimensions_size();
+        const int constantRank = constant.dimensions_size();
+        if (rank < 2 || constantRank < rank - 1 || constantRank > rank || !output.dimensions(1).has_constant())
+        {
+            return false;
+        }
+        const auto numChannels = output.dimensions(1).constant().size();
+        for (int i = 0; i < constantRank; ++i)
+        {
+            // Broadcasting aligns the trailing dimensions
+            const int axis = rank - constantRank + i;
+            const auto &dim = constant.dimensions(i);
+            if (!dim.has_constant() || dim.constant().size() != (axis == 1 ? numChannels : 1))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void setVectorType(TensorType &tensorType, std::uint64_t size)
+    {
+        tensorType.clear_dimensions();
+        tensorType.set_rank(1);
+        tensorType.add_dimensions()->mutable_constant()->set_size(size);
+    }
+
+    EpilogueFusion fuseEpilogues(Block &block)
+    {
+        EpilogueFusion fusion;
+        const int numOps = block.operations_size();
+        std::map<std::string, int> producer;
+        std::map<std::string, int> numReaders;
+        for (int i = 0; i < numOps; ++i)
+        {
+            const Operation &op = block.operations(i);
+            std::set<std::string> reads;
+            for (const auto &input : op.inputs())
+            {
+                for (const auto &binding : input.second.arguments())
+                {
+                    if (binding.has_name())
+                    {
+                        reads.insert(binding.name());
+                    }
+                }
+            }
+            for (const auto &read : reads)
+            {
+                ++numReaders[read];
+            }
+            for (const auto &output : op.outputs())
+            {
+                producer[output.name()] = i;
+            }
+        }
+        const std::set<std::string> blockOutputs(block.outputs().begin(), block.outputs().end());
+        auto soleReader = [&](const std::string &value)
+        { return numReaders[value] == 1 && blockOutputs.count(value) == 0; };
+
+        // Ops are removed, or moved next to the op they are emitted before or after
+        std::vector<bool> removed(numOps, false);
+        std::vector<bool> moved(numOps, false);
+        std::vector<std::vector<int>> emitBefore(numOps);
+        std::vector<std::vector<int>> emitAfter(numOps);
+
+        for (int i = 0; i < numOps; ++i)
+        {
+            const Operation &add = block.operations(i);
+            if (add.type() != "add" || add.outputs_size() != 1)
+            {
+                continue;
+            }
+            const std::string x = argumentName(add, "x");
+            const std::string y = argumentName(add, "y");
+            for (const auto &operands : {std::make_pair(x, y), std::make_pair(y, x)})
+            {
+                auto convIt = producer.find(operands.first);
+                auto constantIt = producer.find(operands.second);
+                if (convIt == producer.end() || constantIt == producer.end())
+                {
+                    continue;
+                }
+                const int convIndex = convIt->second;
+                const int constantIndex = constantIt->second;
+                Operation &conv = *block.mutable_operations(convIndex);
+                const Operation &constant = block.operations(constantIndex);
+                if (conv.type() != "conv" || conv.inputs().count("bias") > 0 || conv.outputs_size() != 1 ||
+                    !soleReader(operands.first) || constant.type() != "const" || constant.outputs_size() != 1 ||
+                    !isPerChannel(constant.outputs(0).type().tensortype(), conv.outputs(0).type().tensortype()))
+                {
+                    continue;
+                }
+
+                // The bias is a [C] const before the conv: the add's const itself if nothing
+                // else reads it, else a copy, which can share the same weight blob
+                const std::string &sum = add.outputs(0).name();
+                const std::uint64_t numChannels = conv.outputs(0).type().tensortype().dimensions(1).constant().size();
+                int biasIndex = constantIndex;
+                std::string biasName = operands.second;
+                if (!soleReader(operands.second))
+                {
+                    biasName = sum + "_bias";
+                    Operation *copy = block.add_operations();
+                    *copy = constant;
+                    copy->mutable_outputs(0)->set_name(biasName);
+                    auto *nameValue = (*copy->mutable_attributes())["name"].mutable_immediatevalue()->mutable_tensor();
+                    nameValue->mutable_strings()->clear_values();
+                    nameValue->mutable_strings()->add_values(biasName);
+                    biasIndex = block.operations_size() - 1;
+                    --numReaders[operands.second];
+                    moved.push_back(false);
+                    removed.push_back(false);
+                }
+                Operation &bias = *block.mutable_operations(biasIndex);
+                setVectorType(*bias.mutable_outputs(0)->mutable_type()->mutable_tensortype(), numChannels);
+                setVectorType(*(*bias.mutable_attributes())["val"].mutable_type()->mutable_tensortype(), numChannels);
+                if (biasIndex > convIndex)
+                {
+                    moved[biasIndex] = true;
+                    emitBefore[convIndex].push_back(biasIndex);
+                }
+
+                (*conv.mutable_inputs())["bias"].add_arguments()->set_name(biasName);
+                conv.mutable_outputs(0)->set_name(sum);
+                producer[sum] = convIndex;
+                removed[i] = true;
+                ++fusion.biasesFused;
+                break;
+            }
+        }
+
+        for (int i = 0; i < numOps; ++i)
+        {
+            const Operation &activation = block.operations(i);
+            if (ACTIVATION_TYPES.count(activation.type()) == 0)
+            {
+                continue;
+            }
+            const std::string x = argumentName(activation, "x");
+            auto producerIt = producer.find(x);
+            if (producerIt == producer.end() || !soleReader(x))
+            {
+                continue;
+            }
+            const int head = producerIt->second;
+            const std::string &headType = block.operations(head).type();
+            if ((headType != "add" && headType != "conv") || removed[head])
+            {
+                continue;
+            }
+
+            // Other inputs, such as the alpha of leaky_relu, must already be defined at the head
+            bool movable = true;
+            for (const auto &input : activation.inputs())
+            {
+                for (const auto &binding : input.second.arguments())
+                {
+                    auto other = binding.has_name() ? producer.find(binding.name()) : producer.end();
+                    if (binding.name() != x && other != producer.end() && (other->second >= head || moved[other->second]))
+                    {
+                        movable = false;
+                    }
+                }
+            }
+            bool adjacent = true;
+            for (int between = head + 1; between < i; ++between)
+            {
+                adjacent = adjacent && (removed[between] || moved[between]);
+            }
+            if (!movable || adjacent)
+            {
+                continue;
+            }
+            moved[i] = true;
+            emitAfter[head].push_back(i);
+            ++fusion.activationsAdjoined;
+        }
+
+        if (fusion.biasesFused == 0 && fusion.activationsAdjoined == 0)
+        {
+            return fusion;
+        }
+        std::vector<int> order;
+        for (int i = 0; i < numOps; ++i)
+        {
+            if (removed[i] || moved[i])
+            {
+                continue;
+            }
+            order.insert(order.end(), emitBefore[i].begin(), emitBefore[i].end());
+            order.push_back(i);
+            order.insert(order.end(), emitAfter[i].begin(), emitAfter[i].end());
+        }
+        reorderOperations(block, order);
+        return fusion;
+    }
+
+} // namespace KataGoCoreML
@@ -0,0 +1,284 @@
+#include "OpScheduling.hpp"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <Model.pb.h>
+#include "CostModel.hpp"
+
+using namespace CoreML::Specification::MILSpec;
+
+namespace KataGoCoreML
+{
+    // Data flow of a block: the values each op reads and writes, with their sizes
+    struct DataFlow
+    {
+        // Values read from outside the block, alive from the start
+        std::vector<std::uint64_t> externalBytes;
+        // Per op: its output values and the distinct values it reads
+        std::vector<std::vector<int>> outputs;
+        std::vector<std::vector<int>> reads;
+        // Per op: the distinct ops producing the values it reads
+        std::vector<std::vector<int>> producers;
+        // Per value: bytes as an activation (0 for weights), number of reading ops, and
+        // whether it is a block output that stays alive to the end
+        std::vector<std::uint64_t> bytes;
+        std::vector<int> numReaders;
+        std::vector<bool> keep;
+    };
+
+    static DataFlow analyzeDataFlow(const Block &block, const Function &function)
+    {
+        DataFlow flow;
+        std::map<std::string, int> values;
+        std::vector<int> producer;
+        auto addValue = [&](const std::string &name, std::uint64_t bytes, int op)
+        {
+            values[name] = static_cast<int>(flow.bytes.size());
+            flow.bytes.push_back(bytes);
+            flow.numReaders.push_back(0);
+            flow.keep.push_back(false);
+            producer.push_back(op);
+        };
+
+        for (const auto &input : function.inputs())
+        {
+            addValue(input.name(), valueBytes(input.type()), -1);
+        }
+
+        const int numOps = block.operations_size();
+        flow.outputs.resize(numOps);
+        flow.reads.resize(numOps);
+        flow.producers.resize(numOps);
+        for (int i = 0; i < numOps; ++i)
+        {
+            const Operation &op = block.operations(i);
+            std::set<int> reads;
+            for (const auto &input : op.inputs())
+            {
+                for (const auto &binding : input.second.arguments())
+                {
+                    auto value = binding.has_name() ? values.find(binding.name()) : values.end();
+                    if (value != values.end())
+                    {
+                        reads.insert(value->second);
+                    }
+                }
+            }
+            std::set<int> producers;
+            for (int value : reads)
+            {
+                flow.reads[i].push_back(value);
+                ++flow.numReaders[value];
+                if (producer[value] >= 0)
+                {
+                    producers.insert(producer[value]);
+                }
+            }
+            flow.producers[i].assign(producers.begin(), producers.end());
+
+            const bool constant = isConstantOperation(op);
+            for (const auto &output : op.outputs())
+            {
+                flow.outputs[i].push_back(static_cast<int>(flow.bytes.size()));
+                addValue(output.name(), constant ? 0 : valueBytes(output.type()), i);
+            }
+        }
+        for (const auto &output : block.outputs())
+        {
+            auto value = values.find(output);
+            if (value != values.end())
+            {
+                flow.keep[value->second] = true;
+            }
+        }
+        for (const auto &input : function.inputs())
+        {
+            flow.externalBytes.push_back(flow.bytes[values.at(input.name())]);
+        }
+        return flow;
+    }
+
+    // Peak live activation bytes when the ops run in the given order: an activation is alive
+    // from the op that writes it until the last op that reads it
+    static std::uint64_t peakLiveBytes(const DataFlow &flow, const std::vector<int> &order)
+    {
+        std::vector<int> remainingReaders = flow.numReaders;
+        std::uint64_t liveBytes = 0;
+        for (auto bytes : flow.externalBytes)
+        {
+            liveBytes += bytes;
+        }
+        std::uint64_t peakBytes = liveBytes;
+        for (int op : order)
+        {
+            for (int value : flow.outputs[op])
+            {
+                liveBytes += flow.bytes[value];
+            }
+            peakBytes = std::max(peakBytes, liveBytes);
+            for (int value : flow.reads[op])
+            {
+                if (--remainingReaders[value] == 0 && !flow.keep[value])
+                {
+                    liveBytes -= flow.bytes[value];
+                }
+            }
+            for (int value : flow.outputs[op])
+            {
+                if (flow.numReaders[value] == 0 && !flow.keep[value])
+                {
+                    liveBytes -= flow.bytes[value];
+                }
+            }
+        }
+        return peakBytes;
+    }
+
+    // Emits every op after its producers, starting from the ops nobody reads. The producers of
+    // an op are visited in decreasing order of their memory demand minus their output size,
+    // as in Sethi-Ullman register allocation, so that the most demanding input is computed
+    // while the fewest other inputs are held. Shared inputs are counted once per reader, which
+    // makes the demand an estimate on graphs that are not trees.
+    static std::vector<int> demandDrivenOrder(const DataFlow &flow)
+    {
+        const int numOps = static_cast<int>(flow.outputs.size());
+        std::vector<std::uint64_t> outputBytes(numOps, 0);
+        for (int i = 0; i < numOps; ++i)
+        {
+            for (int value : flow.outputs[i])
+            {
+                outputBytes[i] += flow.bytes[value];
+            }
+        }
+
+        // Ops are in a valid order already, so producers come before their readers
+        std::vector<std::uint64_t> demand(numOps, 0);
+        std::vector<std::vector<int>> inputOrder(numOps);
+        auto byDemand = [&](int a, int b)
+        {
+            const auto keyA = demand[a] - outputBytes[a];
+            const auto keyB = demand[b] - outputBytes[b];
+            return keyA != keyB ? keyA > keyB : a < b;
+        };
+        for (int i = 0; i < numOps; ++i)
+        {
+            inputOrder[i] = flow.producers[i];
+            std::sort(inputOrder[i].begin(), inputOrder[i].end(), byDemand);
+            std::uint64_t held = 0;
+            for (int producer : inputOrder[i])
+            {
+                demand[i] = std::max(demand[i], held + demand[producer]);
+                held += outputBytes[producer];
+            }
+            demand[i] = std::max(demand[i], held + outputBytes[i]);
+        }
+
+        std::vector<bool> read(numOps, false);
+        for (int i = 0; i < numOps; ++i)
+        {
+            for (int producer : flow.producers[i])
+            {
+                read[producer] = true;
+            }
+        }
+        std::vector<int> roots;
+        for (int i = 0; i < numOps; ++i)
+        {
+            if (!read[i])
+            {
+                roots.push_back(i);
+            }
+        }
+        std::sort(roots.begin(), roots.end(), byDemand);
+
+        // Depth-first with an explicit stack, as a trunk can be thousands of ops deep
+        std::vector<int> order;
+        order.reserve(numOps);
+        std::vector<bool> emitted(numOps, false);
+        std::vector<std::pair<int, std::size_t>> stack;
+        for (int root : roots)
+        {
+            stack.emplace_back(root, 0);
+            while (!stack.empty())
+            {
+                auto &top = stack.back();
+                const int op = top.first;
+                if (top.second < inputOrder[op].size())
+                {
+                    const int producer = inputOrder[op][top.second++];
+                    if (!emitted[producer])
+                    {
+                        stack.emplace_back(producer, 0);
+                    }
+                }
+                else
+                {
+                    if (!emitted[op])
+                    {
+                        emitted[op] = true;
+                        order.push_back(op);
+                    }
+                    stack.pop_back();
+                }
+            }
+        }
+        return order;
+    }
+
+    void reorderOperations(Block &block, const std::vector<int> &order)
+    {
+        // Permute in place by swapping, then drop the operations left at the end
+        const int numOps = block.operations_size();
+        std::vector<int> position(numOps);
+        std::vector<int> opAt(numOps);
+        for (int i = 0; i < numOps; ++i)
+        {
+            position[i] = i;
+            opAt[i] = i;
+        }
+        for (int i = 0; i < static_cast<int>(order.size()); ++i)
+        {
+            const int from = position[order[i]];
+            if (from != i)
+            {
+                block.mutable_operations()->SwapElements(i, from);
+                const int displaced = opAt[i];
+                opAt[from] = displaced;
+                position[displaced] = from;
+                opAt[i] = order[i];
+                position[order[i]] = i;
+            }
+        }
+        block.mutable_operations()->DeleteSubrange(static_cast<int>(order.size()), numOps - static_cast<int>(order.size()));
+    }
+
+    MemorySchedule scheduleForMemory(Block &block, const Function &function)
+    {
+        const DataFlow flow = analyzeDataFlow(block, function);
+        const int numOps = block.operations_size();
+        std::vector<int> order(numOps);
+        for (int i = 0; i < numOps; ++i)
+        {
+            order[i] = i;
+        }
+
+        MemorySchedule schedule;
+        schedule.peakLiveActivationBytesBefore = peakLiveBytes(flow, order);
+        schedule.peakLiveActivationBytesAfter = schedule.peakLiveActivationBytesBefore;
+
+        const std::vector<int> scheduled = demandDrivenOrder(flow);
+        const std::uint64_t scheduledPeak = peakLiveBytes(flow, scheduled);
+        if (scheduledPeak >= schedule.peakLiveActivationBytesBefore)
+        {
+            return schedule;
+        }
+        schedule.peakLiveActivationBytesAfter = scheduledPeak;
+
+        reorderOperations(block, scheduled);
+        return schedule;
+    }
+
+} // namespace KataGoCoreML
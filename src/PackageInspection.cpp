@@ -0,0 +1,474 @@
+#include "PackageInspection.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+#include <MILBlob/Blob/StorageReader.hpp>
+#include <Model.pb.h>
+#include <ModelPackage.hpp>
+#include "ConversionObserver.hpp"
+
+using namespace MILBlob;
+using namespace CoreML::Specification;
+using namespace CoreML::Specification::MILSpec;
+namespace fs = std::filesystem;
+
+namespace KataGoCoreML
+{
+    int PackageSummary::totalOpCount() const
+    {
+        int count = 0;
+        for (const auto &entry : opCounts)
+        {
+            count += entry.second;
+        }
+        return count;
+    }
+
+    std::uint64_t PackageSummary::totalWeightBytes() const
+    {
+        std::uint64_t bytes = 0;
+        for (const auto &layer : layerWeights)
+        {
+            bytes += layer.bytes;
+        }
+        return bytes;
+    }
+
+    static const char *blobDataTypeName(Blob::BlobDataType dataType)
+    {
+        switch (dataType)
+        {
+        case Blob::BlobDataType::Float16:
+            return "fp16";
+        case Blob::BlobDataType::Float32:
+            return "fp32";
+        case Blob::BlobDataType::UInt8:
+            return "uint8";
+        case Blob::BlobDataType::Int8:
+            return "int8";
+        case Blob::BlobDataType::BFloat16:
+            return "bf16";
+        case Blob::BlobDataType::Int16:
+            return "int16";
+        case Blob::BlobDataType::UInt16:
+            return "uint16";
+        default:
+            return "unknown";
+        }
+    }
+
+    static const char *arrayDataTypeName(ArrayFeatureType_ArrayDataType dataType)
+    {
+        switch (dataType)
+        {
+        case ArrayFeatureType_ArrayDataType_FLOAT32:
+            return "fp32";
+        case ArrayFeatureType_ArrayDataType_FLOAT16:
+            return "fp16";
+        case ArrayFeatureType_ArrayDataType_DOUBLE:
+            return "fp64";
+        case ArrayFeatureType_ArrayDataType_INT32:
+            return "int32";
+        default:
+            return "unknown";
+        }
+    }
+
+    static PackageFeature packageFeature(const FeatureDescription &feature)
+    {
+        PackageFeature result;
+        result.name = feature.name();
+        if (feature.type().has_multiarraytype())
+        {
+            const ArrayFeatureType &array = feature.type().multiarraytype();
+            result.dataType = arrayDataTypeName(array.datatype());
+            result.shape.assign(array.shape().begin(), array.shape().end());
+            const auto &ranges = array.shaperange().sizeranges();
+            for (int i = 0; i < ranges.size() && i < static_cast<int>(result.shape.size()); ++i)
+            {
+                if (ranges.Get(i).upperbound() != static_cast<std::int64_t>(ranges.Get(i).lowerbound()))
+                {
+                    result.shape[i] = -1;
+                }
+            }
+        }
+        else
+        {
+            result.dataType = "unknown";
+        }
+        return result;
+    }
+
+    static std::string opName(const Operation &op)
+    {
+        auto name = op.attributes().find("name");
+        if (name != op.attributes().end() && name->second.immediatevalue().tensor().strings().values_size() > 0)
+        {
+            return name->second.immediatevalue().tensor().strings().values(0);
+        }
+        return op.outputs_size() > 0 ? op.outputs(0).name() : op.type();
+    }
+
+    // Resolves a blob file name relative to the model file, as Core ML does
+    static fs::path blobFilePath(const std::string &fileName, const fs::path &modelPath)
+    {
+        const std::string prefix = "@model_path/";
+        if (fileName.compare(0, prefix.size(), prefix) == 0)
+        {
+            return modelPath.parent_path() / fileName.substr(prefix.size());
+        }
+        return modelPath.parent_path() / fileName;
+    }
+
+    PackageSummary inspectPackage(const std::string &packagePath)
+    {
+        if (!fs::is_directory(packagePath) || !MPL::ModelPackage::isValid(packagePath))
+        {
+            throw std::runtime_error("Not a model package: " + packagePath);
+        }
+
+        PackageSummary summary;
+        summary.packagePath = packagePath;
+        for (const auto &entry : fs::recursive_directory_iterator(packagePath))
+        {
+            if (entry.is_regular_file())
+            {
+                summary.packageBytes += entry.file_size();
+            }
+        }
+
+        fs::path modelPath;
+        {
+            MPL::ModelPackage package(packagePath, false, true);
+            auto rootModel = package.getRootModel();
+            if (rootModel == nullptr)
+            {
+                throw std::runtime_error("Package has no root model: " + packagePath);
+            }
+            modelPath = rootModel->path();
+        }
+
+        Model model;
+        std::ifstream ifs(modelPath, std::ios::binary);
+        if (!ifs || !model.ParseFromIstream(&ifs))
+        {
+            throw std::runtime_error("Failed to parse model specification: " + modelPath.string());
+        }
+        summary.modelBytes = fs::file_size(modelPath);
+        summary.specificationVersion = model.specificationversion();
+        for (const auto &input : model.description().input())
+        {
+            summary.inputs.push_back(packageFeature(input));
+        }
+        for (const auto &output : model.description().output())
+        {
+            summary.outputs.push_back(packageFeature(output));
+        }
+        if (!model.has_mlprogram())
+        {
+            throw std::runtime_error("Model is not an ML program: " + modelPath.string());
+        }
+
+        // Weight files are opened once, and each blob is counted once
+        std::map<std::string, std::unique_ptr<Blob::StorageReader>> readers;
+        std::set<std::pair<std::string, std::uint64_t>> blobs;
+        std::uint64_t blobBytes = 0;
+
+        auto mainFunction = model.mlprogram().functions().find("main");
+        if (mainFunction != model.mlprogram().functions().end())
+        {
+            summary.opset = mainFunction->second.opset();
+        }
+        for (const auto &function : model.mlprogram().functions())
+        {
+            auto block = function.second.block_specializations().find(function.second.opset());
+            if (block == function.second.block_specializations().end())
+            {
+                throw std::runtime_error("Function " + function.first + " has no block for opset " + function.second.opset());
+            }
+            for (const auto &op : block->second.operations())
+            {
+                ++summary.opCounts[op.type()];
+                if (op.type() == "const" || op.type().compare(0, 10, "constexpr_") == 0)
+                {
+                    ++summary.numConstOps;
+                    summary.constOpBytes += op.ByteSizeLong();
+                }
+
+                PackageLayerWeights layer;
+                std::uint64_t largestBlob = 0;
+                for (const auto &attribute : op.attributes())
+                {
+                    if (!attribute.second.has_blobfilevalue())
+                    {
+                        continue;
+                    }
+                    const auto &blobFile = attribute.second.blobfilevalue();
+                    const std::string path = blobFilePath(blobFile.filename(), modelPath).string();
+                    auto &reader = readers[path];
+                    if (reader == nullptr)
+                    {
+                        if (!fs::is_regular_file(path))
+                        {
+                            throw std::runtime_error(opName(op) + " references missing weight file: " + path);
+                        }
+                        reader = std::make_unique<Blob::StorageReader>(path);
+                        summary.weightFileBytes += fs::file_size(path);
+                    }
+                    const std::uint64_t bytes = reader->GetDataSize(blobFile.offset());
+                    if (blobs.emplace(path, blobFile.offset()).second)
+                    {
+                        blobBytes += bytes;
+                    }
+                    layer.bytes += bytes;
+                    ++layer.numBlobs;
+                    if (bytes >= largestBlob)
+                    {
+                        largestBlob = bytes;
+                        layer.dataType = blobDataTypeName(reader->GetDataType(blobFile.offset()));
+                    }
+                }
+                if (layer.numBlobs > 0)
+                {
+                    // Float16 weights are emitted as <name>_fp16 and cast to <name>; report them
+                    // under the weight's name so that packages of different precisions line up
+                    layer.name = opName(op);
+                    const std::string halfSuffix = "_fp16";
+                    if (layer.name.size() > halfSuffix.size() &&
+                        layer.name.compare(layer.name.size() - halfSuffix.size(), halfSuffix.size(), halfSuffix) == 0)
+                    {
+                        layer.name.resize(layer.name.size() - halfSuffix.size());
+                    }
+                    layer.opType = op.type();
+                    summary.layerWeights.push_back(layer);
+                }
+            }
+        }
+        summary.weightFileOverheadBytes = summary.weightFileBytes - blobBytes;
+        return summary;
+    }
+
+    static std::string describeShape(const std::vector<std::int64_t> &shape)
+    {
+        std::ostringstream os;
+        os << "[";
+        for (std::size_t i = 0; i < shape.size(); ++i)
+        {
+            os << (i == 0 ? "" : ", ") << shape[i];
+        }
+        os << "]";
+        return os.str();
+    }
+
+    static std::string describeFeature(const PackageFeature &feature)
+    {
+        return feature.dataType + " " + describeShape(feature.shape);
+    }
+
+    std::string PackageSummary::toText() const
+    {
+        std::ostringstream os;
+        os << "Package: " << packagePath << "\n";
+        os << "  Size: " << packageBytes << " bytes (model.mlmodel " << modelBytes << ", weights " << weightFileBytes << ")\n";
+        os << "  Specification version: " << specificationVersion << " (" << opset << ")\n";
+        os << "  Inputs:\n";
+        for (const auto &input : inputs)
+        {
+            os << "    " << input.name << ": " << describeFeature(input) << "\n";
+        }
+        os << "  Outputs:\n";
+        for (const auto &output : outputs)
+        {
+            os << "    " << output.name << ": " << describeFeature(output) << "\n";
+        }
+        os << "  Ops: " << totalOpCount() << "\n";
+        for (const auto &entry : opCounts)
+        {
+            os << "    " << std::left << std::setw(32) << entry.first << std::right << std::setw(8) << entry.second << "\n";
+        }
+        os << "  Const ops: " << numConstOps << ", " << constOpBytes << " bytes in model.mlmodel\n";
+        os << "  Weights: " << totalWeightBytes() << " bytes, plus " << weightFileOverheadBytes
+           << " bytes of weight file headers and padding\n";
+        for (const auto &layer : layerWeights)
+        {
+            os << "    " << std::left << std::setw(40) << layer.name << std::setw(30) << layer.opType << std::setw(8)
+               << layer.dataType << std::right << std::setw(12) << layer.bytes << "\n";
+        }
+        return os.str();
+    }
+
+    static void writeFeaturesJSON(std::ostream &os, const std::vector<PackageFeature> &features)
+    {
+        bool first = true;
+        for (const auto &feature : features)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    {\"name\": \"" << escapeJSON(feature.name) << "\", \"data_type\": \"" << feature.dataType
+               << "\", \"shape\": " << describeShape(feature.shape) << "}";
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "],\n";
+    }
+
+    std::string PackageSummary::toJSON() const
+    {
+        std::ostringstream os;
+        os << "{\n";
+        os << "  \"package_path\": \"" << escapeJSON(packagePath) << "\",\n";
+        os << "  \"package_bytes\": " << packageBytes << ",\n";
+        os << "  \"model_bytes\": " << modelBytes << ",\n";
+        os << "  \"weight_file_bytes\": " << weightFileBytes << ",\n";
+        os << "  \"specification_version\": " << specificationVersion << ",\n";
+        os << "  \"opset\": \"" << escapeJSON(opset) << "\",\n";
+        os << "  \"inputs\": [";
+        writeFeaturesJSON(os, inputs);
+        os << "  \"outputs\": [";
+        writeFeaturesJSON(os, outputs);
+
+        os << "  \"op_counts\": {";
+        bool first = true;
+        for (const auto &entry : opCounts)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    \"" << escapeJSON(entry.first) << "\": " << entry.second;
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "},\n";
+        os << "  \"total_ops\": " << totalOpCount() << ",\n";
+        os << "  \"const_ops\": " << numConstOps << ",\n";
+        os << "  \"const_op_bytes\": " << constOpBytes << ",\n";
+
+        os << "  \"layer_weights\": [";
+        first = true;
+        for (const auto &layer : layerWeights)
+        {
+            os << (first ? "\n" : ",\n");
+            os << "    {\"name\": \"" << escapeJSON(layer.name) << "\", \"op\": \"" << escapeJSON(layer.opType)
+               << "\", \"data_type\": \"" << layer.dataType << "\", \"bytes\": " << layer.bytes
+               << ", \"blobs\": " << layer.numBlobs << "}";
+            first = false;
+        }
+        os << (first ? "" : "\n  ") << "],\n";
+        os << "  \"total_weight_bytes\": " << totalWeightBytes() << ",\n";
+        os << "  \"weight_file_overhead_bytes\": " << weightFileOverheadBytes << "\n";
+        os << "}\n";
+        return os.str();
+    }
+
+    template <typename T>
+    static void diffValue(std::ostream &os, const std::string &what, T before, T after)
+    {
+        if (before == after)
+        {
+            return;
+        }
+        os << what << ": " << before << " -> " << after;
+        if constexpr (std::is_integral_v<T>)
+        {
+            const auto delta = static_cast<long long>(after) - static_cast<long long>(before);
+            os << " (" << (delta > 0 ? "+" : "") << delta << ")";
+        }
+        os << "\n";
+    }
+
+    static void diffFeatures(std::ostream &os,
+                             const std::string &kind,
+                             const std::vector<PackageFeature> &before,
+                             const std::vector<PackageFeature> &after)
+    {
+        std::map<std::string, std::pair<const PackageFeature *, const PackageFeature *>> features;
+        for (const auto &feature : before)
+        {
+            features[feature.name].first = &feature;
+        }
+        for (const auto &feature : after)
+        {
+            features[feature.name].second = &feature;
+        }
+        for (const auto &entry : features)
+        {
+            const PackageFeature *b = entry.second.first;
+            const PackageFeature *a = entry.second.second;
+            if (a == nullptr)
+            {
+                os << kind << " " << entry.first << " removed: " << describeFeature(*b) << "\n";
+            }
+            else if (b == nullptr)
+            {
+                os << kind << " " << entry.first << " added: " << describeFeature(*a) << "\n";
+            }
+            else
+            {
+                diffValue(os, kind + " " + entry.first, describeFeature(*b), describeFeature(*a));
+            }
+        }
+    }
+
+    std::string diffPackages(const PackageSummary &before, const PackageSummary &after)
+    {
+        std::ostringstream os;
+        diffValue(os, "package bytes", before.packageBytes, after.packageBytes);
+        diffValue(os, "model bytes", before.modelBytes, after.modelBytes);
+        diffValue(os, "weight file bytes", before.weightFileBytes, after.weightFileBytes);
+        diffValue(os, "specification version", before.specificationVersion, after.specificationVersion);
+        diffValue(os, "opset", before.opset, after.opset);
+        diffFeatures(os, "input", before.inputs, after.inputs);
+        diffFeatures(os, "output", before.outputs, after.outputs);
+
+        diffValue(os, "total ops", before.totalOpCount(), after.totalOpCount());
+        std::set<std::string> opTypes;
+        for (const auto &entry : before.opCounts)
+            opTypes.insert(entry.first);
+        for (const auto &entry : after.opCounts)
+            opTypes.insert(entry.first);
+        for (const auto &opType : opTypes)
+        {
+            auto b = before.opCounts.find(opType);
+            auto a = after.opCounts.find(opType);
+            diffValue(os, "ops " + opType, b == before.opCounts.end() ? 0 : b->second, a == after.opCounts.end() ? 0 : a->second);
+        }
+        diffValue(os, "const ops", before.numConstOps, after.numConstOps);
+        diffValue(os, "const op bytes", before.constOpBytes, after.constOpBytes);
+
+        diffValue(os, "total weight bytes", before.totalWeightBytes(), after.totalWeightBytes());
+        diffValue(os, "weight file overhead bytes", before.weightFileOverheadBytes, after.weightFileOverheadBytes);
+        std::map<std::string, std::pair<const PackageLayerWeights *, const PackageLayerWeights *>> layers;
+        for (const auto &layer : before.layerWeights)
+        {
+            layers[layer.name].first = &layer;
+        }
+        for (const auto &layer : after.layerWeights)
+        {
+            layers[layer.name].second = &layer;
+        }
+        for (const auto &entry : layers)
+        {
+            auto describeLayer = [](const PackageLayerWeights &layer)
+            {
+                return layer.opType + " " + layer.dataType + " " + std::to_string(layer.bytes) + " bytes";
+            };
+            const PackageLayerWeights *b = entry.second.first;
+            const PackageLayerWeights *a = entry.second.second;
+            if (a == nullptr)
+            {
+                os << "weights " << entry.first << " removed: " << describeLayer(*b) << "\n";
+            }
+            else if (b == nullptr)
+            {
+                os << "weights " << entry.first << " added: " << describeLayer(*a) << "\n";
+            }
+            else
+            {
+                diffValue(os, "weights " + entry.first, describeLayer(*b), describeLayer(*a));
+            }
+        }
+        return os.str();
+    }
+
+} // namespace KataGoCoreML
@@ -0,0 +1,1148 @@
+#include "ProgramVerifier.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <Model.pb.h>
+#include "CoremltoolsDefines.hpp"
+
+using namespace CoreML::Specification;
+using namespace CoreML::Specification::MILSpec;
+
+namespace KataGoCoreML
+{
+    // Dimensions of a tensor type; unknown dimensions are -1
+    using Shape = std::vector<std::int64_t>;
+
+    static Shape shapeOf(const TensorType &tensorType)
+    {
+        Shape shape;
+        for (const auto &dim : tensorType.dimensions())
+        {
+            shape.push_back(dim.has_constant() ? static_cast<std::int64_t>(dim.constant().size()) : -1);
+        }
+        return shape;
+    }
+
+    static const char *dataTypeName(DataType dataType)
+    {
+        switch (dataType)
+        {
+        case DataType::BOOL:
+            return "bool";
+        case DataType::STRING:
+            return "string";
+        case DataType::FLOAT16:
+            return "fp16";
+        case DataType::FLOAT32:
+            return "fp32";
+        case DataType::FLOAT64:
+            return "fp64";
+        case DataType::INT8:
+            return "int8";
+        case DataType::INT16:
+            return "int16";
+        case DataType::INT32:
+            return "int32";
+        case DataType::INT64:
+            return "int64";
+        case DataType::UINT8:
+            return "uint8";
+        case DataType::UINT16:
+            return "uint16";
+        case DataType::UINT32:
+            return "uint32";
+        case DataType::UINT64:
+            return "uint64";
+        default:
+            return "unknown";
+        }
+    }
+
+    static std::string describe(DataType dataType, const Shape &shape)
+    {
+        std::ostringstream os;
+        os << dataTypeName(dataType) << "[";
+        for (std::size_t i = 0; i < shape.size(); ++i)
+        {
+            os << (i == 0 ? "" : ",");
+            if (shape[i] < 0)
+                os << "?";
+            else
+                os << shape[i];
+        }
+        os << "]";
+        return os.str();
+    }
+
+    static std::string describe(const TensorType &tensorType)
+    {
+        return describe(tensorType.datatype(), shapeOf(tensorType));
+    }
+
+    // Expected type of an op output
+    struct TensorSignature
+    {
+        DataType dataType = DataType::UNUSED_TYPE;
+        Shape shape;
+    };
+
+    static bool matches(const TensorSignature &expected, const TensorType &actual)
+    {
+        return expected.dataType == actual.datatype() && expected.shape == shapeOf(actual);
+    }
+
+    static std::string describe(const TensorSignature &signature)
+    {
+        return describe(signature.dataType, signature.shape);
+    }
+
+    // -1 if a dimension is unknown
+    static std::int64_t elementCount(const Shape &shape)
+    {
+        std::int64_t count = 1;
+        for (auto dim : shape)
+        {
+            if (dim < 0)
+                return -1;
+            count *= dim;
+        }
+        return count;
+    }
+
+    static std::string opLabel(const Operation &op)
+    {
+        auto name = op.attributes().find("name");
+        if (name != op.attributes().end() && name->second.immediatevalue().tensor().strings().values_size() > 0)
+        {
+            return op.type() + " '" + name->second.immediatevalue().tensor().strings().values(0) + "'";
+        }
+        if (op.outputs_size() > 0)
+        {
+            return op.type() + " '" + op.outputs(0).name() + "'";
+        }
+        return op.type();
+    }
+
+    // Checks the ops of one block in order, tracking the values defined so far
+    class BlockVerifier
+    {
+    public:
+        explicit BlockVerifier(std::vector<std::string> &errors)
+            : errors(errors) {}
+
+        void define(const NamedValueType &value, const std::string &where)
+        {
+            if (!values.emplace(value.name(), &value).second)
+            {
+                error(where, "redefines '" + value.name() + "'");
+            }
+            if (!value.type().has_tensortype())
+            {
+                error(where, "'" + value.name() + "' is not a tensor");
+                return;
+            }
+            const TensorType &tensorType = value.type().tensortype();
+            if (tensorType.rank() != tensorType.dimensions_size())
+            {
+                error(where, "'" + value.name() + "' has rank " + std::to_string(tensorType.rank()) + " but " +
+                                 std::to_string(tensorType.dimensions_size()) + " dimensions");
+            }
+        }
+
+        const TensorType *find(const std::string &name) const
+        {
+            auto it = values.find(name);
+            return it == values.end() || !it->second->type().has_tensortype() ? nullptr
+                                                                               : &it->second->type().tensortype();
+        }
+
+        void verify(const Operation &op)
+        {
+            label = opLabel(op);
+
+            // Every argument must be defined before it is read
+            for (const auto &input : op.inputs())
+            {
+                if (input.second.arguments_size() == 0)
+                {
+                    error(label, "has no argument for input '" + input.first + "'");
+                }
+                for (const auto &binding : input.second.arguments())
+                {
+                    if (binding.has_name() && values.count(binding.name()) == 0)
+                    {
+                        error(label, "reads undefined value '" + binding.name() + "' as '" + input.first + "'");
+                    }
+                }
+            }
+
+            if (op.outputs_size() != 1)
+            {
+                error(label, "has " + std::to_string(op.outputs_size()) + " outputs, expected 1");
+            }
+            else
+            {
+                auto rule = rules().find(op.type());
+                if (rule == rules().end())
+                {
+                    error(label, "has no verification rule");
+                }
+                else
+                {
+                    TensorSignature expected;
+                    if ((this->*(rule->second))(op, expected) && op.outputs(0).type().has_tensortype() &&
+                        !matches(expected, op.outputs(0).type().tensortype()))
+                    {
+                        error(label, "declares output " + describe(op.outputs(0).type().tensortype()) +
+                                         ", inferred " + describe(expected));
+                    }
+                }
+            }
+
+            for (const auto &output : op.outputs())
+            {
+                define(output, label);
+                if (op.type() == "const")
+                {
+                    auto val = op.attributes().find("val");
+                    if (val != op.attributes().end() && val->second.has_immediatevalue())
+                    {
+                        constants[output.name()] = &val->second.immediatevalue().tensor();
+                    }
+                }
+            }
+        }
+
+        // Declares the type inferred from the op's inputs as its output type, then verifies it
+        void inferAndVerify(Operation &op)
+        {
+            label = opLabel(op);
+            auto rule = rules().find(op.type());
+            TensorSignature inferred;
+            if (op.outputs_size() == 1 && rule != rules().end() && (this->*(rule->second))(op, inferred) &&
+                op.outputs(0).type().has_tensortype() && !matches(inferred, op.outputs(0).type().tensortype()))
+            {
+                TensorType &tensorType = *op.mutable_outputs(0)->mutable_type()->mutable_tensortype();
+                tensorType.set_datatype(inferred.dataType);
+                tensorType.set_rank(static_cast<std::int64_t>(inferred.shape.size()));
+                tensorType.clear_dimensions();
+                for (auto dim : inferred.shape)
+                {
+                    if (dim < 0)
+                        tensorType.add_dimensions()->mutable_unknown()->set_variadic(false);
+                    else
+                        tensorType.add_dimensions()->mutable_constant()->set_size(static_cast<std::uint64_t>(dim));
+                }
+            }
+            verify(op);
+        }
+
+    private:
+        using Rule = bool (BlockVerifier::*)(const Operation &, TensorSignature &);
+
+        static const std::map<std::string, Rule> &rules()
+        {
+            static const std::map<std::string, Rule> table = {
+                {"add", &BlockVerifier::inferBroadcast},
+                {"cast", &BlockVerifier::inferCast},
+                {"concat", &BlockVerifier::inferConcat},
+                {"const", &BlockVerifier::inferConst},
+                {"constexpr_affine_dequantize", &BlockVerifier::inferAffineDequantize},
+                {"constexpr_sparse_to_dense", &BlockVerifier::inferSparseToDense},
+                {"conv", &BlockVerifier::inferConv},
+                {"dequantize", &BlockVerifier::inferDequantize},
+                {"matmul", &BlockVerifier::inferMatmul},
+                {"mul", &BlockVerifier::inferBroadcast},
+                {"pad", &BlockVerifier::inferPad},
+                {"quantize", &BlockVerifier::inferQuantize},
+                {"real_div", &BlockVerifier::inferBroadcast},
+                {"reduce_max", &BlockVerifier::inferReduce},
+                {"reduce_mean", &BlockVerifier::inferReduce},
+                {"reduce_sum", &BlockVerifier::inferReduce},
+                {"relu", &BlockVerifier::inferUnary},
+                {"reshape", &BlockVerifier::inferReshape},
+                {"slice_by_size", &BlockVerifier::inferSliceBySize},
+                {"transpose", &BlockVerifier::inferTranspose},
+            };
+            return table;
+        }
+
+        void error(const std::string &where, const std::string &message)
+        {
+            errors.push_back(where + " " + message);
+        }
+
+        // Type of a tensor input; reports an error if it is missing
+        const TensorType *input(const Operation &op, const std::string &name)
+        {
+            auto it = op.inputs().find(name);
+            if (it == op.inputs().end() || it->second.arguments_size() == 0)
+            {
+                error(label, "is missing input '" + name + "'");
+                return nullptr;
+            }
+            const auto &binding = it->second.arguments(0);
+            if (binding.has_value())
+            {
+                return binding.value().type().has_tensortype() ? &binding.value().type().tensortype() : nullptr;
+            }
+            return find(binding.name());
+        }
+
+        // Immediate value of a const input; reports an error if it is not one
+        const TensorValue *constantInput(const Operation &op, const std::string &name)
+        {
+            auto it = op.inputs().find(name);
+            if (it == op.inputs().end() || it->second.arguments_size() == 0)
+            {
+                error(label, "is missing input '" + name + "'");
+                return nullptr;
+            }
+            const auto &binding = it->second.arguments(0);
+            if (binding.has_value())
+            {
+                return &binding.value().immediatevalue().tensor();
+            }
+            auto constant = constants.find(binding.name());
+            if (constant == constants.end())
+            {
+                error(label, "input '" + name + "' must be a constant");
+                return nullptr;
+            }
+            return constant->second;
+        }
+
+        bool intsInput(const Operation &op, const std::string &name, std::vector<std::int64_t> &values)
+        {
+            const TensorValue *value = constantInput(op, name);
+            if (value == nullptr)
+                return false;
+            values.assign(value->ints().values().begin(), value->ints().values().end());
+            return true;
+        }
+
+        bool stringInput(const Operation &op, const std::string &name, std::string &string)
+        {
+            const TensorValue *value = constantInput(op, name);
+            if (value == nullptr || value->strings().values_size() != 1)
+            {
+                if (value != nullptr)
+                    error(label, "input '" + name + "' must be one string");
+                return false;
+            }
+            string = value->strings().values(0);
+            return true;
+        }
+
+        const Value *attribute(const Operation &op, const std::string &name)
+        {
+            auto it = op.attributes().find(name);
+            if (it == op.attributes().end())
+            {
+                error(label, "is missing attribute '" + name + "'");
+                return nullptr;
+            }
+            return &it->second;
+        }
+
+        bool inferConst(const Operation &op, TensorSignature &expected)
+        {
+            const Value *val = attribute(op, "val");
+            if (val == nullptr)
+                return false;
+            if (!val->has_immediatevalue() && !val->has_blobfilevalue())
+            {
+                error(label, "has no value");
+            }
+            expected = {val->type().tensortype().datatype(), shapeOf(val->type().tensortype())};
+            return true;
+        }
+
+        bool inferSparseToDense(const Operation &op, TensorSignature &expected)
+        {
+            const Value *nonzeroData = attribute(op, "nonzero_data");
+            const Value *mask = attribute(op, "mask");
+            const Value *shapeValue = attribute(op, "shape");
+            if (nonzeroData == nullptr || mask == nullptr || shapeValue == nullptr)
+                return false;
+
+            // uint32 immediate values are raw little-endian bytes
+            const std::string &bytes = shapeValue->immediatevalue().tensor().bytes().values();
+            Shape shape;
+            for (std::size_t i = 0; i + 4 <= bytes.size(); i += 4)
+            {
+                std::uint32_t dim = 0;
+                for (int b = 0; b < 4; ++b)
+                {
+                    dim |= static_cast<std::uint32_t>(static_cast<unsigned char>(bytes[i + b])) << (8 * b);
+                }
+                shape.push_back(dim);
+            }
+
+            const Shape maskShape = shapeOf(mask->type().tensortype());
+            const std::int64_t maskBytes = (elementCount(shape) + 7) / 8;
+            if (maskShape.size() != 1 || maskShape[0] != maskBytes)
+            {
+                error(label, "has mask " + describe(mask->type().tensortype()) + ", expected " +
+                                 std::to_string(maskBytes) + " bytes");
+            }
+            expected = {nonzeroData->type().tensortype().datatype(), shape};
+            return true;
+        }
+
+        bool inferAffineDequantize(const Operation &op, TensorSignature &expected)
+        {
+            const Value *quantizedData = attribute(op, "quantized_data");
+            const Value *zeroPoint = attribute(op, "zero_point");
+            const Value *scale = attribute(op, "scale");
+            const Value *axis = attribute(op, "axis");
+            if (quantizedData == nullptr || zeroPoint == nullptr || scale == nullptr || axis == nullptr)
+                return false;
+
+            const Shape shape = shapeOf(quantizedData->type().tensortype());
+            const auto &axisValues = axis->immediatevalue().tensor().ints().values();
+            if (axisValues.size() != 1 || axisValues[0] < 0 || axisValues[0] >= static_cast<int>(shape.size()))
+            {
+                error(label, "has an invalid axis");
+                return false;
+            }
+            const Shape channels = {shape[axisValues[0]]};
+            for (const Value *perChannel : {zeroPoint, scale})
+            {
+                const Shape perChannelShape = shapeOf(perChannel->type().tensortype());
+                if (perChannelShape != channels && !perChannelShape.empty())
+                {
+                    error(label, "has per-channel parameters " + describe(perChannel->type().tensortype()) +
+                                     " for " + std::to_string(channels[0]) + " channels");
+                }
+            }
+            expected = {scale->type().tensortype().datatype(), shape};
+            return true;
+        }
+
+        // Checks the scale and zero_point of quantize/dequantize: scalars, or one value per
+        // slice along `axis`, which is required for per-channel parameters
+        bool checkQuantizationParameters(const Operation &op, const Shape &shape, DataType zeroPointType,
+                                         DataType &scaleType)
+        {
+            const TensorType *scale = input(op, "scale");
+            if (scale == nullptr)
+                return false;
+            scaleType = scale->datatype();
+
+            Shape expected;
+            if (op.inputs().count("axis") != 0)
+            {
+                std::vector<std::int64_t> axis;
+                if (!intsInput(op, "axis", axis))
+                    return false;
+                if (axis.size() != 1 || !normalizeAxis(axis[0], shape.size()))
+                    return false;
+                expected = {shape[axis[0]]};
+            }
+
+            std::vector<const TensorType *> parameters = {scale};
+            if (op.inputs().count("zero_point") != 0)
+            {
+                const TensorType *zeroPoint = input(op, "zero_point");
+                if (zeroPoint == nullptr)
+                    return false;
+                if (zeroPoint->datatype() != zeroPointType)
+                {
+                    error(label, "has zero_point " + describe(*zeroPoint) + ", expected " + dataTypeName(zeroPointType));
+                }
+                parameters.push_back(zeroPoint);
+            }
+            for (const TensorType *parameter : parameters)
+            {
+                const Shape parameterShape = shapeOf(*parameter);
+                if (!parameterShape.empty() && parameterShape != expected)
+                {
+                    error(label, "has quantization parameter " + describe(*parameter) + " for " +
+                                     (expected.empty() ? std::string("a per-tensor scale") : describe(scaleType, expected)));
+                }
+            }
+            return true;
+        }
+
+        bool inferQuantize(const Operation &op, TensorSignature &expected)
+        {
+            static const std::map<std::string, DataType> dtypes = {
+                {"int8", DataType::INT8},
+                {"uint8", DataType::UINT8},
+            };
+            const TensorType *x = input(op, "input");
+            std::string dtype;
+            if (x == nullptr || !stringInput(op, "output_dtype", dtype))
+                return false;
+            auto it = dtypes.find(dtype);
+            if (it == dtypes.end())
+            {
+                error(label, "quantizes to unsupported dtype '" + dtype + "'");
+                return false;
+            }
+            const Shape shape = shapeOf(*x);
+            DataType scaleType;
+            if (!checkQuantizationParameters(op, shape, it->second, scaleType))
+                return false;
+            if (scaleType != x->datatype())
+            {
+                error(label, "has " + std::string(dataTypeName(scaleType)) + " scale for " + describe(*x));
+            }
+            expected = {it->second, shape};
+            return true;
+        }
+
+        bool inferDequantize(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "input");
+            if (x == nullptr)
+                return false;
+            if (x->datatype() != DataType::INT8 && x->datatype() != DataType::UINT8)
+            {
+                error(label, "dequantizes " + describe(*x) + ", expected int8 or uint8");
+                return false;
+            }
+            const Shape shape = shapeOf(*x);
+            DataType scaleType;
+            if (!checkQuantizationParameters(op, shape, x->datatype(), scaleType))
+                return false;
+            expected = {scaleType, shape};
+            return true;
+        }
+
+        bool inferCast(const Operation &op, TensorSignature &expected)
+        {
+            static const std::map<std::string, DataType> dtypes = {
+                {"bool", DataType::BOOL},
+                {"fp16", DataType::FLOAT16},
+                {"fp32", DataType::FLOAT32},
+                {"int32", DataType::INT32},
+            };
+            const TensorType *x = input(op, "x");
+            std::string dtype;
+            if (x == nullptr || !stringInput(op, "dtype", dtype))
+                return false;
+            auto it = dtypes.find(dtype);
+            if (it == dtypes.end())
+            {
+                error(label, "casts to unsupported dtype '" + dtype + "'");
+                return false;
+            }
+            expected = {it->second, shapeOf(*x)};
+            return true;
+        }
+
+        // Elementwise binary op with numpy broadcasting
+        bool inferBroadcast(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            const TensorType *y = input(op, "y");
+            if (x == nullptr || y == nullptr)
+                return false;
+            if (x->datatype() != y->datatype())
+            {
+                error(label, "combines " + describe(*x) + " with another type " + describe(*y));
+                return false;
+            }
+
+            // Trailing dimensions are aligned; each pair must be equal, or one of them 1
+            const Shape xShape = shapeOf(*x);
+            const Shape yShape = shapeOf(*y);
+            Shape shape(std::max(xShape.size(), yShape.size()));
+            for (std::size_t i = 0; i < shape.size(); ++i)
+            {
+                const std::int64_t a = i < shape.size() - xShape.size() ? 1 : xShape[i - (shape.size() - xShape.size())];
+                const std::int64_t b = i < shape.size() - yShape.size() ? 1 : yShape[i - (shape.size() - yShape.size())];
+                if (a == 1 || a == b)
+                    shape[i] = b;
+                else if (b == 1)
+                    shape[i] = a;
+                else if (a < 0 || b < 0)
+                    shape[i] = std::max(a, b);
+                else
+                {
+                    error(label, "cannot broadcast " + describe(*x) + " with " + describe(*y));
+                    return false;
+                }
+            }
+            expected = {x->datatype(), shape};
+            return true;
+        }
+
+        // Product of the last two dimensions, with the leading ones broadcast
+        bool inferMatmul(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            const TensorType *y = input(op, "y");
+            bool transposeX = false;
+            bool transposeY = false;
+            if (x == nullptr || y == nullptr || !boolInput(op, "transpose_x", transposeX) ||
+                !boolInput(op, "transpose_y", transposeY))
+                return false;
+            if (x->datatype() != y->datatype())
+            {
+                error(label, "multiplies " + describe(*x) + " with another type " + describe(*y));
+                return false;
+            }
+
+            Shape xShape = shapeOf(*x);
+            Shape yShape = shapeOf(*y);
+            if (xShape.size() < 2 || yShape.size() < 2)
+            {
+                error(label, "multiplies " + describe(*x) + " with " + describe(*y) + ", expected rank 2 or more");
+                return false;
+            }
+            if (transposeX)
+                std::swap(xShape[xShape.size() - 2], xShape[xShape.size() - 1]);
+            if (transposeY)
+                std::swap(yShape[yShape.size() - 2], yShape[yShape.size() - 1]);
+            const std::int64_t inner = xShape.back();
+            const std::int64_t yInner = yShape[yShape.size() - 2];
+            if (inner >= 0 && yInner >= 0 && inner != yInner)
+            {
+                error(label, "multiplies " + describe(*x) + " with " + describe(*y) + ", inner dimensions differ");
+                return false;
+            }
+
+            Shape shape(std::max(xShape.size(), yShape.size()));
+            for (std::size_t i = 0; i + 2 < shape.size(); ++i)
+            {
+                const std::int64_t a = i < shape.size() - xShape.size() ? 1 : xShape[i - (shape.size() - xShape.size())];
+                const std::int64_t b = i < shape.size() - yShape.size() ? 1 : yShape[i - (shape.size() - yShape.size())];
+                if (a == 1 || a == b)
+                    shape[i] = b;
+                else if (b == 1)
+                    shape[i] = a;
+                else if (a < 0 || b < 0)
+                    shape[i] = std::max(a, b);
+                else
+                {
+                    error(label, "cannot broadcast " + describe(*x) + " with " + describe(*y));
+                    return false;
+                }
+            }
+            shape[shape.size() - 2] = xShape[xShape.size() - 2];
+            shape[shape.size() - 1] = yShape.back();
+            expected = {x->datatype(), shape};
+            return true;
+        }
+
+        bool inferUnary(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            if (x == nullptr)
+                return false;
+            expected = {x->datatype(), shapeOf(*x)};
+            return true;
+        }
+
+        bool inferPad(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            std::vector<std::int64_t> pad;
+            std::string mode;
+            if (x == nullptr || !intsInput(op, "pad", pad) || !stringInput(op, "mode", mode))
+                return false;
+            if (input(op, "constant_val") == nullptr)
+                return false;
+
+            Shape shape = shapeOf(*x);
+            // Pads apply to the last pad.size() / 2 dimensions, as (before, after) pairs
+            if (pad.size() % 2 != 0 || pad.size() / 2 > shape.size())
+            {
+                error(label, "has " + std::to_string(pad.size()) + " pad values for rank " +
+                                 std::to_string(shape.size()));
+                return false;
+            }
+            const std::size_t first = shape.size() - pad.size() / 2;
+            for (std::size_t i = 0; i < pad.size() / 2; ++i)
+            {
+                if (shape[first + i] >= 0)
+                    shape[first + i] += pad[2 * i] + pad[2 * i + 1];
+            }
+            expected = {x->datatype(), shape};
+            return true;
+        }
+
+        bool inferSliceBySize(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            std::vector<std::int64_t> begin;
+            std::vector<std::int64_t> size;
+            if (x == nullptr || !intsInput(op, "begin", begin) || !intsInput(op, "size", size))
+                return false;
+
+            const Shape xShape = shapeOf(*x);
+            if (begin.size() != xShape.size() || size.size() != xShape.size())
+            {
+                error(label, "has begin and size of length " + std::to_string(begin.size()) + " and " +
+                                 std::to_string(size.size()) + " for rank " + std::to_string(xShape.size()));
+                return false;
+            }
+            Shape shape(xShape.size());
+            for (std::size_t i = 0; i < xShape.size(); ++i)
+            {
+                // A size of -1 extends to the end of the dimension
+                shape[i] = size[i] < 0 && xShape[i] >= 0 ? xShape[i] - begin[i] : size[i];
+                if (xShape[i] >= 0 && (begin[i] < 0 || begin[i] + shape[i] > xShape[i]))
+                {
+                    error(label, "slices [" + std::to_string(begin[i]) + ", " + std::to_string(begin[i] + shape[i]) +
+                                     ") out of dimension " + std::to_string(i) + " of " + describe(*x));
+                }
+            }
+            expected = {x->datatype(), shape};
+            return true;
+        }
+
+        bool boolInput(const Operation &op, const std::string &name, bool &flag)
+        {
+            const TensorValue *value = constantInput(op, name);
+            if (value == nullptr || value->bools().values_size() != 1)
+            {
+                if (value != nullptr)
+                    error(label, "input '" + name + "' must be one bool");
+                return false;
+            }
+            flag = value->bools().values(0);
+            return true;
+        }
+
+        // Resolves a negative axis; reports an error if it is out of range
+        bool normalizeAxis(std::int64_t &axis, std::size_t rank)
+        {
+            if (axis < 0)
+                axis += static_cast<std::int64_t>(rank);
+            if (axis < 0 || axis >= static_cast<std::int64_t>(rank))
+            {
+                error(label, "has axis " + std::to_string(axis) + " out of rank " + std::to_string(rank));
+                return false;
+            }
+            return true;
+        }
+
+        bool inferReshape(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            std::vector<std::int64_t> shape;
+            if (x == nullptr || !intsInput(op, "shape", shape))
+                return false;
+
+            // One dimension may be -1, inferred from the element count
+            const Shape xShape = shapeOf(*x);
+            const std::int64_t count = elementCount(xShape);
+            std::int64_t known = 1;
+            int inferred = -1;
+            for (std::size_t i = 0; i < shape.size(); ++i)
+            {
+                if (shape[i] == -1 && inferred < 0)
+                    inferred = static_cast<int>(i);
+                else
+                    known *= shape[i];
+            }
+            if (inferred >= 0 && known > 0 && count % known == 0)
+            {
+                shape[inferred] = count / known;
+            }
+            if (count >= 0 && elementCount(shape) != count)
+            {
+                error(label, "reshapes " + describe(*x) + " to " + describe(x->datatype(), shape) +
+                                 ", which has another element count");
+            }
+            expected = {x->datatype(), shape};
+            return true;
+        }
+
+        bool inferTranspose(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            std::vector<std::int64_t> perm;
+            if (x == nullptr || !intsInput(op, "perm", perm))
+                return false;
+
+            const Shape xShape = shapeOf(*x);
+            std::vector<bool> used(xShape.size(), false);
+            Shape shape;
+            for (std::int64_t axis : perm)
+            {
+                if (!normalizeAxis(axis, xShape.size()) || used[axis])
+                {
+                    error(label, "has perm that is not a permutation of the " + std::to_string(xShape.size()) + " axes");
+                    return false;
+                }
+                used[axis] = true;
+                shape.push_back(xShape[axis]);
+            }
+            if (perm.size() != xShape.size())
+            {
+                error(label, "has perm that is not a permutation of the " + std::to_string(xShape.size()) + " axes");
+                return false;
+            }
+            expected = {x->datatype(), shape};
+            return true;
+        }
+
+        bool inferConcat(const Operation &op, TensorSignature &expected)
+        {
+            std::vector<std::int64_t> axisValues;
+            bool interleave = false;
+            if (!intsInput(op, "axis", axisValues) || !boolInput(op, "interleave", interleave))
+                return false;
+            auto values = op.inputs().find("values");
+            if (values == op.inputs().end() || values->second.arguments_size() == 0 || axisValues.size() != 1)
+            {
+                error(label, "needs values and one axis");
+                return false;
+            }
+
+            const TensorType *first = nullptr;
+            Shape shape;
+            std::int64_t axis = axisValues[0];
+            for (const auto &binding : values->second.arguments())
+            {
+                const TensorType *value = binding.has_name() ? find(binding.name()) : nullptr;
+                if (value == nullptr)
+                    return false;
+                const Shape valueShape = shapeOf(*value);
+                if (first == nullptr)
+                {
+                    first = value;
+                    shape = valueShape;
+                    if (!normalizeAxis(axis, shape.size()))
+                        return false;
+                    continue;
+                }
+                bool compatible = value->datatype() == first->datatype() && valueShape.size() == shape.size();
+                for (std::size_t i = 0; compatible && i < shape.size(); ++i)
+                {
+                    compatible = static_cast<std::int64_t>(i) == axis || valueShape[i] == shape[i];
+                }
+                if (!compatible)
+                {
+                    error(label, "concatenates " + describe(*first) + " with " + describe(*value) +
+                                     " along axis " + std::to_string(axis));
+                    return false;
+                }
+                shape[axis] = shape[axis] < 0 || valueShape[axis] < 0 ? -1 : shape[axis] + valueShape[axis];
+            }
+            expected = {first->datatype(), shape};
+            return true;
+        }
+
+        bool inferReduce(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            std::vector<std::int64_t> axes;
+            bool keepDims = false;
+            if (x == nullptr || !intsInput(op, "axes", axes) || !boolInput(op, "keep_dims", keepDims))
+                return false;
+
+            const Shape xShape = shapeOf(*x);
+            std::vector<bool> reduced(xShape.size(), false);
+            for (std::int64_t axis : axes)
+            {
+                if (!normalizeAxis(axis, xShape.size()))
+                    return false;
+                reduced[axis] = true;
+            }
+            Shape shape;
+            for (std::size_t i = 0; i < xShape.size(); ++i)
+            {
+                if (!reduced[i])
+                    shape.push_back(xShape[i]);
+                else if (keepDims)
+                    shape.push_back(1);
+            }
+            expected = {x->datatype(), shape};
+            return true;
+        }
+
+        bool inferConv(const Operation &op, TensorSignature &expected)
+        {
+            const TensorType *x = input(op, "x");
+            const TensorType *weight = input(op, "weight");
+            std::vector<std::int64_t> strides;
+            std::vector<std::int64_t> dilations;
+            std::vector<std::int64_t> pad;
+            std::vector<std::int64_t> groups;
+            std::string padType;
+            if (x == nullptr || weight == nullptr || !intsInput(op, "strides", strides) ||
+                !intsInput(op, "dilations", dilations) || !intsInput(op, "pad", pad) ||
+                !intsInput(op, "groups", groups) || !stringInput(op, "pad_type", padType))
+                return false;
+
+            const Shape xShape = shapeOf(*x);
+            const Shape wShape = shapeOf(*weight);
+            if (xShape.size() != 4 || wShape.size() != 4)
+            {
+                error(label, "convolves " + describe(*x) + " with " + describe(*weight) + ", expected rank 4");
+                return false;
+            }
+            if (x->datatype() != weight->datatype())
+            {
+                error(label, "convolves " + describe(*x) + " with weights of another type " + describe(*weight));
+            }
+            const std::int64_t numGroups = groups.empty() ? 1 : groups[0];
+            if (xShape[1] >= 0 && wShape[1] * numGroups != xShape[1])
+            {
+                error(label, "has weights for " + std::to_string(wShape[1] * numGroups) + " input channels, x " +
+                                 describe(*x) + " has " + std::to_string(xShape[1]));
+            }
+            if (op.inputs().count("bias") > 0)
+            {
+                const TensorType *bias = input(op, "bias");
+                if (bias != nullptr && shapeOf(*bias) != Shape{wShape[0]})
+                {
+                    error(label, "has bias " + describe(*bias) + " for " + std::to_string(wShape[0]) + " output channels");
+                }
+            }
+            if (strides.size() != 2 || dilations.size() != 2 || pad.size() != 4)
+            {
+                error(label, "needs 2 strides, 2 dilations and 4 pad values");
+                return false;
+            }
+
+            Shape shape = {xShape[0], wShape[0], xShape[2], xShape[3]};
+            for (int i = 0; i < 2; ++i)
+            {
+                const std::int64_t in = xShape[2 + i];
+                if (in < 0)
+                    continue;
+                const std::int64_t kernel = dilations[i] * (wShape[2 + i] - 1) + 1;
+                if (padType == "same")
+                    shape[2 + i] = (in + strides[i] - 1) / strides[i];
+                else if (padType == "valid")
+                    shape[2 + i] = (in - kernel) / strides[i] + 1;
+                else if (padType == "custom")
+                    shape[2 + i] = (in + pad[2 * i] + pad[2 * i + 1] - kernel) / strides[i] + 1;
+                else
+                {
+                    error(label, "has unsupported pad_type '" + padType + "'");
+                    return false;
+                }
+            }
+            expected = {x->datatype(), shape};
+            return true;
+        }
+
+        std::vector<std::string> &errors;
+        std::map<std::string, const NamedValueType *> values;
+        std::map<std::string, const TensorValue *> constants;
+        std::string label;
+    };
+
+    static DataType arrayDataType(ArrayFeatureType_ArrayDataType dataType)
+    {
+        switch (dataType)
+        {
+        case ArrayFeatureType_ArrayDataType_FLOAT32:
+            return DataType::FLOAT32;
+        case ArrayFeatureType_ArrayDataType_FLOAT16:
+            return DataType::FLOAT16;
+        case ArrayFeatureType_ArrayDataType_DOUBLE:
+            return DataType::FLOAT64;
+        case ArrayFeatureType_ArrayDataType_INT32:
+            return DataType::INT32;
+        default:
+            return DataType::UNUSED_TYPE;
+        }
+    }
+
+    // Dimensions with a range of sizes are unknown
+    static TensorSignature featureSignature(const FeatureDescription &feature)
+    {
+        const ArrayFeatureType &array = feature.type().multiarraytype();
+        TensorSignature signature = {arrayDataType(array.datatype()), Shape(array.shape().begin(), array.shape().end())};
+        const auto &ranges = array.shaperange().sizeranges();
+        if (array.has_shaperange() && ranges.size() == array.shape_size())
+        {
+            for (int i = 0; i < ranges.size(); ++i)
+            {
+                if (ranges.Get(i).upperbound() != static_cast<std::int64_t>(ranges.Get(i).lowerbound()))
+                    signature.shape[i] = -1;
+            }
+        }
+        return signature;
+    }
+
+    // A feature declared without a shape, as outputs of flexible shape are, only has a data type
+    static bool implementsFeature(const TensorSignature &declared, const TensorType &actual)
+    {
+        return declared.shape.empty() ? declared.dataType == actual.datatype() : matches(declared, actual);
+    }
+
+    static int specificationVersionForOpset(const std::string &opset)
+    {
+        static const std::map<std::string, int> versions = {
+            {OPSET_SPECIFICATION_VERSION_IOS_15, SPECIFICATION_VERSION_IOS_15},
+            {OPSET_SPECIFICATION_VERSION_IOS_16, SPECIFICATION_VERSION_IOS_16},
+            {OPSET_SPECIFICATION_VERSION_IOS_17, SPECIFICATION_VERSION_IOS_17},
+            {OPSET_SPECIFICATION_VERSION_IOS_18, SPECIFICATION_VERSION_IOS_18},
+        };
+        auto it = versions.find(opset);
+        return it == versions.end() ? 0 : it->second;
+    }
+
+    std::vector<std::string> findProgramErrors(const Model &model)
+    {
+        std::vector<std::string> errors;
+        const Program &program = model.mlprogram();
+        auto main = program.functions().find("main");
+        if (main == program.functions().end())
+        {
+            errors.push_back("program has no main function");
+            return errors;
+        }
+
+        for (const auto &function : program.functions())
+        {
+            const std::string where = "function '" + function.first + "'";
+            const std::string &opset = function.second.opset();
+            auto block = function.second.block_specializations().find(opset);
+            if (block == function.second.block_specializations().end())
+            {
+                errors.push_back(where + " has no block for its opset '" + opset + "'");
+                continue;
+            }
+            const int version = specificationVersionForOpset(opset);
+            if (version == 0 || version > model.specificationversion())
+            {
+                errors.push_back(where + " uses opset '" + opset + "', which specification version " +
+                                 std::to_string(model.specificationversion()) + " does not provide");
+            }
+
+            BlockVerifier verifier(errors);
+            for (const auto &input : function.second.inputs())
+            {
+                verifier.define(input, where + " input");
+            }
+            for (const auto &op : block->second.operations())
+            {
+                verifier.verify(op);
+            }
+            for (const auto &output : block->second.outputs())
+            {
+                if (verifier.find(output) == nullptr)
+                {
+                    errors.push_back(where + " outputs undefined value '" + output + "'");
+                }
+            }
+        }
+
+        // The main function implements the model description
+        const Function &function = main->second;
+        const ModelDescription &desc = model.description();
+        if (function.inputs_size() != desc.input_size())
+        {
+            errors.push_back("main function has " + std::to_string(function.inputs_size()) +
+                             " inputs, the model description declares " + std::to_string(desc.input_size()));
+        }
+        for (int i = 0; i < std::min(function.inputs_size(), desc.input_size()); ++i)
+        {
+            const NamedValueType &input = function.inputs(i);
+            const TensorSignature declared = featureSignature(desc.input(i));
+            if (input.name() != desc.input(i).name() || !implementsFeature(declared, input.type().tensortype()))
+            {
+                errors.push_back("main function input " + std::to_string(i) + " is '" + input.name() + "' " +
+                                 describe(input.type().tensortype()) + ", the model description declares '" +
+                                 desc.input(i).name() + "' " + describe(declared));
+            }
+        }
+
+        auto block = function.block_specializations().find(function.opset());
+        if (block != function.block_specializations().end())
+        {
+            std::map<std::string, const TensorType *> produced;
+            for (const auto &input : function.inputs())
+            {
+                produced[input.name()] = &input.type().tensortype();
+            }
+            for (const auto &op : block->second.operations())
+            {
+                for (const auto &output : op.outputs())
+                {
+                    produced[output.name()] = &output.type().tensortype();
+                }
+            }
+            const std::vector<std::string> outputs(block->second.outputs().begin(), block->second.outputs().end());
+            for (const auto &feature : desc.output())
+            {
+                if (std::find(outputs.begin(), outputs.end(), feature.name()) == outputs.end())
+                {
+                    errors.push_back("main function does not output '" + feature.name() +
+                                     "', declared in the model description");
+                }
+            }
+            std::set<std::string> seen;
+            for (const auto &output : outputs)
+            {
+                if (!seen.insert(output).second)
+                {
+                    errors.push_back("main function outputs '" + output + "' twice");
+                }
+                auto feature = std::find_if(desc.output().begin(), desc.output().end(),
+                                            [&](const FeatureDescription &f)
+                                            { return f.name() == output; });
+                auto value = produced.find(output);
+                if (feature == desc.output().end())
+                {
+                    errors.push_back("main function output '" + output + "' is not declared in the model description");
+                }
+                else if (value != produced.end() && !implementsFeature(featureSignature(*feature), *value->second))
+                {
+                    errors.push_back("main function output '" + output + "' is " + describe(*value->second) +
+                                     ", the model description declares " + describe(featureSignature(*feature)));
+                }
+            }
+        }
+        return errors;
+    }
+
+    void inferOutputTypes(Model &model)
+    {
+        auto main = model.mutable_mlprogram()->mutable_functions()->find("main");
+        if (main == model.mutable_mlprogram()->mutable_functions()->end())
+        {
+            return;
+        }
+        Function &function = main->second;
+        auto block = function.mutable_block_specializations()->find(function.opset());
+        if (block == function.mutable_block_specializations()->end())
+        {
+            return;
+        }
+
+        // Problems are left to findProgramErrors
+        std::vector<std::string> errors;
+        BlockVerifier verifier(errors);
+        for (const auto &input : function.inputs())
+        {
+            verifier.define(input, "input");
+        }
+        for (auto &op : *block->second.mutable_operations())
+        {
+            verifier.inferAndVerify(op);
+        }
+    }
+
+    void verifyProgram(const Model &model)
+    {
+        const std::vector<std::string> errors = findProgramErrors(model);
+        if (errors.empty())
+        {
+            return;
+        }
+        std::string message = "Invalid ML program (" + std::to_string(errors.size()) + " errors):";
+        for (const auto &error : errors)
+        {
+            message += "\n  " + error;
+        }
+        throw std::runtime_error(message);
+    }
+
+} // namespace KataGoCoreML
@@ -0,0 +1,231 @@
+#include "QuantizationAnalysis.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <MILBlob/Fp16.hpp>
+
+namespace KataGoCoreML
+{
+    const char *weightPrecisionName(WeightPrecision precision)
+    {
+        switch (precision)
+        {
+        case WeightPrecision::FLOAT32:
+            return "float32";
+        case WeightPrecision::FLOAT16:
+            return "float16";
+        case WeightPrecision::INT8:
+            return "int8";
+        }
+        return "unknown";
+    }
+
+    std::size_t weightPrecisionBytes(WeightPrecision precision)
+    {
+        switch (precision)
+        {
+        case WeightPrecision::FLOAT32:
+            return 4;
+        case WeightPrecision::FLOAT16:
+            return 2;
+        case WeightPrecision::INT8:
+            return 1;
+        }
+        return 4;
+    }
+
+    const PrecisionErrorStats *LayerQuantizationAnalysis::find(WeightPrecision precision) const
+    {
+        for (const auto &s : stats)
+        {
+            if (s.precision == precision)
+            {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    WeightPrecision PrecisionPlan::precisionFor(const std::string &layerName) const
+    {
+        auto it = layers.find(layerName);
+        return it == layers.end() ? defaultPrecision : it->second;
+    }
+
+    bool PrecisionPlan::uses(WeightPrecision precision) const
+    {
+        if (defaultPrecision == precision)
+        {
+            return true;
+        }
+        for (const auto &entry : layers)
+        {
+            if (entry.second == precision)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<float> roundTripFloat16(const WeightArray &weights)
+    {
+        std::vector<float> rounded(weights.size());
+        for (std::size_t i = 0; i < weights.size(); ++i)
+        {
+            rounded[i] = MILBlob::Fp16::FromFloat(weights[i]).GetFloat();
+        }
+        return rounded;
+    }
+
+    void quantizeInt8PerChannel(const WeightArray &weights,
+                                int numChannels,
+                                std::vector<int8_t> &quantized,
+                                std::vector<float> &scales)
+    {
+        if (numChannels <= 0 || weights.size() % numChannels != 0)
+        {
+            throw std::invalid_argument("Weights cannot be split into " + std::to_string(numChannels) + " channels");
+        }
+
+        const std::size_t sliceSize = weights.size() / numChannels;
+        quantized.resize(weights.size());
+        scales.resize(numChannels);
+
+        for (int c = 0; c < numChannels; ++c)
+        {
+            const float *slice = weights.data() + c * sliceSize;
+            float maxAbs = 0.0f;
+            for (std::size_t i = 0; i < sliceSize; ++i)
+            {
+                maxAbs = std::max(maxAbs, std::fabs(slice[i]));
+            }
+
+            // An all-zero channel still needs a non-zero scale to be a valid dequantization
+            const float scale = maxAbs > 0.0f ? maxAbs / 127.0f : 1.0f;
+            scales[c] = scale;
+
+            for (std::size_t i = 0; i < sliceSize; ++i)
+            {
+                const float q = std::round(slice[i] / scale);
+                quantized[c * sliceSize + i] = static_cast<int8_t>(std::clamp(q, -127.0f, 127.0f));
+            }
+        }
+    }
+
+    static std::vector<float> roundTripInt8(const WeightArray &weights, int numChannels)
+    {
+        std::vector<int8_t> quantized;
+        std::vector<float> scales;
+        quantizeInt8PerChannel(weights, numChannels, quantized, scales);
+
+        const std::size_t sliceSize = weights.size() / numChannels;
+        std::vector<float> rounded(weights.size());
+        for (std::size_t i = 0; i < weights.size(); ++i)
+        {
+            rounded[i] = quantized[i] * scales[i / sliceSize];
+        }
+        return rounded;
+    }
+
+    static PrecisionErrorStats computeErrorStats(WeightPrecision precision,
+                                                 const WeightArray &weights,
+                                                 const std::vector<float> &rounded)
+    {
+        double signal = 0.0;
+        double noise = 0.0;
+        double maxAbsError = 0.0;
+        for (std::size_t i = 0; i < weights.size(); ++i)
+        {
+            const double error = static_cast<double>(weights[i]) - rounded[i];
+            signal += static_cast<double>(weights[i]) * weights[i];
+            noise += error * error;
+            maxAbsError = std::max(maxAbsError, std::fabs(error));
+        }
+
+        const double snrDb = noise > 0.0 ? 10.0 * std::log10(signal / noise)
+                                         : std::numeric_limits<double>::infinity();
+        return {precision, snrDb, maxAbsError};
+    }
+
+    static LayerQuantizationAnalysis analyzeLayer(const std::string &name,
+                                                  const WeightArray &weights,
+                                                  int numChannels,
+                                                  const std::vector<WeightPrecision> &candidates)
+    {
+        LayerQuantizationAnalysis layer;
+        layer.name = name;
+        layer.numWeights = weights.size();
+
+        for (WeightPrecision precision : candidates)
+        {
+            switch (precision)
+            {
+            case WeightPrecision::FLOAT32:
+                layer.stats.push_back({precision, std::numeric_limits<double>::infinity(), 0.0});
+                break;
+            case WeightPrecision::FLOAT16:
+                layer.stats.push_back(computeErrorStats(precision, weights, roundTripFloat16(weights)));
+                break;
+            case WeightPrecision::INT8:
+                layer.stats.push_back(computeErrorStats(precision, weights, roundTripInt8(weights, numChannels)));
+                break;
+            }
+        }
+        return layer;
+    }
+
+    std::vector<LayerQuantizationAnalysis> analyzeQuantizationError(
+        const ModelDesc &modelDesc,
+        const std::vector<WeightPrecision> &candidates)
+    {
+        std::vector<LayerQuantizationAnalysis> analysis;
+
+        // Conv weights are outC x inC x H x W, quantize per output channel
+        forEachConvLayer(modelDesc,
+                         [&](const ConvLayerDesc &conv)
+                         {
+                             if (!conv.weights.empty())
+                             {
+                                 analysis.push_back(analyzeLayer(conv.name, conv.weights, conv.outChannels, candidates));
+                             }
+                         });
+
+        // MatMul weights are inC x outC, quantize per input row
+        forEachMatMulLayer(modelDesc,
+                           [&](const MatMulLayerDesc &matMul)
+                           {
+                               if (!matMul.weights.empty())
+                               {
+                                   analysis.push_back(analyzeLayer(matMul.name, matMul.weights, matMul.inChannels, candidates));
+                               }
+                           });
+
+        return analysis;
+    }
+
+    PrecisionPlan selectMixedPrecision(const std::vector<LayerQuantizationAnalysis> &analysis,
+                                       const QuantizationErrorBudget &budget)
+    {
+        PrecisionPlan plan;
+
+        for (const auto &layer : analysis)
+        {
+            WeightPrecision chosen = WeightPrecision::FLOAT32;
+            for (const auto &s : layer.stats)
+            {
+                const bool withinBudget = s.snrDb >= budget.minSnrDb && s.maxAbsError <= budget.maxAbsError;
+                if (withinBudget && weightPrecisionBytes(s.precision) < weightPrecisionBytes(chosen))
+                {
+                    chosen = s.precision;
+                }
+            }
+            plan.layers[layer.name] = chosen;
+        }
+
+        return plan;
+    }
+
+} // namespace KataGoCoreML
@@ -0,0 +1,288 @@
+#include "Sha256.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define KATAGOCOREML_SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define KATAGOCOREML_SHA256_ARM
+#include <arm_neon.h>
+#endif
+
+namespace KataGoCoreML
+{
+    static const std::uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+    static inline std::uint32_t rotr(std::uint32_t x, int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    using CompressFunction = void (*)(std::uint32_t *state, const std::uint8_t *blocks, std::size_t numBlocks);
+
+    static void compressPortable(std::uint32_t *state, const std::uint8_t *blocks, std::size_t numBlocks)
+    {
+        for (; numBlocks > 0; --numBlocks, blocks += 64)
+        {
+            std::uint32_t w[64];
+            for (int i = 0; i < 16; ++i)
+            {
+                w[i] = (std::uint32_t(blocks[4 * i]) << 24) | (std::uint32_t(blocks[4 * i + 1]) << 16) |
+                       (std::uint32_t(blocks[4 * i + 2]) << 8) | std::uint32_t(blocks[4 * i + 3]);
+            }
+            for (int i = 16; i < 64; ++i)
+            {
+                const std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                const std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; ++i)
+            {
+                const std::uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+                const std::uint32_t ch = (e & f) ^ (~e & g);
+                const std::uint32_t t1 = h + s1 + ch + K[i] + w[i];
+                const std::uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+                const std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                const std::uint32_t t2 = s0 + maj;
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+    }
+
+#if defined(KATAGOCOREML_SHA256_X86)
+    // SHA-NI keeps the state as ABEF and CDGH and runs two rounds per sha256rnds2
+    __attribute__((target("sha,sse4.1"))) static void compressShaNi(std::uint32_t *state,
+                                                                      const std::uint8_t *blocks,
+                                                                      std::size_t numBlocks)
+    {
+        const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+        const __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0])), 0xB1);
+        const __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4])), 0x1B);
+        __m128i abef = _mm_alignr_epi8(dcba, efgh, 8);
+        __m128i cdgh = _mm_blend_epi16(efgh, dcba, 0xF0);
+
+        for (; numBlocks > 0; --numBlocks, blocks += 64)
+        {
+            const __m128i abefSaved = abef;
+            const __m128i cdghSaved = cdgh;
+            __m128i w[4];
+            for (int i = 0; i < 4; ++i)
+            {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(blocks + 16 * i)), byteSwap);
+            }
+            // Four rounds per step; w[i % 4] then becomes the schedule words of step i + 4
+            for (int i = 0; i < 16; ++i)
+            {
+                const __m128i wk = _mm_add_epi32(w[i % 4], _mm_loadu_si128(reinterpret_cast<const __m128i *>(&K[4 * i])));
+                cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+                abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E));
+                if (i < 12)
+                {
+                    __m128i next = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+                    next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+                    w[i % 4] = _mm_sha256msg2_epu32(next, w[(i + 3) % 4]);
+                }
+            }
+            abef = _mm_add_epi32(abef, abefSaved);
+            cdgh = _mm_add_epi32(cdgh, cdghSaved);
+        }
+
+        const __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+        const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), _mm_blend_epi16(feba, dchg, 0xF0));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), _mm_alignr_epi8(dchg, feba, 8));
+    }
+
+    static bool cpuHasShaNi()
+    {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & bit_SSE4_1) == 0)
+        {
+            return false;
+        }
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) != 0;
+    }
+#elif defined(KATAGOCOREML_SHA256_ARM)
+    // The cryptography extension keeps the state as ABCD and EFGH and runs four rounds per
+    // sha256h/sha256h2 pair
+    static void compressArmv8(std::uint32_t *state, const std::uint8_t *blocks, std::size_t numBlocks)
+    {
+        uint32x4_t abcd = vld1q_u32(&state[0]);
+        uint32x4_t efgh = vld1q_u32(&state[4]);
+
+        for (; numBlocks > 0; --numBlocks, blocks += 64)
+        {
+            const uint32x4_t abcdSaved = abcd;
+            const uint32x4_t efghSaved = efgh;
+            uint32x4_t w[4];
+            for (int i = 0; i < 4; ++i)
+            {
+                w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + 16 * i)));
+            }
+            // Four rounds per step; w[i % 4] then becomes the schedule words of step i + 4
+            for (int i = 0; i < 16; ++i)
+            {
+                const uint32x4_t wk = vaddq_u32(w[i % 4], vld1q_u32(&K[4 * i]));
+                if (i < 12)
+                {
+                    w[i % 4] = vsha256su1q_u32(vsha256su0q_u32(w[i % 4], w[(i + 1) % 4]), w[(i + 2) % 4], w[(i + 3) % 4]);
+                }
+                const uint32x4_t abcdBefore = abcd;
+                abcd = vsha256hq_u32(abcd, efgh, wk);
+                efgh = vsha256h2q_u32(efgh, abcdBefore, wk);
+            }
+            abcd = vaddq_u32(abcd, abcdSaved);
+            efgh = vaddq_u32(efgh, efghSaved);
+        }
+
+        vst1q_u32(&state[0], abcd);
+        vst1q_u32(&state[4], efgh);
+    }
+#endif
+
+    static CompressFunction selectCompressFunction()
+    {
+#if defined(KATAGOCOREML_SHA256_X86)
+        if (cpuHasShaNi())
+        {
+            return compressShaNi;
+        }
+#elif defined(KATAGOCOREML_SHA256_ARM)
+        return compressArmv8;
+#endif
+        return compressPortable;
+    }
+
+    static std::atomic<bool> hardwareAccelerationEnabled{true};
+
+    static CompressFunction compressFunction()
+    {
+        static const CompressFunction compress = selectCompressFunction();
+        return hardwareAccelerationEnabled.load(std::memory_order_relaxed) ? compress : compressPortable;
+    }
+
+    bool Sha256::isHardwareAccelerated()
+    {
+        return compressFunction() != compressPortable;
+    }
+
+    void Sha256::setHardwareAccelerationEnabled(bool enabled)
+    {
+        hardwareAccelerationEnabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    Sha256::Sha256()
+        : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}
+    {
+    }
+
+    void Sha256::processBlocks(const std::uint8_t *blocks, std::size_t numBlocks)
+    {
+        compressFunction()(state.data(), blocks, numBlocks);
+    }
+
+    void Sha256::update(const void *data, std::size_t size)
+    {
+        // data may be null when size is 0, which memcpy does not allow
+        if (size == 0)
+        {
+            return;
+        }
+        const std::uint8_t *bytes = static_cast<const std::uint8_t *>(data);
+        totalBytes += size;
+
+        if (bufferSize > 0)
+        {
+            const std::size_t n = std::min(size, buffer.size() - bufferSize);
+            std::memcpy(buffer.data() + bufferSize, bytes, n);
+            bufferSize += n;
+            bytes += n;
+            size -= n;
+            if (bufferSize < buffer.size())
+            {
+                return;
+            }
+            processBlocks(buffer.data(), 1);
+            bufferSize = 0;
+        }
+
+        const std::size_t numBlocks = size / buffer.size();
+        processBlocks(bytes, numBlocks);
+        bytes += numBlocks * buffer.size();
+        size -= numBlocks * buffer.size();
+
+        std::memcpy(buffer.data(), bytes, size);
+        bufferSize = size;
+    }
+
+    std::array<std::uint8_t, 32> Sha256::digest()
+    {
+        const std::uint64_t totalBits = totalBytes * 8;
+        const std::uint8_t pad = 0x80;
+        update(&pad, 1);
+        const std::uint8_t zero = 0;
+        while (bufferSize != 56)
+        {
+            update(&zero, 1);
+        }
+        std::uint8_t length[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            length[i] = static_cast<std::uint8_t>(totalBits >> (56 - 8 * i));
+        }
+        update(length, sizeof(length));
+
+        std::array<std::uint8_t, 32> result;
+        for (int i = 0; i < 8; ++i)
+        {
+            result[4 * i] = static_cast<std::uint8_t>(state[i] >> 24);
+            result[4 * i + 1] = static_cast<std::uint8_t>(state[i] >> 16);
+            result[4 * i + 2] = static_cast<std::uint8_t>(state[i] >> 8);
+            result[4 * i + 3] = static_cast<std::uint8_t>(state[i]);
+        }
+        return result;
+    }
+
+    std::string Sha256::hexDigest()
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::string s;
+        for (std::uint8_t byte : digest())
+        {
+            s += hex[byte >> 4];
+            s += hex[byte & 0xf];
+        }
+        return s;
+    }
+
+} // namespace KataGoCoreML
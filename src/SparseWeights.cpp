@@ -0,0 +1,65 @@
+#include "SparseWeights.hpp"
+
+namespace KataGoCoreML
+{
+    static std::size_t countZeros(const WeightArray &weights)
+    {
+        std::size_t zeros = 0;
+        for (float w : weights)
+        {
+            if (w == 0.0f)
+            {
+                zeros++;
+            }
+        }
+        return zeros;
+    }
+
+    double weightSparsity(const WeightArray &weights)
+    {
+        return weights.empty() ? 0.0 : static_cast<double>(countZeros(weights)) / weights.size();
+    }
+
+    std::vector<LayerSparsity> analyzeWeightSparsity(const ModelDesc &modelDesc)
+    {
+        std::vector<LayerSparsity> layers;
+
+        forEachConvLayer(modelDesc,
+                         [&](const ConvLayerDesc &conv)
+                         {
+                             if (!conv.weights.empty())
+                             {
+                                 layers.push_back({conv.name, conv.weights.size(), countZeros(conv.weights)});
+                             }
+                         });
+
+        forEachMatMulLayer(modelDesc,
+                           [&](const MatMulLayerDesc &matMul)
+                           {
+                               if (!matMul.weights.empty())
+                               {
+                                   layers.push_back({matMul.name, matMul.weights.size(), countZeros(matMul.weights)});
+                               }
+                           });
+
+        return layers;
+    }
+
+    void encodeSparseWeights(const WeightArray &weights,
+                             std::vector<float> &nonzeroData,
+                             std::vector<uint8_t> &mask)
+    {
+        nonzeroData.clear();
+        mask.assign((weights.size() + 7) / 8, 0);
+
+        for (std::size_t i = 0; i < weights.size(); ++i)
+        {
+            if (weights[i] != 0.0f)
+            {
+                nonzeroData.push_back(weights[i]);
+                mask[i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+            }
+        }
+    }
+
+} // namespace KataGoCoreML
@@ -1,47 +1,1898 @@
+#include "ChannelPadding.hpp"
+#include "ChannelPruning.hpp"
+#include "ConversionTask.hpp"
+#include "CostModel.hpp"
+#include "MetadataFolding.hpp"
 #include "ModelBuilder.hpp"
+#include "ModelCache.hpp"
+#include "OpBuilder.hpp"
+#include "OpFusion.hpp"
+#include "OpScheduling.hpp"
+#include "PackageInspection.hpp"
+#include "ProgramVerifier.hpp"
+#include "Sha256.hpp"
 
-#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <MILBlob/Blob/StorageReader.hpp>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <Model.pb.h>
 
-int main()
+using namespace KataGoCoreML;
+using namespace CoreML::Specification;
+namespace fs = std::filesystem;
+
+namespace
 {
-    KataGoCoreML::ModelDesc modelDesc;
+    bool fail(const std::string &message)
+    {
+        std::cerr << "❌ " << message << std::endl;
+        return false;
+    }
+
+    std::vector<float> randomValues(std::mt19937 &rng, std::size_t size, float low, float high)
+    {
+        std::uniform_real_distribution<float> distribution(low, high);
+        std::vector<float> values(size);
+        for (float &value : values)
+        {
+            value = distribution(rng);
+        }
+        return values;
+    }
+
+    ConvLayerDesc makeConv(std::mt19937 &rng, const std::string &name, int inChannels, int outChannels, int kernelSize)
+    {
+        ConvLayerDesc conv;
+        conv.name = name;
+        conv.convYSize = kernelSize;
+        conv.convXSize = kernelSize;
+        conv.inChannels = inChannels;
+        conv.outChannels = outChannels;
+        conv.weights = randomValues(rng, static_cast<std::size_t>(outChannels) * inChannels * kernelSize * kernelSize,
+                                    -0.5f, 0.5f);
+        return conv;
+    }
+
+    BatchNormLayerDesc makeBatchNorm(std::mt19937 &rng, const std::string &name, int numChannels)
+    {
+        BatchNormLayerDesc bn;
+        bn.name = name;
+        bn.numChannels = numChannels;
+        bn.hasScale = true;
+        bn.hasBias = true;
+        bn.mean = randomValues(rng, numChannels, -0.5f, 0.5f);
+        bn.variance = randomValues(rng, numChannels, 0.5f, 1.5f);
+        bn.scale = randomValues(rng, numChannels, 0.5f, 1.5f);
+        bn.bias = randomValues(rng, numChannels, -0.5f, 0.5f);
+        return bn;
+    }
+
+    template <typename T>
+    unique_ptr_void makeBlock(T *block)
+    {
+        return unique_ptr_void(block, [](const void *p)
+                               { delete static_cast<const T *>(p); });
+    }
+
+    // A trunk of ordinary residual blocks with random weights; the same seed gives the same model
+    ModelDesc makeTrunkModelDesc(unsigned seed, int numInputChannels, int trunkChannels, int midChannels, int numBlocks)
+    {
+        std::mt19937 rng(seed);
+        ModelDesc desc;
+        desc.name = "test_trunk";
+        desc.modelVersion = 14;
+        desc.numInputChannels = numInputChannels;
+        desc.numInputGlobalChannels = 19;
+        desc.numPolicyChannels = 1;
+        desc.numValueChannels = 3;
+        desc.numScoreValueChannels = 1;
+        desc.numOwnershipChannels = 1;
+
+        TrunkDesc &trunk = desc.trunk;
+        trunk.modelVersion = desc.modelVersion;
+        trunk.numBlocks = numBlocks;
+        trunk.trunkNumChannels = trunkChannels;
+        trunk.midNumChannels = midChannels;
+        trunk.initialConv = makeConv(rng, "conv1", numInputChannels, trunkChannels, 3);
+        for (int i = 0; i < numBlocks; ++i)
+        {
+            const std::string name = "rconv" + std::to_string(i + 1);
+            auto *block = new ResidualBlockDesc();
+            trunk.blocks.emplace_back(ORDINARY_BLOCK_KIND, makeBlock(block));
+            block->name = name;
+            block->preBN = makeBatchNorm(rng, name + ".norm1", trunkChannels);
+            block->regularConv = makeConv(rng, name + ".conv1", trunkChannels, midChannels, 3);
+            block->midBN = makeBatchNorm(rng, name + ".norm2", midChannels);
+            block->finalConv = makeConv(rng, name + ".conv2", midChannels, trunkChannels, 3);
+        }
+        trunk.trunkTipBN = makeBatchNorm(rng, "trunk/norm", trunkChannels);
+        return desc;
+    }
+
+    // Reference evaluation of a trunk of ordinary blocks on one C x H x W board, ignoring the
+    // global inputs, used to check that rewrites of a ModelDesc keep its outputs
+    using Planes = std::vector<float>;
+
+    Planes applyConv(const ConvLayerDesc &conv, const Planes &input, int h, int w)
+    {
+        Planes output(static_cast<std::size_t>(conv.outChannels) * h * w, 0.0f);
+        for (int oc = 0; oc < conv.outChannels; ++oc)
+            for (int ic = 0; ic < conv.inChannels; ++ic)
+                for (int ky = 0; ky < conv.convYSize; ++ky)
+                    for (int kx = 0; kx < conv.convXSize; ++kx)
+                    {
+                        const float weight =
+                            conv.weights[((static_cast<std::size_t>(oc) * conv.inChannels + ic) * conv.convYSize + ky) *
+                                             conv.convXSize + kx];
+                        const int dy = (ky - conv.convYSize / 2) * conv.dilationY;
+                        const int dx = (kx - conv.convXSize / 2) * conv.dilationX;
+                        for (int y = 0; y < h; ++y)
+                            for (int x = 0; x < w; ++x)
+                            {
+                                if (y + dy < 0 || y + dy >= h || x + dx < 0 || x + dx >= w)
+                                    continue;
+                                output[(static_cast<std::size_t>(oc) * h + y) * w + x] +=
+                                    weight * input[(static_cast<std::size_t>(ic) * h + y + dy) * w + x + dx];
+                            }
+                    }
+        return output;
+    }
+
+    Planes applyBatchNormActivation(const BatchNormLayerDesc &bn, const ActivationLayerDesc &activation,
+                                    const Planes &input, int area)
+    {
+        Planes output(input.size());
+        for (int c = 0; c < bn.numChannels; ++c)
+        {
+            const float scale = bn.hasScale ? bn.scale[c] : 1.0f;
+            const float bias = bn.hasBias ? bn.bias[c] : 0.0f;
+            for (int i = 0; i < area; ++i)
+            {
+                const std::size_t index = static_cast<std::size_t>(c) * area + i;
+                float x = (input[index] - bn.mean[c]) * scale / std::sqrt(bn.variance[c] + bn.epsilon) + bias;
+                if (activation.activation == ACTIVATION_RELU)
+                    x = x > 0.0f ? x : 0.0f;
+                else if (activation.activation == ACTIVATION_MISH)
+                    x = x * std::tanh(std::log1p(std::exp(x)));
+                output[index] = x;
+            }
+        }
+        return output;
+    }
+
+    // `trunkBias` is added after the initial convolution, as the metadata encoder output is
+    Planes evaluateTrunk(const ModelDesc &desc, const Planes &input, int h, int w,
+                         const std::vector<float> &trunkBias = {})
+    {
+        const TrunkDesc &trunk = desc.trunk;
+        Planes x = applyConv(trunk.initialConv, input, h, w);
+        for (std::size_t c = 0; c < trunkBias.size(); ++c)
+            for (int i = 0; i < h * w; ++i)
+                x[c * h * w + i] += trunkBias[c];
+        for (const auto &block : trunk.blocks)
+        {
+            const auto *b = static_cast<const ResidualBlockDesc *>(block.second.get());
+            Planes y = applyBatchNormActivation(b->preBN, b->preActivation, x, h * w);
+            y = applyConv(b->regularConv, y, h, w);
+            y = applyBatchNormActivation(b->midBN, b->midActivation, y, h * w);
+            y = applyConv(b->finalConv, y, h, w);
+            for (std::size_t i = 0; i < x.size(); ++i)
+                x[i] += y[i];
+        }
+        return applyBatchNormActivation(trunk.trunkTipBN, trunk.trunkTipActivation, x, h * w);
+    }
+
+    // Declares the inputs of a model to a builder
+    void addModelInputs(ModelBuilder &builder, const ModelDesc &desc, int nnXLen, int nnYLen)
+    {
+        InputFeature inputSpatial(INPUT_SPATIAL_NAME, {1, desc.numInputChannels, nnYLen, nnXLen});
+        builder.addInputFeature(inputSpatial);
+        InputFeature inputGlobal(INPUT_GLOBAL_NAME, {1, desc.numInputGlobalChannels});
+        builder.addInputFeature(inputGlobal);
+    }
+
+    fs::path findPackageFile(const std::string &packagePath, const std::string &fileName)
+    {
+        for (const auto &entry : fs::recursive_directory_iterator(packagePath))
+        {
+            if (entry.path().filename() == fileName)
+            {
+                return entry.path();
+            }
+        }
+        throw std::runtime_error("No " + fileName + " in " + packagePath);
+    }
+
+    Model readPackageModel(const std::string &packagePath)
+    {
+        const fs::path path = findPackageFile(packagePath, "model.mlmodel");
+        std::ifstream in(path, std::ios::binary);
+        Model model;
+        if (!model.ParseFromIstream(&in))
+        {
+            throw std::runtime_error("Failed to parse " + path.string());
+        }
+        return model;
+    }
+
+    const MILSpec::Block &mainBlock(const Model &model)
+    {
+        const MILSpec::Function &function = model.mlprogram().functions().at("main");
+        return function.block_specializations().at(function.opset());
+    }
+
+    // The op producing the value `name`, or nullptr
+    const MILSpec::Operation *findProducer(const MILSpec::Block &block, const std::string &name)
+    {
+        for (const auto &op : block.operations())
+        {
+            for (const auto &output : op.outputs())
+            {
+                if (output.name() == name)
+                {
+                    return &op;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Name of the value bound to input `input` of `op`, empty if unbound
+    std::string inputName(const MILSpec::Operation &op, const std::string &input)
+    {
+        auto it = op.inputs().find(input);
+        return it == op.inputs().end() || it->second.arguments_size() == 0 ? "" : it->second.arguments(0).name();
+    }
+
+    // Static shape of the value `name` produced by an op of the block, empty if there is none
+    std::vector<std::int64_t> valueShape(const MILSpec::Block &block, const std::string &name)
+    {
+        std::vector<std::int64_t> shape;
+        const MILSpec::Operation *op = findProducer(block, name);
+        if (op != nullptr)
+        {
+            for (const auto &output : op->outputs())
+            {
+                if (output.name() == name)
+                {
+                    for (const auto &dim : output.type().tensortype().dimensions())
+                    {
+                        shape.push_back(dim.constant().size());
+                    }
+                }
+            }
+        }
+        return shape;
+    }
+
+    // A feature of the model description, or nullptr
+    const FeatureDescription *findFeature(const google::protobuf::RepeatedPtrField<FeatureDescription> &features,
+                                          const std::string &name)
+    {
+        for (const auto &feature : features)
+        {
+            if (feature.name() == name)
+            {
+                return &feature;
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<std::int64_t> featureShape(const FeatureDescription &feature)
+    {
+        const auto &shape = feature.type().multiarraytype().shape();
+        return std::vector<std::int64_t>(shape.begin(), shape.end());
+    }
+
+    std::vector<std::string> featureNames(const google::protobuf::RepeatedPtrField<FeatureDescription> &features)
+    {
+        std::vector<std::string> names;
+        for (const auto &feature : features)
+        {
+            names.push_back(feature.name());
+        }
+        return names;
+    }
+
+    // Values of an int32 const op, empty if `name` is not one
+    std::vector<int> constInts(const MILSpec::Block &block, const std::string &name)
+    {
+        const MILSpec::Operation *op = findProducer(block, name);
+        if (op == nullptr || op->type() != "const" || op->attributes().count("val") == 0)
+        {
+            return {};
+        }
+        const auto &values = op->attributes().at("val").immediatevalue().tensor().ints().values();
+        return std::vector<int>(values.begin(), values.end());
+    }
+
+    bool testBasicConversion()
+    {
+        ModelDesc modelDesc;
+
+        modelDesc.modelVersion = 3;
+        modelDesc.numPolicyChannels = 1;
+        modelDesc.numValueChannels = 3;
+        modelDesc.numScoreValueChannels = 1;
+        modelDesc.numOwnershipChannels = 1;
+
+        const int nnXLen = 19;
+        const int nnYLen = 19;
+
+        ModelBuilder builder(modelDesc, nnXLen, nnYLen);
+
+        // Input spatial feature
+        const int batchSize = 1;
+        const int numSpatialFeatures = 22;
+
+        InputFeature inputSpatial("input_spatial", {batchSize, numSpatialFeatures, nnYLen, nnXLen});
+
+        builder.addInputFeature(inputSpatial);
+
+        // Input global feature
+        const int numGlobalFeatures = 19;
+        InputFeature inputGlobal("input_global", {batchSize, numGlobalFeatures});
+        builder.addInputFeature(inputGlobal);
+
+        // Record a conversion report alongside the package
+        const std::string reportPath = "test_output_report.json";
+        builder.setReportPath(reportPath);
+
+        // Create a CoreML package with the model builder
+        const std::string outputPath = "test_output.mlpackage";
+        builder.createMLPackage(outputPath);
+
+        if (!std::filesystem::exists(outputPath))
+        {
+            return fail("Output file was not created.");
+        }
+
+        const ConversionReport &report = builder.getReport();
+        if (!std::filesystem::exists(reportPath) || report.totalOpCount() == 0 || report.totalWeightBytes() == 0)
+        {
+            return fail("Conversion report is missing or empty.");
+        }
+
+        // A second conversion of the same model must give a byte-identical package
+        const std::string firstHash = report.packageSha256;
+        const std::string secondOutputPath = "test_output_2.mlpackage";
+        builder.createMLPackage(secondOutputPath);
+        if (firstHash.empty() || builder.getReport().packageSha256 != firstHash)
+        {
+            return fail("Conversion output is not deterministic.");
+        }
+
+        std::cout << "✅ Successfully built a CoreML package at " << outputPath << std::endl;
+        return true;
+    }
+
+    // Padding channels, including those of the spatial input, must not change the real channels
+    bool testChannelPadding()
+    {
+        const int h = 5;
+        const int w = 4;
+        ModelDesc desc = makeTrunkModelDesc(1, 22, 12, 6, 2);
+        ModelDesc paddedDesc = makeTrunkModelDesc(1, 22, 12, 6, 2);
+        // A batch norm without scale normalizes with scale 1
+        for (ModelDesc *d : {&desc, &paddedDesc})
+        {
+            d->trunk.trunkTipBN.hasScale = false;
+            d->trunk.trunkTipBN.scale = WeightArray();
+        }
+        padModelChannels(paddedDesc, 8);
+        if (paddedDesc.trunk.initialConv.inChannels != 24 || paddedDesc.trunk.trunkNumChannels != 16 ||
+            paddedDesc.trunk.midNumChannels != 8 || paddedDesc.numInputChannels != 22)
+        {
+            return fail("Channel padding gave unexpected channel counts.");
+        }
+
+        std::mt19937 rng(2);
+        const Planes input = randomValues(rng, static_cast<std::size_t>(22) * h * w, -1.0f, 1.0f);
+        Planes paddedInput = input;
+        paddedInput.resize(static_cast<std::size_t>(24) * h * w, 0.0f);
+
+        const Planes output = evaluateTrunk(desc, input, h, w);
+        const Planes paddedOutput = evaluateTrunk(paddedDesc, paddedInput, h, w);
+        for (std::size_t i = 0; i < paddedOutput.size(); ++i)
+        {
+            const float expected = i < output.size() ? output[i] : 0.0f;
+            if (paddedOutput[i] != expected)
+            {
+                return fail("Channel padding changed the trunk output at " + std::to_string(i) + ".");
+            }
+        }
+
+        // The graph pads its input for the alignment the ModelDesc was padded to, so that cannot change
+        ModelDesc builderDesc = makeTrunkModelDesc(1, 22, 12, 6, 2);
+        ModelBuilder builder(builderDesc, 9, 9);
+        builder.setChannelAlignment(16);
+        builder.setChannelAlignment(16);
+        try
+        {
+            builder.setChannelAlignment(8);
+            return fail("A second channel alignment was accepted.");
+        }
+        catch (const std::invalid_argument &)
+        {
+        }
+        if (builder.getChannelAlignment() != 16 || builderDesc.trunk.initialConv.inChannels != 32)
+        {
+            return fail("Repeating the channel alignment changed the padding.");
+        }
+        return true;
+    }
+
+    // Dead channels are removed without changing the outputs
+    bool testChannelPruning()
+    {
+        const int h = 5;
+        const int w = 5;
+        ModelDesc desc = makeTrunkModelDesc(7, 22, 12, 6, 1);
+        ModelDesc prunedDesc = makeTrunkModelDesc(7, 22, 12, 6, 1);
+        for (ModelDesc *d : {&desc, &prunedDesc})
+        {
+            auto *block = static_cast<ResidualBlockDesc *>(d->trunk.blocks[0].second.get());
+            // Mid channel 1 is never read by finalConv
+            float *finalWeights = block->finalConv.weights.mutableData();
+            for (int oc = 0; oc < 12; ++oc)
+                for (int k = 0; k < 9; ++k)
+                    finalWeights[(oc * 6 + 1) * 9 + k] = 0.0f;
+            // Mid channel 4 normalizes to a negative constant, which relu turns into 0
+            block->midBN.scale.mutableData()[4] = 0.0f;
+            block->midBN.bias.mutableData()[4] = -0.25f;
+        }
+
+        const std::vector<PrunedChannels> pruned = pruneDeadChannels(prunedDesc);
+        const auto *block = static_cast<const ResidualBlockDesc *>(prunedDesc.trunk.blocks[0].second.get());
+        if (pruned.size() != 1 || pruned[0].layerName != "rconv1.conv1" || pruned[0].numChannelsBefore != 6 ||
+            pruned[0].numChannelsAfter != 4 || block->regularConv.outChannels != 4 ||
+            block->midBN.numChannels != 4 || block->finalConv.inChannels != 4 || prunedDesc.trunk.midNumChannels != 4)
+        {
+            return fail("Pruning did not remove exactly the two dead channels.");
+        }
+
+        std::mt19937 rng(8);
+        const Planes input = randomValues(rng, static_cast<std::size_t>(22) * h * w, -1.0f, 1.0f);
+        if (evaluateTrunk(prunedDesc, input, h, w) != evaluateTrunk(desc, input, h, w))
+        {
+            return fail("Pruning changed the trunk output.");
+        }
+        return true;
+    }
+
+    // Replaces the kernel by one of exactly `rank` separable terms, sum over k of a[k][ic][y] * b[k][oc][x]
+    void setLowRankWeights(std::mt19937 &rng, ConvLayerDesc &conv, int rank)
+    {
+        const int inC = conv.inChannels, outC = conv.outChannels, kY = conv.convYSize, kX = conv.convXSize;
+        const std::vector<float> a = randomValues(rng, static_cast<std::size_t>(rank) * inC * kY, -1.0f, 1.0f);
+        const std::vector<float> b = randomValues(rng, static_cast<std::size_t>(rank) * outC * kX, -1.0f, 1.0f);
+        std::vector<float> weights(static_cast<std::size_t>(outC) * inC * kY * kX, 0.0f);
+        for (int k = 0; k < rank; ++k)
+            for (int oc = 0; oc < outC; ++oc)
+                for (int ic = 0; ic < inC; ++ic)
+                    for (int y = 0; y < kY; ++y)
+                        for (int x = 0; x < kX; ++x)
+                            weights[((static_cast<std::size_t>(oc) * inC + ic) * kY + y) * kX + x] +=
+                                a[(k * inC + ic) * kY + y] * b[(k * outC + oc) * kX + x];
+        conv.weights = weights;
+    }
+
+    // A rank-r plan turns the initial convolution into a K x 1 convolution to r channels followed
+    // by a 1 x K convolution
+    bool testLowRankLowering()
+    {
+        const int rank = 2;
+        ModelDesc desc = makeTrunkModelDesc(3, 22, 16, 8, 0);
+        ConvLayerDesc &conv = desc.trunk.initialConv;
+        std::mt19937 rng(4);
+        setLowRankWeights(rng, conv, rank);
+
+        LowRankOptions options;
+        options.maxRelativeError = 1e-4;
+        options.layers = {conv.name};
+        const LowRankPlan plan = planLowRankFactorization(desc, options);
+        if (plan.find(conv.name) == nullptr || plan.find(conv.name)->rank != rank)
+        {
+            return fail("The low-rank plan did not find the rank of the initial convolution.");
+        }
+
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        builder.setLowRankPlan(plan);
+        const std::string packagePath = "test_low_rank.mlpackage";
+        builder.createMLPackage(packagePath);
+
+        const Model model = readPackageModel(packagePath);
+        const MILSpec::Block &block = mainBlock(model);
+        const MILSpec::Operation *horizontal = findProducer(block, "initial_conv");
+        if (horizontal == nullptr || horizontal->type() != "conv")
+        {
+            return fail("The factorized initial convolution was not emitted.");
+        }
+        const std::string verticalName = inputName(*horizontal, "x");
+        const MILSpec::Operation *vertical = findProducer(block, verticalName);
+        if (vertical == nullptr || vertical->type() != "conv" || inputName(*vertical, "x") != INPUT_SPATIAL_NAME)
+        {
+            return fail("The factorized convolutions are not chained.");
+        }
+        if (valueShape(block, inputName(*vertical, "weight")) != std::vector<std::int64_t>{rank, 22, 3, 1} ||
+            valueShape(block, inputName(*horizontal, "weight")) != std::vector<std::int64_t>{16, rank, 1, 3} ||
+            valueShape(block, verticalName) != std::vector<std::int64_t>{1, rank, 9, 9} ||
+            valueShape(block, "initial_conv") != std::vector<std::int64_t>{1, 16, 9, 9})
+        {
+            return fail("The factorized convolutions have unexpected shapes.");
+        }
+        const auto &lowRankLayers = builder.getReport().lowRankLayers;
+        if (lowRankLayers.size() != 1 || lowRankLayers[0].name != conv.name || lowRankLayers[0].rank != rank)
+        {
+            return fail("The conversion report does not record the factorized layer.");
+        }
+
+        // A plan entry that names no layer of the model is a mistake, not an unlowered layer
+        LowRankPlan unmatchedPlan = plan;
+        unmatchedPlan.layers["rconv1.conv1"] = plan.layers.begin()->second;
+        builder.setLowRankPlan(unmatchedPlan);
+        try
+        {
+            builder.createMLPackage("test_low_rank_unmatched.mlpackage");
+        }
+        catch (const std::invalid_argument &)
+        {
+            return true;
+        }
+        return fail("A low-rank plan for a layer that is not in the model was accepted.");
+    }
+
+    // The default plan covers every factorizable convolution, a 5x5 initial one included, and the
+    // builder takes it as is for a model with blocks
+    bool testDefaultLowRankPlan()
+    {
+        std::mt19937 rng(17);
+        ModelDesc desc = makeTrunkModelDesc(18, 22, 16, 8, 1);
+        desc.trunk.initialConv = makeConv(rng, "conv1", 22, 16, 5);
+        setLowRankWeights(rng, desc.trunk.initialConv, 2);
+        auto *block = static_cast<ResidualBlockDesc *>(desc.trunk.blocks[0].second.get());
+        setLowRankWeights(rng, block->regularConv, 1);
+
+        const LowRankPlan plan = planLowRankFactorization(desc, {});
+        if (plan.find("conv1") == nullptr || plan.find("rconv1.conv1") == nullptr)
+        {
+            return fail("The default low-rank plan skipped a factorizable convolution.");
+        }
+
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        builder.setLowRankPlan(plan);
+        builder.createMLPackage("test_low_rank_default.mlpackage");
+
+        const ConversionReport &report = builder.getReport();
+        if (report.lowRankLayers.size() != 1 || report.lowRankLayers[0].name != "conv1" ||
+            report.lowRankLayers[0].rank != 2)
+        {
+            return fail("The 5x5 initial convolution was not factorized.");
+        }
+        if (report.unloweredPlanLayers.size() != 1 || report.unloweredPlanLayers[0].name != "rconv1.conv1")
+        {
+            return fail("The block convolution of the default plan was not reported as unlowered.");
+        }
+        return true;
+    }
+
+    // An int8 activation plan rounds the initial convolution's output through quantize and dequantize
+    bool testActivationQuantizationLowering()
+    {
+        ModelDesc desc = makeTrunkModelDesc(5, 22, 16, 8, 0);
+        ActivationQuantizationPlan plan;
+        LayerActivationQuantization &layer = plan.layers[desc.trunk.initialConv.name];
+        layer.quantization = ActivationQuantization::INT8_PER_TENSOR;
+        layer.scales = {0.05f};
+        layer.zeroPoints = {0};
+
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        builder.setActivationQuantizationPlan(plan);
+        const std::string packagePath = "test_activation_quantization.mlpackage";
+        builder.createMLPackage(packagePath);
+
+        const Model model = readPackageModel(packagePath);
+        const MILSpec::Block &block = mainBlock(model);
+        const MILSpec::Operation *dequantize = findProducer(block, "initial_conv");
+        const MILSpec::Operation *quantize =
+            dequantize == nullptr ? nullptr : findProducer(block, inputName(*dequantize, "input"));
+        const MILSpec::Operation *conv =
+            quantize == nullptr ? nullptr : findProducer(block, inputName(*quantize, "input"));
+        if (dequantize == nullptr || dequantize->type() != "dequantize" || quantize == nullptr ||
+            quantize->type() != "quantize" || conv == nullptr || conv->type() != "conv")
+        {
+            return fail("The initial convolution's output is not rounded through quantize and dequantize.");
+        }
+        // quantize and dequantize need specification version 8, iOS 17
+        if (model.specificationversion() < 8 || builder.getReport().quantizedActivations.size() != 1)
+        {
+            return fail("The quantized activation is not reflected in the version or the report.");
+        }
+
+        // The model has no blocks, so this entry names no layer of it
+        plan.layers["rconv1.conv1"] = layer;
+        builder.setActivationQuantizationPlan(plan);
+        try
+        {
+            builder.createMLPackage("test_activation_quantization_unmatched.mlpackage");
+        }
+        catch (const std::invalid_argument &)
+        {
+            return true;
+        }
+        return fail("An activation quantization plan for a layer that is not in the model was accepted.");
+    }
+
+    // A plan from a calibration file that covers the whole trunk converts; the block convolutions,
+    // which the graph does not lower yet, are reported
+    bool testCalibratedActivationQuantization()
+    {
+        ModelDesc desc = makeTrunkModelDesc(19, 22, 16, 8, 1);
+        std::istringstream calibration("# trunk outputs\n"
+                                       "layer conv1 -2.0 2.5 -1.5 2.0\n"
+                                       "layer rconv1.conv1 -1.0 1.0\n"
+                                       "layer rconv1.conv2 0.0 3.0\n");
+        const ActivationQuantizationPlan plan = planActivationQuantization(desc, parseCalibration(calibration));
+        if (plan.layers.size() != 3)
+        {
+            return fail("The calibration did not give a plan entry for every calibrated convolution.");
+        }
+
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        builder.setActivationQuantizationPlan(plan);
+        builder.createMLPackage("test_activation_quantization_calibrated.mlpackage");
+
+        const ConversionReport &report = builder.getReport();
+        if (report.quantizedActivations.size() != 1 || report.quantizedActivations[0].name != "conv1")
+        {
+            return fail("The initial convolution's output was not quantized.");
+        }
+        std::set<std::string> unlowered;
+        for (const auto &layer : report.unloweredPlanLayers)
+        {
+            unlowered.insert(layer.name);
+        }
+        if (unlowered != std::set<std::string>{"rconv1.conv1", "rconv1.conv2"})
+        {
+            return fail("The block convolutions of the plan were not reported as unlowered.");
+        }
+        return true;
+    }
+
+    // A per-layer precision entry changes how the weights of that layer are stored, and only those
+    bool testPrecisionPlanLowering()
+    {
+        ModelDesc desc = makeTrunkModelDesc(6, 22, 16, 8, 0);
+        const std::string weightName = "initial_conv_weight";
+        const struct
+        {
+            WeightPrecision precision;
+            const char *weightOpType;
+        } cases[] = {
+            {WeightPrecision::FLOAT32, "const"},
+            {WeightPrecision::FLOAT16, "cast"},
+            {WeightPrecision::INT8, "constexpr_affine_dequantize"},
+        };
+        for (const auto &c : cases)
+        {
+            PrecisionPlan plan;
+            plan.layers[desc.trunk.initialConv.name] = c.precision;
+            ModelBuilder builder(desc, 9, 9);
+            addModelInputs(builder, desc, 9, 9);
+            builder.setPrecisionPlan(plan);
+            const std::string packagePath = std::string("test_precision_") + weightPrecisionName(c.precision) + ".mlpackage";
+            builder.createMLPackage(packagePath);
+
+            const Model model = readPackageModel(packagePath);
+            const MILSpec::Block &block = mainBlock(model);
+            const MILSpec::Operation *weight = findProducer(block, weightName);
+            const MILSpec::Operation *headWeight = findProducer(block, "output_policy_weight");
+            if (weight == nullptr || weight->type() != c.weightOpType || headWeight == nullptr ||
+                headWeight->type() != "const")
+            {
+                return fail(std::string("A ") + weightPrecisionName(c.precision) +
+                            " entry for the initial convolution did not set its weight op.");
+            }
+        }
+
+        // Entries must name ModelDesc layers, not graph values
+        PrecisionPlan plan;
+        plan.layers[OUTPUT_POLICY_NAME] = WeightPrecision::FLOAT16;
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        builder.setPrecisionPlan(plan);
+        try
+        {
+            builder.createMLPackage("test_precision_unmatched.mlpackage");
+        }
+        catch (const std::invalid_argument &)
+        {
+            return true;
+        }
+        return fail("A precision plan for a value that is not a layer was accepted.");
+    }
+
+    // A plan chosen from the whole model names layers the graph does not lower yet; those are
+    // reported and skipped rather than failing the conversion
+    bool testWholeModelPrecisionPlan()
+    {
+        ModelDesc desc = makeTrunkModelDesc(16, 22, 16, 8, 1);
+        const PrecisionPlan plan = selectMixedPrecision(analyzeQuantizationError(desc), QuantizationErrorBudget{});
+        if (plan.layers.count("rconv1.conv1") == 0)
+        {
+            return fail("The whole-model precision plan does not name the block's convolutions.");
+        }
+
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        builder.setPrecisionPlan(plan);
+        builder.createMLPackage("test_precision_whole_model.mlpackage");
+
+        std::set<std::string> unlowered;
+        for (const auto &layer : builder.getReport().unloweredPlanLayers)
+        {
+            if (layer.plan != "precision")
+            {
+                return fail("An unlowered precision plan entry was attributed to another plan.");
+            }
+            unlowered.insert(layer.name);
+        }
+        if (unlowered.count("rconv1.conv1") == 0 || unlowered.count("rconv1.conv2") == 0 ||
+            unlowered.count(desc.trunk.initialConv.name) > 0)
+        {
+            return fail("The report does not list exactly the plan entries the graph does not lower.");
+        }
+        return true;
+    }
+
+    // A program of one input tensor named `inputName`, with an empty main block to append ops to
+    MILSpec::Block &makeProgram(MILSpec::Program &program, const std::string &inputName, const std::vector<int> &shape)
+    {
+        MILSpec::Function &function = (*program.mutable_functions())["main"];
+        function.set_opset("CoreML5");
+        MILSpec::NamedValueType *input = function.add_inputs();
+        input->set_name(inputName);
+        MILSpec::TensorType *tensor = input->mutable_type()->mutable_tensortype();
+        tensor->set_datatype(MILSpec::DataType::FLOAT32);
+        tensor->set_rank(shape.size());
+        for (int dim : shape)
+        {
+            tensor->add_dimensions()->mutable_constant()->set_size(dim);
+        }
+        return (*function.mutable_block_specializations())["CoreML5"];
+    }
+
+    // Whether every argument and output of the block is a function input or an earlier op output
+    bool isInDependencyOrder(const MILSpec::Block &block, const MILSpec::Function &function)
+    {
+        std::set<std::string> defined;
+        for (const auto &input : function.inputs())
+        {
+            defined.insert(input.name());
+        }
+        for (const auto &op : block.operations())
+        {
+            for (const auto &input : op.inputs())
+            {
+                for (const auto &argument : input.second.arguments())
+                {
+                    if (argument.has_name() && defined.count(argument.name()) == 0)
+                    {
+                        return false;
+                    }
+                }
+            }
+            for (const auto &output : op.outputs())
+            {
+                defined.insert(output.name());
+            }
+        }
+        return std::all_of(block.outputs().begin(), block.outputs().end(),
+                           [&](const std::string &output)
+                           { return defined.count(output) > 0; });
+    }
+
+    // Index of the op that outputs `output`, or -1
+    int operationIndex(const MILSpec::Block &block, const std::string &output)
+    {
+        for (int i = 0; i < block.operations_size(); ++i)
+        {
+            if (block.operations(i).outputs(0).name() == output)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Weights are counted once, where they are read, and names are escaped in the JSON
+    bool testCostModel()
+    {
+        MILSpec::Program program;
+        MILSpec::Block &block = makeProgram(program, "x", {1, 2, 3, 3});
+        OpBuilder ops(block);
+        ops.addConst<float>("w", {4, 2, 3, 3}, std::vector<float>(72, 1.0f));
+        const std::string convName = "net\"conv";
+        block.add_outputs(ops.addConv(program.functions().at("main").inputs(0), "w", 4, 1, 1, convName)->name());
+
+        const CostReport cost = analyzeProgramCost(program);
+        for (const OpCost &op : cost.ops)
+        {
+            if (op.type == "const" && op.memoryTrafficBytes != 0)
+            {
+                return fail("The cost model counts the traffic of weights at their const op.");
+            }
+            if (op.name == "w" && op.weightBytes != 72 * 4)
+            {
+                return fail("The cost model miscounted the bytes of a weight.");
+            }
+            // The conv reads its input and weights, alongside a few scalar parameters, and writes its output
+            if (op.type == "conv" && (op.name != convName || op.macs != 36 * 18 ||
+                                      op.memoryTrafficBytes < (18 + 72 + 36) * 4 ||
+                                      op.memoryTrafficBytes >= (18 + 72 + 36) * 4 + 72))
+            {
+                return fail("The cost model miscounted the work or the traffic of a conv.");
+            }
+        }
+        if (cost.toJSON().find("\"name\": \"net\\\"conv\"") == std::string::npos)
+        {
+            return fail("The cost report does not escape op names.");
+        }
+        return true;
+    }
+
+    // A mapped cache gives back the ModelDesc it was written from, and a damaged one is rejected
+    bool testModelCache()
+    {
+        const int h = 4;
+        const int w = 3;
+        const std::string path = "test_cache.kgcache";
+        ModelDesc desc = makeTrunkModelDesc(11, 22, 8, 4, 2);
+        desc.sha256 = std::string(64, 'a');
+        writeModelCache(desc, path, "key");
+
+        {
+            const ModelDesc mapped = mapModelCache(path, "key");
+            if (mapped.sha256 != desc.sha256 || mapped.trunk.initialConv.name != "conv1" ||
+                mapped.trunk.initialConv.weights.size() != desc.trunk.initialConv.weights.size())
+            {
+                return fail("The mapped cache does not describe the model it was written from.");
+            }
+            std::mt19937 rng(12);
+            const Planes input = randomValues(rng, static_cast<std::size_t>(22) * h * w, -1.0f, 1.0f);
+            if (evaluateTrunk(mapped, input, h, w) != evaluateTrunk(desc, input, h, w))
+            {
+                return fail("The mapped cache changed the trunk output.");
+            }
+        }
+
+        const auto rejects = [&](const std::string &cachePath, const std::string &key)
+        {
+            try
+            {
+                mapModelCache(cachePath, key);
+            }
+            catch (const std::runtime_error &)
+            {
+                return true;
+            }
+            return false;
+        };
+        if (!rejects(path, "other key"))
+        {
+            return fail("A cache written with another key was accepted.");
+        }
+
+        std::string bytes;
+        {
+            std::ifstream in(path, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        const std::string damagedPath = "test_cache_damaged.kgcache";
+        const auto writeDamaged = [&](const std::string &damaged)
+        {
+            std::ofstream out(damagedPath, std::ios::binary | std::ios::trunc);
+            out.write(damaged.data(), damaged.size());
+        };
+        std::string badMagic = bytes;
+        badMagic[0] ^= 0x20;
+        for (const std::string &damaged : {bytes.substr(0, 64), bytes.substr(0, bytes.size() / 2), badMagic})
+        {
+            writeDamaged(damaged);
+            if (!rejects(damagedPath, "key"))
+            {
+                return fail("A truncated or damaged cache was accepted.");
+            }
+        }
+        fs::remove(path);
+        fs::remove(damagedPath);
+        return true;
+    }
+
+    // Known answers from FIPS 180-2, on the hardware code path when this CPU has one and on the portable one
+    bool testSha256()
+    {
+        const std::string million(1000000, 'a');
+        const struct
+        {
+            std::string message;
+            const char *digest;
+        } cases[] = {
+            {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+            {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+            {million, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+        };
+
+        bool passed = true;
+        for (bool hardware : {true, false})
+        {
+            Sha256::setHardwareAccelerationEnabled(hardware);
+            for (const auto &c : cases)
+            {
+                Sha256 whole;
+                whole.update(c.message);
+                // Uneven chunks cross block boundaries, and an empty update may pass null
+                Sha256 chunked;
+                chunked.update(nullptr, 0);
+                for (std::size_t begin = 0, size = 1; begin < c.message.size(); begin += size, size = size * 3 % 1000 + 1)
+                {
+                    chunked.update(c.message.data() + begin, std::min(size, c.message.size() - begin));
+                }
+                if (whole.hexDigest() != c.digest || chunked.hexDigest() != c.digest)
+                {
+                    passed = fail(std::string("Wrong SHA-256 on the ") + (hardware ? "default" : "portable") +
+                                  " path for a message of " + std::to_string(c.message.size()) + " bytes.");
+                }
+            }
+        }
+        Sha256::setHardwareAccelerationEnabled(true);
+        return passed;
+    }
 
-    modelDesc.modelVersion = 3;
-    modelDesc.numPolicyChannels = 1;
-    modelDesc.numValueChannels = 3;
-    modelDesc.numScoreValueChannels = 1;
-    modelDesc.numOwnershipChannels = 1;
+    // A report that cannot be written throws instead of leaving a missing or partial file
+    bool testConversionReportWrite()
+    {
+        ConversionReport report;
+        report.packagePath = "test_report.mlpackage";
+        report.writeJSON("test_report.json");
+        const bool written = fs::file_size("test_report.json") == report.toJSON().size();
+        fs::remove("test_report.json");
+        if (!written)
+        {
+            return fail("The conversion report was not written in full.");
+        }
 
-    const int nnXLen = 19;
-    const int nnYLen = 19;
+        std::vector<std::string> unwritablePaths = {"test_missing_dir/report.json"};
+        // Writes to /dev/full fail once the stream is flushed
+        if (fs::exists("/dev/full"))
+        {
+            unwritablePaths.push_back("/dev/full");
+        }
+        for (const std::string &path : unwritablePaths)
+        {
+            try
+            {
+                report.writeJSON(path);
+                return fail("Writing the conversion report to " + path + " did not throw.");
+            }
+            catch (const std::runtime_error &)
+            {
+            }
+        }
+        return true;
+    }
 
-    KataGoCoreML::ModelBuilder builder(modelDesc, nnXLen, nnYLen);
+    // Holds the conversion at its first weight until the test has cancelled it, and records what follows
+    class CancellingObserver : public ConversionObserver
+    {
+    public:
+        std::promise<void> firstWeightWritten;
+        std::promise<void> cancelled;
+        std::vector<ConversionStage> stagesBegun;
+        int numLayersWritten = 0;
 
-    // Input spatial feature
-    const int batchSize = 1;
-    const int numSpatialFeatures = 22;
+        void onStageBegin(ConversionStage stage) override
+        {
+            stagesBegun.push_back(stage);
+        }
 
-    KataGoCoreML::InputFeature inputSpatial("input_spatial",
-                                            {batchSize, numSpatialFeatures, nnYLen, nnXLen});
+        void onLayerWeightsWritten(const std::string & /*name*/, std::size_t /*bytes*/) override
+        {
+            if (++numLayersWritten == 1)
+            {
+                firstWeightWritten.set_value();
+                cancelled.get_future().wait_for(std::chrono::seconds(30));
+            }
+        }
+    };
 
-    builder.addInputFeature(inputSpatial);
+    // A cancelled conversion stops at the next layer, throws ConversionCancelled and leaves no package
+    bool testCancellation()
+    {
+        ModelDesc desc = makeTrunkModelDesc(9, 22, 8, 4, 2);
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        CancellingObserver observer;
+        builder.setObserver(&observer);
 
-    // Input global feature
-    const int numGlobalFeatures = 19;
-    KataGoCoreML::InputFeature inputGlobal("input_global", {batchSize, numGlobalFeatures});
-    builder.addInputFeature(inputGlobal);
+        const std::string packagePath = "test_cancelled.mlpackage";
+        fs::remove_all(packagePath);
+        std::unique_ptr<ConversionTask> task = builder.createMLPackageAsync(packagePath);
+        if (observer.firstWeightWritten.get_future().wait_for(std::chrono::seconds(30)) != std::future_status::ready)
+        {
+            return fail("The conversion did not write any weights.");
+        }
+        task->cancel();
+        observer.cancelled.set_value();
 
-    // Create a CoreML package with the model builder
-    const std::string outputPath = "test_output.mlpackage";
-    builder.createMLPackage(outputPath);
+        try
+        {
+            task->get();
+            return fail("A cancelled conversion finished.");
+        }
+        catch (const ConversionCancelled &)
+        {
+        }
+        if (observer.numLayersWritten != 1 || observer.stagesBegun != std::vector<ConversionStage>{ConversionStage::GRAPH_BUILD})
+        {
+            return fail("A cancelled conversion went on past the next layer.");
+        }
+        if (fs::exists(packagePath))
+        {
+            return fail("A cancelled conversion left a package behind.");
+        }
+        return true;
+    }
+
+    MatMulLayerDesc makeMatMul(std::mt19937 &rng, const std::string &name, int inChannels, int outChannels)
+    {
+        MatMulLayerDesc matMul;
+        matMul.name = name;
+        matMul.inChannels = inChannels;
+        matMul.outChannels = outChannels;
+        matMul.weights = randomValues(rng, static_cast<std::size_t>(inChannels) * outChannels, -1.0f, 1.0f);
+        return matMul;
+    }
+
+    MatBiasLayerDesc makeMatBias(std::mt19937 &rng, const std::string &name, int numChannels)
+    {
+        MatBiasLayerDesc bias;
+        bias.name = name;
+        bias.numChannels = numChannels;
+        bias.weights = randomValues(rng, numChannels, -0.5f, 0.5f);
+        return bias;
+    }
+
+    // Folding a fixed metadata vector keeps the trunk output the encoder would have given
+    bool testMetadataFolding()
+    {
+        const int h = 4;
+        const int w = 4;
+        const int numMeta = 5;
+        const int hidden = 6;
+        ModelDesc desc = makeTrunkModelDesc(13, 22, 8, 4, 2);
+        std::mt19937 rng(14);
+        SGFMetadataEncoderDesc &encoder = desc.trunk.sgfMetadataEncoder;
+        encoder.metaEncoderVersion = 1;
+        encoder.numInputMetaChannels = numMeta;
+        encoder.mul1 = makeMatMul(rng, "meta.mul1", numMeta, hidden);
+        encoder.bias1 = makeMatBias(rng, "meta.bias1", hidden);
+        encoder.act1.activation = ACTIVATION_RELU;
+        encoder.mul2 = makeMatMul(rng, "meta.mul2", hidden, hidden);
+        encoder.bias2 = makeMatBias(rng, "meta.bias2", hidden);
+        encoder.act2.activation = ACTIVATION_RELU;
+        encoder.mul3 = makeMatMul(rng, "meta.mul3", hidden, 8);
+        desc.trunk.metaEncoderVersion = desc.metaEncoderVersion = 1;
+        desc.numInputMetaChannels = numMeta;
+
+        // The encoder evaluated by hand: relu layers with weights stored in x out
+        const std::vector<float> meta = randomValues(rng, numMeta, -1.0f, 1.0f);
+        const auto layer = [](const MatMulLayerDesc &matMul, const MatBiasLayerDesc *bias, const std::vector<float> &x)
+        {
+            std::vector<float> y(matMul.outChannels, 0.0f);
+            for (int o = 0; o < matMul.outChannels; ++o)
+            {
+                for (int i = 0; i < matMul.inChannels; ++i)
+                    y[o] += x[i] * matMul.weights[static_cast<std::size_t>(i) * matMul.outChannels + o];
+                if (bias != nullptr)
+                    y[o] = std::max(y[o] + bias->weights[o], 0.0f);
+            }
+            return y;
+        };
+        const std::vector<float> trunkBias =
+            layer(encoder.mul3, nullptr, layer(encoder.mul2, &encoder.bias2, layer(encoder.mul1, &encoder.bias1, meta)));
+
+        const Planes input = randomValues(rng, static_cast<std::size_t>(22) * h * w, -1.0f, 1.0f);
+        const Planes expected = evaluateTrunk(desc, input, h, w, trunkBias);
+        foldFixedMetadata(desc, meta);
+        if (desc.metaEncoderVersion != 0 || desc.trunk.metaEncoderVersion != 0 || desc.numInputMetaChannels != 0)
+        {
+            return fail("Metadata folding left the encoder in the model.");
+        }
+        const Planes folded = evaluateTrunk(desc, input, h, w);
+        for (std::size_t i = 0; i < expected.size(); ++i)
+        {
+            if (std::abs(folded[i] - expected[i]) > 1e-4f * (1.0f + std::abs(expected[i])))
+            {
+                return fail("The folded metadata bias changed the trunk output at " + std::to_string(i) + ".");
+            }
+        }
+        return true;
+    }
+
+    template <typename T, typename = void>
+    struct CanView : std::false_type
+    {
+    };
+
+    template <typename T>
+    struct CanView<T, std::void_t<decltype(WeightArray::view(std::declval<T>()))>> : std::true_type
+    {
+    };
+
+    static_assert(CanView<const std::vector<float> &>::value && !CanView<std::vector<float>>::value,
+                  "WeightArray::view must not accept a temporary vector");
+
+    // A view shares the caller's buffer until it is written to, and keeps its owner alive
+    bool testWeightArrayCopyOnWrite()
+    {
+        auto buffer = std::make_shared<std::vector<float>>(std::vector<float>{1.0f, 2.0f, 3.0f});
+        const std::weak_ptr<std::vector<float>> bufferAlive = buffer;
+        WeightArray view = WeightArray::view(buffer->data(), buffer->size(), buffer);
+        const float *bufferData = buffer->data();
+        buffer.reset();
+        if (bufferAlive.expired() || !view.isView() || view.data() != bufferData)
+        {
+            return fail("A weight view does not keep its buffer.");
+        }
+
+        WeightArray copy = view;
+        if (copy.data() != bufferData)
+        {
+            return fail("Copying a weight view copied its data.");
+        }
+        copy.mutableData()[0] = 10.0f;
+        if (copy.isView() || copy.data() == bufferData || copy.toVector() != std::vector<float>{10.0f, 2.0f, 3.0f} ||
+            view.toVector() != std::vector<float>{1.0f, 2.0f, 3.0f})
+        {
+            return fail("Writing to a weight view did not copy it first.");
+        }
+        view.mutableData();
+        if (!bufferAlive.expired())
+        {
+            return fail("A weight view that was copied still holds its buffer.");
+        }
+        if (WeightArray::view(nullptr, 0).isView())
+        {
+            return fail("An empty weight view is not empty.");
+        }
+
+        // A model viewing the caller's weights converts to the same package as one owning them
+        ModelDesc owned = makeTrunkModelDesc(15, 22, 8, 4, 1);
+        ModelDesc viewed = makeTrunkModelDesc(15, 22, 8, 4, 1);
+        auto *block = static_cast<ResidualBlockDesc *>(viewed.trunk.blocks[0].second.get());
+        const std::vector<float> callerWeights[] = {viewed.trunk.initialConv.weights.toVector(),
+                                                    block->regularConv.weights.toVector(),
+                                                    block->finalConv.weights.toVector()};
+        viewed.trunk.initialConv.weights = WeightArray::view(callerWeights[0]);
+        block->regularConv.weights = WeightArray::view(callerWeights[1]);
+        block->finalConv.weights = WeightArray::view(callerWeights[2]);
+        std::string hashes[2];
+        for (int i = 0; i < 2; ++i)
+        {
+            ModelBuilder builder(i == 0 ? owned : viewed, 9, 9);
+            addModelInputs(builder, owned, 9, 9);
+            builder.createMLPackage("test_weight_view.mlpackage");
+            hashes[i] = builder.getReport().packageSha256;
+        }
+        if (hashes[0] != hashes[1])
+        {
+            return fail("A model viewing its weights converted differently.");
+        }
+        return true;
+    }
+
+    // Sparse weights expand back to the dense weights: mask bits in little-endian order select
+    // the positions of the non-zero values, which are stored in order
+    bool testSparseWeightRoundTrip()
+    {
+        ModelDesc desc = makeTrunkModelDesc(17, 22, 8, 4, 0);
+        ConvLayerDesc &conv = desc.trunk.initialConv;
+        float *weights = conv.weights.mutableData();
+        for (std::size_t i = 0; i < conv.weights.size(); ++i)
+        {
+            if (i % 10 < 7)
+                weights[i] = 0.0f;
+        }
+
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        builder.setSparsityThreshold(0.5f);
+        const std::string packagePath = "test_sparse.mlpackage";
+        builder.createMLPackage(packagePath);
+
+        const Model model = readPackageModel(packagePath);
+        const MILSpec::Block &block = mainBlock(model);
+        const MILSpec::Operation *convOp = findProducer(block, "initial_conv");
+        const MILSpec::Operation *sparseOp = convOp == nullptr ? nullptr : findProducer(block, inputName(*convOp, "weight"));
+        if (sparseOp == nullptr || sparseOp->type() != "constexpr_sparse_to_dense")
+        {
+            return fail("The sparse initial convolution weights were not emitted.");
+        }
+
+        const MILBlob::Blob::StorageReader reader(findPackageFile(packagePath, "weight.bin").string());
+        const auto nonzeroData =
+            reader.GetDataView<float>(sparseOp->attributes().at("nonzero_data").blobfilevalue().offset());
+        const auto mask = reader.GetDataView<std::uint8_t>(sparseOp->attributes().at("mask").blobfilevalue().offset());
+        if (mask.Size() != (conv.weights.size() + 7) / 8)
+        {
+            return fail("The sparse mask does not have one bit per weight.");
+        }
+        std::size_t numNonzero = 0;
+        for (std::size_t i = 0; i < conv.weights.size(); ++i)
+        {
+            const bool present = (mask.Data()[i / 8] >> (i % 8)) & 1;
+            const float value = present && numNonzero < nonzeroData.Size() ? nonzeroData.Data()[numNonzero] : 0.0f;
+            numNonzero += present ? 1 : 0;
+            if (value != conv.weights[i])
+            {
+                return fail("The sparse weights do not expand to the dense weights at " + std::to_string(i) + ".");
+            }
+        }
+        const auto &sparseLayers = builder.getReport().sparseLayers;
+        if (numNonzero != nonzeroData.Size() || sparseLayers.size() != 1 ||
+            sparseLayers[0].encodedBytes != numNonzero * sizeof(float) + mask.Size())
+        {
+            return fail("The sparse weights have unexpected sizes.");
+        }
+        return true;
+    }
+
+    // A padded board runs the graph at the padded size, zero-padding the spatial input at the
+    // bottom and right, and crops the spatial outputs back to the board
+    bool testPaddedBoardSize()
+    {
+        ModelDesc desc = makeTrunkModelDesc(19, 22, 8, 4, 0);
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        try
+        {
+            builder.setPaddedBoardSize(8, 9);
+            return fail("A padded board smaller than the board was accepted.");
+        }
+        catch (const std::invalid_argument &)
+        {
+        }
+        builder.setPaddedBoardSize(12, 12);
+        const std::string packagePath = "test_padded_board.mlpackage";
+        builder.createMLPackage(packagePath);
+
+        const Model model = readPackageModel(packagePath);
+        const MILSpec::Block &block = mainBlock(model);
+        const MILSpec::Operation *pad = findProducer(block, INPUT_SPATIAL_NAME + "_padded");
+        if (pad == nullptr || pad->type() != "pad" || inputName(*pad, "x") != INPUT_SPATIAL_NAME ||
+            valueShape(block, pad->outputs(0).name()) != std::vector<std::int64_t>{1, 22, 12, 12})
+        {
+            return fail("The spatial input is not padded to the padded board size.");
+        }
+        if (constInts(block, inputName(*pad, "pad")) != std::vector<int>{0, 0, 0, 3, 0, 3})
+        {
+            return fail("The spatial input is not padded at the bottom and right.");
+        }
+        if (valueShape(block, "initial_conv") != std::vector<std::int64_t>{1, 8, 12, 12})
+        {
+            return fail("The trunk does not run at the padded board size.");
+        }
+        const MILSpec::Operation *ownership = findProducer(block, OUTPUT_OWNERSHIP_NAME);
+        if (ownership == nullptr || ownership->type() != "slice_by_size" ||
+            valueShape(block, inputName(*ownership, "x")) != std::vector<std::int64_t>{1, 1, 12, 12} ||
+            valueShape(block, OUTPUT_OWNERSHIP_NAME) != std::vector<std::int64_t>{1, 1, 9, 9})
+        {
+            return fail("The ownership output is not cropped back to the board.");
+        }
+        return true;
+    }
+
+    bool containsError(const std::vector<std::string> &errors, const std::string &text)
+    {
+        return std::any_of(errors.begin(), errors.end(),
+                           [&](const std::string &error)
+                           { return error.find(text) != std::string::npos; });
+    }
+
+    // The verifier accepts a converted program and reports an undefined argument and a wrong
+    // declared output type
+    bool testProgramVerifier()
+    {
+        ModelDesc desc = makeTrunkModelDesc(21, 22, 8, 4, 0);
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        const std::string packagePath = "test_verifier.mlpackage";
+        builder.createMLPackage(packagePath);
+        const Model model = readPackageModel(packagePath);
+        const std::vector<std::string> errors = findProgramErrors(model);
+        if (!errors.empty())
+        {
+            return fail("The verifier rejects a converted program: " + errors[0]);
+        }
+
+        for (int broken = 0; broken < 2; ++broken)
+        {
+            Model brokenModel = model;
+            MILSpec::Function &function = brokenModel.mutable_mlprogram()->mutable_functions()->at("main");
+            MILSpec::Block &block = function.mutable_block_specializations()->at(function.opset());
+            auto op = std::find_if(block.mutable_operations()->begin(), block.mutable_operations()->end(),
+                                   [](const MILSpec::Operation &o)
+                                   { return o.outputs(0).name() == "initial_conv"; });
+            if (op == block.mutable_operations()->end())
+            {
+                return fail("The converted program has no initial convolution.");
+            }
+            std::string expected;
+            if (broken == 0)
+            {
+                (*op->mutable_inputs())["x"].mutable_arguments(0)->set_name("missing");
+                expected = "reads undefined value 'missing'";
+            }
+            else
+            {
+                MILSpec::TensorType *type = op->mutable_outputs(0)->mutable_type()->mutable_tensortype();
+                type->mutable_dimensions(1)->mutable_constant()->set_size(7);
+                expected = "declares output";
+            }
+            if (!containsError(findProgramErrors(brokenModel), expected))
+            {
+                return fail("The verifier does not report a broken program: expected '" + expected + "'.");
+            }
+        }
+        return true;
+    }
+
+    // The output layout shapes both the declared outputs and the program outputs
+    bool testOutputLayout()
+    {
+        ModelDesc desc = makeTrunkModelDesc(23, 22, 8, 4, 0);
+        desc.numPolicyChannels = 2;
+        const int policyLength = 9 * 9 + 1;
+        for (bool packed : {false, true})
+        {
+            ModelBuilder builder(desc, 9, 9);
+            addModelInputs(builder, desc, 9, 9);
+            OutputLayout layout;
+            layout.policyWithPass = true;
+            layout.channelsLast = true;
+            layout.packed = packed;
+            builder.setOutputLayout(layout);
+            const std::string packagePath = "test_output_layout.mlpackage";
+            builder.createMLPackage(packagePath);
+
+            const Model model = readPackageModel(packagePath);
+            const auto &outputs = model.description().output();
+            if (packed)
+            {
+                const int size = policyLength * 2 + 3 + 1 + 9 * 9;
+                if (featureNames(outputs) != std::vector<std::string>{OUTPUT_PACKED_NAME} ||
+                    featureShape(outputs[0]) != std::vector<std::int64_t>{1, size} ||
+                    valueShape(mainBlock(model), OUTPUT_PACKED_NAME) != std::vector<std::int64_t>{1, size})
+                {
+                    return fail("The packed layout does not declare one row of every output.");
+                }
+            }
+            else
+            {
+                const std::vector<std::string> names = {OUTPUT_POLICY_NAME, OUTPUT_VALUE_NAME, OUTPUT_SCORE_VALUE_NAME,
+                                                        OUTPUT_OWNERSHIP_NAME};
+                const std::vector<std::vector<std::int64_t>> shapes = {{1, policyLength, 2}, {1, 3}, {1, 1}, {1, 9, 9, 1}};
+                if (featureNames(outputs) != names)
+                {
+                    return fail("The layout with the pass in the policy declares unexpected outputs.");
+                }
+                for (std::size_t i = 0; i < names.size(); ++i)
+                {
+                    if (featureShape(outputs[i]) != shapes[i] || valueShape(mainBlock(model), names[i]) != shapes[i])
+                    {
+                        return fail("The output " + names[i] + " does not have the configured layout.");
+                    }
+                }
+            }
+            const std::vector<std::string> errors = findProgramErrors(model);
+            if (!errors.empty())
+            {
+                return fail("The program does not match its outputs: " + errors[0]);
+            }
+        }
+        return true;
+    }
+
+    // A flexible board declares a range on the board dimensions of input_spatial, leaves them
+    // unknown in the program and declares the spatial outputs without a shape
+    bool testFlexibleBoardSize()
+    {
+        ModelDesc desc = makeTrunkModelDesc(25, 22, 8, 4, 0);
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        try
+        {
+            builder.setFlexibleBoardSize(10, 13);
+            return fail("A board size range without the default board was accepted.");
+        }
+        catch (const std::invalid_argument &)
+        {
+        }
+        builder.setFlexibleBoardSize(7, 13);
+        const std::string packagePath = "test_flexible_board.mlpackage";
+        builder.createMLPackage(packagePath);
+
+        const Model model = readPackageModel(packagePath);
+        const FeatureDescription *spatial = findFeature(model.description().input(), INPUT_SPATIAL_NAME);
+        if (spatial == nullptr || featureShape(*spatial) != std::vector<std::int64_t>{1, 22, 9, 9})
+        {
+            return fail("The spatial input does not default to the board size.");
+        }
+        const auto &ranges = spatial->type().multiarraytype().shaperange().sizeranges();
+        const std::int64_t expectedRanges[4][2] = {{1, 1}, {22, 22}, {7, 13}, {7, 13}};
+        if (ranges.size() != 4)
+        {
+            return fail("The spatial input does not declare a shape range.");
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            if (static_cast<std::int64_t>(ranges[i].lowerbound()) != expectedRanges[i][0] ||
+                ranges[i].upperbound() != expectedRanges[i][1])
+            {
+                return fail("The spatial input declares an unexpected range for dimension " + std::to_string(i) + ".");
+            }
+        }
+
+        const auto &dims = model.mlprogram().functions().at("main").inputs(0).type().tensortype().dimensions();
+        if (dims.size() != 4 || !dims[1].has_constant() || !dims[2].has_unknown() || !dims[3].has_unknown())
+        {
+            return fail("The program does not leave the board dimensions unknown.");
+        }
+        const FeatureDescription *ownership = findFeature(model.description().output(), OUTPUT_OWNERSHIP_NAME);
+        const FeatureDescription *value = findFeature(model.description().output(), OUTPUT_VALUE_NAME);
+        if (ownership == nullptr || !featureShape(*ownership).empty() || value == nullptr ||
+            featureShape(*value) != std::vector<std::int64_t>{1, 3})
+        {
+            return fail("Only the outputs that depend on the board size may be declared without a shape.");
+        }
+        const std::vector<std::string> errors = findProgramErrors(model);
+        if (!errors.empty())
+        {
+            return fail("The flexible program does not verify: " + errors[0]);
+        }
+        return true;
+    }
+
+    // A secondary network shares the inputs and adds its own prefixed outputs
+    bool testSecondaryModel()
+    {
+        ModelDesc desc = makeTrunkModelDesc(27, 22, 8, 4, 0);
+        ModelDesc humanDesc = makeTrunkModelDesc(28, 22, 16, 4, 0);
+        humanDesc.numPolicyChannels = 2;
+        ModelBuilder builder(desc, 9, 9);
+        addModelInputs(builder, desc, 9, 9);
+        ModelDesc otherInputsDesc = makeTrunkModelDesc(28, 23, 16, 4, 0);
+        try
+        {
+            builder.setSecondaryModel(otherInputsDesc, "human_");
+            return fail("A secondary model with other inputs was accepted.");
+        }
+        catch (const std::invalid_argument &)
+        {
+        }
+        builder.setSecondaryModel(humanDesc, "human_");
+        const std::string packagePath = "test_secondary_model.mlpackage";
+        builder.createMLPackage(packagePath);
+
+        const Model model = readPackageModel(packagePath);
+        if (featureNames(model.description().input()) != std::vector<std::string>{INPUT_SPATIAL_NAME, INPUT_GLOBAL_NAME})
+        {
+            return fail("The networks do not share their inputs.");
+        }
+        const std::vector<std::string> names = featureNames(model.description().output());
+        std::vector<std::string> expectedNames;
+        for (const char *prefix : {"", "human_"})
+        {
+            for (const std::string &name : {OUTPUT_POLICY_NAME, OUTPUT_POLICY_PASS_NAME, OUTPUT_VALUE_NAME,
+                                            OUTPUT_SCORE_VALUE_NAME, OUTPUT_OWNERSHIP_NAME})
+            {
+                expectedNames.push_back(prefix + name);
+            }
+        }
+        if (names != expectedNames)
+        {
+            return fail("The package does not declare the outputs of both networks.");
+        }
+        const FeatureDescription *humanPolicy = findFeature(model.description().output(), "human_" + OUTPUT_POLICY_NAME);
+        if (featureShape(*humanPolicy) != std::vector<std::int64_t>{1, 2, 9, 9})
+        {
+            return fail("The secondary policy does not have the secondary model's channels.");
+        }
+
+        const MILSpec::Block &block = mainBlock(model);
+        const MILSpec::Operation *humanConv = findProducer(block, "human_initial_conv");
+        if (humanConv == nullptr || inputName(*humanConv, "x") != INPUT_SPATIAL_NAME ||
+            valueShape(block, "human_initial_conv") != std::vector<std::int64_t>{1, 16, 9, 9})
+        {
+            return fail("The secondary network does not read the shared spatial input.");
+        }
+        const std::vector<std::string> errors = findProgramErrors(model);
+        if (!errors.empty())
+        {
+            return fail("The program with two networks does not verify: " + errors[0]);
+        }
+        return true;
+    }
+
+    // The inspector reads back what the builder wrote, and the diff shows a change of precision
+    bool testPackageInspection()
+    {
+        ModelDesc desc = makeTrunkModelDesc(29, 22, 8, 4, 0);
+        PackageSummary summaries[2];
+        std::map<std::string, int> opCounts[2];
+        for (int i = 0; i < 2; ++i)
+        {
+            ModelBuilder builder(desc, 9, 9);
+            addModelInputs(builder, desc, 9, 9);
+            PrecisionPlan plan;
+            plan.defaultPrecision = i == 0 ? WeightPrecision::FLOAT32 : WeightPrecision::FLOAT16;
+            builder.setPrecisionPlan(plan);
+            const std::string packagePath = i == 0 ? "test_inspect_fp32.mlpackage" : "test_inspect_fp16.mlpackage";
+            builder.createMLPackage(packagePath);
+            summaries[i] = inspectPackage(packagePath);
+            opCounts[i] = builder.getReport().opCounts;
+        }
+
+        const PackageSummary &fp32 = summaries[0];
+        const PackageSummary &fp16 = summaries[1];
+        std::vector<std::string> inputNames;
+        for (const PackageFeature &input : fp32.inputs)
+        {
+            inputNames.push_back(input.name);
+        }
+        if (inputNames != std::vector<std::string>{INPUT_SPATIAL_NAME, INPUT_GLOBAL_NAME} ||
+            fp32.inputs[0].shape != std::vector<std::int64_t>{1, 22, 9, 9} || fp32.inputs[0].dataType != "fp32")
+        {
+            return fail("The inspector does not read the inputs of the package.");
+        }
+        if (fp32.opCounts != opCounts[0] || fp16.opCounts != opCounts[1])
+        {
+            return fail("The inspector does not count the ops of the program.");
+        }
+        if (fp32.weightFileBytes != fp32.totalWeightBytes() + fp32.weightFileOverheadBytes)
+        {
+            return fail("The inspector does not account for every byte of weight.bin.");
+        }
+        const std::uint64_t initialConvWeights = 8 * 22 * 3 * 3;
+        const auto hasLayer = [](const PackageSummary &summary, const std::string &dataType, std::uint64_t bytes)
+        {
+            return std::any_of(summary.layerWeights.begin(), summary.layerWeights.end(),
+                               [&](const PackageLayerWeights &layer)
+                               { return layer.dataType == dataType && layer.bytes == bytes; });
+        };
+        if (!hasLayer(fp32, "fp32", initialConvWeights * 4) || !hasLayer(fp16, "fp16", initialConvWeights * 2))
+        {
+            return fail("The inspector does not find the initial convolution weights.");
+        }
+
+        if (!diffPackages(fp32, fp32).empty())
+        {
+            return fail("A package differs from itself.");
+        }
+        const std::string diff = diffPackages(fp32, fp16);
+        if (diff.find("total weight bytes: " + std::to_string(fp32.totalWeightBytes()) + " -> " +
+                      std::to_string(fp16.totalWeightBytes())) == std::string::npos ||
+            diff.find("ops cast: ") == std::string::npos)
+        {
+            return fail("The diff does not show the change of precision:\n" + diff);
+        }
+        return true;
+    }
+
+    // A conv, a bias add and a relu separated by an unrelated op become a conv with a bias,
+    // directly followed by the relu
+    bool testEpilogueFusion()
+    {
+        MILSpec::Program program;
+        MILSpec::Block &block = makeProgram(program, "x", {1, 2, 4, 4});
+        const MILSpec::Function &function = program.functions().at("main");
+        OpBuilder ops(block);
+        ops.addConst<float>("w", {4, 2, 3, 3}, std::vector<float>(72, 0.5f));
+        MILSpec::NamedValueType *conv = ops.addConv(function.inputs(0), "w", 4, 1, 1, "c");
+        MILSpec::NamedValueType *bias = ops.addConst<float>("b", {1, 4, 1, 1}, {1.0f, 2.0f, 3.0f, 4.0f});
+        MILSpec::NamedValueType *sum = ops.addBinary("add", *conv, *bias, "s");
+        MILSpec::NamedValueType *mean = ops.addReduce("reduce_mean", function.inputs(0), {2, 3}, false, "m");
+        MILSpec::NamedValueType *relu = ops.addUnary("relu", *sum, "r");
+        block.add_outputs(relu->name());
+        block.add_outputs(mean->name());
+
+        const EpilogueFusion fusion = fuseEpilogues(block);
+        if (fusion.biasesFused != 1 || fusion.activationsAdjoined != 1)
+        {
+            return fail("Fusion reports " + std::to_string(fusion.biasesFused) + " biases and " +
+                        std::to_string(fusion.activationsAdjoined) + " activations, expected 1 and 1.");
+        }
+        if (!isInDependencyOrder(block, function))
+        {
+            return fail("Fusion broke the dependency order.");
+        }
+        const int convIndex = operationIndex(block, "s");
+        const int reluIndex = operationIndex(block, "r");
+        if (convIndex < 0 || block.operations(convIndex).type() != "conv" ||
+            block.operations(convIndex).inputs().count("bias") == 0 || reluIndex != convIndex + 1 ||
+            std::any_of(block.operations().begin(), block.operations().end(),
+                        [](const MILSpec::Operation &op)
+                        { return op.type() == "add"; }))
+        {
+            return fail("The epilogue was not fused into a conv with a bias followed by its relu.");
+        }
+        return true;
+    }
+
+    // Three large activations computed before any of them is reduced are interleaved with their
+    // reductions, so that only one is alive at a time
+    bool testMemoryScheduling()
+    {
+        MILSpec::Program program;
+        MILSpec::Block &block = makeProgram(program, "x", {1, 4, 8, 8});
+        const MILSpec::Function &function = program.functions().at("main");
+        OpBuilder ops(block);
+        const MILSpec::NamedValueType &x = function.inputs(0);
+        MILSpec::NamedValueType *large[] = {ops.addUnary("relu", x, "a1"), ops.addUnary("sigmoid", x, "a2"),
+                                            ops.addUnary("tanh", x, "a3")};
+        MILSpec::NamedValueType *means[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            means[i] = ops.addReduce("reduce_mean", *large[i], {2, 3}, false, "m" + std::to_string(i + 1));
+        }
+        MILSpec::NamedValueType *sum = ops.addBinary("add", *means[0], *means[1], "s");
+        block.add_outputs(ops.addBinary("add", *sum, *means[2], "t")->name());
+        const int numOperations = block.operations_size();
+
+        const std::uint64_t peakBefore = analyzeProgramCost(program).peakLiveActivationBytes;
+        const MemorySchedule schedule = scheduleForMemory(block, function);
+        const std::uint64_t peakAfter = analyzeProgramCost(program).peakLiveActivationBytes;
+        if (schedule.peakLiveActivationBytesBefore != peakBefore || schedule.peakLiveActivationBytesAfter != peakAfter)
+        {
+            return fail("Scheduling reports other peaks than the cost model.");
+        }
+        if (peakAfter >= peakBefore)
+        {
+            return fail("Scheduling did not lower the peak live activation bytes.");
+        }
+        if (block.operations_size() != numOperations || !isInDependencyOrder(block, function))
+        {
+            return fail("Scheduling lost an operation or broke the dependency order.");
+        }
+        // No other large activation is computed between one and its reduction
+        for (int i = 1; i <= 3; ++i)
+        {
+            const int begin = operationIndex(block, "a" + std::to_string(i));
+            const int end = operationIndex(block, "m" + std::to_string(i));
+            for (int j = 1; j <= 3; ++j)
+            {
+                const int other = operationIndex(block, "a" + std::to_string(j));
+                if (j != i && other > begin && other < end)
+                {
+                    return fail("Scheduling did not reduce each large activation before computing the next.");
+                }
+            }
+        }
+        return true;
+    }
+
+    // Ops as the graph code built them by hand before OpBuilder, used as the reference for it
+    void setHandTensorType(MILSpec::TensorType &tensorType, MILSpec::DataType dataType, const std::vector<int> &shape)
+    {
+        tensorType.set_datatype(dataType);
+        tensorType.set_rank(shape.size());
+        for (int dim : shape)
+        {
+            tensorType.add_dimensions()->mutable_constant()->set_size(dim);
+        }
+    }
+
+    void setHandNameAttribute(MILSpec::Operation &op, const std::string &name)
+    {
+        MILSpec::Value &attribute = (*op.mutable_attributes())["name"];
+        attribute.mutable_type()->mutable_tensortype()->set_datatype(MILSpec::DataType::STRING);
+        attribute.mutable_immediatevalue()->mutable_tensor()->mutable_strings()->add_values(name);
+    }
+
+    // A const op whose immediate value is filled in by `fill`; the shape is empty for scalars
+    template <typename Fill>
+    void addHandConst(MILSpec::Block &block, const std::string &name, MILSpec::DataType dataType,
+                      const std::vector<int> &shape, Fill fill)
+    {
+        MILSpec::Operation *op = block.add_operations();
+        op->set_type("const");
+        MILSpec::NamedValueType *output = op->add_outputs();
+        output->set_name(name);
+        setHandTensorType(*output->mutable_type()->mutable_tensortype(), dataType, shape);
+        MILSpec::Value &value = (*op->mutable_attributes())["val"];
+        setHandTensorType(*value.mutable_type()->mutable_tensortype(), dataType, shape);
+        fill(*value.mutable_immediatevalue()->mutable_tensor());
+        setHandNameAttribute(*op, name);
+    }
+
+    void addHandInts(MILSpec::Block &block, const std::string &name, const std::vector<int> &shape,
+                     const std::vector<int> &values)
+    {
+        addHandConst(block, name, MILSpec::DataType::INT32, shape, [&](MILSpec::TensorValue &tensor)
+                     {
+                         for (int v : values)
+                             tensor.mutable_ints()->add_values(v);
+                     });
+    }
+
+    MILSpec::Operation &addHandOperation(MILSpec::Block &block, const char *type, const std::string &name,
+                                         const std::vector<std::pair<const char *, std::string>> &inputs,
+                                         MILSpec::DataType dataType, const std::vector<int> &shape)
+    {
+        MILSpec::Operation &op = *block.add_operations();
+        op.set_type(type);
+        for (const auto &input : inputs)
+        {
+            (*op.mutable_inputs())[input.first].add_arguments()->set_name(input.second);
+        }
+        MILSpec::NamedValueType *output = op.add_outputs();
+        output->set_name(name);
+        setHandTensorType(*output->mutable_type()->mutable_tensortype(), dataType, shape);
+        setHandNameAttribute(op, name);
+        return op;
+    }
+
+    std::string deterministicBytes(const google::protobuf::MessageLite &message)
+    {
+        std::string bytes;
+        google::protobuf::io::StringOutputStream stream(&bytes);
+        google::protobuf::io::CodedOutputStream output(&stream);
+        output.SetSerializationDeterministic(true);
+        message.SerializeToCodedStream(&output);
+        output.Trim();
+        return bytes;
+    }
+
+    // OpBuilder emits the same ops, byte for byte, as the hand-built code it replaced
+    bool testOpBuilderMatchesHandBuiltOps()
+    {
+        const std::vector<int> inputShape = {1, 2, 5, 5};
+        MILSpec::Program program;
+        MILSpec::Block &block = makeProgram(program, "x", inputShape);
+        const MILSpec::NamedValueType &x = program.functions().at("main").inputs(0);
+        OpBuilder ops(block);
+        ops.addConst<std::int32_t>("ints", {3}, {4, -5, 6});
+        ops.addConst<std::int8_t>("bytes", {3}, {-1, 0, 7});
+        ops.addScalarConst("half", 0.5f);
+        ops.addScalarConst("flag", true);
+        ops.addScalarConst<std::string>("mode", "constant");
+        MILSpec::NamedValueType *conv = ops.addConv(x, "c_weight", 4, 2, 1, "c");
+        MILSpec::NamedValueType *relu = ops.addUnary("relu", *conv, "r");
+        ops.addReduce("reduce_mean", *relu, {2, 3}, false, "m");
+
+        MILSpec::Block expected;
+        addHandInts(expected, "ints", {3}, {4, -5, 6});
+        addHandConst(expected, "bytes", MILSpec::DataType::INT8, {3}, [](MILSpec::TensorValue &tensor)
+                     { tensor.mutable_bytes()->set_values(std::string{'\xff', '\0', '\x07'}); });
+        addHandConst(expected, "half", MILSpec::DataType::FLOAT32, {}, [](MILSpec::TensorValue &tensor)
+                     { tensor.mutable_floats()->add_values(0.5f); });
+        addHandConst(expected, "flag", MILSpec::DataType::BOOL, {}, [](MILSpec::TensorValue &tensor)
+                     { tensor.mutable_bools()->add_values(true); });
+        addHandConst(expected, "mode", MILSpec::DataType::STRING, {}, [](MILSpec::TensorValue &tensor)
+                     { tensor.mutable_strings()->add_values("constant"); });
+        addHandConst(expected, "c_pad_type", MILSpec::DataType::STRING, {}, [](MILSpec::TensorValue &tensor)
+                     { tensor.mutable_strings()->add_values("same"); });
+        addHandInts(expected, "c_strides", {2}, {1, 1});
+        addHandInts(expected, "c_pad", {4}, {0, 0, 0, 0});
+        addHandInts(expected, "c_dilations", {2}, {2, 1});
+        addHandInts(expected, "c_groups", {}, {1});
+        addHandOperation(expected, "conv", "c",
+                         {{"x", "x"}, {"weight", "c_weight"}, {"strides", "c_strides"}, {"pad", "c_pad"},
+                          {"pad_type", "c_pad_type"}, {"dilations", "c_dilations"}, {"groups", "c_groups"}},
+                         MILSpec::DataType::FLOAT32, {1, 4, 5, 5});
+        addHandOperation(expected, "relu", "r", {{"x", "c"}}, MILSpec::DataType::FLOAT32, {1, 4, 5, 5});
+        addHandInts(expected, "m_axes", {2}, {2, 3});
+        addHandConst(expected, "m_keep_dims", MILSpec::DataType::BOOL, {}, [](MILSpec::TensorValue &tensor)
+                     { tensor.mutable_bools()->add_values(false); });
+        addHandOperation(expected, "reduce_mean", "m", {{"x", "r"}, {"axes", "m_axes"}, {"keep_dims", "m_keep_dims"}},
+                         MILSpec::DataType::FLOAT32, {1, 4});
+
+        if (block.operations_size() != expected.operations_size())
+        {
+            return fail("OpBuilder emitted " + std::to_string(block.operations_size()) + " ops, expected " +
+                        std::to_string(expected.operations_size()) + ".");
+        }
+        for (int i = 0; i < block.operations_size(); ++i)
+        {
+            if (deterministicBytes(block.operations(i)) != deterministicBytes(expected.operations(i)))
+            {
+                return fail("OpBuilder emitted a different op " + block.operations(i).outputs(0).name() + ".");
+            }
+        }
+        return true;
+    }
+
+} // namespace
+
+int main()
+{
+    const struct
+    {
+        const char *name;
+        bool (*run)();
+    } tests[] = {
+        {"basic conversion", testBasicConversion},
+        {"channel padding", testChannelPadding},
+        {"channel pruning", testChannelPruning},
+        {"low-rank lowering", testLowRankLowering},
+        {"default low-rank plan", testDefaultLowRankPlan},
+        {"activation quantization lowering", testActivationQuantizationLowering},
+        {"calibrated activation quantization", testCalibratedActivationQuantization},
+        {"precision plan lowering", testPrecisionPlanLowering},
+        {"whole-model precision plan", testWholeModelPrecisionPlan},
+        {"cost model", testCostModel},
+        {"model cache", testModelCache},
+        {"SHA-256", testSha256},
+        {"conversion report write", testConversionReportWrite},
+        {"cancellation", testCancellation},
+        {"metadata folding", testMetadataFolding},
+        {"weight array copy-on-write", testWeightArrayCopyOnWrite},
+        {"sparse weight round trip", testSparseWeightRoundTrip},
+        {"padded board size", testPaddedBoardSize},
+        {"program verifier", testProgramVerifier},
+        {"output layout", testOutputLayout},
+        {"flexible board size", testFlexibleBoardSize},
+        {"secondary model", testSecondaryModel},
+        {"package inspection", testPackageInspection},
+        {"epilogue fusion", testEpilogueFusion},
+        {"memory scheduling", testMemoryScheduling},
+        {"op builder", testOpBuilderMatchesHandBuiltOps},
+    };
 
-    if (!std::filesystem::exists(outputPath))
+    for (const auto &test : tests)
     {
-        std::cerr << "❌ Output file was not created." << std::endl;
-        return 1;
+        bool passed = false;
+        try
+        {
+            passed = test.run();
+        }
+        catch (const std::exception &e)
+        {
+            passed = fail(e.what());
+        }
+        if (!passed)
+        {
+            std::cerr << "❌ Test failed: " << test.name << std::endl;
+            return 1;
+        }
     }
 
-    std::cout << "✅ Successfully built a CoreML package at " << outputPath << std::endl;
+    std::cout << "✅ All " << sizeof(tests) / sizeof(tests[0]) << " tests passed" << std::endl;
     return 0;
 }
@@ -0,0 +1,507 @@
+// katagocoreml-convert: converts KataGo models into CoreML packages in parallel,
+// for every combination of board size, batch size and weight precision.
+
+#include "ChannelPruning.hpp"
+#include "MetadataFolding.hpp"
+#include "ModelBuilder.hpp"
+#include "ModelCache.hpp"
+#include "ModelFile.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace KataGoCoreML;
+
+namespace
+{
+    struct BoardSize
+    {
+        int x;
+        int y;
+        // A flexible board size from minLen to maxLen, built at maxLen x maxLen; 0 if fixed
+        int minLen = 0;
+        int maxLen = 0;
+    };
+
+    struct Job
+    {
+        std::string modelPath;
+        BoardSize boardSize;
+        int batchSize;
+        WeightPrecision precision;
+        std::string packagePath;
+    };
+
+    struct JobResult
+    {
+        bool ok = false;
+        double seconds = 0.0;
+        std::uintmax_t packageBytes = 0;
+        std::string error;
+    };
+
+    struct Options
+    {
+        std::vector<std::string> modelPaths;
+        std::vector<std::string> modelSha256s;
+        std::vector<BoardSize> boardSizes = {{19, 19}};
+        std::vector<int> batchSizes = {1};
+        std::vector<WeightPrecision> precisions = {WeightPrecision::FLOAT32};
+        std::vector<float> fixedMetadata;
+        std::string outputDir = ".";
+        std::string cacheDir;
+        bool pruneDeadChannels = false;
+        int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    };
+
+    void printUsage(const char *program)
+    {
+        std::cerr << "Usage: " << program << " [options] MODEL...\n"
+                  << "\n"
+                  << "Converts KataGo models (.bin, .bin.gz, .txt, .txt.gz) into CoreML packages.\n"
+                  << "One package is built for every model x board size x batch size x precision.\n"
+                  << "\n"
+                  << "Options:\n"
+                  << "  -o, --output-dir DIR      Directory for the packages (default: .)\n"
+                  << "  -s, --board-sizes LIST    Comma separated sizes such as 19,13x13,9x7 (default: 19);\n"
+                  << "                            a range such as 7..19 builds one package for all of them\n"
+                  << "  -b, --batch-sizes LIST    Comma separated batch sizes (default: 1)\n"
+                  << "  -p, --precisions LIST     Comma separated float32, float16 or int8 (default: float32)\n"
+                  << "  -m, --fixed-metadata LIST Comma separated SGF metadata values folded into the model,\n"
+                  << "                            which then has no input_meta input\n"
+                  << "  -c, --cache-dir DIR       Cache parsed models in DIR, so later runs map them instead\n"
+                  << "                            of parsing the model files again\n"
+                  << "      --prune-dead-channels Remove the residual block channels that cannot affect the\n"
+                  << "                            outputs, such as those with all-zero weights\n"
+                  << "      --sha256 LIST         Comma separated SHA-256 of each model file, in the order of\n"
+                  << "                            the models; a model that does not match is not converted\n"
+                  << "  -j, --jobs N              Number of concurrent conversions (default: number of cores)\n"
+                  << "  -h, --help                Show this help\n";
+    }
+
+    std::vector<std::string> splitList(const std::string &list)
+    {
+        std::vector<std::string> items;
+        std::stringstream ss(list);
+        std::string item;
+        while (std::getline(ss, item, ','))
+        {
+            if (!item.empty())
+            {
+                items.push_back(item);
+            }
+        }
+        return items;
+    }
+
+    int parsePositiveInt(const std::string &s, const std::string &what)
+    {
+        std::size_t pos = 0;
+        int value = 0;
+        try
+        {
+            value = std::stoi(s, &pos);
+        }
+        catch (const std::exception &)
+        {
+            pos = 0;
+        }
+        if (pos != s.size() || value <= 0)
+        {
+            throw std::invalid_argument("Invalid " + what + ": " + s);
+        }
+        return value;
+    }
+
+    float parseFloat(const std::string &s)
+    {
+        std::size_t pos = 0;
+        float value = 0.0f;
+        try
+        {
+            value = std::stof(s, &pos);
+        }
+        catch (const std::exception &)
+        {
+            pos = 0;
+        }
+        if (pos != s.size())
+        {
+            throw std::invalid_argument("Invalid metadata value: " + s);
+        }
+        return value;
+    }
+
+    BoardSize parseBoardSize(const std::string &s)
+    {
+        const auto range = s.find("..");
+        if (range != std::string::npos)
+        {
+            const int minLen = parsePositiveInt(s.substr(0, range), "board size");
+            const int maxLen = parsePositiveInt(s.substr(range + 2), "board size");
+            if (minLen > maxLen)
+            {
+                throw std::invalid_argument("Invalid board size range: " + s);
+            }
+            return {maxLen, maxLen, minLen, maxLen};
+        }
+        const auto sep = s.find('x');
+        if (sep == std::string::npos)
+        {
+            const int size = parsePositiveInt(s, "board size");
+            return {size, size};
+        }
+        return {parsePositiveInt(s.substr(0, sep), "board size"),
+                parsePositiveInt(s.substr(sep + 1), "board size")};
+    }
+
+    WeightPrecision parsePrecision(const std::string &s)
+    {
+        for (WeightPrecision precision : {WeightPrecision::FLOAT32, WeightPrecision::FLOAT16, WeightPrecision::INT8})
+        {
+            if (s == weightPrecisionName(precision))
+            {
+                return precision;
+            }
+        }
+        throw std::invalid_argument("Invalid precision: " + s);
+    }
+
+    std::string modelStem(const std::string &path)
+    {
+        std::string stem = fs::path(path).filename().string();
+        for (const char *ext : {".gz", ".bin", ".txt"})
+        {
+            const std::string suffix = ext;
+            if (stem.size() > suffix.size() && stem.compare(stem.size() - suffix.size(), suffix.size(), suffix) == 0)
+            {
+                stem.erase(stem.size() - suffix.size());
+            }
+        }
+        return stem;
+    }
+
+    Options parseOptions(int argc, char **argv)
+    {
+        Options options;
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            auto value = [&]() -> std::string
+            {
+                if (i + 1 >= argc)
+                {
+                    throw std::invalid_argument("Missing value for " + arg);
+                }
+                return argv[++i];
+            };
+
+            if (arg == "-h" || arg == "--help")
+            {
+                printUsage(argv[0]);
+                std::exit(0);
+            }
+            else if (arg == "-o" || arg == "--output-dir")
+            {
+                options.outputDir = value();
+            }
+            else if (arg == "-s" || arg == "--board-sizes")
+            {
+                options.boardSizes.clear();
+                for (const auto &item : splitList(value()))
+                    options.boardSizes.push_back(parseBoardSize(item));
+            }
+            else if (arg == "-b" || arg == "--batch-sizes")
+            {
+                options.batchSizes.clear();
+                for (const auto &item : splitList(value()))
+                    options.batchSizes.push_back(parsePositiveInt(item, "batch size"));
+            }
+            else if (arg == "-p" || arg == "--precisions")
+            {
+                options.precisions.clear();
+                for (const auto &item : splitList(value()))
+                    options.precisions.push_back(parsePrecision(item));
+            }
+            else if (arg == "-m" || arg == "--fixed-metadata")
+            {
+                options.fixedMetadata.clear();
+                for (const auto &item : splitList(value()))
+                    options.fixedMetadata.push_back(parseFloat(item));
+            }
+            else if (arg == "-c" || arg == "--cache-dir")
+            {
+                options.cacheDir = value();
+            }
+            else if (arg == "--prune-dead-channels")
+            {
+                options.pruneDeadChannels = true;
+            }
+            else if (arg == "--sha256")
+            {
+                options.modelSha256s = splitList(value());
+            }
+            else if (arg == "-j" || arg == "--jobs")
+            {
+                options.numThreads = parsePositiveInt(value(), "job count");
+            }
+            else if (!arg.empty() && arg[0] == '-')
+            {
+                throw std::invalid_argument("Unknown option: " + arg);
+            }
+            else
+            {
+                options.modelPaths.push_back(arg);
+            }
+        }
+
+        if (options.modelPaths.empty() || options.boardSizes.empty() ||
+            options.batchSizes.empty() || options.precisions.empty())
+        {
+            throw std::invalid_argument("Nothing to convert");
+        }
+        if (!options.modelSha256s.empty() && options.modelSha256s.size() != options.modelPaths.size())
+        {
+            throw std::invalid_argument("--sha256 needs one digest per model");
+        }
+        // Packages are named after the model, so two models with one name would write the same packages
+        std::map<std::string, std::string> modelsByStem;
+        for (const auto &modelPath : options.modelPaths)
+        {
+            const auto inserted = modelsByStem.emplace(modelStem(modelPath), modelPath);
+            if (!inserted.second)
+            {
+                throw std::invalid_argument(inserted.first->second == modelPath
+                                                ? "Duplicate model: " + modelPath
+                                                : "Models " + inserted.first->second + " and " + modelPath +
+                                                      " would write the same packages");
+            }
+        }
+        return options;
+    }
+
+    // Repeated list entries, such as "-s 19,19x19" or "-b 8,8", name the same package; it is
+    // converted once rather than by concurrent jobs writing the same directory
+    std::vector<Job> makeJobs(const Options &options)
+    {
+        std::vector<Job> jobs;
+        std::set<std::string> packagePaths;
+        for (const auto &modelPath : options.modelPaths)
+            for (const auto &boardSize : options.boardSizes)
+                for (int batchSize : options.batchSizes)
+                    for (WeightPrecision precision : options.precisions)
+                    {
+                        std::ostringstream name;
+                        name << modelStem(modelPath) << "_";
+                        if (boardSize.maxLen > 0)
+                            name << boardSize.minLen << "-" << boardSize.maxLen;
+                        else
+                            name << boardSize.x << "x" << boardSize.y;
+                        name << "_b" << batchSize << "_" << weightPrecisionName(precision) << ".mlpackage";
+                        const std::string packagePath = (fs::path(options.outputDir) / name.str()).string();
+                        if (packagePaths.insert(packagePath).second)
+                        {
+                            jobs.push_back({modelPath, boardSize, batchSize, precision, packagePath});
+                        }
+                    }
+        return jobs;
+    }
+
+    std::uintmax_t directorySize(const fs::path &dir)
+    {
+        std::uintmax_t bytes = 0;
+        for (const auto &entry : fs::recursive_directory_iterator(dir))
+        {
+            if (entry.is_regular_file())
+            {
+                bytes += entry.file_size();
+            }
+        }
+        return bytes;
+    }
+
+    void runJob(const Job &job, ModelDesc &modelDesc, JobResult &result)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        const int x = job.boardSize.x;
+        const int y = job.boardSize.y;
+        const int batch = job.batchSize;
+        ModelBuilder builder(modelDesc, x, y, batch);
+
+        InputFeature inputSpatial(INPUT_SPATIAL_NAME, {batch, modelDesc.numInputChannels, y, x});
+        builder.addInputFeature(inputSpatial);
+        InputFeature inputGlobal(INPUT_GLOBAL_NAME, {batch, modelDesc.numInputGlobalChannels});
+        builder.addInputFeature(inputGlobal);
+        if (modelDesc.numInputMetaChannels > 0)
+        {
+            InputFeature inputMeta(INPUT_META_NAME, {batch, modelDesc.numInputMetaChannels});
+            builder.addInputFeature(inputMeta);
+        }
+
+        PrecisionPlan plan;
+        plan.defaultPrecision = job.precision;
+        builder.setPrecisionPlan(plan);
+        if (job.boardSize.maxLen > 0)
+        {
+            builder.setFlexibleBoardSize(job.boardSize.minLen, job.boardSize.maxLen);
+        }
+
+        builder.createMLPackage(job.packagePath);
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        result.seconds = elapsed.count();
+        result.packageBytes = directorySize(job.packagePath);
+        result.ok = true;
+    }
+
+    void printSummary(const std::vector<Job> &jobs, const std::vector<JobResult> &results, double totalSeconds)
+    {
+        std::size_t nameWidth = 7;
+        for (const auto &job : jobs)
+        {
+            nameWidth = std::max(nameWidth, fs::path(job.packagePath).filename().string().size());
+        }
+
+        std::cout << std::left << std::setw(nameWidth) << "package"
+                  << "  " << std::setw(6) << "status"
+                  << "  " << std::right << std::setw(9) << "seconds"
+                  << "  " << std::setw(12) << "bytes" << "\n";
+        int failures = 0;
+        for (std::size_t i = 0; i < jobs.size(); ++i)
+        {
+            const JobResult &r = results[i];
+            std::cout << std::left << std::setw(nameWidth) << fs::path(jobs[i].packagePath).filename().string()
+                      << "  " << std::setw(6) << (r.ok ? "ok" : "FAILED")
+                      << "  " << std::right << std::setw(9) << std::fixed << std::setprecision(2) << r.seconds
+                      << "  " << std::setw(12) << r.packageBytes << "\n";
+            if (!r.ok)
+            {
+                failures++;
+                std::cout << "    " << r.error << "\n";
+            }
+        }
+        std::cout << jobs.size() - failures << " of " << jobs.size() << " conversions succeeded in "
+                  << std::fixed << std::setprecision(2) << totalSeconds << " s\n";
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << "\n\n";
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    fs::create_directories(options.outputDir);
+
+    // Each model is loaded once and shared read-only by all of its jobs
+    std::map<std::string, std::unique_ptr<ModelDesc>> models;
+    std::map<std::string, std::string> loadErrors;
+    for (std::size_t i = 0; i < options.modelPaths.size(); ++i)
+    {
+        const std::string &path = options.modelPaths[i];
+        const std::string sha256 = options.modelSha256s.empty() ? "" : options.modelSha256s[i];
+        try
+        {
+            auto modelDesc = std::make_unique<ModelDesc>(options.cacheDir.empty()
+                                                             ? loadModelFile(path, sha256)
+                                                             : loadModelFileCached(path, options.cacheDir, sha256));
+            if (!options.fixedMetadata.empty())
+            {
+                foldFixedMetadata(*modelDesc, options.fixedMetadata);
+            }
+            if (options.pruneDeadChannels)
+            {
+                int numPruned = 0;
+                for (const auto &layer : pruneDeadChannels(*modelDesc))
+                {
+                    numPruned += layer.numChannelsBefore - layer.numChannelsAfter;
+                }
+                std::cerr << "Pruned " << numPruned << " dead channels from " << path << std::endl;
+            }
+            models[path] = std::move(modelDesc);
+        }
+        catch (const std::exception &e)
+        {
+            loadErrors[path] = e.what();
+        }
+    }
+
+    const std::vector<Job> jobs = makeJobs(options);
+    std::vector<JobResult> results(jobs.size());
+    std::atomic<std::size_t> nextJob{0};
+    std::mutex progressMutex;
+    std::size_t numDone = 0;
+
+    auto worker = [&]()
+    {
+        for (std::size_t i = nextJob++; i < jobs.size(); i = nextJob++)
+        {
+            const Job &job = jobs[i];
+            JobResult &result = results[i];
+            auto failed = loadErrors.find(job.modelPath);
+            if (failed != loadErrors.end())
+            {
+                result.error = failed->second;
+            }
+            else
+            {
+                try
+                {
+                    runJob(job, *models.at(job.modelPath), result);
+                }
+                catch (const std::exception &e)
+                {
+                    result.error = e.what();
+                }
+            }
+
+            // Progress lines go to stderr and are serialized, so they never interleave
+            std::lock_guard<std::mutex> lock(progressMutex);
+            numDone++;
+            std::cerr << "[" << numDone << "/" << jobs.size() << "] "
+                      << (result.ok ? "built " : "failed ") << job.packagePath << std::endl;
+        }
+    };
+
+    const int numThreads = std::min<int>(options.numThreads, jobs.size());
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+    {
+        threads.emplace_back(worker);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printSummary(jobs, results, elapsed.count());
+
+    const bool allOk = std::all_of(results.begin(), results.end(), [](const JobResult &r)
+                                   { return r.ok; });
+    return allOk ? 0 : 1;
+}
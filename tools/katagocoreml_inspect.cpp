@@ -0,0 +1,108 @@
+// katagocoreml-inspect: summarizes a CoreML package built by this library, or the
+// differences between two packages, without loading the model into Core ML.
+
+#include "PackageInspection.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace KataGoCoreML;
+
+namespace
+{
+    struct Options
+    {
+        std::vector<std::string> packagePaths;
+        bool json = false;
+    };
+
+    void printUsage(const char *program)
+    {
+        std::cerr << "Usage: " << program << " [options] PACKAGE [PACKAGE]\n"
+                  << "\n"
+                  << "With one package, prints its size, inputs and outputs, op histogram, const ops\n"
+                  << "and per-layer weight bytes and data types. With two packages, prints what\n"
+                  << "changed from the first to the second.\n"
+                  << "\n"
+                  << "Exits with 0 on success, or when two packages do not differ; 1 when they differ,\n"
+                  << "as diff(1) does; and 2 on errors.\n"
+                  << "\n"
+                  << "Options:\n"
+                  << "  --json                    Print the summary of one package as JSON\n"
+                  << "  -h, --help                Show this help\n";
+    }
+
+    Options parseOptions(int argc, char **argv)
+    {
+        Options options;
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            if (arg == "-h" || arg == "--help")
+            {
+                printUsage(argv[0]);
+                std::exit(0);
+            }
+            else if (arg == "--json")
+            {
+                options.json = true;
+            }
+            else if (!arg.empty() && arg[0] == '-')
+            {
+                throw std::invalid_argument("Unknown option: " + arg);
+            }
+            else
+            {
+                options.packagePaths.push_back(arg);
+            }
+        }
+        if (options.packagePaths.empty() || options.packagePaths.size() > 2)
+        {
+            throw std::invalid_argument("Expected one or two packages");
+        }
+        if (options.json && options.packagePaths.size() != 1)
+        {
+            throw std::invalid_argument("--json takes one package");
+        }
+        return options;
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << "\n\n";
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    try
+    {
+        const PackageSummary summary = inspectPackage(options.packagePaths[0]);
+        if (options.packagePaths.size() == 1)
+        {
+            std::cout << (options.json ? summary.toJSON() : summary.toText());
+            return 0;
+        }
+
+        const PackageSummary other = inspectPackage(options.packagePaths[1]);
+        const std::string diff = diffPackages(summary, other);
+        std::cout << (diff.empty() ? "No differences\n" : diff);
+        return diff.empty() ? 0 : 1;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+    return 0;
+}